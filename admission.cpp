@@ -0,0 +1,88 @@
+#include "admission.h"
+#include <sstream>
+
+using namespace std;
+
+AdmissionController::AdmissionController(const AdmissionLimits& limits) : limits(limits) {
+}
+
+bool AdmissionController::openConnection() {
+    lock_guard<mutex> lock(admissionMutex);
+    if (counters.connections >= limits.maxConnections) {
+        ++counters.rejectedConnections;
+        return false;
+    }
+    ++counters.connections;
+    return true;
+}
+
+void AdmissionController::closeConnection() {
+    lock_guard<mutex> lock(admissionMutex);
+    if (counters.connections > 0) --counters.connections;
+}
+
+bool AdmissionController::admit(RequestClass requestClass) {
+    if (requestClass == RequestClass::EXEMPT) return true;
+
+    lock_guard<mutex> lock(admissionMutex);
+    if (requestClass == RequestClass::HEAVY) {
+        // Четверть мест всегда остаётся дешёвым командам
+        size_t heavyCeiling = limits.maxInFlight - limits.maxInFlight / 4;
+        if (counters.heavyInFlight >= limits.maxHeavyInFlight || counters.inFlight >= heavyCeiling) {
+            ++counters.rejectedHeavy;
+            return false;
+        }
+        ++counters.heavyInFlight;
+    } else if (counters.inFlight >= limits.maxInFlight) {
+        ++counters.rejectedCheap;
+        return false;
+    }
+
+    ++counters.inFlight;
+    if (counters.inFlight > counters.peakInFlight) {
+        counters.peakInFlight = counters.inFlight;
+    }
+    return true;
+}
+
+void AdmissionController::finish(RequestClass requestClass) {
+    if (requestClass == RequestClass::EXEMPT) return;
+
+    lock_guard<mutex> lock(admissionMutex);
+    if (counters.inFlight > 0) --counters.inFlight;
+    if (requestClass == RequestClass::HEAVY && counters.heavyInFlight > 0) {
+        --counters.heavyInFlight;
+    }
+}
+
+AdmissionCounters AdmissionController::getCounters() const {
+    lock_guard<mutex> lock(admissionMutex);
+    return counters;
+}
+
+string AdmissionController::serialize() const {
+    lock_guard<mutex> lock(admissionMutex);
+    ostringstream oss;
+    oss << "CONNECTIONS:" << counters.connections << "/" << limits.maxConnections;
+    oss << "\nIN_FLIGHT:" << counters.inFlight << "/" << limits.maxInFlight;
+    oss << "\nHEAVY_IN_FLIGHT:" << counters.heavyInFlight << "/" << limits.maxHeavyInFlight;
+    oss << "\nPEAK_IN_FLIGHT:" << counters.peakInFlight;
+    oss << "\nREJECTED_CONNECTIONS:" << counters.rejectedConnections;
+    oss << "\nREJECTED_CHEAP:" << counters.rejectedCheap;
+    oss << "\nREJECTED_HEAVY:" << counters.rejectedHeavy;
+    return oss.str();
+}
+
+RequestClass AdmissionController::classify(const string& command) {
+    if (command == "LOGOUT" || command == "HEARTBEAT" || command == "PING") {
+        return RequestClass::EXEMPT;
+    }
+    // Эти команды читают журнал сообщений или архив, отдают всю таблицу пользователей,
+    // грузят выгрузку или копируют базу
+    if (command == "LOGIN" || command == "GET_MESSAGES" || command == "GET_USERS" ||
+        command == "FETCH_MAIL" || command == "STATS" || command == "EXPORT" || command == "IMPORT" ||
+        command == "BACKUP" || command == "HISTORY" || command == "ARCHIVE") {
+        return RequestClass::HEAVY;
+    }
+    return RequestClass::CHEAP;
+}
@@ -0,0 +1,55 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <string>
+#include <mutex>
+#include <cstddef>
+
+using namespace std;
+
+// Дешёвые команды отклоняются только при полной загрузке,
+// тяжёлые (выгрузка истории) - раньше, чтобы оставить место дешёвым
+enum class RequestClass {
+    EXEMPT,     // не ограничивается: снижает нагрузку или поддерживает присутствие
+    CHEAP,
+    HEAVY
+};
+
+struct AdmissionLimits {
+    size_t maxConnections = 512;
+    size_t maxInFlight = 64;          // запросов одновременно в обработке
+    size_t maxHeavyInFlight = 8;      // из них тяжёлых
+};
+
+struct AdmissionCounters {
+    size_t connections = 0;
+    size_t inFlight = 0;
+    size_t heavyInFlight = 0;
+    size_t peakInFlight = 0;
+    size_t rejectedConnections = 0;
+    size_t rejectedCheap = 0;
+    size_t rejectedHeavy = 0;
+};
+
+class AdmissionController {
+private:
+    mutable mutex admissionMutex;
+    AdmissionLimits limits;
+    AdmissionCounters counters;
+
+public:
+    explicit AdmissionController(const AdmissionLimits& limits = AdmissionLimits());
+
+    bool openConnection();
+    void closeConnection();
+
+    bool admit(RequestClass requestClass);
+    void finish(RequestClass requestClass);
+
+    AdmissionCounters getCounters() const;
+    string serialize() const;
+
+    static RequestClass classify(const string& command);
+};
+
+#endif
@@ -0,0 +1,466 @@
+#include "backup.h"
+#include "tracer.h"
+#include "block_codec.h"
+#include <sstream>
+#include <chrono>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+static const char* const MANIFEST_FILE = "MANIFEST";
+static const char* const LATEST_FILE = "LATEST";
+static const size_t COPY_CHUNK_BYTES = 1024 * 1024;
+
+// Сколько байт с конца базовой копии сверяется с журналом перед инкрементальной копией
+static const long long JOURNAL_CHECK_BYTES = 4096;
+
+// Сегменты журнала: блоки по COPY_CHUNK_BYTES с заголовком из трёх uint32 (little endian) -
+// исходный размер, сохранённый размер и FNV-1a исходных байтов. Равные размеры - блок
+// не сжался и лежит как есть. Без контрольной суммы испорченный литерал распаковался бы молча
+static const char* const SEGMENT_CODEC = "BLOCK";
+static const size_t SEGMENT_HEADER_BYTES = 12;
+
+static uint64_t fnv1a(const char* data, size_t size, uint64_t hash = 14695981039346656037ULL) {
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= static_cast<unsigned char>(data[i]);
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static void putU32(char* out, uint32_t value) {
+    for (int i = 0; i < 4; ++i) out[i] = static_cast<char>((value >> (8 * i)) & 0xFF);
+}
+
+static uint32_t getU32(const char* in) {
+    uint32_t value = 0;
+    for (int i = 0; i < 4; ++i) value |= static_cast<uint32_t>(static_cast<unsigned char>(in[i])) << (8 * i);
+    return value;
+}
+
+static long long currentTimeMs() {
+    return chrono::duration_cast<chrono::milliseconds>(
+        chrono::system_clock::now().time_since_epoch()).count();
+}
+
+static string segmentName(size_t index) {
+    char name[32];
+    snprintf(name, sizeof(name), "messages.%06zu", index);
+    return name;
+}
+
+BackupManager::BackupManager(Database& db, const string& directory) : db(db), directory(directory) {
+}
+
+bool BackupManager::makeDirectory(const string& path) {
+#ifdef _WIN32
+    int result = _mkdir(path.c_str());
+#else
+    int result = mkdir(path.c_str(), 0755);
+#endif
+    return result == 0 || errno == EEXIST;
+}
+
+bool BackupManager::linkOrCopy(const string& sourcePath, const string& targetPath) {
+#ifndef _WIN32
+    if (link(sourcePath.c_str(), targetPath.c_str()) == 0) return true;
+#endif
+    ifstream source(sourcePath, ios::binary);
+    if (!source.is_open()) return false;
+    source.seekg(0, ios::end);
+    long long size = static_cast<long long>(source.tellg());
+    return size >= 0 && copyRange(source, 0, size, targetPath);
+}
+
+bool BackupManager::copyRange(ifstream& source, long long from, long long to, const string& targetPath) {
+    ofstream target(targetPath, ios::binary | ios::trunc);
+    if (!target.is_open()) return false;
+
+    source.clear();
+    source.seekg(from);
+    vector<char> chunk(COPY_CHUNK_BYTES);
+    long long remaining = to - from;
+    while (remaining > 0) {
+        streamsize wanted = static_cast<streamsize>(min<long long>(remaining, static_cast<long long>(chunk.size())));
+        source.read(chunk.data(), wanted);
+        streamsize got = source.gcount();
+        if (got <= 0) break;
+        target.write(chunk.data(), got);
+        remaining -= got;
+    }
+    target.close();
+    return remaining == 0 && !target.fail();
+}
+
+bool BackupManager::packRange(ifstream& source, long long from, long long to, const string& targetPath,
+                              long long& storedBytes) {
+    ofstream target(targetPath, ios::binary | ios::trunc);
+    if (!target.is_open()) return false;
+
+    source.clear();
+    source.seekg(from);
+    vector<char> chunk(COPY_CHUNK_BYTES);
+    char header[SEGMENT_HEADER_BYTES];
+    long long remaining = to - from;
+    while (remaining > 0) {
+        streamsize wanted = static_cast<streamsize>(min<long long>(remaining, static_cast<long long>(chunk.size())));
+        source.read(chunk.data(), wanted);
+        size_t got = static_cast<size_t>(source.gcount());
+        if (got == 0) break;
+
+        string packed = block_codec::compress(chunk.data(), got);
+        bool keepRaw = packed.size() >= got;
+        putU32(header, static_cast<uint32_t>(got));
+        putU32(header + 4, static_cast<uint32_t>(keepRaw ? got : packed.size()));
+        putU32(header + 8, static_cast<uint32_t>(fnv1a(chunk.data(), got)));
+        target.write(header, sizeof(header));
+        if (keepRaw) {
+            target.write(chunk.data(), static_cast<streamsize>(got));
+        } else {
+            target.write(packed.data(), static_cast<streamsize>(packed.size()));
+        }
+        storedBytes += static_cast<long long>(sizeof(header) + (keepRaw ? got : packed.size()));
+        remaining -= static_cast<long long>(got);
+    }
+    target.close();
+    return remaining == 0 && !target.fail();
+}
+
+bool BackupManager::unpackSegment(const string& path, ofstream& target, long long& rawBytes) {
+    ifstream source(path, ios::binary);
+    if (!source.is_open()) return false;
+
+    char header[SEGMENT_HEADER_BYTES];
+    string stored;
+    string raw;
+    while (source.read(header, sizeof(header))) {
+        uint32_t rawSize = getU32(header);
+        uint32_t storedSize = getU32(header + 4);
+        if (rawSize > COPY_CHUNK_BYTES || storedSize > block_codec::maxCompressedSize(rawSize)) return false;
+        stored.resize(storedSize);
+        if (!source.read(&stored[0], static_cast<streamsize>(storedSize))) return false;
+        if (storedSize == rawSize) {
+            raw.swap(stored);
+        } else if (!block_codec::decompress(stored.data(), stored.size(), rawSize, raw)) {
+            return false;
+        }
+        if (static_cast<uint32_t>(fnv1a(raw.data(), raw.size())) != getU32(header + 8)) return false;
+        target.write(raw.data(), static_cast<streamsize>(raw.size()));
+        rawBytes += rawSize;
+    }
+    // Обрезанный заголовок в конце - повреждённый файл
+    return source.gcount() == 0;
+}
+
+// FNV-1a защищает от случайного совпадения, а не от подделки - копии лежат у того же администратора
+bool BackupManager::hashRange(ifstream& source, long long from, long long to, uint64_t& hash) {
+    string bytes(static_cast<size_t>(to - from), '\0');
+    source.clear();
+    source.seekg(from);
+    if (!bytes.empty() && !source.read(&bytes[0], static_cast<streamsize>(bytes.size()))) return false;
+    hash = fnv1a(bytes.data(), bytes.size());
+    return true;
+}
+
+bool BackupManager::readManifest(const string& backupPath, Manifest& manifest) {
+    ifstream file(backupPath + "/" + MANIFEST_FILE);
+    if (!file.is_open()) return false;
+
+    string line;
+    while (getline(file, line)) {
+        size_t colon = line.find(':');
+        if (colon == string::npos) continue;
+        string key = line.substr(0, colon);
+        string value = line.substr(colon + 1);
+        if (key == "CREATED_MS") {
+            manifest.createdMs = strtoll(value.c_str(), nullptr, 10);
+        } else if (key == "BASE") {
+            manifest.base = value;
+        } else if (key == "MESSAGES") {
+            manifest.messageCount = strtoull(value.c_str(), nullptr, 10);
+        } else if (key == "MESSAGES_BYTES") {
+            manifest.messagesBytes = strtoll(value.c_str(), nullptr, 10);
+        } else if (key == "USERS_BYTES") {
+            manifest.usersBytes = strtoll(value.c_str(), nullptr, 10);
+        } else if (key == "ROOMS_BYTES") {
+            manifest.roomsBytes = strtoll(value.c_str(), nullptr, 10);
+        } else if (key == "SEGMENT") {
+            // SEGMENT:файл:начало:конец (смещения в журнале)
+            Segment segment;
+            stringstream ss(value);
+            string from, to;
+            if (getline(ss, segment.file, ':') && getline(ss, from, ':') && getline(ss, to)) {
+                segment.from = strtoll(from.c_str(), nullptr, 10);
+                segment.to = strtoll(to.c_str(), nullptr, 10);
+                manifest.segments.push_back(segment);
+            }
+        } else if (key == "ARCHIVE") {
+            manifest.archiveFiles.push_back(value);
+        } else if (key == "CODEC") {
+            manifest.codec = value;
+        } else if (key == "TAIL") {
+            // TAIL:начало:хэш в hex
+            size_t separator = value.find(':');
+            if (separator != string::npos) {
+                manifest.tailFrom = strtoll(value.c_str(), nullptr, 10);
+                manifest.tailHash = strtoull(value.c_str() + separator + 1, nullptr, 16);
+            }
+        }
+    }
+
+    // Сегменты должны покрывать журнал подряд, без дыр
+    long long expected = 0;
+    for (const Segment& segment : manifest.segments) {
+        if (segment.from != expected || segment.to < segment.from) return false;
+        expected = segment.to;
+    }
+    return expected == manifest.messagesBytes;
+}
+
+bool BackupManager::writeManifest(const string& backupPath, const Manifest& manifest) {
+    string path = backupPath + "/" + MANIFEST_FILE;
+    string tmpPath = path + ".tmp";
+    {
+        ofstream file(tmpPath, ios::trunc);
+        if (!file.is_open()) return false;
+        file << "CREATED_MS:" << manifest.createdMs << "\n";
+        file << "BASE:" << manifest.base << "\n";
+        file << "MESSAGES:" << manifest.messageCount << "\n";
+        file << "MESSAGES_BYTES:" << manifest.messagesBytes << "\n";
+        file << "USERS_BYTES:" << manifest.usersBytes << "\n";
+        file << "ROOMS_BYTES:" << manifest.roomsBytes << "\n";
+        if (!manifest.codec.empty()) {
+            file << "CODEC:" << manifest.codec << "\n";
+            file << "TAIL:" << manifest.tailFrom << ":" << hex << manifest.tailHash << dec << "\n";
+        }
+        for (const Segment& segment : manifest.segments) {
+            file << "SEGMENT:" << segment.file << ":" << segment.from << ":" << segment.to << "\n";
+        }
+        for (const string& archiveFile : manifest.archiveFiles) {
+            file << "ARCHIVE:" << archiveFile << "\n";
+        }
+        file.close();
+        if (file.fail()) return false;
+    }
+    return rename(tmpPath.c_str(), path.c_str()) == 0;
+}
+
+// Журнал только дописывается, но его могли заменить целиком (восстановление из другой копии)
+// или переписать при переносе в архив: хвост базовой копии должен совпасть с теми же байтами
+// журнала. Копии без хэша хвоста (несжатый формат) продолжать нельзя - нужна полная
+bool BackupManager::journalMatches(DatabaseSnapshot& snapshot, const Manifest& base) {
+    if (base.messagesBytes > snapshot.messagesBytes || base.codec != SEGMENT_CODEC) return false;
+    uint64_t hash;
+    return hashRange(*snapshot.messages, base.tailFrom, base.messagesBytes, hash) && hash == base.tailHash;
+}
+
+bool BackupManager::createBackup(const string& name, bool incremental, BackupResult& result, string& error) {
+    TraceSpan span("backup.create", "storage");
+    lock_guard<mutex> lock(backupMutex);
+    result = BackupResult();
+    result.name = name;
+
+    string backupPath = directory + "/" + name;
+    if (!makeDirectory(directory)) {
+        error = "Cannot create backup directory";
+        return false;
+    }
+    ifstream existing(backupPath + "/" + MANIFEST_FILE);
+    if (existing.is_open()) {
+        error = "Backup already exists";
+        return false;
+    }
+
+    Manifest base;
+    string baseName;
+    if (incremental) {
+        ifstream latest(directory + "/" + LATEST_FILE);
+        if (latest.is_open() && getline(latest, baseName) && !baseName.empty() && baseName != name &&
+            !readManifest(directory + "/" + baseName, base)) {
+            error = "Latest backup " + baseName + " is unreadable";
+            return false;
+        }
+    }
+
+    DatabaseSnapshot snapshot;
+    if (!db.openSnapshot(snapshot)) {
+        error = "Cannot open database files";
+        return false;
+    }
+    if (!baseName.empty() && !journalMatches(snapshot, base)) {
+        error = "Journal does not continue backup " + baseName + ", take a full backup";
+        return false;
+    }
+    if (!makeDirectory(backupPath)) {
+        error = "Cannot create " + name;
+        return false;
+    }
+
+    Manifest manifest;
+    manifest.createdMs = currentTimeMs();
+    manifest.base = baseName;
+    manifest.messageCount = snapshot.messageCount;
+    manifest.messagesBytes = snapshot.messagesBytes;
+    manifest.usersBytes = snapshot.usersBytes;
+    manifest.roomsBytes = snapshot.roomsBytes;
+    manifest.codec = SEGMENT_CODEC;
+    manifest.tailFrom = max(0LL, snapshot.messagesBytes - JOURNAL_CHECK_BYTES);
+    if (!hashRange(*snapshot.messages, manifest.tailFrom, snapshot.messagesBytes, manifest.tailHash)) {
+        error = "Cannot read journal";
+        return false;
+    }
+
+    long long linkedEnd = 0;
+    for (const Segment& segment : base.segments) {
+        if (!linkOrCopy(directory + "/" + baseName + "/" + segment.file, backupPath + "/" + segment.file)) {
+            error = "Cannot link segment " + segment.file;
+            return false;
+        }
+        manifest.segments.push_back(segment);
+        result.linkedBytes += segment.to - segment.from;
+        linkedEnd = segment.to;
+    }
+    if (snapshot.messagesBytes > linkedEnd) {
+        Segment segment{segmentName(manifest.segments.size()), linkedEnd, snapshot.messagesBytes};
+        if (!packRange(*snapshot.messages, segment.from, segment.to, backupPath + "/" + segment.file,
+                       result.storedBytes)) {
+            error = "Cannot write segment " + segment.file;
+            return false;
+        }
+        manifest.segments.push_back(segment);
+        result.copiedBytes += segment.to - segment.from;
+    }
+
+    if (!copyRange(*snapshot.users, 0, snapshot.usersBytes, backupPath + "/" + Database::USERS_FILE) ||
+        !copyRange(*snapshot.rooms, 0, snapshot.roomsBytes, backupPath + "/" + Database::ROOMS_FILE)) {
+        error = "Cannot copy users or rooms";
+        return false;
+    }
+    result.copiedBytes += snapshot.usersBytes + snapshot.roomsBytes;
+    
+    if (!snapshot.archiveFiles.empty()) {
+        string archivePath = backupPath + "/" + Database::ARCHIVE_DIR;
+        bool archived = makeDirectory(archivePath);
+        for (const string& file : snapshot.archiveFiles) {
+            archived = archived && linkOrCopy(snapshot.archivePath + "/" + file, archivePath + "/" + file);
+        }
+        ofstream catalog(archivePath + "/" + Database::ARCHIVE_CATALOG, ios::trunc);
+        catalog << snapshot.archiveCatalog;
+        catalog.close();
+        if (!archived || catalog.fail()) {
+            error = "Cannot copy archive";
+            return false;
+        }
+        manifest.archiveFiles = snapshot.archiveFiles;
+    }
+
+    if (!writeManifest(backupPath, manifest)) {
+        error = "Cannot write manifest";
+        return false;
+    }
+    {
+        ofstream latest(directory + "/" + LATEST_FILE, ios::trunc);
+        latest << name << "\n";
+    }
+    result.base = baseName;
+    result.messageCount = snapshot.messageCount;
+    return true;
+}
+
+bool BackupManager::restoreBackup(const string& backupPath, const string& dbPath, string& error) {
+    Manifest manifest;
+    if (!readManifest(backupPath, manifest)) {
+        error = "Backup manifest is missing or inconsistent";
+        return false;
+    }
+    if (!makeDirectory(dbPath)) {
+        error = "Cannot create " + dbPath;
+        return false;
+    }
+
+    string messagesPath = dbPath + "/" + Database::MESSAGES_FILE;
+    {
+        ifstream existing(messagesPath, ios::binary | ios::ate);
+        if (existing.is_open() && existing.tellg() > 0) {
+            error = messagesPath + " is not empty";
+            return false;
+        }
+    }
+
+    if (!manifest.codec.empty() && manifest.codec != SEGMENT_CODEC) {
+        error = "Unknown segment codec " + manifest.codec;
+        return false;
+    }
+    ofstream messages(messagesPath, ios::binary | ios::trunc);
+    if (!messages.is_open()) {
+        error = "Cannot write " + messagesPath;
+        return false;
+    }
+    vector<char> chunk(COPY_CHUNK_BYTES);
+    for (const Segment& segment : manifest.segments) {
+        long long copied = 0;
+        bool intact = true;
+        if (manifest.codec.empty()) {
+            ifstream source(backupPath + "/" + segment.file, ios::binary);
+            while (source.is_open()) {
+                source.read(chunk.data(), static_cast<streamsize>(chunk.size()));
+                streamsize got = source.gcount();
+                if (got <= 0) break;
+                messages.write(chunk.data(), got);
+                copied += got;
+            }
+        } else {
+            intact = unpackSegment(backupPath + "/" + segment.file, messages, copied);
+        }
+        if (!intact || copied != segment.to - segment.from) {
+            // Недописанный журнал обнуляем: иначе повторное восстановление упрётся в непустую базу
+            messages.close();
+            ofstream(messagesPath, ios::binary | ios::trunc);
+            error = "Segment " + segment.file + " is damaged";
+            return false;
+        }
+    }
+    messages.close();
+    if (messages.fail()) {
+        error = "Cannot write " + messagesPath;
+        return false;
+    }
+
+    // Копируем, а не связываем: база будет дописывать users.txt и rooms.txt на месте
+    for (const char* file : {Database::USERS_FILE, Database::ROOMS_FILE}) {
+        ifstream source(backupPath + "/" + file, ios::binary | ios::ate);
+        long long size = source.is_open() ? static_cast<long long>(source.tellg()) : -1;
+        if (size < 0 || !copyRange(source, 0, size, dbPath + "/" + file)) {
+            error = string("Cannot restore ") + file;
+            return false;
+        }
+    }
+    
+    // Архив запечатан и не переписывается на месте, поэтому ссылки безопасны
+    if (!manifest.archiveFiles.empty()) {
+        string sourceArchive = backupPath + "/" + Database::ARCHIVE_DIR;
+        string targetArchive = dbPath + "/" + Database::ARCHIVE_DIR;
+        vector<string> files = manifest.archiveFiles;
+        files.push_back(Database::ARCHIVE_CATALOG);
+        bool restored = makeDirectory(targetArchive);
+        for (const string& file : files) {
+            restored = restored && linkOrCopy(sourceArchive + "/" + file, targetArchive + "/" + file);
+        }
+        if (!restored) {
+            error = "Cannot restore archive";
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,76 @@
+#ifndef BACKUP_H
+#define BACKUP_H
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <cstdint>
+#include "database.h"
+
+using namespace std;
+
+struct BackupResult {
+    string name;
+    string base;                // пусто - полная копия
+    uint64_t messageCount = 0;
+    long long copiedBytes = 0;  // записано заново, до сжатия
+    long long storedBytes = 0;  // столько же после сжатия сегментов журнала
+    long long linkedBytes = 0;  // сегменты журнала, взятые жёсткими ссылками из базовой копии
+};
+
+// Резервные копии работающей базы. Копия - каталог <directory>/<name>:
+//   users.txt, rooms.txt - файлы на момент снимка;
+//   messages.NNNNNN - запечатанные сегменты журнала, сжатые блоками block_codec;
+//                     распакованные по порядку, склеиваются в messages.txt;
+//   archive/ - запечатанные сегменты архива и их каталог, тоже жёсткими ссылками;
+//   MANIFEST - пишется последним: без него копия считается незавершённой.
+// Инкрементальная копия берёт сегменты предыдущей жёсткими ссылками (место не занимают)
+// и дописывает один новый сегмент с тем, что появилось в журнале после неё
+class BackupManager {
+private:
+    struct Segment {
+        string file;
+        long long from;
+        long long to;
+    };
+
+    struct Manifest {
+        long long createdMs = 0;
+        string base;
+        uint64_t messageCount = 0;
+        long long messagesBytes = 0;
+        long long usersBytes = 0;
+        long long roomsBytes = 0;
+        vector<Segment> segments;
+        vector<string> archiveFiles;    // сегменты архива базы, в копии лежат в archive/
+        string codec;                   // пусто - сегменты без сжатия (копии прежнего формата)
+        long long tailFrom = 0;         // хэш байтов журнала [tailFrom, messagesBytes)
+        uint64_t tailHash = 0;
+    };
+
+    Database& db;
+    string directory;
+    mutex backupMutex;          // одна копия за раз
+
+    static bool readManifest(const string& backupPath, Manifest& manifest);
+    static bool writeManifest(const string& backupPath, const Manifest& manifest);
+    static bool copyRange(ifstream& source, long long from, long long to, const string& targetPath);
+    static bool packRange(ifstream& source, long long from, long long to, const string& targetPath,
+                          long long& storedBytes);
+    static bool unpackSegment(const string& path, ofstream& target, long long& rawBytes);
+    static bool hashRange(ifstream& source, long long from, long long to, uint64_t& hash);
+    static bool linkOrCopy(const string& sourcePath, const string& targetPath);
+    static bool makeDirectory(const string& path);
+    static bool journalMatches(DatabaseSnapshot& snapshot, const Manifest& base);
+
+public:
+    BackupManager(Database& db, const string& directory);
+
+    // incremental - относительно последней удачной копии (файл LATEST); если её нет, копия полная
+    bool createBackup(const string& name, bool incremental, BackupResult& result, string& error);
+
+    // Собирает каталог базы из копии; каталог не должен содержать журнал сообщений
+    static bool restoreBackup(const string& backupPath, const string& dbPath, string& error);
+};
+
+#endif
@@ -0,0 +1,203 @@
+#include "block_codec.h"
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+
+using namespace std;
+
+namespace block_codec {
+
+static const size_t HASH_BITS = 14;
+// Последние байты блока всегда идут литералами, а совпадение не начинается ближе MATCH_TAIL
+// к концу: так распаковщику не нужно проверять хвост внутри каждой ссылки
+static const size_t LAST_LITERALS = 5;
+static const size_t MATCH_TAIL = 12;
+// После стольких промахов подряд шаг поиска растёт: несжимаемые данные проходятся быстрее
+static const size_t SKIP_TRIGGER = 6;
+
+static inline uint32_t read32(const char* p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline size_t hashOf(uint32_t sequence) {
+    return (sequence * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// Длина от 15 и больше: остаток байтами по 255, последний байт меньше 255
+static void writeLength(string& out, size_t length) {
+    length -= 15;
+    while (length >= 255) {
+        out += static_cast<char>(255);
+        length -= 255;
+    }
+    out += static_cast<char>(length);
+}
+
+static bool readLength(const unsigned char*& in, const unsigned char* end, size_t& length) {
+    unsigned char byte;
+    do {
+        if (in >= end) return false;
+        byte = *in++;
+        length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+static void writeSequence(string& out, const char* literals, size_t literalLength, size_t offset, size_t matchLength) {
+    size_t matchCode = matchLength - MIN_MATCH;
+    unsigned char token = static_cast<unsigned char>((min<size_t>(literalLength, 15) << 4) | min<size_t>(matchCode, 15));
+    out += static_cast<char>(token);
+    if (literalLength >= 15) writeLength(out, literalLength);
+    out.append(literals, literalLength);
+    out += static_cast<char>(offset & 0xFF);
+    out += static_cast<char>(offset >> 8);
+    if (matchCode >= 15) writeLength(out, matchCode);
+}
+
+size_t maxCompressedSize(size_t rawSize) {
+    return rawSize + rawSize / 255 + 16;
+}
+
+string compress(const char* data, size_t size) {
+    string out;
+    out.reserve(maxCompressedSize(size));
+
+    size_t anchor = 0;
+    if (size > MATCH_TAIL) {
+        vector<uint32_t> table(static_cast<size_t>(1) << HASH_BITS, 0);
+        size_t searchLimit = size - MATCH_TAIL;
+        size_t matchLimit = size - LAST_LITERALS;
+        size_t misses = 0;
+        size_t pos = 0;
+        while (pos < searchLimit) {
+            uint32_t sequence = read32(data + pos);
+            size_t slot = hashOf(sequence);
+            size_t candidate = table[slot];
+            table[slot] = static_cast<uint32_t>(pos);
+
+            if (candidate >= pos || pos - candidate > MAX_OFFSET || read32(data + candidate) != sequence) {
+                pos += 1 + (misses++ >> SKIP_TRIGGER);
+                continue;
+            }
+            misses = 0;
+
+            while (pos > anchor && candidate > 0 && data[pos - 1] == data[candidate - 1]) {
+                --pos;
+                --candidate;
+            }
+            size_t matchEnd = pos + MIN_MATCH;
+            size_t reference = candidate + MIN_MATCH;
+            while (matchEnd < matchLimit && data[matchEnd] == data[reference]) {
+                ++matchEnd;
+                ++reference;
+            }
+
+            writeSequence(out, data + anchor, pos - anchor, pos - candidate, matchEnd - pos);
+            pos = matchEnd;
+            anchor = pos;
+            if (pos < searchLimit) {
+                table[hashOf(read32(data + pos - 2))] = static_cast<uint32_t>(pos - 2);
+            }
+        }
+    }
+
+    // Хвост: только литералы, без ссылки - по концу входа распаковщик понимает, что блок кончился
+    size_t literalLength = size - anchor;
+    out += static_cast<char>(min<size_t>(literalLength, 15) << 4);
+    if (literalLength >= 15) writeLength(out, literalLength);
+    out.append(data + anchor, literalLength);
+    return out;
+}
+
+static const char FRAME_ESCAPE = '\x1b';
+
+string packFrame(const string& frame) {
+    string block = compress(frame.data(), frame.size());
+    string packed = "Z:" + to_string(frame.size()) + "\n";
+    packed.reserve(packed.size() + block.size() + block.size() / 64);
+    for (char c : block) {
+        if (c == '\n') {
+            packed += FRAME_ESCAPE;
+            packed += 'n';
+        } else if (c == FRAME_ESCAPE) {
+            packed += FRAME_ESCAPE;
+            packed += FRAME_ESCAPE;
+        } else {
+            packed += c;
+        }
+    }
+    return packed;
+}
+
+bool isPackedFrame(const string& frame) {
+    return frame.compare(0, 2, "Z:") == 0;
+}
+
+bool unpackFrame(const string& packed, string& frame) {
+    size_t headerEnd = packed.find('\n');
+    if (!isPackedFrame(packed) || headerEnd == string::npos) return false;
+    char* sizeEnd = nullptr;
+    unsigned long long rawSize = strtoull(packed.c_str() + 2, &sizeEnd, 10);
+    if (sizeEnd != packed.c_str() + headerEnd) return false;
+    // Ссылка не разворачивается больше чем в 255 раз: больший размер - испорченный заголовок
+    if (rawSize > static_cast<unsigned long long>(packed.size()) * 255 + 64) return false;
+
+    string block;
+    block.reserve(packed.size() - headerEnd);
+    for (size_t i = headerEnd + 1; i < packed.size(); ++i) {
+        if (packed[i] != FRAME_ESCAPE) {
+            block += packed[i];
+            continue;
+        }
+        if (++i >= packed.size()) return false;
+        if (packed[i] == 'n') block += '\n';
+        else if (packed[i] == FRAME_ESCAPE) block += FRAME_ESCAPE;
+        else return false;
+    }
+    return decompress(block.data(), block.size(), static_cast<size_t>(rawSize), frame);
+}
+
+bool decompress(const char* data, size_t size, size_t rawSize, string& out) {
+    out.assign(rawSize, '\0');
+    const unsigned char* in = reinterpret_cast<const unsigned char*>(data);
+    const unsigned char* end = in + size;
+    size_t produced = 0;
+
+    while (in < end) {
+        unsigned char token = *in++;
+        size_t literalLength = token >> 4;
+        if (literalLength == 15 && !readLength(in, end, literalLength)) return false;
+        if (literalLength > static_cast<size_t>(end - in) || literalLength > rawSize - produced) return false;
+        memcpy(&out[0] + produced, in, literalLength);
+        in += literalLength;
+        produced += literalLength;
+        if (in == end) break;
+
+        if (end - in < 2) return false;
+        size_t offset = static_cast<size_t>(in[0]) | (static_cast<size_t>(in[1]) << 8);
+        in += 2;
+        if (offset == 0 || offset > produced) return false;
+
+        size_t matchLength = token & 0x0F;
+        if (matchLength == 15 && !readLength(in, end, matchLength)) return false;
+        matchLength += MIN_MATCH;
+        if (matchLength > rawSize - produced) return false;
+
+        // Ссылка может перекрывать сама себя (повтор короткого куска) - тогда только побайтно
+        char* target = &out[0] + produced;
+        const char* source = target - offset;
+        if (offset >= matchLength) {
+            memcpy(target, source, matchLength);
+        } else {
+            for (size_t i = 0; i < matchLength; ++i) target[i] = source[i];
+        }
+        produced += matchLength;
+    }
+    return produced == rawSize;
+}
+
+}
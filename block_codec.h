@@ -0,0 +1,34 @@
+#ifndef BLOCK_CODEC_H
+#define BLOCK_CODEC_H
+
+#include <string>
+#include <cstddef>
+
+using namespace std;
+
+// Блочное сжатие в духе LZ4: последовательности "литералы + ссылка назад" с окном 64 КБ.
+// Блок самодостаточен - словарь между блоками не переносится, поэтому любой блок архива
+// распаковывается отдельно. Размер исходных данных хранит вызывающий
+namespace block_codec {
+
+const size_t MIN_MATCH = 4;
+const size_t MAX_OFFSET = 65535;
+
+// Худший случай для несжимаемых данных: литералы плюс байты длины
+size_t maxCompressedSize(size_t rawSize);
+
+string compress(const char* data, size_t size);
+
+// false - повреждённый блок: выход за границы, ссылка до начала или другой размер
+bool decompress(const char* data, size_t size, size_t rawSize, string& out);
+
+// Сжатый кадр протокола: "Z:<исходный размер>\n" и сжатый блок, в котором '\n' и ESC
+// экранированы через ESC. Перевода строки в теле нет, значит нет и "\nEND\n" - разбор
+// потока на кадры у клиента и сервера не меняется
+string packFrame(const string& frame);
+bool isPackedFrame(const string& frame);
+bool unpackFrame(const string& packed, string& frame);
+
+}
+
+#endif
@@ -1,4 +1,6 @@
 #include "chat.h"
+#include "database.h"
+#include "block_codec.h"
 #include <iostream>
 #include <limits>
 #include <string>
@@ -11,7 +13,10 @@
 #include <mutex>
 #include <cstring>
 #include <cstdio>
+#include <cstdlib>
 #include <map>
+#include <random>
+#include <cerrno>
 
 #ifdef _WIN32
 #include <winsock2.h>
@@ -23,11 +28,37 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <sys/un.h>
 #endif
 
 using namespace std;
 
-Chat::Chat() : currentUser(nullptr), clientSocket(-1), serverPort(0) {}
+static long long currentTimeMs() {
+    return chrono::duration_cast<chrono::milliseconds>(
+        chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// Интервал HEARTBEAT; сервер считает пользователя ушедшим после 30 секунд тишины
+static const int HEARTBEAT_INTERVAL_MS = 10000;
+
+// Сообщения сверх этого, пока меню не разобрало очередь, отбрасываются:
+// они остаются в истории на сервере
+static const size_t MESSAGE_QUEUE_CAPACITY = 4096;
+
+// Сколько ждать места в кольце запросов и ответа сервера
+static const int SHARED_MEMORY_TIMEOUT_MS = 30000;
+
+// Как часто поток приёма в режиме разделяемой памяти заглядывает в сокет за событиями
+static const int RECEIVER_POLL_INTERVAL_MS = 50;
+
+Chat::Chat() : currentUser(nullptr), messageQueue(MESSAGE_QUEUE_CAPACITY), clientSocket(-1), serverPort(0) {}
+
+Chat::~Chat() {
+    stopHeartbeat();
+    if (connectedToServer) {
+        disconnectFromServer();
+    }
+}
 
 void Chat::registerUser() {
     clearScreen();
@@ -120,6 +151,15 @@ void Chat::login() {
                 currentUser->setOnlineStatus(true);
                 onlineUsers.insert(login);
                 
+                // Три запроса уходят одним заходом, ждём только самый долгий ответ
+                future<string> roomsResponse = sendRequestAsync("GET_ROOMS\n" + login);
+                future<string> friendsResponse = sendRequestAsync("GET_FRIENDS\n" + login);
+                future<string> onlineResponse = sendRequestAsync("GET_ONLINE");
+                applyChatRooms(roomsResponse.get());
+                applyFriends(friendsResponse.get());
+                applyOnlineUsers(onlineResponse.get());
+                startHeartbeat(login);
+                
                 cout << "Welcome back, " << currentUser->getName() << "!" << endl;
                 chatMenu();
             } else {
@@ -136,6 +176,9 @@ void Chat::login() {
 void Chat::logout() {
     if (currentUser) {
         string name = currentUser->getName();
+        stopHeartbeat();
+        sendRequestToServer("LOGOUT");
+        startHeartbeat("");
         currentUser->setOnlineStatus(false);
         onlineUsers.erase(currentUser->getLogin());
         currentUser = nullptr;
@@ -147,7 +190,9 @@ void Chat::logout() {
 void Chat::chatMenu() {
     int choice;
     while (currentUser) {
+        processMessageQueue();
         clearScreen();
+        fetchMail();
         cout << "\n=== Chat Menu ===" << endl;
         cout << "User: " << currentUser->getName() << " (Online: " << onlineUsers.size() << ")" << endl;
         cout << "1. Send public message" << endl;
@@ -195,6 +240,7 @@ void Chat::chatMenu() {
                 break;
             case 9:
                 showStatistics();
+                showServerStatistics();
                 break;
             case 10:
                 logout();
@@ -231,15 +277,14 @@ void Chat::sendPublicMessage() {
     string status, data;
     if (parseServerResponse(response, status, data)) {
         if (status == "SUCCESS") {
-            Message message(currentUser, nullptr, text, MessageType::PUBLIC);
+            Message message = addMessage(currentUser, nullptr, text.data(), text.size(),
+                                         MessageType::PUBLIC, currentTimeMs());
             if (text.find("!important") != string::npos) {
                 message.addTag("important");
             }
             if (text.find("?") != string::npos) {
                 message.addTag("question");
             }
-            messages.push_back(message);
-            updateUserMessageIndex(message);
             cout << "Message sent successfully!" << endl;
         } else {
             cout << "Failed to send message: " << data << endl;
@@ -302,9 +347,8 @@ void Chat::sendPrivateMessage() {
             string status, data;
             if (parseServerResponse(response, status, data)) {
                 if (status == "SUCCESS") {
-                    Message message(currentUser, &(it->second), text, MessageType::PRIVATE);
-                    messages.push_back(message);
-                    updateUserMessageIndex(message);
+                    addMessage(currentUser, &(it->second), text.data(), text.size(),
+                               MessageType::PRIVATE, currentTimeMs());
                     cout << "Private message sent to " << it->second.getName() << "!" << endl;
                 } else {
                     cout << "Failed to send message: " << data << endl;
@@ -313,9 +357,8 @@ void Chat::sendPrivateMessage() {
                 cout << "Failed to communicate with server!" << endl;
             }
         } else {
-            Message message(currentUser, &(it->second), text, MessageType::PRIVATE);
-            messages.push_back(message);
-            updateUserMessageIndex(message);
+            addMessage(currentUser, &(it->second), text.data(), text.size(),
+                       MessageType::PRIVATE, currentTimeMs());
             cout << "Private message sent to " << it->second.getName() << "!" << endl;
         }
     }
@@ -351,13 +394,16 @@ void Chat::searchMessages() {
     cout << "1. Search by text" << endl;
     cout << "2. Search by tag" << endl;
     cout << "3. Search by sender" << endl;
+    if (connectedToServer) {
+        cout << "4. Search full history on server (including archive)" << endl;
+    }
     cout << "Choose search type: ";
     
     int choice;
     cin >> choice;
     
     string searchTerm;
-    vector<Message> results;
+    vector<size_t> results;
     
     switch (choice) {
         case 1:
@@ -365,32 +411,36 @@ void Chat::searchMessages() {
             cin.ignore(numeric_limits<streamsize>::max(), '\n');
             getline(cin, searchTerm);
             
-            copy_if(messages.begin(), messages.end(), back_inserter(results),
-                    [&](const Message& msg) {
-                        return msg.getText().find(searchTerm) != string::npos;
-                    });
+            results = messages.findByText(searchTerm);
             break;
             
         case 2:
             cout << "Enter tag: ";
             cin >> searchTerm;
             
-            copy_if(messages.begin(), messages.end(), back_inserter(results),
-                    [&](const Message& msg) {
-                        return msg.hasTag(searchTerm);
-                    });
+            results = messages.findByTag(searchTerm);
             break;
             
         case 3:
             cout << "Enter sender login: ";
             cin >> searchTerm;
             
-            copy_if(messages.begin(), messages.end(), back_inserter(results),
-                    [&](const Message& msg) {
-                        return msg.getSender() && msg.getSender()->getLogin() == searchTerm;
-                    });
+            if (const User* sender = findUser(searchTerm)) {
+                results = messages.findBySender(sender);
+            }
             break;
             
+        case 4:
+            if (!connectedToServer) {
+                cout << "Invalid choice!" << endl;
+                return;
+            }
+            cout << "Enter search text: ";
+            cin.ignore(numeric_limits<streamsize>::max(), '\n');
+            getline(cin, searchTerm);
+            searchServerHistory(searchTerm);
+            return;
+            
         default:
             cout << "Invalid choice!" << endl;
             return;
@@ -402,13 +452,48 @@ void Chat::searchMessages() {
     }
     
     cout << "\nFound " << results.size() << " message(s):" << endl;
-    for (const auto& message : results) {
-        cout << message.toString() << endl;
+    for (size_t index : results) {
+        cout << messages.at(index).toString() << endl;
         cout << string(30, '-') << endl;
     }
 }
 
+// Старые сообщения сервер держит в архиве и отдаёт только по HISTORY; в локальное
+// хранилище они не попадают, только выводятся
+void Chat::searchServerHistory(const string& text) {
+    string status, data;
+    string response = sendRequestToServer("HISTORY\n" + currentUser->getLogin() + "\n\n\n" + text);
+    if (!parseServerResponse(response, status, data) || status != "SUCCESS") {
+        cout << "Search failed: " << data << endl;
+        return;
+    }
+    if (data.empty()) {
+        cout << "No messages found." << endl;
+        return;
+    }
+    
+    stringstream lines(data);
+    string line;
+    size_t found = 0;
+    while (getline(lines, line)) {
+        // sender|recipient|text|type|timestamp, текст может содержать '|'
+        size_t senderEnd = line.find('|');
+        size_t recipientEnd = senderEnd == string::npos ? string::npos : line.find('|', senderEnd + 1);
+        size_t timestampSep = line.rfind('|');
+        size_t typeSep = timestampSep == string::npos || timestampSep == 0 ? string::npos : line.rfind('|', timestampSep - 1);
+        if (recipientEnd == string::npos || typeSep == string::npos || typeSep < recipientEnd) continue;
+        
+        string recipient = line.substr(senderEnd + 1, recipientEnd - senderEnd - 1);
+        cout << "[" << line.substr(typeSep + 1, timestampSep - typeSep - 1) << "] "
+             << line.substr(0, senderEnd) << (recipient.empty() ? "" : " -> " + recipient) << ": "
+             << line.substr(recipientEnd + 1, typeSep - recipientEnd - 1) << endl;
+        ++found;
+    }
+    cout << "\nFound " << found << " message(s) in server history." << endl;
+}
+
 void Chat::showOnlineUsers() {
+    refreshOnlineUsers();
     cout << "\n=== Online Users ===" << endl;
     if (onlineUsers.empty()) {
         cout << "No users online." << endl;
@@ -423,6 +508,85 @@ void Chat::showOnlineUsers() {
     }
 }
 
+void Chat::refreshOnlineUsers() {
+    if (!connectedToServer) return;
+    applyOnlineUsers(sendRequestToServer("GET_ONLINE"));
+}
+
+void Chat::applyOnlineUsers(const string& response) {
+    string status, data;
+    if (!parseServerResponse(response, status, data) || status != "SUCCESS") return;
+    
+    // Полный снимок с сервера заменяет накопленные диффы
+    {
+        lock_guard<mutex> lock(queueMutex);
+        presenceUpdates.clear();
+    }
+    onlineUsers.clear();
+    stringstream ss(data);
+    string login;
+    while (getline(ss, login, ',')) {
+        if (!login.empty()) onlineUsers.insert(login);
+    }
+}
+
+void Chat::fetchMail() {
+    if (!currentUser || !connectedToServer) return;
+    
+    string response = sendRequestToServer("FETCH_MAIL\n" + currentUser->getLogin());
+    string status, data;
+    if (!parseServerResponse(response, status, data) || status != "SUCCESS" || data.empty()) return;
+    
+    size_t added = appendMessagesFromServer(data);
+    if (added > 0) {
+        cout << "You have " << added << " new private message(s)." << endl;
+    }
+}
+
+void Chat::refreshFriends() {
+    if (!currentUser || !connectedToServer) return;
+    applyFriends(sendRequestToServer("GET_FRIENDS\n" + currentUser->getLogin()));
+}
+
+void Chat::applyFriends(const string& response) {
+    if (!currentUser) return;
+    string status, data;
+    if (!parseServerResponse(response, status, data) || status != "SUCCESS") return;
+    
+    stringstream ss(data);
+    string friendLogin;
+    while (getline(ss, friendLogin, ',')) {
+        if (!friendLogin.empty()) currentUser->addFriend(friendLogin);
+    }
+}
+
+void Chat::startHeartbeat(const string& login) {
+    stopHeartbeat();
+    heartbeatRunning.store(true);
+    heartbeatThread = thread(&Chat::heartbeatLoop, this, login);
+}
+
+void Chat::stopHeartbeat() {
+    heartbeatRunning.store(false);
+    if (heartbeatThread.joinable()) {
+        heartbeatThread.join();
+    }
+}
+
+void Chat::heartbeatLoop(string login) {
+    const int stepMs = 100;
+    int elapsedMs = 0;
+    while (heartbeatRunning.load()) {
+        this_thread::sleep_for(chrono::milliseconds(stepMs));
+        elapsedMs += stepMs;
+        if (elapsedMs < HEARTBEAT_INTERVAL_MS) continue;
+        
+        elapsedMs = 0;
+        // До входа сервер всё равно закроет молчащее соединение - отвечаем на его PING заранее
+        sendRequestToServer(login.empty() ? string("PING") : "HEARTBEAT\n" + login);
+    }
+}
+
 void Chat::manageFriends() {
     if (!currentUser) return;
     
@@ -468,8 +632,16 @@ void Chat::manageFriends() {
                 } else if (currentUser->hasFriend(friendLogin)) {
                     cout << "This user is already your friend!" << endl;
                 } else {
-                    currentUser->addFriend(friendLogin);
-                    cout << "Friend added successfully!" << endl;
+                    string response = sendRequestToServer("ADD_FRIEND\n" + currentUser->getLogin() + "\n" + friendLogin);
+                    string status, data;
+                    if (!parseServerResponse(response, status, data)) {
+                        cout << "Failed to communicate with server!" << endl;
+                    } else if (status != "SUCCESS") {
+                        cout << "Failed to add friend: " << data << endl;
+                    } else {
+                        currentUser->addFriend(friendLogin);
+                        cout << "Friend added successfully!" << endl;
+                    }
                 }
                 break;
             }
@@ -479,8 +651,14 @@ void Chat::manageFriends() {
                 cin >> friendLogin;
                 
                 if (currentUser->hasFriend(friendLogin)) {
-                    currentUser->removeFriend(friendLogin);
-                    cout << "Friend removed successfully!" << endl;
+                    string response = sendRequestToServer("REMOVE_FRIEND\n" + currentUser->getLogin() + "\n" + friendLogin);
+                    string status, data;
+                    if (parseServerResponse(response, status, data) && status == "SUCCESS") {
+                        currentUser->removeFriend(friendLogin);
+                        cout << "Friend removed successfully!" << endl;
+                    } else {
+                        cout << "Failed to remove friend: " << data << endl;
+                    }
                 } else {
                     cout << "This user is not your friend!" << endl;
                 }
@@ -499,11 +677,7 @@ void Chat::showUserProfile() {
     cout << "Friends: " << currentUser->getFriendCount() << endl;
     cout << "Status: " << (currentUser->getOnlineStatus() ? "Online" : "Offline") << endl;
     
-    auto userMessages = getMessagesForUser(currentUser);
-    cout << "Messages sent: " << count_if(userMessages.begin(), userMessages.end(),
-                                         [this](const Message& msg) {
-                                             return msg.getSender() == currentUser;
-                                         }) << endl;
+    cout << "Messages sent: " << messages.findBySender(currentUser).size() << endl;
 }
 
 void Chat::showChatRoomMenu() {
@@ -511,13 +685,20 @@ void Chat::showChatRoomMenu() {
     
     int choice;
     do {
+        refreshChatRooms();
         cout << "\n=== Chat Rooms ===" << endl;
         cout << "1. Create new room" << endl;
         cout << "2. Join existing room" << endl;
         cout << "3. View room members" << endl;
-        cout << "4. Back to main menu" << endl;
+        cout << "4. Send room message" << endl;
+        cout << "5. Leave room" << endl;
+        cout << "6. Back to main menu" << endl;
         cout << "Choose action: ";
-        cin >> choice;
+        if (!(cin >> choice)) {
+            cin.clear();
+            cin.ignore(numeric_limits<streamsize>::max(), '\n');
+            choice = 0;
+        }
         
         switch (choice) {
             case 1:
@@ -529,8 +710,59 @@ void Chat::showChatRoomMenu() {
             case 3:
                 showChatRoomMembers();
                 break;
+            case 4:
+                sendRoomMessage();
+                break;
+            case 5:
+                leaveChatRoom();
+                break;
         }
-    } while (choice != 4);
+    } while (choice != 6);
+}
+
+void Chat::refreshChatRooms() {
+    if (!currentUser || !connectedToServer) return;
+    applyChatRooms(sendRequestToServer("GET_ROOMS\n" + currentUser->getLogin()));
+}
+
+void Chat::applyChatRooms(const string& response) {
+    string status, data;
+    if (!parseServerResponse(response, status, data) || status != "SUCCESS") return;
+    
+    chatRooms.clear();
+    joinedRooms.clear();
+    stringstream ss(data);
+    string entry;
+    while (getline(ss, entry, '|')) {
+        // name:members:joined
+        size_t first = entry.find(':');
+        size_t second = first != string::npos ? entry.find(':', first + 1) : string::npos;
+        if (second == string::npos) continue;
+        
+        string name = entry.substr(0, first);
+        chatRooms[name] = static_cast<size_t>(stoul(entry.substr(first + 1, second - first - 1)));
+        if (entry.substr(second + 1) == "1") {
+            joinedRooms.insert(name);
+        }
+        stats.roomOpened(name);
+    }
+}
+
+string Chat::chooseRoom(const vector<string>& rooms) {
+    if (rooms.empty()) return "";
+    
+    for (size_t i = 0; i < rooms.size(); ++i) {
+        cout << (i + 1) << ". " << rooms[i] << " (" << chatRooms[rooms[i]] << " members)" << endl;
+    }
+    
+    int choice;
+    cout << "Choose room (1-" << rooms.size() << "): ";
+    if (!(cin >> choice) || choice < 1 || choice > static_cast<int>(rooms.size())) {
+        cin.clear();
+        cout << "Invalid choice!" << endl;
+        return "";
+    }
+    return rooms[choice - 1];
 }
 
 void Chat::createChatRoom() {
@@ -546,12 +778,30 @@ void Chat::createChatRoom() {
         return;
     }
     
+    if (roomName.find_first_of("|:,") != string::npos) {
+        cout << "Room name cannot contain '|', ':' or ','!" << endl;
+        return;
+    }
+    
     if (chatRooms.find(roomName) != chatRooms.end()) {
         cout << "Room with this name already exists!" << endl;
         return;
     }
     
-    chatRooms[roomName].insert(currentUser->getLogin());
+    string response = sendRequestToServer("CREATE_ROOM\n" + roomName + "\n" + currentUser->getLogin());
+    string status, data;
+    if (!parseServerResponse(response, status, data)) {
+        cout << "Failed to communicate with server!" << endl;
+        return;
+    }
+    if (status != "SUCCESS") {
+        cout << "Failed to create room: " << data << endl;
+        return;
+    }
+    
+    chatRooms[roomName] = 1;
+    joinedRooms.insert(roomName);
+    stats.roomOpened(roomName);
     cout << "Chat room '" << roomName << "' created successfully!" << endl;
     sendSystemMessage("New chat room '" + roomName + "' created by " + currentUser->getName());
 }
@@ -559,33 +809,91 @@ void Chat::createChatRoom() {
 void Chat::joinChatRoom() {
     if (!currentUser) return;
     
-    if (chatRooms.empty()) {
+    vector<string> available;
+    for (const auto& room : chatRooms) {
+        if (!joinedRooms.count(room.first)) {
+            available.push_back(room.first);
+        }
+    }
+    
+    if (available.empty()) {
         cout << "No chat rooms available." << endl;
         return;
     }
     
     cout << "Available chat rooms:" << endl;
-    int i = 1;
-    for (const auto& room : chatRooms) {
-        cout << i++ << ". " << room.first << " (" << room.second.size() << " members)" << endl;
+    string room = chooseRoom(available);
+    if (room.empty()) return;
+    
+    string response = sendRequestToServer("JOIN_ROOM\n" + room + "\n" + currentUser->getLogin());
+    string status, data;
+    if (!parseServerResponse(response, status, data)) {
+        cout << "Failed to communicate with server!" << endl;
+    } else if (status != "SUCCESS") {
+        cout << "Failed to join room: " << data << endl;
+    } else {
+        joinedRooms.insert(room);
+        ++chatRooms[room];
+        cout << "Successfully joined room '" << room << "'!" << endl;
+        sendSystemMessage(currentUser->getName() + " joined room '" + room + "'");
     }
+}
+
+void Chat::leaveChatRoom() {
+    if (!currentUser) return;
     
-    int choice;
-    cout << "Choose room to join: ";
-    if (!(cin >> choice) || choice < 1 || choice > static_cast<int>(chatRooms.size())) {
-        cout << "Invalid choice!" << endl;
+    if (joinedRooms.empty()) {
+        cout << "You are not a member of any room." << endl;
         return;
     }
     
-    auto it = chatRooms.begin();
-    advance(it, choice - 1);
+    cout << "Your rooms:" << endl;
+    string room = chooseRoom(vector<string>(joinedRooms.begin(), joinedRooms.end()));
+    if (room.empty()) return;
     
-    if (it->second.find(currentUser->getLogin()) != it->second.end()) {
-        cout << "You are already a member of this room!" << endl;
+    string response = sendRequestToServer("LEAVE_ROOM\n" + room + "\n" + currentUser->getLogin());
+    string status, data;
+    if (parseServerResponse(response, status, data) && status == "SUCCESS") {
+        joinedRooms.erase(room);
+        cout << "You left room '" << room << "'." << endl;
     } else {
-        it->second.insert(currentUser->getLogin());
-        cout << "Successfully joined room '" << it->first << "'!" << endl;
-        sendSystemMessage(currentUser->getName() + " joined room '" + it->first + "'");
+        cout << "Failed to leave room: " << data << endl;
+    }
+}
+
+void Chat::sendRoomMessage() {
+    if (!currentUser) return;
+    
+    if (joinedRooms.empty()) {
+        cout << "Join a room first." << endl;
+        return;
+    }
+    
+    cout << "Your rooms:" << endl;
+    string room = chooseRoom(vector<string>(joinedRooms.begin(), joinedRooms.end()));
+    if (room.empty()) return;
+    
+    string text;
+    cout << "Enter message: ";
+    cin.ignore(numeric_limits<streamsize>::max(), '\n');
+    getline(cin, text);
+    
+    if (text.empty()) {
+        cout << "Message cannot be empty!" << endl;
+        return;
+    }
+    
+    string request = "SEND_MESSAGE\n" + currentUser->getLogin() + "\n" + room + "\n" + text + "\nROOM";
+    string response = sendRequestToServer(request);
+    
+    string status, data;
+    if (!parseServerResponse(response, status, data)) {
+        cout << "Failed to communicate with server!" << endl;
+    } else if (status == "SUCCESS") {
+        addRoomMessage(currentUser, room, text.data(), text.size(), currentTimeMs());
+        cout << "Message sent to room '" << room << "'!" << endl;
+    } else {
+        cout << "Failed to send message: " << data << endl;
     }
 }
 
@@ -595,45 +903,80 @@ void Chat::showChatRoomMembers() {
         return;
     }
     
-    cout << "Chat room members:" << endl;
+    vector<string> rooms;
     for (const auto& room : chatRooms) {
-        cout << "\nRoom: " << room.first << endl;
-        for (const auto& memberLogin : room.second) {
-            auto it = users.find(memberLogin);
-            if (it != users.end()) {
-                cout << "  - " << it->second.getName() << " (" << memberLogin << ")";
-                if (isUserOnline(memberLogin)) {
-                    cout << " [Online]";
-                }
-                cout << endl;
-            }
+        rooms.push_back(room.first);
+    }
+    string room = chooseRoom(rooms);
+    if (room.empty()) return;
+    
+    string response = sendRequestToServer("GET_ROOM_MEMBERS\n" + room);
+    string status, data;
+    if (!parseServerResponse(response, status, data) || status != "SUCCESS") {
+        cout << "Failed to load room members!" << endl;
+        return;
+    }
+    
+    cout << "\nRoom: " << room << endl;
+    stringstream ss(data);
+    string memberLogin;
+    while (getline(ss, memberLogin, ',')) {
+        auto it = users.find(memberLogin);
+        string name = it != users.end() ? it->second.getName() : memberLogin;
+        cout << "  - " << name << " (" << memberLogin << ")";
+        if (isUserOnline(memberLogin)) {
+            cout << " [Online]";
         }
+        cout << endl;
     }
 }
 
 void Chat::sendSystemMessage(const string& text) {
-    Message systemMessage(nullptr, nullptr, text, MessageType::SYSTEM);
-    messages.push_back(systemMessage);
+    addMessage(nullptr, nullptr, text.data(), text.size(), MessageType::SYSTEM, currentTimeMs());
+}
+
+Message Chat::addMessage(const User* sender, const User* recipient, const char* text, size_t length,
+                         MessageType type, long long timestamp) {
+    Message message = messages.append(sender, recipient, text, length, type, timestamp);
+    updateUserMessageIndex(message);
+    stats.record(sender ? sender->getLogin() : "", recipient ? recipient->getLogin() : "",
+                 type, timestamp);
+    return message;
+}
+
+Message Chat::addRoomMessage(const User* sender, const string& room, const char* text, size_t length,
+                             long long timestamp) {
+    Message message = messages.appendToRoom(sender, room, text, length, timestamp);
+    updateUserMessageIndex(message);
+    stats.record(sender ? sender->getLogin() : "", "", MessageType::ROOM, timestamp);
+    return message;
 }
 
 void Chat::updateUserMessageIndex(const Message& message) {
     if (message.getSender()) {
-        userMessageIndex[message.getSender()->getLogin()].push_back(messages.size() - 1);
+        userMessageIndex[message.getSender()->getLogin()].push_back(message.getIndex());
     }
     if (message.getRecipient()) {
-        userMessageIndex[message.getRecipient()->getLogin()].push_back(messages.size() - 1);
+        userMessageIndex[message.getRecipient()->getLogin()].push_back(message.getIndex());
     }
 }
 
+const User* Chat::findUser(const string& login) const {
+    if (login.empty()) return nullptr;
+    auto it = users.find(login);
+    return it != users.end() ? &(it->second) : nullptr;
+}
+
 vector<Message> Chat::getMessagesForUser(const User* user) const {
     vector<Message> userMessages;
     
-    for (const auto& message : messages) {
-        if (message.getRecipient() == nullptr || 
-            message.getRecipient() == user || 
-            message.getSender() == user ||
-            message.getType() == MessageType::SYSTEM) {
-            userMessages.push_back(message);
+    for (size_t i = 0; i < messages.size(); ++i) {
+        const User* recipient = messages.getRecipient(i);
+        if (recipient == nullptr || 
+            recipient == user || 
+            messages.getSender(i) == user ||
+            messages.getType(i) == MessageType::SYSTEM) {
+            userMessages.push_back(messages.at(i));
         }
     }
     
@@ -643,20 +986,43 @@ vector<Message> Chat::getMessagesForUser(const User* user) const {
 vector<Message> Chat::getMessagesByTag(const string& tag) const {
     vector<Message> taggedMessages;
     
-    copy_if(messages.begin(), messages.end(), back_inserter(taggedMessages),
-            [&](const Message& msg) {
-                return msg.hasTag(tag);
-            });
+    for (size_t index : messages.findByTag(tag)) {
+        taggedMessages.push_back(messages.at(index));
+    }
     
     return taggedMessages;
 }
 
 void Chat::processMessageQueue() {
-    while (!messageQueue.empty()) {
-        Message msg = messageQueue.front();
-        messageQueue.pop();
-        messages.push_back(msg);
-        updateUserMessageIndex(msg);
+    vector<pair<string, bool>> presence;
+    {
+        lock_guard<mutex> lock(queueMutex);
+        presence.swap(presenceUpdates);
+    }
+    
+    for (const auto& update : presence) {
+        if (update.second) {
+            onlineUsers.insert(update.first);
+        } else if (!currentUser || update.first != currentUser->getLogin()) {
+            onlineUsers.erase(update.first);
+        }
+    }
+    
+    // Текст копируется один раз - сразу в арену хранилища
+    messageQueue.drain([this](MessageRecord&& record) {
+        Message msg = record.type == MessageType::ROOM
+            ? addRoomMessage(findUser(record.senderLogin), record.recipientLogin,
+                             record.text.data(), record.text.size(), record.timestamp)
+            : addMessage(findUser(record.senderLogin), findUser(record.recipientLogin),
+                         record.text.data(), record.text.size(), record.type, record.timestamp);
+        for (const auto& tag : record.tags) {
+            msg.addTag(tag);
+        }
+    });
+    
+    size_t dropped = droppedMessages.exchange(0);
+    if (dropped > 0) {
+        sendSystemMessage(to_string(dropped) + " incoming messages were dropped, see history for them.");
     }
 }
 
@@ -677,21 +1043,203 @@ void Chat::showStatistics() const {
     cout << "Total users: " << getUserCount() << endl;
     cout << "Online users: " << onlineUsers.size() << endl;
     cout << "Total messages: " << getMessageCount() << endl;
-    cout << "Chat rooms: " << chatRooms.size() << endl;
+    cout << "Chat rooms: " << stats.getActiveRoomCount() << endl;
+    
+    // Счётчики поддерживаются при вставке, здесь только чтение
+    cout << "Public messages: " << stats.getTypeTotal(MessageType::PUBLIC) << endl;
+    cout << "Private messages: " << stats.getTypeTotal(MessageType::PRIVATE) << endl;
+    cout << "System messages: " << stats.getTypeTotal(MessageType::SYSTEM) << endl;
+    
+    if (currentUser) {
+        UserMessageCounters counters = stats.getUserCounters(currentUser->getLogin());
+        cout << "Sent by you: " << counters.sent << endl;
+        cout << "Received by you: " << counters.received << endl;
+    }
+    if (stats.getTotal() > 0) {
+        int hour = stats.getBusiestHour();
+        cout << "Busiest hour (UTC): " << (hour < 10 ? "0" : "") << hour << ":00 ("
+             << stats.getHourBucket(hour) << " messages)" << endl;
+    }
+    
+    MemoryReport memory = collectMemory();
+    cout << "\nMemory (estimated): " << memory.total() << " bytes" << endl;
+    for (const auto& entry : memory.getEntries()) {
+        cout << "  " << entry.first << ": " << entry.second << endl;
+    }
+}
+
+// Оценка кучи по структурам клиента; буфер приёма принадлежит потоку приёма и не учитывается
+MemoryReport Chat::collectMemory() const {
+    size_t userBytes = memory_usage::heapBytes(users);
+    for (const auto& user : users) {
+        userBytes += user.second.memoryUsage();
+    }
+    size_t pendingBytes;
+    {
+        lock_guard<mutex> lock(pendingMutex);
+        pendingBytes = memory_usage::heapBytes(pendingRequests);
+    }
     
-    // Статистика по типам сообщений
-    int publicCount = 0, privateCount = 0, systemCount = 0;
-    for (const auto& msg : messages) {
-        switch (msg.getType()) {
-            case MessageType::PUBLIC: publicCount++; break;
-            case MessageType::PRIVATE: privateCount++; break;
-            case MessageType::SYSTEM: systemCount++; break;
+    MemoryReport report;
+    report.add("users", userBytes);
+    report.add("messages", messages.memoryUsage());
+    report.add("message index", memory_usage::heapBytes(userMessageIndex));
+    report.add("message queue", messageQueue.memoryUsage());
+    report.add("statistics", stats.memoryUsage());
+    report.add("online users", memory_usage::heapBytes(onlineUsers));
+    report.add("rooms", memory_usage::heapBytes(chatRooms) + memory_usage::heapBytes(joinedRooms));
+    report.add("pending requests", pendingBytes);
+    return report;
+}
+
+// Формат строк - как в журнале сервера, так что выгрузку клиента принимает IMPORT
+void Chat::exportMessages(const string& filename) const {
+    ofstream file(filename, ios::binary | ios::trunc);
+    if (!file.is_open()) {
+        cout << "Cannot open " << filename << " for writing." << endl;
+        return;
+    }
+    
+    MessageData record;
+    for (size_t i = 0; i < messages.size(); ++i) {
+        MessageType type = messages.getType(i);
+        const User* sender = messages.getSender(i);
+        const User* recipient = messages.getRecipient(i);
+        record.senderLogin = sender ? sender->getLogin() : "";
+        record.recipientLogin = type == MessageType::ROOM ? messages.getRoom(i)
+                                                          : (recipient ? recipient->getLogin() : "");
+        record.text.assign(messages.getTextData(i), messages.getTextLength(i));
+        record.type = Message::typeToString(type);
+        record.timestamp = messages.getTimestamp(i);
+        record.tags = messages.getTags(i);
+        file << Database::serializeMessage(record) << '\n';
+    }
+    file.close();
+    
+    if (file.fail()) {
+        cout << "Failed to write " << filename << "." << endl;
+    } else {
+        cout << "Exported " << messages.size() << " messages to " << filename << "." << endl;
+    }
+}
+
+// Файл разбирается кусками в несколько потоков; вставка в хранилище - в этом потоке.
+// Незнакомые логины заводятся с логином вместо имени, иначе сообщение потеряло бы автора
+void Chat::importMessages(const string& filename) {
+    size_t threads = max<size_t>(1, thread::hardware_concurrency());
+    size_t imported = 0;
+    size_t rejected = 0;
+    auto knownUser = [this](const string& login) -> const User* {
+        if (login.empty()) return nullptr;
+        auto it = users.find(login);
+        if (it == users.end()) {
+            it = users.emplace(login, User(login, "", login)).first;
         }
+        return &(it->second);
+    };
+    bool ok = Database::readMessageFile(filename, threads, false, [&](vector<MessageBatch>& batches) {
+        for (const MessageBatch& batch : batches) {
+            rejected += batch.rejected;
+            for (const MessageData& msg : batch.messages) {
+                MessageType type = Message::typeFromString(msg.type);
+                Message message = type == MessageType::ROOM
+                    ? addRoomMessage(knownUser(msg.senderLogin), msg.recipientLogin,
+                                     msg.text.data(), msg.text.size(), msg.timestamp)
+                    : addMessage(knownUser(msg.senderLogin), knownUser(msg.recipientLogin),
+                                 msg.text.data(), msg.text.size(), type, msg.timestamp);
+                for (const string& tag : msg.tags) {
+                    message.addTag(tag);
+                }
+                ++imported;
+            }
+        }
+    });
+    
+    if (!ok) {
+        cout << "Failed to read " << filename << "." << endl;
+        return;
+    }
+    cout << "Imported " << imported << " messages";
+    if (rejected > 0) cout << ", skipped " << rejected << " malformed lines";
+    cout << "." << endl;
+}
+
+// Пароли в копию не попадают: клиент их не хранит
+void Chat::backupUsers(const string& filename) const {
+    ofstream file(filename, ios::binary | ios::trunc);
+    if (!file.is_open()) {
+        cout << "Cannot open " << filename << " for writing." << endl;
+        return;
     }
     
-    cout << "Public messages: " << publicCount << endl;
-    cout << "Private messages: " << privateCount << endl;
-    cout << "System messages: " << systemCount << endl;
+    UserData record;
+    for (const auto& entry : users) {
+        record.login = entry.second.getLogin();
+        record.name = entry.second.getName();
+        record.friends = entry.second.getFriends();
+        file << Database::serializeUser(record) << '\n';
+    }
+    file.close();
+    
+    if (file.fail()) {
+        cout << "Failed to write " << filename << "." << endl;
+    } else {
+        cout << "Backed up " << users.size() << " users to " << filename << "." << endl;
+    }
+}
+
+// Известные пользователи не заменяются, им только добавляются друзья из копии
+void Chat::restoreUsers(const string& filename) {
+    ifstream file(filename, ios::binary);
+    if (!file.is_open()) {
+        cout << "Cannot open " << filename << "." << endl;
+        return;
+    }
+    
+    size_t restored = 0;
+    string line;
+    while (getline(file, line)) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (line.empty()) continue;
+        UserData record = Database::deserializeUser(line);
+        if (record.login.empty()) continue;
+        
+        auto it = users.find(record.login);
+        if (it == users.end()) {
+            it = users.emplace(record.login, User(record.login, "", record.name)).first;
+            ++restored;
+        }
+        for (const string& friendLogin : record.friends) {
+            if (!it->second.hasFriend(friendLogin)) {
+                it->second.addFriend(friendLogin);
+            }
+        }
+    }
+    cout << "Restored " << restored << " users from " << filename << "." << endl;
+}
+
+void Chat::showServerStatistics() {
+    if (!connectedToServer) return;
+    
+    string request = "STATS";
+    if (currentUser) {
+        request += "\n" + currentUser->getLogin();
+    }
+    string response = sendRequestToServer(request);
+    
+    string status, data;
+    if (parseServerResponse(response, status, data) && status == "SUCCESS") {
+        cout << "\n=== Server Statistics ===" << endl;
+        cout << data << endl;
+    } else {
+        cout << "\nServer statistics unavailable." << endl;
+    }
+    
+    response = sendRequestToServer("MEMORY");
+    if (parseServerResponse(response, status, data) && status == "SUCCESS") {
+        cout << "\n=== Server Memory (bytes) ===" << endl;
+        cout << data << endl;
+    }
 }
 
 size_t Chat::getUserCount() const {
@@ -738,6 +1286,36 @@ bool Chat::connectToServer(const string& host, uint16_t port) {
     }
 #endif
 
+    {
+        lock_guard<mutex> lock(connectionMutex);
+        if (!openServerConnection()) {
+            return false;
+        }
+    }
+
+    connectedToServer = true;
+    offerCompression();
+    startHeartbeat("");
+    if (host.compare(0, 5, "unix:") == 0 || host.compare(0, 4, "shm:") == 0) {
+        cout << "Connected to server " << host << endl;
+    } else {
+        cout << "Connected to server " << host << ":" << port << endl;
+    }
+    return true;
+}
+
+// "unix:/path" - сервер на этой же машине, соединение минует стек TCP;
+// "shm:/path" - то же, но запросы и ответы идут через кольца в разделяемой памяти
+bool Chat::openServerSocket() {
+    if (serverHost.compare(0, 5, "unix:") == 0) {
+        return openUnixSocket(serverHost.substr(5));
+    }
+    if (serverHost.compare(0, 4, "shm:") == 0) {
+        if (!openUnixSocket(serverHost.substr(4))) return false;
+        attachSharedMemory();
+        return true;
+    }
+    
     clientSocket = socket(AF_INET, SOCK_STREAM, 0);
     if (clientSocket < 0) {
         cerr << "Failed to create socket" << endl;
@@ -746,13 +1324,13 @@ bool Chat::connectToServer(const string& host, uint16_t port) {
 
     sockaddr_in serverAddr{};
     serverAddr.sin_family = AF_INET;
-    serverAddr.sin_port = htons(port);
+    serverAddr.sin_port = htons(serverPort);
     
-    if (inet_pton(AF_INET, host.c_str(), &serverAddr.sin_addr) <= 0) {
+    if (inet_pton(AF_INET, serverHost.c_str(), &serverAddr.sin_addr) <= 0) {
         // Попытка резолва через DNS (упрощенно)
-        serverAddr.sin_addr.s_addr = inet_addr(host.c_str());
+        serverAddr.sin_addr.s_addr = inet_addr(serverHost.c_str());
         if (serverAddr.sin_addr.s_addr == INADDR_NONE) {
-            cerr << "Invalid server address: " << host << endl;
+            cerr << "Invalid server address: " << serverHost << endl;
             close_socket_portable(clientSocket);
             clientSocket = -1;
             return false;
@@ -760,65 +1338,423 @@ bool Chat::connectToServer(const string& host, uint16_t port) {
     }
 
     if (connect(clientSocket, (sockaddr*)&serverAddr, sizeof(serverAddr)) < 0) {
-        cerr << "Failed to connect to server " << host << ":" << port << endl;
+        cerr << "Failed to connect to server " << serverHost << ":" << serverPort << endl;
         close_socket_portable(clientSocket);
         clientSocket = -1;
         return false;
     }
-
-    connectedToServer = true;
-    cout << "Connected to server " << host << ":" << port << endl;
+    receiveBuffer.clear();
     return true;
 }
 
-void Chat::disconnectFromServer() {
-    if (clientSocket >= 0) {
+bool Chat::openUnixSocket(const string& path) {
+#ifdef _WIN32
+    cerr << "Unix domain sockets are not supported on this platform: " << path << endl;
+    return false;
+#else
+    sockaddr_un serverAddr{};
+    if (path.size() >= sizeof(serverAddr.sun_path)) {
+        cerr << "Unix socket path is too long: " << path << endl;
+        return false;
+    }
+    serverAddr.sun_family = AF_UNIX;
+    path.copy(serverAddr.sun_path, path.size());
+    
+    clientSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (clientSocket < 0) {
+        cerr << "Failed to create socket" << endl;
+        return false;
+    }
+    if (connect(clientSocket, (sockaddr*)&serverAddr, sizeof(serverAddr)) < 0) {
+        cerr << "Failed to connect to server unix:" << path << endl;
         close_socket_portable(clientSocket);
         clientSocket = -1;
+        return false;
     }
-    connectedToServer = false;
-#ifdef _WIN32
-    WSACleanup();
+    receiveBuffer.clear();
+    return true;
 #endif
 }
 
-string Chat::sendRequestToServer(const string& request) {
-    if (!connectedToServer || clientSocket < 0) {
-        return "STATUS:ERROR\nDATA:Not connected to server";
+// Не удалось - остаёмся на unix-сокете
+bool Chat::attachSharedMemory() {
+    if (!sharedChannel.create(ShmChannel::uniqueName())) {
+        cerr << "Failed to create shared memory segment, using the socket" << endl;
+        return false;
     }
     
-    string fullRequest = request + "\nEND\n";
-    if (send(clientSocket, fullRequest.c_str(), static_cast<int>(fullRequest.length()), 0) < 0) {
-        return "STATUS:ERROR\nDATA:Failed to send request";
+    string request = "SHM_ATTACH\n" + sharedChannel.getName() + "\nEND\n";
+    string response;
+    if (send(clientSocket, request.c_str(), static_cast<int>(request.length()), 0) >= 0) {
+        response = receiveFromClient(clientSocket);
     }
+    sharedChannel.unlinkName();
     
-    return receiveFromClient(clientSocket);
+    if (response != "STATUS:SUCCESS\nDATA:ATTACHED") {
+        sharedChannel.close();
+        cerr << "Server refused shared memory, using the socket" << endl;
+        return false;
+    }
+    sharedMemoryActive = true;
+    return true;
 }
 
-string Chat::receiveFromClient(int socket) {
-    string response;
+void Chat::closeSharedMemory() {
+    sharedChannel.close();
+    sharedMemoryActive = false;
+}
+
+// Поток приёма владеет чтением: в режиме сокета ждёт данных в recv, в режиме
+// разделяемой памяти ждёт ответов в кольце и между ними забирает события из сокета
+void Chat::receiverLoop(int socket, bool sharedMemory) {
+    string frame;
+    while (receiverRunning.load()) {
+        if (!sharedMemory) {
+            if (!readServerFrames(socket, true)) break;
+            continue;
+        }
+        
+        if (sharedChannel.responseRing().pop(frame, RECEIVER_POLL_INTERVAL_MS)) {
+            dispatchServerFrame(frame);
+        } else if (sharedChannel.isClosed()) {
+            break;
+        }
+        if (!readServerFrames(socket, false)) break;
+    }
+    failPendingRequests("STATUS:ERROR\nDATA:Connection lost");
+}
+
+// wait - ждать первых данных, иначе забрать то, что уже пришло. false - соединение закрыто
+bool Chat::readServerFrames(int socket, bool wait) {
     char buffer[4096];
-    
+#ifdef _WIN32
+    int flags = 0;
+#else
+    int flags = wait ? 0 : MSG_DONTWAIT;
+#endif
+    bool open = true;
     while (true) {
-        int bytesReceived = recv(socket, buffer, sizeof(buffer) - 1, 0);
-        if (bytesReceived <= 0) break;
+        int bytesReceived = recv(socket, buffer, sizeof(buffer), flags);
+        if (bytesReceived > 0) {
+            receiveBuffer.append(buffer, static_cast<size_t>(bytesReceived));
+            if (wait) break;
+            continue;
+        }
+        if (bytesReceived < 0 && errno == EINTR) continue;
+        if (bytesReceived == 0 || wait || (errno != EAGAIN && errno != EWOULDBLOCK)) open = false;
+        break;
+    }
+    
+    size_t endPos;
+    while ((endPos = receiveBuffer.find("\nEND\n")) != string::npos) {
+        string frame = receiveBuffer.substr(0, endPos);
+        receiveBuffer.erase(0, endPos + 5);
+        dispatchServerFrame(frame);
+    }
+    return open;
+}
+
+void Chat::dispatchServerFrame(const string& received) {
+    string unpacked;
+    if (block_codec::isPackedFrame(received)) {
+        // id внутри сжатого блока - кому ответ, не узнать
+        if (!block_codec::unpackFrame(received, unpacked)) {
+            deliverUnmatched("STATUS:ERROR\nDATA:Corrupted compressed response");
+            return;
+        }
+    }
+    const string& frame = unpacked.empty() ? received : unpacked;
+    if (frame.compare(0, 6, "EVENT:") == 0) {
+        handleServerEvent(frame);
+        return;
+    }
+    if (frame.compare(0, 3, "ID:") != 0) {
+        // Отказ CONNECTION_LIMIT при приёме: сервер закрывает сокет, соединение потеряно целиком
+        if (frame.find("CONNECTION_LIMIT") != string::npos) {
+            failPendingRequests(frame);
+        } else {
+            deliverUnmatched(frame);
+        }
+        return;
+    }
+    
+    size_t lineEnd = frame.find('\n');
+    uint64_t id = strtoull(frame.c_str() + 3, nullptr, 10);
+    function<void(const string&)> onResponse;
+    {
+        lock_guard<mutex> lock(pendingMutex);
+        auto it = pendingRequests.find(id);
+        if (it == pendingRequests.end()) return;
+        onResponse = move(it->second);
+        pendingRequests.erase(it);
+    }
+    onResponse(lineEnd != string::npos ? frame.substr(lineEnd + 1) : string());
+}
+
+// Ответ без id (например, отказ до разбора запроса) сопоставить по номеру нельзя.
+// Единственный ждущий запрос - точно его адресат; иначе кадр только в лог: соединение
+// цело, и остальные ответы дойдут по своим id
+void Chat::deliverUnmatched(const string& response) {
+    function<void(const string&)> onResponse;
+    {
+        lock_guard<mutex> lock(pendingMutex);
+        if (pendingRequests.size() == 1) {
+            onResponse = move(pendingRequests.begin()->second);
+            pendingRequests.clear();
+        }
+    }
+    if (onResponse) {
+        onResponse(response);
+        return;
+    }
+    string summary = response;
+    replace(summary.begin(), summary.end(), '\n', ' ');
+    cerr << "Dropped server response without request id: " << summary << endl;
+}
+
+// Первая причина запоминается: её же получат запросы, отправленные после обрыва
+void Chat::failPendingRequests(const string& response) {
+    map<uint64_t, function<void(const string&)>> failed;
+    string reason;
+    {
+        lock_guard<mutex> lock(pendingMutex);
+        if (connectionError.empty()) connectionError = response;
+        reason = connectionError;
+        failed.swap(pendingRequests);
+    }
+    for (auto& request : failed) {
+        request.second(reason);
+    }
+}
+
+static bool sendAll(int socket, const string& data) {
+#ifdef MSG_NOSIGNAL
+    const int flags = MSG_NOSIGNAL;
+#else
+    const int flags = 0;
+#endif
+    size_t sent = 0;
+    while (sent < data.size()) {
+        int bytesSent = send(socket, data.c_str() + sent, static_cast<int>(data.size() - sent), flags);
+        if (bytesSent < 0 && errno == EINTR) continue;
+        if (bytesSent <= 0) return false;
+        sent += static_cast<size_t>(bytesSent);
+    }
+    return true;
+}
+
+// Вызывающий держит connectionMutex
+bool Chat::openServerConnection() {
+    {
+        lock_guard<mutex> lock(requestMutex);
+        if (!openServerSocket()) return false;
+    }
+    {
+        lock_guard<mutex> lock(pendingMutex);
+        connectionError.clear();
+    }
+    receiverRunning.store(true);
+    receiverThread = thread(&Chat::receiverLoop, this, clientSocket, sharedMemoryActive);
+    return true;
+}
+
+// Сжатие окупается только в сети; unix-сокет и разделяемая память копируют дешевле, чем жмут.
+// Сервер без COMPRESS ответит ошибкой, и ответы останутся несжатыми
+void Chat::offerCompression() {
+    if (serverHost.compare(0, 5, "unix:") == 0 || serverHost.compare(0, 4, "shm:") == 0) return;
+    sendRequestAsync("COMPRESS\nBLOCK", [](const string&) {});
+}
+
+// Вызывающий держит connectionMutex. shutdown будит поток приёма в recv;
+// кольца отображены, пока он не завершится
+void Chat::closeServerConnection() {
+    int socket;
+    {
+        lock_guard<mutex> lock(requestMutex);
+        socket = clientSocket;
+        clientSocket = -1;
+        sharedMemoryActive = false;
+        if (socket >= 0) {
+#ifdef _WIN32
+            shutdown(socket, SD_BOTH);
+#else
+            shutdown(socket, SHUT_RDWR);
+#endif
+        }
+    }
+    receiverRunning.store(false);
+    if (receiverThread.joinable()) {
+        receiverThread.join();
+    }
+    closeSharedMemory();
+    if (socket >= 0) {
+        close_socket_portable(socket);
+    }
+    failPendingRequests("STATUS:ERROR\nDATA:Connection closed");
+}
+
+void Chat::disconnectFromServer() {
+    stopHeartbeat();
+    {
+        lock_guard<mutex> lock(connectionMutex);
+        closeServerConnection();
+    }
+    connectedToServer = false;
+#ifdef _WIN32
+    WSACleanup();
+#endif
+}
+
+bool Chat::sendRequestAsync(const string& request, function<void(const string&)> onResponse) {
+    string failure = "STATUS:ERROR\nDATA:Not connected to server";
+    {
+        lock_guard<mutex> lock(requestMutex);
+        if (connectedToServer && clientSocket >= 0) {
+            uint64_t id = nextRequestId++;
+            bool registered;
+            {
+                lock_guard<mutex> pendingLock(pendingMutex);
+                registered = connectionError.empty();
+                if (registered) {
+                    pendingRequests[id] = onResponse;
+                } else {
+                    failure = connectionError;
+                }
+            }
+            
+            if (registered) {
+                string frame = "ID:" + to_string(id) + "\n" + request;
+                bool sent = sharedMemoryActive
+                    ? sharedChannel.requestRing().push(frame, SHARED_MEMORY_TIMEOUT_MS)
+                    : sendAll(clientSocket, frame + "\nEND\n");
+                if (sent) return true;
+                
+                failure = "STATUS:ERROR\nDATA:Failed to send request";
+                lock_guard<mutex> pendingLock(pendingMutex);
+                // Обработчик уже вызван потоком приёма при обрыве
+                if (pendingRequests.erase(id) == 0) return false;
+            }
+        }
+    }
+    onResponse(failure);
+    return false;
+}
+
+future<string> Chat::sendRequestAsync(const string& request) {
+    shared_ptr<promise<string>> result = make_shared<promise<string>>();
+    future<string> response = result->get_future();
+    sendRequestAsync(request, [result](const string& frame) { result->set_value(frame); });
+    return response;
+}
+
+size_t Chat::getPendingRequestCount() const {
+    lock_guard<mutex> lock(pendingMutex);
+    return pendingRequests.size();
+}
+
+// STATUS:BUSY - сервер перегружен: повтор с экспоненциальной задержкой и полным джиттером,
+// чтобы отклонённые клиенты не вернулись все одновременно
+string Chat::sendRequestToServer(const string& request) {
+    const int maxAttempts = 5;
+    const int baseDelayMs = 100;
+    string response;
+    
+    for (int attempt = 0; attempt < maxAttempts; ++attempt) {
+        response = sendRequestAsync(request).get();
+        if (response.compare(0, 12, "STATUS:BUSY\n") != 0) {
+            return response;
+        }
         
-        buffer[bytesReceived] = '\0';
-        response += buffer;
+        static thread_local mt19937 generator(random_device{}());
+        uniform_int_distribution<int> delay(0, baseDelayMs << attempt);
+        this_thread::sleep_for(chrono::milliseconds(delay(generator)));
         
-        if (response.find("\nEND\n") != string::npos) {
-            break;
+        // Отказ по лимиту соединений: сервер уже закрыл сокет, нужен новый.
+        // Если другой поток успел переподключиться, ошибка соединения уже сброшена
+        if (response.find("CONNECTION_LIMIT") != string::npos) {
+            lock_guard<mutex> lock(connectionMutex);
+            bool lost;
+            {
+                lock_guard<mutex> pendingLock(pendingMutex);
+                lost = !connectionError.empty();
+            }
+            if (!lost) continue;
+            
+            closeServerConnection();
+            if (!openServerConnection()) {
+                connectedToServer = false;
+                return "STATUS:ERROR\nDATA:Failed to reconnect";
+            }
+            offerCompression();
         }
     }
+    return response;
+}
+
+// Только до запуска потока приёма: ответ на SHM_ATTACH
+string Chat::receiveFromClient(int socket) {
+    char buffer[4096];
     
-    size_t endPos = response.find("\nEND\n");
-    if (endPos != string::npos) {
-        response = response.substr(0, endPos);
+    while (true) {
+        size_t endPos = receiveBuffer.find("\nEND\n");
+        if (endPos != string::npos) {
+            string frame = receiveBuffer.substr(0, endPos);
+            receiveBuffer.erase(0, endPos + 5);
+            
+            // Сервер может прислать событие до ответа на наш запрос
+            if (frame.compare(0, 6, "EVENT:") == 0) {
+                handleServerEvent(frame);
+                continue;
+            }
+            return frame;
+        }
+        
+        int bytesReceived = recv(socket, buffer, sizeof(buffer), 0);
+        if (bytesReceived <= 0) break;
+        receiveBuffer.append(buffer, bytesReceived);
     }
     
+    string response;
+    response.swap(receiveBuffer);
     return response;
 }
 
+void Chat::handleServerEvent(const string& frame) {
+    size_t lineEnd = frame.find('\n');
+    string event = frame.substr(6, lineEnd == string::npos ? string::npos : lineEnd - 6);
+    size_t dataPos = frame.find("DATA:");
+    if (dataPos == string::npos) return;
+    string data = frame.substr(dataPos + 5);
+    
+    if (event == "ROOM_MESSAGE") {
+        // sender|room|text|ROOM|timestamp
+        size_t senderEnd = data.find('|');
+        size_t roomEnd = senderEnd != string::npos ? data.find('|', senderEnd + 1) : string::npos;
+        size_t timestampSep = data.rfind('|');
+        size_t typeSep = timestampSep != string::npos && timestampSep > 0 ? data.rfind('|', timestampSep - 1) : string::npos;
+        if (roomEnd == string::npos || typeSep == string::npos || typeSep < roomEnd) return;
+        
+        MessageRecord record;
+        record.senderLogin = data.substr(0, senderEnd);
+        record.recipientLogin = data.substr(senderEnd + 1, roomEnd - senderEnd - 1);
+        record.text = data.substr(roomEnd + 1, typeSep - roomEnd - 1);
+        record.type = MessageType::ROOM;
+        record.timestamp = strtoll(data.c_str() + timestampSep + 1, nullptr, 10);
+        if (!messageQueue.tryPush(move(record))) {
+            ++droppedMessages;
+        }
+    } else if (event == "PRESENCE") {
+        // +login,-login,...
+        stringstream ss(data);
+        string token;
+        lock_guard<mutex> lock(queueMutex);
+        while (getline(ss, token, ',')) {
+            if (token.size() < 2) continue;
+            presenceUpdates.emplace_back(token.substr(1), token[0] == '+');
+        }
+    }
+}
+
 bool Chat::parseServerResponse(const string& response, string& status, string& data) {
     size_t statusPos = response.find("STATUS:");
     size_t dataPos = response.find("DATA:");
@@ -860,44 +1796,57 @@ void Chat::loadMessagesFromServer(const string& messagesData) {
     if (messagesData.empty()) return;
     
     messages.clear();
-    stringstream ss(messagesData);
-    string line;
+    userMessageIndex.clear();
+    stats.reset();
+    for (const auto& room : chatRooms) {
+        stats.roomOpened(room.first);
+    }
     
-    while (getline(ss, line)) {
-        if (line.empty()) continue;
-        
-        stringstream msgStream(line);
-        string senderLogin, recipientLogin, text, type, timestampStr;
-        
-        getline(msgStream, senderLogin, '|');
-        getline(msgStream, recipientLogin, '|');
-        getline(msgStream, text, '|');
-        getline(msgStream, type, '|');
-        getline(msgStream, timestampStr, '|');
-        
-        const User* sender = nullptr;
-        const User* recipient = nullptr;
+    appendMessagesFromServer(messagesData);
+}
+
+size_t Chat::appendMessagesFromServer(const string& messagesData) {
+    size_t added = 0;
+    
+    // Текст уходит в арену одним memcpy на сообщение, без промежуточных строк
+    size_t lineCount = static_cast<size_t>(count(messagesData.begin(), messagesData.end(), '\n')) + 1;
+    messages.reserve(messages.size() + lineCount, messagesData.size());
+    
+    const char* data = messagesData.data();
+    size_t pos = 0;
+    while (pos < messagesData.size()) {
+        size_t lineEnd = messagesData.find('\n', pos);
+        if (lineEnd == string::npos) lineEnd = messagesData.size();
         
-        if (!senderLogin.empty()) {
-            auto it = users.find(senderLogin);
-            if (it != users.end()) {
-                sender = &(it->second);
-            }
-        }
+        // sender|recipient|text|type|timestamp; текст может содержать '|',
+        // поэтому тип и время разбираем с конца строки
+        size_t senderEnd = messagesData.find('|', pos);
+        size_t recipientEnd = senderEnd < lineEnd ? messagesData.find('|', senderEnd + 1) : string::npos;
+        size_t timestampSep = messagesData.rfind('|', lineEnd - 1);
+        size_t typeSep = timestampSep != string::npos && timestampSep > pos
+                             ? messagesData.rfind('|', timestampSep - 1) : string::npos;
         
-        if (!recipientLogin.empty()) {
-            auto it = users.find(recipientLogin);
-            if (it != users.end()) {
-                recipient = &(it->second);
-            }
+        if (senderEnd >= lineEnd || recipientEnd >= lineEnd ||
+            typeSep == string::npos || typeSep < recipientEnd) {
+            pos = lineEnd + 1;
+            continue;
         }
         
-        MessageType msgType = MessageType::PUBLIC;
-        if (type == "PRIVATE") msgType = MessageType::PRIVATE;
-        else if (type == "SYSTEM") msgType = MessageType::SYSTEM;
+        string senderLogin(data + pos, senderEnd - pos);
+        string recipientLogin(data + senderEnd + 1, recipientEnd - senderEnd - 1);
+        string type(data + typeSep + 1, timestampSep - typeSep - 1);
+        long long timestamp = strtoll(data + timestampSep + 1, nullptr, 10);
         
-        Message message(sender, recipient, text, msgType);
-        messages.push_back(message);
-        updateUserMessageIndex(message);
+        MessageType msgType = Message::typeFromString(type);
+        if (msgType == MessageType::ROOM) {
+            addRoomMessage(findUser(senderLogin), recipientLogin,
+                           data + recipientEnd + 1, typeSep - recipientEnd - 1, timestamp);
+        } else {
+            addMessage(findUser(senderLogin), findUser(recipientLogin),
+                       data + recipientEnd + 1, typeSep - recipientEnd - 1, msgType, timestamp);
+        }
+        ++added;
+        pos = lineEnd + 1;
     }
-}
\ No newline at end of file
+    return added;
+}
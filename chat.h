@@ -5,32 +5,61 @@
 #include <map>
 #include <set>
 #include <unordered_map>
-#include <queue>
 #include <string>
 #include <functional>
 #include <thread>
 #include <atomic>
 #include <mutex>
+#include <future>
+#include <cstdint>
 #include "user.h"
 #include "message.h"
+#include "message_store.h"
+#include "stats.h"
+#include "shm_channel.h"
+#include "mpsc_queue.h"
+#include "memory_usage.h"
 
 using namespace std;
 
 class Chat {
 private:
     unordered_map<string, User> users;
-    vector<Message> messages;
+    MessageStore messages;
+    MessageStats stats;
     User* currentUser;
     
     set<string> onlineUsers;
     map<string, vector<size_t>> userMessageIndex;
-    queue<Message> messageQueue;
-    unordered_map<string, set<string>> chatRooms;
+    BoundedMpscQueue<MessageRecord> messageQueue;     // производители - потоки приёма, потребитель - меню
+    atomic<size_t> droppedMessages{0};
+    map<string, size_t> chatRooms;
+    set<string> joinedRooms;
+    string receiveBuffer;
+    
+    // Соединение открывает и закрывает один поток за раз; запись запроса идёт под requestMutex.
+    // Ответы читает поток приёма и отдаёт обработчику из pendingRequests по id запроса
+    mutex connectionMutex;
+    mutex requestMutex;
+    mutable mutex pendingMutex;
+    map<uint64_t, function<void(const string&)>> pendingRequests;
+    string connectionError;         // под pendingMutex: непустая - соединение потеряно, ответ на всё новое
+    uint64_t nextRequestId = 1;     // под requestMutex
+    thread receiverThread;
+    atomic<bool> receiverRunning{false};
+    
+    // Диффы присутствия из потока приёма
+    mutex queueMutex;
+    vector<pair<string, bool>> presenceUpdates;
+    thread heartbeatThread;
+    atomic<bool> heartbeatRunning{false};
     
     int clientSocket = -1;
     string serverHost;
     uint16_t serverPort;
     bool connectedToServer = false;
+    ShmChannel sharedChannel;
+    bool sharedMemoryActive = false;
     
     void chatMenu();
     void sendPublicMessage();
@@ -40,27 +69,63 @@ private:
     void manageFriends();
     void showOnlineUsers();
     void searchMessages();
+    void searchServerHistory(const string& text);
     void createChatRoom();
     void joinChatRoom();
     void showChatRoomMenu();
     void showChatRoomMembers();
+    void leaveChatRoom();
+    void sendRoomMessage();
+    void refreshChatRooms();
+    void applyChatRooms(const string& response);
+    string chooseRoom(const vector<string>& rooms);
     void sendSystemMessage(const string& text);
+    void showServerStatistics();
+    MemoryReport collectMemory() const;
     
+    Message addMessage(const User* sender, const User* recipient, const char* text, size_t length,
+                       MessageType type, long long timestamp);
+    Message addRoomMessage(const User* sender, const string& room, const char* text, size_t length,
+                           long long timestamp);
     void updateUserMessageIndex(const Message& message);
+    const User* findUser(const string& login) const;
     vector<Message> getMessagesForUser(const User* user) const;
     vector<Message> getMessagesByTag(const string& tag) const;
     void processMessageQueue();
     bool isValidInput(const string& input) const;
     void clearScreen() const;
     
+    bool openServerConnection();
+    void closeServerConnection();
+    void offerCompression();
+    bool openServerSocket();
+    bool openUnixSocket(const string& path);
+    bool attachSharedMemory();
+    void closeSharedMemory();
+    void receiverLoop(int socket, bool sharedMemory);
+    bool readServerFrames(int socket, bool wait);
+    void dispatchServerFrame(const string& frame);
+    void failPendingRequests(const string& response);
+    void deliverUnmatched(const string& response);
     string sendRequestToServer(const string& request);
     string receiveFromClient(int socket);
+    void handleServerEvent(const string& frame);
+    void refreshOnlineUsers();
+    void applyOnlineUsers(const string& response);
+    void refreshFriends();
+    void applyFriends(const string& response);
+    void startHeartbeat(const string& login);
+    void stopHeartbeat();
+    void heartbeatLoop(string login);
     bool parseServerResponse(const string& response, string& status, string& data);
     void loadUsersFromServer(const string& usersData);
     void loadMessagesFromServer(const string& messagesData);
+    size_t appendMessagesFromServer(const string& messagesData);
+    void fetchMail();
 
 public:
     Chat();
+    ~Chat();
     
     void registerUser();
     void login();
@@ -76,6 +141,12 @@ public:
     void disconnectFromServer();
     bool isConnected() const { return connectedToServer; }
     
+    // Запрос уходит сразу, не дожидаясь ответов на предыдущие. Обработчик вызывается
+    // из потока приёма и не должен ждать других ответов; BUSY и THROTTLED не повторяются
+    bool sendRequestAsync(const string& request, function<void(const string&)> onResponse);
+    future<string> sendRequestAsync(const string& request);
+    size_t getPendingRequestCount() const;
+    
     size_t getUserCount() const;
     size_t getMessageCount() const;
     const vector<string>& getOnlineUsers() const;
@@ -0,0 +1,453 @@
+#include "server.h"
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <algorithm>
+#include <cstdlib>
+#include <random>
+#include <queue>
+#include <unordered_map>
+#include <thread>
+#include <functional>
+#include <sstream>
+
+#ifdef __linux__
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+using namespace std;
+
+// Генератор нагрузки: N клиентов шлют смесь команд с открытым потоком прибытия.
+// Моменты запросов - пуассоновский процесс: запрос уходит в назначенное время, даже если
+// предыдущий ещё без ответа (конвейер с ID:n). Задержка считается от назначенного момента,
+// поэтому отставание самого генератора не прячет очередь на сервере.
+// Без --connect поднимает сервер в этом же процессе на --port; внешнему серверу
+// нужны --max-connections и снятые --rate-limit, иначе ответы будут BUSY и THROTTLED.
+// Запуск: ./chat_bench [--clients N] [--rate R] [--duration S] [--threads T]
+//                      [--mix register=0,login=10,send=60,messages=20,users=10]
+//                      [--connect host:port | --port P --reactors N]
+
+#ifndef __linux__
+int main() {
+    cerr << "chat_bench requires Linux (epoll)" << endl;
+    return 1;
+}
+#else
+
+enum BenchCommand {
+    CMD_REGISTER,
+    CMD_LOGIN,
+    CMD_SEND,
+    CMD_MESSAGES,
+    CMD_USERS,
+    CMD_COUNT
+};
+
+static const char* const COMMAND_NAMES[CMD_COUNT] = {"register", "login", "send", "messages", "users"};
+
+// После конца замера ждём оставшиеся ответы не дольше этого
+static const long long DRAIN_TIMEOUT_US = 5000000;
+
+struct BenchOptions {
+    size_t clients = 1000;
+    double rate = 5000;             // запросов в секунду на всех клиентов
+    double durationSec = 10;
+    size_t threads = 2;
+    double weights[CMD_COUNT] = {0, 10, 60, 20, 10};
+    string host = "127.0.0.1";
+    uint16_t port = 9651;
+    bool external = false;
+    size_t reactors = 2;
+};
+
+struct CommandResult {
+    size_t sent = 0;
+    size_t ok = 0;
+    size_t busy = 0;        // BUSY и THROTTLED - отказ до выполнения
+    size_t failed = 0;
+    vector<long long> latenciesUs;
+};
+
+struct BenchClient {
+    size_t index = 0;
+    int socket = -1;
+    string login;
+    string buffer;
+    uint64_t nextId = 1;
+    unordered_map<uint64_t, pair<BenchCommand, long long>> inFlight;    // id -> команда и назначенный момент
+};
+
+static long long nowUs() {
+    return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static int connectTcp(const string& host, uint16_t port) {
+    int s = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (s < 0 || inet_pton(AF_INET, host.c_str(), &addr.sin_addr) <= 0 ||
+        connect(s, (sockaddr*)&addr, sizeof(addr)) < 0) {
+        if (s >= 0) close(s);
+        return -1;
+    }
+    int noDelay = 1;
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+    return s;
+}
+
+static bool sendAll(int s, const string& data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t bytesSent = send(s, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (bytesSent < 0 && errno == EINTR) continue;
+        if (bytesSent <= 0) return false;
+        sent += static_cast<size_t>(bytesSent);
+    }
+    return true;
+}
+
+// Блокирующий обмен для подготовки клиентов, до начала замера
+static string roundTrip(BenchClient& client, const string& request) {
+    if (!sendAll(client.socket, request + "\nEND\n")) return string();
+    char chunk[4096];
+    while (true) {
+        size_t endPos = client.buffer.find("\nEND\n");
+        if (endPos != string::npos) {
+            string frame = client.buffer.substr(0, endPos);
+            client.buffer.erase(0, endPos + 5);
+            if (frame.compare(0, 6, "EVENT:") == 0) continue;
+            return frame;
+        }
+        ssize_t received = recv(client.socket, chunk, sizeof(chunk), 0);
+        if (received <= 0) return string();
+        client.buffer.append(chunk, static_cast<size_t>(received));
+    }
+}
+
+static bool parseMix(const string& spec, double* weights) {
+    double parsed[CMD_COUNT] = {0, 0, 0, 0, 0};
+    double total = 0;
+    stringstream ss(spec);
+    string item;
+    while (getline(ss, item, ',')) {
+        size_t eq = item.find('=');
+        if (eq == string::npos) return false;
+        string name = item.substr(0, eq);
+        size_t command = 0;
+        while (command < CMD_COUNT && name != COMMAND_NAMES[command]) ++command;
+        if (command == CMD_COUNT) return false;
+        parsed[command] = atof(item.c_str() + eq + 1);
+        if (parsed[command] < 0) return false;
+        total += parsed[command];
+    }
+    if (total <= 0) return false;
+    copy(parsed, parsed + CMD_COUNT, weights);
+    return true;
+}
+
+static string buildRequest(BenchCommand command, const BenchClient& client, size_t clientCount,
+                           size_t worker, size_t& registered, mt19937& rng) {
+    switch (command) {
+        case CMD_REGISTER:
+            return "REGISTER\nbench_new_" + to_string(worker) + "_" + to_string(registered++) + "_" +
+                   to_string(rng()) + "\np\nBench";
+        case CMD_LOGIN:
+            return "LOGIN\n" + client.login + "\np";
+        case CMD_SEND: {
+            // Поровну личных и общих: личные проходят ещё и через почтовые ящики
+            if (rng() & 1) {
+                return "SEND_MESSAGE\n" + client.login + "\n\nload test message\nPUBLIC";
+            }
+            size_t recipient = rng() % clientCount;
+            return "SEND_MESSAGE\n" + client.login + "\nbench" + to_string(recipient) + "\nload test message\nPRIVATE";
+        }
+        case CMD_MESSAGES:
+            return "GET_MESSAGES\n" + client.login;
+        case CMD_USERS:
+        case CMD_COUNT:
+            break;
+    }
+    return "GET_USERS";
+}
+
+static void recordResponse(BenchClient& client, const string& frame, long long receivedUs, CommandResult* results) {
+    if (frame.compare(0, 3, "ID:") != 0) return;
+    uint64_t id = strtoull(frame.c_str() + 3, nullptr, 10);
+    auto it = client.inFlight.find(id);
+    if (it == client.inFlight.end()) return;
+
+    // GET_USERS и GET_MESSAGES отвечают данными без строки STATUS
+    CommandResult& result = results[it->second.first];
+    size_t payload = frame.find('\n');
+    payload = payload == string::npos ? frame.size() : payload + 1;
+    if (frame.compare(payload, 7, "STATUS:") != 0 || frame.compare(payload, 15, "STATUS:SUCCESS\n") == 0) {
+        ++result.ok;
+    } else if (frame.compare(payload, 12, "STATUS:BUSY\n") == 0 ||
+               frame.compare(payload, 17, "STATUS:THROTTLED\n") == 0) {
+        ++result.busy;
+    } else {
+        ++result.failed;
+    }
+    result.latenciesUs.push_back(receivedUs - it->second.second);
+    client.inFlight.erase(it);
+}
+
+// Поток генератора ведёт свою долю клиентов: одно расписание прибытий и один epoll на всех
+static void runWorker(const BenchOptions& options, vector<BenchClient>& clients, size_t worker,
+                      long long startUs, long long endUs, CommandResult* results, size_t& outstanding) {
+    mt19937 rng(static_cast<unsigned>(nowUs()) + static_cast<unsigned>(worker) * 7919u);
+    double perClientRate = options.rate / options.clients;
+    exponential_distribution<double> gap(perClientRate * 1e-6);
+    discrete_distribution<int> pick(options.weights, options.weights + CMD_COUNT);
+    size_t registered = 0;
+
+    int epollFd = epoll_create1(0);
+    typedef pair<long long, size_t> Arrival;
+    priority_queue<Arrival, vector<Arrival>, greater<Arrival>> arrivals;
+    for (size_t i = 0; i < clients.size(); ++i) {
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.u64 = i;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, clients[i].socket, &event);
+        arrivals.push(Arrival(startUs + static_cast<long long>(gap(rng)), i));
+    }
+
+    vector<epoll_event> events(256);
+    char chunk[16384];
+    size_t pending = 0;
+    while (true) {
+        long long now = nowUs();
+        while (!arrivals.empty() && arrivals.top().first <= now) {
+            Arrival arrival = arrivals.top();
+            arrivals.pop();
+            if (arrival.first >= endUs) continue;
+
+            BenchClient& client = clients[arrival.second];
+            BenchCommand command = static_cast<BenchCommand>(pick(rng));
+            uint64_t id = client.nextId++;
+            string frame = "ID:" + to_string(id) + "\n" +
+                           buildRequest(command, client, options.clients, worker, registered, rng) + "\nEND\n";
+            ++results[command].sent;
+            if (sendAll(client.socket, frame)) {
+                client.inFlight[id] = make_pair(command, arrival.first);
+                ++pending;
+            } else {
+                ++results[command].failed;
+            }
+            arrivals.push(Arrival(arrival.first + static_cast<long long>(gap(rng)) + 1, arrival.second));
+        }
+
+        bool sending = !arrivals.empty() && arrivals.top().first < endUs;
+        if (!sending && (pending == 0 || now >= endUs + DRAIN_TIMEOUT_US)) break;
+
+        int timeoutMs = 10;
+        if (sending) {
+            timeoutMs = static_cast<int>(max(0LL, (arrivals.top().first - now) / 1000));
+        }
+        int ready = epoll_wait(epollFd, events.data(), static_cast<int>(events.size()), timeoutMs);
+        long long receivedUs = nowUs();
+        for (int i = 0; i < ready; ++i) {
+            BenchClient& client = clients[events[i].data.u64];
+            while (true) {
+                ssize_t received = recv(client.socket, chunk, sizeof(chunk), MSG_DONTWAIT);
+                if (received > 0) {
+                    client.buffer.append(chunk, static_cast<size_t>(received));
+                    continue;
+                }
+                if (received < 0 && errno == EINTR) continue;
+                if (received == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+                    epoll_ctl(epollFd, EPOLL_CTL_DEL, client.socket, nullptr);
+                }
+                break;
+            }
+
+            size_t endPos;
+            size_t consumed = 0;
+            while ((endPos = client.buffer.find("\nEND\n", consumed)) != string::npos) {
+                size_t before = client.inFlight.size();
+                recordResponse(client, client.buffer.substr(consumed, endPos - consumed), receivedUs, results);
+                pending -= before - client.inFlight.size();
+                consumed = endPos + 5;
+            }
+            client.buffer.erase(0, consumed);
+        }
+    }
+    outstanding = pending;
+    close(epollFd);
+}
+
+static double percentileMs(const vector<long long>& sorted, double p) {
+    if (sorted.empty()) return 0;
+    return sorted[min(sorted.size() - 1, static_cast<size_t>(p * sorted.size()))] / 1000.0;
+}
+
+static void printRow(const string& name, const CommandResult& result, double seconds) {
+    cout << left << setw(10) << name << right
+         << setw(10) << result.sent << setw(10) << result.ok << setw(8) << result.busy << setw(8) << result.failed
+         << fixed << setprecision(0) << setw(10) << result.latenciesUs.size() / seconds
+         << setprecision(3) << setw(10) << percentileMs(result.latenciesUs, 0.50)
+         << setw(10) << percentileMs(result.latenciesUs, 0.99)
+         << setw(10) << percentileMs(result.latenciesUs, 0.999) << endl;
+}
+
+static int runBenchmark(const BenchOptions& options) {
+    // Подготовка: каждый клиент подключается, регистрируется (если ещё нет) и входит
+    vector<vector<BenchClient>> shards(options.threads);
+    for (size_t i = 0; i < options.clients; ++i) {
+        BenchClient client;
+        client.index = i;
+        client.login = "bench" + to_string(i);
+        client.socket = connectTcp(options.host, options.port);
+        if (client.socket < 0) {
+            cerr << "Failed to connect client " << i << " to " << options.host << ":" << options.port << endl;
+            return 1;
+        }
+        roundTrip(client, "REGISTER\n" + client.login + "\np\nBench");
+        string login = roundTrip(client, "LOGIN\n" + client.login + "\np");
+        if (login.compare(0, 15, "STATUS:SUCCESS\n") != 0) {
+            cerr << "Client " << i << " failed to log in: " << login.substr(0, login.find('\n', 7)) << endl;
+            return 1;
+        }
+        shards[i % options.threads].push_back(move(client));
+    }
+
+    cout << "\n" << options.clients << " clients, " << options.threads << " threads, target "
+         << fixed << setprecision(0) << options.rate << " req/s for " << options.durationSec
+         << " s, latency in milliseconds from scheduled send\n";
+
+    vector<vector<CommandResult>> workerResults(options.threads, vector<CommandResult>(CMD_COUNT));
+    vector<size_t> outstanding(options.threads, 0);
+    long long startUs = nowUs() + 10000;
+    long long endUs = startUs + static_cast<long long>(options.durationSec * 1e6);
+    vector<thread> workers;
+    for (size_t w = 0; w < options.threads; ++w) {
+        workers.emplace_back(runWorker, cref(options), ref(shards[w]), w, startUs, endUs,
+                             workerResults[w].data(), ref(outstanding[w]));
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    CommandResult total;
+    CommandResult merged[CMD_COUNT];
+    size_t lost = 0;
+    for (size_t w = 0; w < options.threads; ++w) {
+        lost += outstanding[w];
+        for (size_t c = 0; c < CMD_COUNT; ++c) {
+            const CommandResult& part = workerResults[w][c];
+            merged[c].sent += part.sent;
+            merged[c].ok += part.ok;
+            merged[c].busy += part.busy;
+            merged[c].failed += part.failed;
+            merged[c].latenciesUs.insert(merged[c].latenciesUs.end(), part.latenciesUs.begin(), part.latenciesUs.end());
+        }
+    }
+
+    cout << left << setw(10) << "command" << right << setw(10) << "sent" << setw(10) << "ok" << setw(8) << "busy"
+         << setw(8) << "failed" << setw(10) << "resp/s" << setw(10) << "p50" << setw(10) << "p99"
+         << setw(10) << "p99.9" << endl;
+    for (size_t c = 0; c < CMD_COUNT; ++c) {
+        if (merged[c].sent == 0) continue;
+        total.sent += merged[c].sent;
+        total.ok += merged[c].ok;
+        total.busy += merged[c].busy;
+        total.failed += merged[c].failed;
+        total.latenciesUs.insert(total.latenciesUs.end(), merged[c].latenciesUs.begin(), merged[c].latenciesUs.end());
+        sort(merged[c].latenciesUs.begin(), merged[c].latenciesUs.end());
+        printRow(COMMAND_NAMES[c], merged[c], options.durationSec);
+    }
+    sort(total.latenciesUs.begin(), total.latenciesUs.end());
+    printRow("total", total, options.durationSec);
+    if (lost > 0) {
+        cout << lost << " requests still without a response " << DRAIN_TIMEOUT_US / 1000000 << " s after the end" << endl;
+    }
+
+    for (auto& shard : shards) {
+        for (auto& client : shard) {
+            close(client.socket);
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    BenchOptions options;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--clients" && i + 1 < argc) {
+            options.clients = static_cast<size_t>(strtoul(argv[++i], nullptr, 10));
+        } else if (arg == "--rate" && i + 1 < argc) {
+            options.rate = atof(argv[++i]);
+        } else if (arg == "--duration" && i + 1 < argc) {
+            options.durationSec = atof(argv[++i]);
+        } else if (arg == "--threads" && i + 1 < argc) {
+            options.threads = static_cast<size_t>(strtoul(argv[++i], nullptr, 10));
+        } else if (arg == "--mix" && i + 1 < argc) {
+            if (!parseMix(argv[++i], options.weights)) {
+                cerr << "Invalid --mix, expected name=weight,... with names register, login, send, messages, users" << endl;
+                return 1;
+            }
+        } else if (arg == "--connect" && i + 1 < argc) {
+            string target = argv[++i];
+            size_t colon = target.rfind(':');
+            if (colon == string::npos) {
+                cerr << "Invalid --connect, expected host:port" << endl;
+                return 1;
+            }
+            options.host = target.substr(0, colon);
+            options.port = static_cast<uint16_t>(atoi(target.c_str() + colon + 1));
+            options.external = true;
+        } else if (arg == "--port" && i + 1 < argc) {
+            options.port = static_cast<uint16_t>(atoi(argv[++i]));
+        } else if (arg == "--reactors" && i + 1 < argc) {
+            options.reactors = static_cast<size_t>(strtoul(argv[++i], nullptr, 10));
+        } else {
+            cerr << "Unknown option: " << arg << endl;
+            return 1;
+        }
+    }
+    if (options.clients == 0 || options.threads == 0 || options.rate <= 0 || options.durationSec <= 0) {
+        cerr << "--clients, --threads, --rate and --duration must be positive" << endl;
+        return 1;
+    }
+    options.threads = min(options.threads, options.clients);
+
+    // Клиенты и сервер в одном процессе: по два дескриптора на соединение
+    rlimit files;
+    if (getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < files.rlim_max) {
+        files.rlim_cur = files.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &files);
+    }
+
+    if (options.external) {
+        return runBenchmark(options);
+    }
+    
+    ServerConfig config;
+    config.idleTimeoutMs = 0;
+    config.reactorCount = options.reactors;
+    config.admission.maxConnections = options.clients + 64;
+    for (size_t i = 0; i < COMMAND_CLASS_COUNT; ++i) {
+        config.rateLimits.user[i] = RateLimit{0, 0};
+        config.rateLimits.connection[i] = RateLimit{0, 0};
+    }
+    Server server(options.port, "chat_bench.db", config);
+    if (!server.start()) {
+        return 1;
+    }
+    int result = runBenchmark(options);
+    server.stop();
+    return result;
+}
+#endif
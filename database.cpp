@@ -1,39 +1,110 @@
 #include "database.h"
+#include "memory_usage.h"
+#include "tracer.h"
+#include "block_codec.h"
 #include <fstream>
 #include <sstream>
 #include <algorithm>
 #include <iostream>
+#include <map>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <climits>
+#include <thread>
 
 using namespace std;
 
-Database::Database(const string& path) : dbPath(path) {
+// Кусок выгрузки, читаемый за раз, и наименьшая часть на поток разбора
+static const size_t BULK_CHUNK_BYTES = 8 * 1024 * 1024;
+static const size_t BULK_MIN_SLICE_BYTES = 256 * 1024;
+
+// Строка выгрузки длиннее этого считается мусором
+static const size_t MAX_BULK_LINE_BYTES = 64 * 1024 * 1024;
+
+// Несжатый размер блока архива: больше - лучше сжатие, меньше - дешевле точечное чтение
+static const size_t ARCHIVE_BLOCK_BYTES = 256 * 1024;
+
+// Смещение id, чьё сообщение ушло в архив
+static const long long ARCHIVED_OFFSET = -1;
+
+Database::Database(const string& path) : dbPath(path), messagesEnd(0) {
 }
 
 Database::~Database() {
 }
 
+const char* const Database::USERS_FILE = "users.txt";
+const char* const Database::MESSAGES_FILE = "messages.txt";
+const char* const Database::ROOMS_FILE = "rooms.txt";
+const char* const Database::ARCHIVE_DIR = "archive";
+const char* const Database::ARCHIVE_CATALOG = "CATALOG";
+
 string Database::getUsersFilePath() const {
-    return dbPath + "/users.txt";
+    return dbPath + "/" + USERS_FILE;
 }
 
 string Database::getMessagesFilePath() const {
-    return dbPath + "/messages.txt";
+    return dbPath + "/" + MESSAGES_FILE;
+}
+
+string Database::getRoomsFilePath() const {
+    return dbPath + "/" + ROOMS_FILE;
+}
+
+string Database::getArchivePath() const {
+    return dbPath + "/" + ARCHIVE_DIR;
 }
 
 bool Database::initialize() {
     #ifdef _WIN32
         system(("mkdir " + dbPath + " 2>nul").c_str());
+        system(("mkdir " + getArchivePath() + " 2>nul").c_str());
     #else
-        system(("mkdir -p " + dbPath + " 2>/dev/null").c_str());
+        system(("mkdir -p " + getArchivePath() + " 2>/dev/null").c_str());
     #endif
     
     ofstream usersFile(getUsersFilePath(), ios::app);
     ofstream messagesFile(getMessagesFilePath(), ios::app);
+    ofstream roomsFile(getRoomsFilePath(), ios::app);
     
-    return usersFile.good() && messagesFile.good();
+    bool ok = usersFile.good() && messagesFile.good() && roomsFile.good();
+    messagesFile.close();
+    if (ok) {
+        buildMessageIndex();
+        loadArchiveCatalog();
+    }
+    return ok;
+}
+
+void Database::buildMessageIndex() {
+    lock_guard<mutex> lock(messagesMutex);
+    messageOffsets.clear();
+    messagesEnd = 0;
+    
+    ifstream file(getMessagesFilePath());
+    string line;
+    uint64_t archived;
+    while (getline(file, line)) {
+        if (parseTombstone(line, archived)) {
+            messageOffsets.insert(messageOffsets.end(), archived, ARCHIVED_OFFSET);
+        } else if (!line.empty()) {
+            messageOffsets.push_back(messagesEnd);
+        }
+        messagesEnd += static_cast<long long>(line.size()) + 1;
+    }
+}
+
+// Метка архива "~N": в строке сообщения всегда есть '|', так что с ней не спутать
+bool Database::parseTombstone(const string& line, uint64_t& count) {
+    if (line.size() < 2 || line[0] != '~') return false;
+    if (line.find_first_not_of("0123456789", 1) != string::npos) return false;
+    count = strtoull(line.c_str() + 1, nullptr, 10);
+    return true;
 }
 
-string Database::escapeString(const string& s) const {
+string Database::escapeString(const string& s) {
     string result;
     for (char c : s) {
         if (c == '|') {
@@ -51,7 +122,7 @@ string Database::escapeString(const string& s) const {
     return result;
 }
 
-string Database::unescapeString(const string& s) const {
+string Database::unescapeString(const string& s) {
     string result;
     for (size_t i = 0; i < s.length(); ++i) {
         if (s[i] == '\\' && i + 1 < s.length()) {
@@ -77,7 +148,26 @@ string Database::unescapeString(const string& s) const {
     return result;
 }
 
-string Database::serializeUser(const UserData& user) const {
+// Разбиение по разделителю с учётом экранирования: "\\|" не считается границей поля
+vector<string> Database::splitFields(const string& line, char separator) {
+    vector<string> fields;
+    string current;
+    for (size_t i = 0; i < line.length(); ++i) {
+        if (line[i] == '\\' && i + 1 < line.length()) {
+            current += line[i];
+            current += line[++i];
+        } else if (line[i] == separator) {
+            fields.push_back(current);
+            current.clear();
+        } else {
+            current += line[i];
+        }
+    }
+    fields.push_back(current);
+    return fields;
+}
+
+string Database::serializeUser(const UserData& user) {
     ostringstream oss;
     oss << escapeString(user.login) << "|"
         << escapeString(user.password) << "|"
@@ -91,22 +181,20 @@ string Database::serializeUser(const UserData& user) const {
     return oss.str();
 }
 
-UserData Database::deserializeUser(const string& line) const {
+UserData Database::deserializeUser(const string& line) {
     UserData user;
-    stringstream ss(line);
-    string token;
+    vector<string> fields = splitFields(line, '|');
     
-    if (!getline(ss, token, '|')) return user;
-    user.login = unescapeString(token);
+    user.login = unescapeString(fields[0]);
     
-    if (!getline(ss, token, '|')) return user;
-    user.password = unescapeString(token);
+    if (fields.size() < 2) return user;
+    user.password = unescapeString(fields[1]);
     
-    if (!getline(ss, token, '|')) return user;
-    user.name = unescapeString(token);
+    if (fields.size() < 3) return user;
+    user.name = unescapeString(fields[2]);
     
-    if (getline(ss, token, '|')) {
-        stringstream friendsStream(token);
+    if (fields.size() > 3) {
+        stringstream friendsStream(fields[3]);
         string friendLogin;
         while (getline(friendsStream, friendLogin, ',')) {
             if (!friendLogin.empty()) {
@@ -118,7 +206,7 @@ UserData Database::deserializeUser(const string& line) const {
     return user;
 }
 
-string Database::serializeMessage(const MessageData& msg) const {
+string Database::serializeMessage(const MessageData& msg) {
     ostringstream oss;
     oss << escapeString(msg.senderLogin) << "|"
         << escapeString(msg.recipientLogin) << "|"
@@ -134,28 +222,27 @@ string Database::serializeMessage(const MessageData& msg) const {
     return oss.str();
 }
 
-MessageData Database::deserializeMessage(const string& line) const {
+MessageData Database::deserializeMessage(const string& line) {
     MessageData msg;
-    stringstream ss(line);
-    string token;
+    msg.timestamp = 0;
+    vector<string> fields = splitFields(line, '|');
     
-    if (!getline(ss, token, '|')) return msg;
-    msg.senderLogin = unescapeString(token);
+    msg.senderLogin = unescapeString(fields[0]);
 
-    if (!getline(ss, token, '|')) return msg;
-    msg.recipientLogin = unescapeString(token);
+    if (fields.size() < 2) return msg;
+    msg.recipientLogin = unescapeString(fields[1]);
     
-    if (!getline(ss, token, '|')) return msg;
-    msg.text = unescapeString(token);
+    if (fields.size() < 3) return msg;
+    msg.text = unescapeString(fields[2]);
     
-    if (!getline(ss, token, '|')) return msg;
-    msg.type = unescapeString(token);
+    if (fields.size() < 4) return msg;
+    msg.type = unescapeString(fields[3]);
     
-    if (!getline(ss, token, '|')) return msg;
-    msg.timestamp = stoll(token);
+    if (fields.size() < 5) return msg;
+    msg.timestamp = strtoll(fields[4].c_str(), nullptr, 10);
     
-    if (getline(ss, token, '|')) {
-        stringstream tagsStream(token);
+    if (fields.size() > 5) {
+        stringstream tagsStream(fields[5]);
         string tag;
         while (getline(tagsStream, tag, ',')) {
             if (!tag.empty()) {
@@ -168,6 +255,8 @@ MessageData Database::deserializeMessage(const string& line) const {
 }
 
 bool Database::addUser(const string& login, const string& password, const string& name) {
+    TraceSpan span("db.addUser", "db");
+    lock_guard<mutex> lock(usersMutex);
     if (userExists(login)) {
         return false;
     }
@@ -185,6 +274,7 @@ bool Database::addUser(const string& login, const string& password, const string
 }
 
 bool Database::userExists(const string& login) const {
+    TraceSpan span("db.userExists", "db");
     ifstream file(getUsersFilePath());
     if (!file.is_open()) return false;
     
@@ -200,11 +290,13 @@ bool Database::userExists(const string& login) const {
 }
 
 bool Database::checkUserPassword(const string& login, const string& password) const {
+    TraceSpan span("db.checkUserPassword", "db");
     UserData user = getUser(login);
     return user.login == login && user.password == password;
 }
 
 UserData Database::getUser(const string& login) const {
+    TraceSpan span("db.getUser", "db");
     UserData emptyUser;
     ifstream file(getUsersFilePath());
     if (!file.is_open()) return emptyUser;
@@ -221,6 +313,7 @@ UserData Database::getUser(const string& login) const {
 }
 
 vector<UserData> Database::getAllUsers() const {
+    TraceSpan span("db.getAllUsers", "db");
     vector<UserData> users;
     ifstream file(getUsersFilePath());
     if (!file.is_open()) return users;
@@ -237,6 +330,8 @@ vector<UserData> Database::getAllUsers() const {
 }
 
 bool Database::updateUser(const UserData& user) {
+    TraceSpan span("db.updateUser", "db");
+    lock_guard<mutex> lock(usersMutex);
     vector<UserData> allUsers = getAllUsers();
     bool found = false;
     
@@ -250,25 +345,148 @@ bool Database::updateUser(const UserData& user) {
     
     if (!found) return false;
     
-    ofstream file(getUsersFilePath());
+    // Новый файл подменяет старый через rename: читатели и снимок резервной копии
+    // видят либо прежнюю таблицу целиком, либо новую, но не половину
+    string tmpPath = getUsersFilePath() + ".tmp";
+    {
+        ofstream file(tmpPath, ios::trunc);
+        if (!file.is_open()) return false;
+        for (const auto& u : allUsers) {
+            file << serializeUser(u) << "\n";
+        }
+        file.close();
+        if (file.fail()) return false;
+    }
+    return rename(tmpPath.c_str(), getUsersFilePath().c_str()) == 0;
+}
+
+bool Database::addMessage(const MessageData& message, uint64_t* id) {
+    TraceSpan span("db.addMessage", "db");
+    string line = serializeMessage(message);
+    
+    lock_guard<mutex> lock(messagesMutex);
+    ofstream file(getMessagesFilePath(), ios::app);
     if (!file.is_open()) return false;
     
-    for (const auto& u : allUsers) {
-        file << serializeUser(u) << "\n";
-    }
+    file << line << "\n";
+    file.close();
+    if (file.fail()) return false;
     
-    return file.good();
+    if (id) *id = messageOffsets.size();
+    messageOffsets.push_back(messagesEnd);
+    messagesEnd += static_cast<long long>(line.size()) + 1;
+    return true;
 }
 
-bool Database::addMessage(const MessageData& message) {
+// Пачка пишется одним открытием файла и одной записью; id выдаются подряд
+bool Database::addMessages(const vector<const MessageData*>& messages, vector<uint64_t>& ids) {
+    TraceSpan span("db.addMessages", "db");
+    string block;
+    vector<size_t> lengths;
+    lengths.reserve(messages.size());
+    for (const MessageData* message : messages) {
+        string line = serializeMessage(*message);
+        lengths.push_back(line.size() + 1);
+        block += line;
+        block += "\n";
+    }
+    
+    lock_guard<mutex> lock(messagesMutex);
     ofstream file(getMessagesFilePath(), ios::app);
     if (!file.is_open()) return false;
     
-    file << serializeMessage(message) << "\n";
-    return file.good();
+    file << block;
+    file.close();
+    if (file.fail()) return false;
+    
+    ids.clear();
+    for (size_t length : lengths) {
+        ids.push_back(messageOffsets.size());
+        messageOffsets.push_back(messagesEnd);
+        messagesEnd += static_cast<long long>(length);
+    }
+    return true;
+}
+
+uint64_t Database::getMessageCount() const {
+    lock_guard<mutex> lock(messagesMutex);
+    return messageOffsets.size();
+}
+
+vector<MessageData> Database::getMessagesByIds(const vector<uint64_t>& ids) const {
+    TraceSpan span("db.getMessagesByIds", "db");
+    vector<long long> offsets;
+    offsets.reserve(ids.size());
+    // Файл открывается вместе со взятием смещений: после переписывания журнала
+    // старые смещения верны только для старого файла
+    ifstream file;
+    {
+        lock_guard<mutex> lock(messagesMutex);
+        for (uint64_t id : ids) {
+            if (id < messageOffsets.size() && messageOffsets[id] != ARCHIVED_OFFSET) {
+                offsets.push_back(messageOffsets[id]);
+            }
+        }
+        file.open(getMessagesFilePath());
+    }
+    
+    vector<MessageData> result;
+    result.reserve(offsets.size());
+    if (!file.is_open()) return result;
+    
+    string line;
+    for (long long offset : offsets) {
+        file.clear();
+        file.seekg(offset);
+        if (getline(file, line) && !line.empty()) {
+            result.push_back(deserializeMessage(line));
+        }
+    }
+    return result;
+}
+
+vector<pair<uint64_t, MessageData>> Database::scanMessages(uint64_t fromId, uint64_t toId) const {
+    TraceSpan span("db.scanMessages", "db");
+    vector<pair<uint64_t, MessageData>> result;
+    forEachMessage(fromId, toId, [&result](uint64_t id, MessageData& msg) {
+        result.emplace_back(id, move(msg));
+    });
+    return result;
+}
+
+// Проход по живым сообщениям журнала с id в [fromId, toId); ушедшие в архив пропускаются
+bool Database::forEachMessage(uint64_t fromId, uint64_t toId,
+                              const function<void(uint64_t, MessageData&)>& visit) const {
+    long long start;
+    ifstream file;
+    {
+        lock_guard<mutex> lock(messagesMutex);
+        toId = min<uint64_t>(toId, messageOffsets.size());
+        while (fromId < toId && messageOffsets[fromId] == ARCHIVED_OFFSET) ++fromId;
+        if (fromId >= toId) return true;
+        start = messageOffsets[fromId];
+        file.open(getMessagesFilePath());
+    }
+    if (!file.is_open()) return false;
+    file.seekg(start);
+    
+    string line;
+    uint64_t id = fromId;
+    uint64_t archived;
+    while (id < toId && getline(file, line)) {
+        if (line.empty()) continue;
+        if (parseTombstone(line, archived)) {
+            id += archived;
+            continue;
+        }
+        MessageData msg = deserializeMessage(line);
+        visit(id++, msg);
+    }
+    return true;
 }
 
 vector<MessageData> Database::getAllMessages() const {
+    TraceSpan span("db.getAllMessages", "db");
     vector<MessageData> messages;
     ifstream file(getMessagesFilePath());
     if (!file.is_open()) return messages;
@@ -284,12 +502,17 @@ vector<MessageData> Database::getAllMessages() const {
     return messages;
 }
 
-vector<MessageData> Database::getMessagesForUser(const string& login) const {
+vector<MessageData> Database::getMessagesForUser(const string& login, const set<string>& rooms) const {
+    TraceSpan span("db.getMessagesForUser", "db");
     vector<MessageData> allMessages = getAllMessages();
     vector<MessageData> userMessages;
     
     for (const auto& msg : allMessages) {
-        if (msg.type == "SYSTEM" || 
+        if (msg.type == "ROOM") {
+            if (rooms.count(msg.recipientLogin)) {
+                userMessages.push_back(msg);
+            }
+        } else if (msg.type == "SYSTEM" || 
             msg.senderLogin == login || 
             msg.recipientLogin == login ||
             (msg.type == "PUBLIC" && msg.recipientLogin.empty())) {
@@ -300,6 +523,561 @@ vector<MessageData> Database::getMessagesForUser(const string& login) const {
     return userMessages;
 }
 
+bool Database::isValidMessage(const MessageData& msg) {
+    return !msg.text.empty() && msg.timestamp > 0 &&
+           (msg.type == "PUBLIC" || msg.type == "PRIVATE" || msg.type == "SYSTEM" || msg.type == "ROOM");
+}
+
+void Database::parseMessageSlice(const char* begin, const char* end, bool keepLines, MessageBatch& batch) {
+    string line;
+    while (begin < end) {
+        const char* lineEnd = static_cast<const char*>(memchr(begin, '\n', static_cast<size_t>(end - begin)));
+        if (!lineEnd) lineEnd = end;
+        line.assign(begin, lineEnd);
+        begin = lineEnd + 1;
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        uint64_t archived;
+        if (line.empty() || parseTombstone(line, archived)) continue;
+        
+        MessageData msg = deserializeMessage(line);
+        if (!isValidMessage(msg)) {
+            ++batch.rejected;
+            continue;
+        }
+        if (keepLines) {
+            // Строка пересобирается: в журнал попадает только то, что разобралось
+            string normalized = serializeMessage(msg);
+            batch.lines += normalized;
+            batch.lines += '\n';
+            batch.lineLengths.push_back(normalized.size() + 1);
+        }
+        batch.messages.push_back(move(msg));
+    }
+}
+
+bool Database::readMessageFile(const string& path, size_t threads, bool keepLines,
+                               const function<void(vector<MessageBatch>&)>& consumer) {
+    ifstream file(path, ios::binary);
+    if (!file.is_open()) return false;
+    if (threads == 0) threads = 1;
+    
+    vector<char> chunk(BULK_CHUNK_BYTES);
+    string pending;
+    while (true) {
+        file.read(chunk.data(), static_cast<streamsize>(chunk.size()));
+        size_t readBytes = static_cast<size_t>(file.gcount());
+        bool last = readBytes < chunk.size();
+        pending.append(chunk.data(), readBytes);
+        
+        // Кусок обрезается по последней полной строке, хвост уходит в следующий
+        size_t cut = last ? pending.size() : pending.rfind('\n');
+        if (cut == string::npos) {
+            if (pending.size() > MAX_BULK_LINE_BYTES) return false;
+            continue;
+        }
+        if (!last) ++cut;
+        
+        // Границы частей сдвигаются до ближайшего '\n', чтобы строка не делилась
+        size_t parts = min(threads, cut / BULK_MIN_SLICE_BYTES + 1);
+        vector<size_t> bounds(1, 0);
+        for (size_t i = 1; i < parts; ++i) {
+            size_t bound = max(bounds.back(), cut * i / parts);
+            size_t newline = pending.find('\n', bound);
+            bounds.push_back(newline == string::npos || newline >= cut ? cut : newline + 1);
+        }
+        bounds.push_back(cut);
+        
+        vector<MessageBatch> batches(parts);
+        vector<thread> workers;
+        for (size_t i = 1; i < parts; ++i) {
+            workers.emplace_back(parseMessageSlice, pending.data() + bounds[i], pending.data() + bounds[i + 1],
+                                 keepLines, ref(batches[i]));
+        }
+        parseMessageSlice(pending.data() + bounds[0], pending.data() + bounds[1], keepLines, batches[0]);
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        
+        consumer(batches);
+        pending.erase(0, cut);
+        if (last) break;
+    }
+    return !file.bad();
+}
+
+// Журнал только дописывается, поэтому снимок - это граница [0, messagesEnd) на момент вызова:
+// всё до неё уже записано и не изменится, а новые сообщения пишутся после. Архивные
+// сообщения идут в файл первыми; пока выгрузка не кончилась, журнал не переписывается,
+// поэтому каждое сообщение попадает в файл ровно один раз
+long long Database::exportMessages(const string& path) const {
+    TraceSpan span("db.exportMessages", "db");
+    lock_guard<mutex> retentionLock(retentionMutex);
+    long long snapshotEnd;
+    long long snapshotCount;
+    ifstream source;
+    {
+        lock_guard<mutex> lock(messagesMutex);
+        snapshotEnd = messagesEnd;
+        // Метки архива копируются как есть, но сообщениями не считаются
+        snapshotCount = static_cast<long long>(messageOffsets.size()) -
+                        count(messageOffsets.begin(), messageOffsets.end(), ARCHIVED_OFFSET);
+        source.open(getMessagesFilePath(), ios::binary);
+    }
+    if (!source.is_open()) return -1;
+    string tmpPath = path + ".tmp";
+    ofstream target(tmpPath, ios::binary | ios::trunc);
+    if (!target.is_open()) return -1;
+    
+    bool archiveRead = forEachArchived(LLONG_MIN, LLONG_MAX, [&](uint64_t, MessageData& msg) {
+        target << serializeMessage(msg) << '\n';
+        ++snapshotCount;
+    });
+    
+    vector<char> chunk(BULK_CHUNK_BYTES);
+    long long remaining = snapshotEnd;
+    while (remaining > 0) {
+        streamsize wanted = static_cast<streamsize>(min<long long>(remaining, static_cast<long long>(chunk.size())));
+        source.read(chunk.data(), wanted);
+        streamsize got = source.gcount();
+        if (got <= 0) break;
+        target.write(chunk.data(), got);
+        remaining -= got;
+    }
+    target.close();
+    if (!archiveRead || remaining != 0 || target.fail()) {
+        remove(tmpPath.c_str());
+        return -1;
+    }
+    if (rename(tmpPath.c_str(), path.c_str()) != 0) return -1;
+    return snapshotCount;
+}
+
+long long Database::importMessages(const string& path, size_t threads, size_t& rejected,
+                                   const function<void(uint64_t, const MessageData&)>& onImported) {
+    TraceSpan span("db.importMessages", "db");
+    long long imported = 0;
+    bool failed = false;
+    rejected = 0;
+    
+    bool readOk = readMessageFile(path, threads, true, [&](vector<MessageBatch>& batches) {
+        if (failed) return;
+        uint64_t firstId;
+        {
+            lock_guard<mutex> lock(messagesMutex);
+            ofstream file(getMessagesFilePath(), ios::app | ios::binary);
+            for (const MessageBatch& batch : batches) {
+                file << batch.lines;
+            }
+            file.close();
+            if (file.fail()) {
+                failed = true;
+                return;
+            }
+            firstId = messageOffsets.size();
+            for (const MessageBatch& batch : batches) {
+                for (size_t length : batch.lineLengths) {
+                    messageOffsets.push_back(messagesEnd);
+                    messagesEnd += static_cast<long long>(length);
+                }
+            }
+        }
+        
+        uint64_t id = firstId;
+        for (const MessageBatch& batch : batches) {
+            rejected += batch.rejected;
+            for (const MessageData& msg : batch.messages) {
+                onImported(id++, msg);
+            }
+            imported += static_cast<long long>(batch.messages.size());
+        }
+    });
+    return readOk && !failed ? imported : -1;
+}
+
+static long long openedFileSize(ifstream& file) {
+    file.seekg(0, ios::end);
+    long long size = static_cast<long long>(file.tellg());
+    file.seekg(0, ios::beg);
+    return size < 0 ? 0 : size;
+}
+
+bool Database::openSnapshot(DatabaseSnapshot& snapshot) const {
+    TraceSpan span("db.openSnapshot", "db");
+    lock_guard<mutex> usersLock(usersMutex);
+    lock_guard<mutex> messagesLock(messagesMutex);
+    lock_guard<mutex> roomsLock(roomsMutex);
+    
+    snapshot.users.reset(new ifstream(getUsersFilePath(), ios::binary));
+    snapshot.messages.reset(new ifstream(getMessagesFilePath(), ios::binary));
+    snapshot.rooms.reset(new ifstream(getRoomsFilePath(), ios::binary));
+    if (!snapshot.users->is_open() || !snapshot.messages->is_open() || !snapshot.rooms->is_open()) {
+        return false;
+    }
+    snapshot.usersBytes = openedFileSize(*snapshot.users);
+    snapshot.roomsBytes = openedFileSize(*snapshot.rooms);
+    snapshot.messagesBytes = messagesEnd;
+    snapshot.messageCount = messageOffsets.size();
+    
+    lock_guard<mutex> archiveLock(archiveMutex);
+    snapshot.archivePath = getArchivePath();
+    snapshot.archiveFiles.clear();
+    for (const ArchiveSegment& segment : archiveSegments) {
+        snapshot.archiveFiles.push_back(segment.file);
+    }
+    snapshot.archiveCatalog = serializeArchiveCatalog(archiveSegments);
+    return true;
+}
+
+// CATALOG: строка SEGMENT:файл, за ней её блоки
+// BLOCK:смещение:сжато:исходно:первый id:последний id:мин. время:макс. время
+string Database::serializeArchiveCatalog(const vector<ArchiveSegment>& segments) {
+    ostringstream oss;
+    for (const ArchiveSegment& segment : segments) {
+        oss << "SEGMENT:" << segment.file << "\n";
+        for (const ArchiveBlock& block : segment.blocks) {
+            oss << "BLOCK:" << block.offset << ":" << block.storedBytes << ":" << block.rawBytes << ":"
+                << block.firstId << ":" << block.lastId << ":" << block.minTimestamp << ":"
+                << block.maxTimestamp << "\n";
+        }
+    }
+    return oss.str();
+}
+
+void Database::loadArchiveCatalog() {
+    lock_guard<mutex> lock(archiveMutex);
+    archiveSegments.clear();
+    ifstream file(getArchivePath() + "/" + ARCHIVE_CATALOG);
+    string line;
+    while (getline(file, line)) {
+        if (line.compare(0, 8, "SEGMENT:") == 0) {
+            ArchiveSegment segment;
+            segment.file = line.substr(8);
+            archiveSegments.push_back(segment);
+        } else if (line.compare(0, 6, "BLOCK:") == 0 && !archiveSegments.empty()) {
+            vector<string> fields = splitFields(line.substr(6), ':');
+            if (fields.size() < 7) continue;
+            ArchiveBlock block;
+            block.offset = strtoll(fields[0].c_str(), nullptr, 10);
+            block.storedBytes = static_cast<size_t>(strtoull(fields[1].c_str(), nullptr, 10));
+            block.rawBytes = static_cast<size_t>(strtoull(fields[2].c_str(), nullptr, 10));
+            block.firstId = strtoull(fields[3].c_str(), nullptr, 10);
+            block.lastId = strtoull(fields[4].c_str(), nullptr, 10);
+            block.minTimestamp = strtoll(fields[5].c_str(), nullptr, 10);
+            block.maxTimestamp = strtoll(fields[6].c_str(), nullptr, 10);
+            archiveSegments.back().blocks.push_back(block);
+        }
+    }
+}
+
+// Проход идёт по снимку журнала без замка; новое, дописанное за это время, переносится
+// в конце под замком писателей вместе с подменой файла. Сначала ищется первая устаревшая
+// строка: нет её - файлы не создаются вовсе, есть - всё до неё копируется кусками без
+// разбора. Сегмент архива и каталог пишутся раньше журнала: после сбоя между ними
+// сообщение окажется и там, и там, и чтение истории отдаст копию из журнала
+long long Database::archiveExpired(const RetentionPolicy& policy, long long nowMs, vector<uint64_t>& archivedIds) {
+    TraceSpan span("db.archiveExpired", "db");
+    lock_guard<mutex> retentionLock(retentionMutex);
+    archivedIds.clear();
+    if (policy.empty()) return 0;
+    
+    long long snapshotEnd;
+    uint64_t snapshotCount;
+    ifstream source;
+    {
+        lock_guard<mutex> lock(messagesMutex);
+        snapshotEnd = messagesEnd;
+        snapshotCount = messageOffsets.size();
+        source.open(getMessagesFilePath(), ios::binary);
+    }
+    if (!source.is_open()) return -1;
+    
+    auto expired = [&](const MessageData& msg) {
+        auto rule = policy.find(msg.type);
+        return rule != policy.end() && msg.timestamp < nowMs - rule->second;
+    };
+    
+    string line;
+    long long position = 0;
+    uint64_t id = 0;
+    uint64_t archived;
+    bool found = false;
+    while (position < snapshotEnd && getline(source, line)) {
+        long long lineStart = position;
+        position += static_cast<long long>(line.size()) + 1;
+        if (line.empty()) continue;
+        if (parseTombstone(line, archived)) {
+            id += archived;
+            continue;
+        }
+        if (expired(deserializeMessage(line))) {
+            position = lineStart;
+            found = true;
+            break;
+        }
+        ++id;
+    }
+    if (!found) return source.bad() ? -1 : 0;
+    const uint64_t firstId = id;
+    
+    string segmentFile;
+    {
+        lock_guard<mutex> lock(archiveMutex);
+        char name[32];
+        snprintf(name, sizeof(name), "segment.%06zu", archiveSegments.size() + 1);
+        segmentFile = name;
+    }
+    string segmentPath = getArchivePath() + "/" + segmentFile;
+    string journalPath = getMessagesFilePath() + ".compact";
+    ofstream segmentOut(segmentPath, ios::binary | ios::trunc);
+    ofstream journal(journalPath, ios::binary | ios::trunc);
+    if (!segmentOut.is_open() || !journal.is_open()) return -1;
+    
+    ArchiveSegment segment;
+    segment.file = segmentFile;
+    ArchiveBlock block = ArchiveBlock();
+    string blockText;
+    long long segmentBytes = 0;
+    auto sealBlock = [&]() {
+        if (blockText.empty()) return;
+        string stored = block_codec::compress(blockText.data(), blockText.size());
+        segmentOut.write(stored.data(), static_cast<streamsize>(stored.size()));
+        block.offset = segmentBytes;
+        block.storedBytes = stored.size();
+        block.rawBytes = blockText.size();
+        segment.blocks.push_back(block);
+        segmentBytes += static_cast<long long>(stored.size());
+        blockText.clear();
+    };
+    
+    // Начало журнала до первой устаревшей строки не меняется, смещения в нём тоже
+    source.clear();
+    source.seekg(0);
+    vector<char> chunk(BULK_CHUNK_BYTES);
+    long long written = 0;
+    while (written < position && source) {
+        source.read(chunk.data(), static_cast<streamsize>(min<long long>(position - written,
+                                                                         static_cast<long long>(chunk.size()))));
+        journal.write(chunk.data(), source.gcount());
+        written += source.gcount();
+    }
+    if (written != position) {
+        journal.close();
+        remove(journalPath.c_str());
+        remove(segmentPath.c_str());
+        return -1;
+    }
+    
+    vector<long long> newOffsets(snapshotCount - firstId, ARCHIVED_OFFSET);
+    uint64_t pendingArchived = 0;
+    auto flushTombstone = [&]() {
+        if (pendingArchived == 0) return;
+        string tombstone = "~" + to_string(pendingArchived) + "\n";
+        journal << tombstone;
+        written += static_cast<long long>(tombstone.size());
+        pendingArchived = 0;
+    };
+    
+    while (position < snapshotEnd && getline(source, line)) {
+        position += static_cast<long long>(line.size()) + 1;
+        if (line.empty()) continue;
+        if (parseTombstone(line, archived)) {
+            pendingArchived += archived;
+            id += archived;
+            continue;
+        }
+        
+        MessageData msg = deserializeMessage(line);
+        if (expired(msg)) {
+            if (blockText.empty()) {
+                block.firstId = id;
+                block.minTimestamp = msg.timestamp;
+                block.maxTimestamp = msg.timestamp;
+            }
+            block.lastId = id;
+            block.minTimestamp = min(block.minTimestamp, msg.timestamp);
+            block.maxTimestamp = max(block.maxTimestamp, msg.timestamp);
+            blockText += to_string(id);
+            blockText += '|';
+            blockText += line;
+            blockText += '\n';
+            if (blockText.size() >= ARCHIVE_BLOCK_BYTES) sealBlock();
+            archivedIds.push_back(id);
+            ++pendingArchived;
+        } else {
+            flushTombstone();
+            if (id < snapshotCount) newOffsets[id - firstId] = written;
+            journal << line << '\n';
+            written += static_cast<long long>(line.size()) + 1;
+        }
+        ++id;
+    }
+    sealBlock();
+    segmentOut.close();
+    
+    if (archivedIds.empty() || segmentOut.fail() || source.bad()) {
+        journal.close();
+        remove(journalPath.c_str());
+        remove(segmentPath.c_str());
+        return archivedIds.empty() && !segmentOut.fail() ? 0 : -1;
+    }
+    
+    {
+        lock_guard<mutex> lock(archiveMutex);
+        vector<ArchiveSegment> catalog = archiveSegments;
+        catalog.push_back(segment);
+        string catalogPath = getArchivePath() + "/" + ARCHIVE_CATALOG;
+        bool catalogWritten;
+        {
+            ofstream catalogOut(catalogPath + ".tmp", ios::trunc);
+            catalogOut << serializeArchiveCatalog(catalog);
+            catalogOut.close();
+            catalogWritten = !catalogOut.fail();
+        }
+        if (!catalogWritten || rename((catalogPath + ".tmp").c_str(), catalogPath.c_str()) != 0) {
+            journal.close();
+            remove(journalPath.c_str());
+            remove(segmentPath.c_str());
+            return -1;
+        }
+        archiveSegments.swap(catalog);
+    }
+    
+    lock_guard<mutex> lock(messagesMutex);
+    flushTombstone();
+    long long shift = written - snapshotEnd;
+    
+    // Хвост, дописанный во время прохода, переносится как есть
+    ifstream tail(getMessagesFilePath(), ios::binary);
+    tail.seekg(snapshotEnd);
+    while (tail) {
+        tail.read(chunk.data(), static_cast<streamsize>(chunk.size()));
+        journal.write(chunk.data(), tail.gcount());
+    }
+    journal.close();
+    if (journal.fail() || rename(journalPath.c_str(), getMessagesFilePath().c_str()) != 0) {
+        remove(journalPath.c_str());
+        return -1;
+    }
+    
+    for (uint64_t i = firstId; i < messageOffsets.size(); ++i) {
+        if (i < snapshotCount) {
+            messageOffsets[i] = newOffsets[i - firstId];
+        } else {
+            messageOffsets[i] += shift;
+        }
+    }
+    messagesEnd += shift;
+    return static_cast<long long>(archivedIds.size());
+}
+
+bool Database::parseRetentionSpec(const string& spec, RetentionPolicy& policy) {
+    size_t colon = spec.find(':');
+    if (colon == string::npos || colon == 0 || colon + 1 >= spec.size()) return false;
+    string type = spec.substr(0, colon);
+    if (type != "PUBLIC" && type != "PRIVATE" && type != "SYSTEM" && type != "ROOM") return false;
+    
+    // Срок - только цифры: strtoll приняла бы и знак, и пробелы, а "d" без числа - как 0
+    size_t unitPos = spec.find_first_not_of("0123456789", colon + 1);
+    if (unitPos == colon + 1) return false;
+    const char* unit = spec.c_str() + (unitPos == string::npos ? spec.size() : unitPos);
+    long long unitMs;
+    if (*unit == '\0' || strcmp(unit, "d") == 0) unitMs = 24LL * 3600 * 1000;
+    else if (strcmp(unit, "h") == 0) unitMs = 3600LL * 1000;
+    else if (strcmp(unit, "m") == 0) unitMs = 60LL * 1000;
+    else if (strcmp(unit, "s") == 0) unitMs = 1000;
+    else return false;
+    
+    errno = 0;
+    long long amount = strtoll(spec.c_str() + colon + 1, nullptr, 10);
+    if (errno == ERANGE || amount > LLONG_MAX / unitMs) return false;
+    
+    policy[type] = amount * unitMs;
+    return true;
+}
+
+vector<pair<uint64_t, MessageData>> Database::readHistory(long long fromMs, long long toMs,
+                                                          const function<bool(const MessageData&)>& match,
+                                                          size_t limit) const {
+    TraceSpan span("db.readHistory", "db");
+    map<uint64_t, MessageData> found;
+    auto consider = [&](uint64_t id, MessageData& msg) {
+        if (msg.timestamp < fromMs || msg.timestamp > toMs || !match(msg)) return;
+        found[id] = move(msg);
+        if (found.size() > limit) found.erase(found.begin());
+    };
+    
+    forEachArchived(fromMs, toMs, consider);
+    forEachMessage(0, getMessageCount(), consider);
+    
+    vector<pair<uint64_t, MessageData>> result;
+    result.reserve(found.size());
+    for (auto& entry : found) {
+        result.emplace_back(entry.first, move(entry.second));
+    }
+    return result;
+}
+
+bool Database::forEachArchived(long long fromMs, long long toMs,
+                               const function<void(uint64_t, MessageData&)>& visit) const {
+    vector<ArchiveSegment> segments;
+    {
+        lock_guard<mutex> lock(archiveMutex);
+        segments = archiveSegments;
+    }
+    return forEachArchived(segments, fromMs, toMs, visit);
+}
+
+// Сбой посреди переноса оставляет id и в блоке, и в журнале; такие id видны по смещению
+// в индексе журнала и здесь пропускаются. Битый или пропавший блок не прерывает проход,
+// но даёт false
+bool Database::forEachArchived(const vector<ArchiveSegment>& segments, long long fromMs, long long toMs,
+                               const function<void(uint64_t, MessageData&)>& visit) const {
+    bool ok = true;
+    string stored;
+    string text;
+    vector<pair<uint64_t, MessageData>> messages;
+    for (const ArchiveSegment& segment : segments) {
+        ifstream file(getArchivePath() + "/" + segment.file, ios::binary);
+        if (!file.is_open()) {
+            ok = false;
+            continue;
+        }
+        for (const ArchiveBlock& block : segment.blocks) {
+            if (block.maxTimestamp < fromMs || block.minTimestamp > toMs) continue;
+            stored.resize(block.storedBytes);
+            file.clear();
+            file.seekg(block.offset);
+            if (!file.read(&stored[0], static_cast<streamsize>(stored.size())) ||
+                !block_codec::decompress(stored.data(), stored.size(), block.rawBytes, text)) {
+                ok = false;
+                continue;
+            }
+            
+            messages.clear();
+            istringstream lines(text);
+            string line;
+            while (getline(lines, line)) {
+                size_t separator = line.find('|');
+                if (separator == string::npos) continue;
+                messages.emplace_back(strtoull(line.c_str(), nullptr, 10),
+                                      deserializeMessage(line.substr(separator + 1)));
+            }
+            {
+                lock_guard<mutex> lock(messagesMutex);
+                for (auto& item : messages) {
+                    if (item.first < messageOffsets.size() && messageOffsets[item.first] != ARCHIVED_OFFSET) {
+                        item.first = UINT64_MAX;
+                    }
+                }
+            }
+            for (auto& item : messages) {
+                if (item.first != UINT64_MAX) visit(item.first, item.second);
+            }
+        }
+    }
+    return ok;
+}
+
 bool Database::addFriend(const string& userLogin, const string& friendLogin) {
     UserData user = getUser(userLogin);
     if (user.login.empty()) return false;
@@ -328,3 +1106,82 @@ vector<string> Database::getUserFriends(const string& login) const {
     return user.friends;
 }
 
+// rooms.txt - журнал событий CREATE/JOIN/LEAVE, состояние восстанавливается проигрыванием
+bool Database::appendRoomEvent(const string& event, const string& room, const string& login) {
+    TraceSpan span("db.appendRoomEvent", "db");
+    lock_guard<mutex> lock(roomsMutex);
+    ofstream file(getRoomsFilePath(), ios::app);
+    if (!file.is_open()) return false;
+    
+    file << event << "|" << escapeString(room) << "|" << escapeString(login) << "\n";
+    return file.good();
+}
+
+bool Database::addRoom(const string& name, const string& owner) {
+    return appendRoomEvent("CREATE", name, owner);
+}
+
+bool Database::addRoomMember(const string& name, const string& login) {
+    return appendRoomEvent("JOIN", name, login);
+}
+
+bool Database::removeRoomMember(const string& name, const string& login) {
+    return appendRoomEvent("LEAVE", name, login);
+}
+
+vector<RoomData> Database::getAllRooms() const {
+    TraceSpan span("db.getAllRooms", "db");
+    vector<RoomData> rooms;
+    ifstream file(getRoomsFilePath());
+    if (!file.is_open()) return rooms;
+    
+    map<string, pair<string, set<string>>> state;
+    string line;
+    while (getline(file, line)) {
+        if (line.empty()) continue;
+        
+        stringstream ss(line);
+        string event, room, login;
+        if (!getline(ss, event, '|') || !getline(ss, room, '|') || !getline(ss, login, '|')) {
+            continue;
+        }
+        room = unescapeString(room);
+        login = unescapeString(login);
+        
+        auto it = state.find(room);
+        if (event == "CREATE") {
+            if (it != state.end()) continue;
+            state[room].first = login;
+            state[room].second.insert(login);
+        } else if (it != state.end()) {
+            if (event == "JOIN") {
+                it->second.second.insert(login);
+            } else if (event == "LEAVE") {
+                it->second.second.erase(login);
+            }
+        }
+    }
+    
+    for (const auto& entry : state) {
+        RoomData data;
+        data.name = entry.first;
+        data.owner = entry.second.first;
+        data.members.assign(entry.second.second.begin(), entry.second.second.end());
+        rooms.push_back(data);
+    }
+    return rooms;
+}
+
+size_t Database::memoryUsage() const {
+    size_t bytes = 0;
+    {
+        lock_guard<mutex> lock(messagesMutex);
+        bytes += memory_usage::heapBytes(messageOffsets) + memory_usage::heapBytes(dbPath);
+    }
+    lock_guard<mutex> lock(archiveMutex);
+    bytes += archiveSegments.capacity() * sizeof(ArchiveSegment);
+    for (const ArchiveSegment& segment : archiveSegments) {
+        bytes += memory_usage::heapBytes(segment.file) + segment.blocks.capacity() * sizeof(ArchiveBlock);
+    }
+    return bytes;
+}
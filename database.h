@@ -3,6 +3,13 @@
 
 #include <string>
 #include <vector>
+#include <set>
+#include <map>
+#include <mutex>
+#include <functional>
+#include <memory>
+#include <fstream>
+#include <cstdint>
 #include "user.h"
 #include "message.h"
 
@@ -15,6 +22,12 @@ struct UserData {
     vector<string> friends;
 };
 
+struct RoomData {
+    string name;
+    string owner;
+    vector<string> members;
+};
+
 struct MessageData {
     string senderLogin;
     string recipientLogin;
@@ -24,26 +37,112 @@ struct MessageData {
     vector<string> tags;
 };
 
+// Согласованный снимок базы для резервной копии: потоки открыты под замками всех писателей,
+// и в каждом файле действительны первые *Bytes байт. Дальше файлы можно читать без замков:
+// журналы только дописываются, а users.txt заменяется через rename, не трогая открытый файл
+struct DatabaseSnapshot {
+    unique_ptr<ifstream> users;
+    unique_ptr<ifstream> messages;
+    unique_ptr<ifstream> rooms;
+    long long usersBytes = 0;
+    long long messagesBytes = 0;
+    long long roomsBytes = 0;
+    uint64_t messageCount = 0;
+    // Сегменты архива запечатаны и не меняются: достаточно имён и каталога на момент снимка
+    string archivePath;
+    vector<string> archiveFiles;
+    string archiveCatalog;
+};
+
+// Срок хранения по типу сообщения (PUBLIC, SYSTEM...) в мс; тип без записи хранится вечно
+typedef map<string, long long> RetentionPolicy;
+
+// Разобранная часть куска выгрузки. lines - те же сообщения в формате журнала подряд
+// (заполняется, если нужна запись в журнал), lineLengths - длины строк вместе с '\n'
+struct MessageBatch {
+    vector<MessageData> messages;
+    string lines;
+    vector<size_t> lineLengths;
+    size_t rejected = 0;
+};
+
 class Database {
 private:
+    friend class StorageBench;      // замеры кодека и поиска: storage_bench.cpp
+    
     string dbPath;
     
+    // Индекс журнала: id сообщения -> смещение его строки в messages.txt
+    mutable mutex messagesMutex;
+    vector<long long> messageOffsets;
+    long long messagesEnd;
+    
+    // Архив: сжатые блоки по ARCHIVE_BLOCK_BYTES строк "id|сообщение". Блок хранит границы id
+    // и времени, поэтому поиск по истории распаковывает только подходящие блоки
+    struct ArchiveBlock {
+        long long offset;
+        size_t storedBytes;
+        size_t rawBytes;
+        uint64_t firstId;
+        uint64_t lastId;
+        long long minTimestamp;
+        long long maxTimestamp;
+    };
+    struct ArchiveSegment {
+        string file;
+        vector<ArchiveBlock> blocks;
+    };
+    mutable mutex archiveMutex;     // список сегментов; лежит под messagesMutex, не наоборот
+    vector<ArchiveSegment> archiveSegments;
+    mutable mutex retentionMutex;   // один проход хранения за раз; выгрузка его ждёт
+    
+    // Писатели users.txt и rooms.txt; читатели замков не берут
+    mutable mutex usersMutex;
+    mutable mutex roomsMutex;
+    
+    void buildMessageIndex();
     string getUsersFilePath() const;
     string getMessagesFilePath() const;
+    string getRoomsFilePath() const;
+    string getArchivePath() const;
+    void loadArchiveCatalog();
+    static string serializeArchiveCatalog(const vector<ArchiveSegment>& segments);
+    bool forEachArchived(const vector<ArchiveSegment>& segments, long long fromMs, long long toMs,
+                         const function<void(uint64_t, MessageData&)>& visit) const;
+    bool appendRoomEvent(const string& event, const string& room, const string& login);
     
-    string serializeUser(const UserData& user) const;
-    UserData deserializeUser(const string& line) const;
-    string serializeMessage(const MessageData& msg) const;
-    MessageData deserializeMessage(const string& line) const;
-    string escapeString(const string& s) const;
-    string unescapeString(const string& s) const;
+    static string escapeString(const string& s);
+    static string unescapeString(const string& s);
+    static vector<string> splitFields(const string& line, char separator);
+    static bool parseTombstone(const string& line, uint64_t& count);
+    static void parseMessageSlice(const char* begin, const char* end, bool keepLines, MessageBatch& batch);
 
 public:
+    // Имена файлов в каталоге базы (и в каталоге резервной копии)
+    static const char* const USERS_FILE;
+    static const char* const MESSAGES_FILE;
+    static const char* const ROOMS_FILE;
+    static const char* const ARCHIVE_DIR;
+    static const char* const ARCHIVE_CATALOG;
+    
     Database(const string& path = "chat.db");
     ~Database();
     
     bool initialize();
     
+    // Формат строк журнала; он же - формат выгрузок EXPORT/IMPORT и резервных копий клиента
+    static string serializeUser(const UserData& user);
+    static UserData deserializeUser(const string& line);
+    static string serializeMessage(const MessageData& msg);
+    static MessageData deserializeMessage(const string& line);
+    // Строка без отправителя, типа или времени не считается сообщением
+    static bool isValidMessage(const MessageData& msg);
+    
+    // Потоковое чтение выгрузки: кусками по BULK_CHUNK_BYTES, каждый кусок разбирается
+    // в threads потоков. Пачки отдаются consumer по порядку строк файла
+    static bool readMessageFile(const string& path, size_t threads, bool keepLines,
+                                const function<void(vector<MessageBatch>&)>& consumer);
+    
     bool addUser(const string& login, const string& password, const string& name);
     bool userExists(const string& login) const;
     bool checkUserPassword(const string& login, const string& password) const;
@@ -51,13 +150,53 @@ public:
     vector<UserData> getAllUsers() const;
     bool updateUser(const UserData& user);
     
-    bool addMessage(const MessageData& message);
+    bool addMessage(const MessageData& message, uint64_t* id = nullptr);
+    bool addMessages(const vector<const MessageData*>& messages, vector<uint64_t>& ids);
+    uint64_t getMessageCount() const;
+    size_t memoryUsage() const;
+    vector<MessageData> getMessagesByIds(const vector<uint64_t>& ids) const;
+    vector<pair<uint64_t, MessageData>> scanMessages(uint64_t fromId, uint64_t toId) const;
+    // То же по одному сообщению, без сборки вектора: память не зависит от длины отрезка
+    bool forEachMessage(uint64_t fromId, uint64_t toId, const function<void(uint64_t, MessageData&)>& visit) const;
     vector<MessageData> getAllMessages() const;
-    vector<MessageData> getMessagesForUser(const string& login) const;
+    vector<MessageData> getMessagesForUser(const string& login,
+                                           const set<string>& rooms = set<string>()) const;
+    
+    // Выгрузка архива и журнала на момент вызова; писатели ждут только снятия границы снимка,
+    // проход хранения - конца выгрузки. Возвращает число сообщений, -1 - ошибка записи
+    long long exportMessages(const string& path) const;
+    // Загрузка пачками в обход addMessage: одна запись в журнал на кусок файла.
+    // onImported вызывается для каждого сообщения после записи куска, по возрастанию id
+    long long importMessages(const string& path, size_t threads, size_t& rejected,
+                             const function<void(uint64_t, const MessageData&)>& onImported);
+    
+    // Переносит в архив сообщения старше срока своего типа. Журнал переписывается: на месте
+    // ушедших строк остаются метки "~N" (N id подряд в архиве), так что id живых сообщений
+    // не меняются. Писатели ждут только подмены файла в конце. Возвращает число перенесённых
+    // сообщений (их id - в archivedIds по возрастанию), -1 - ошибка записи
+    long long archiveExpired(const RetentionPolicy& policy, long long nowMs, vector<uint64_t>& archivedIds);
+    // TYPE:AGE, AGE - число с суффиксом s, m, h или d (без суффикса - дни): SYSTEM:7d, PUBLIC:365d
+    static bool parseRetentionSpec(const string& spec, RetentionPolicy& policy);
+    // Сообщения блоков архива, пересекающих [fromMs, toMs], в порядке каталога. Кроме
+    // оставшихся и в журнале: их отдаёт forEachMessage/scanMessages
+    bool forEachArchived(long long fromMs, long long toMs, const function<void(uint64_t, MessageData&)>& visit) const;
+    // Глубокая история: журнал и блоки архива, пересекающие [fromMs, toMs]. Из совпавших
+    // возвращаются limit самых поздних по id, по возрастанию
+    vector<pair<uint64_t, MessageData>> readHistory(long long fromMs, long long toMs,
+                                                    const function<bool(const MessageData&)>& match,
+                                                    size_t limit) const;
+    
+    // Замки всех писателей держатся только на время открытия файлов
+    bool openSnapshot(DatabaseSnapshot& snapshot) const;
     
     bool addFriend(const string& userLogin, const string& friendLogin);
     bool removeFriend(const string& userLogin, const string& friendLogin);
     vector<string> getUserFriends(const string& login) const;
+    
+    bool addRoom(const string& name, const string& owner);
+    bool addRoomMember(const string& name, const string& login);
+    bool removeRoomMember(const string& name, const string& login);
+    vector<RoomData> getAllRooms() const;
 };
 
 #endif
@@ -0,0 +1,84 @@
+#include "friends.h"
+#include "memory_usage.h"
+
+using namespace std;
+
+FriendGraph::FriendGraph(Database& db) : db(db) {
+}
+
+void FriendGraph::load() {
+    lock_guard<mutex> lock(graphMutex);
+    friends.clear();
+    followers.clear();
+
+    for (const auto& user : db.getAllUsers()) {
+        for (const auto& friendLogin : user.friends) {
+            friends[user.login].insert(friendLogin);
+            followers[friendLogin].insert(user.login);
+        }
+    }
+}
+
+bool FriendGraph::addFriend(const string& login, const string& friendLogin) {
+    if (login.empty() || friendLogin.empty() || login == friendLogin) return false;
+
+    lock_guard<mutex> lock(graphMutex);
+    auto it = friends.find(login);
+    if (it != friends.end() && it->second.count(friendLogin)) return true;
+    if (!db.addFriend(login, friendLogin)) return false;
+
+    friends[login].insert(friendLogin);
+    followers[friendLogin].insert(login);
+    return true;
+}
+
+bool FriendGraph::removeFriend(const string& login, const string& friendLogin) {
+    lock_guard<mutex> lock(graphMutex);
+    auto it = friends.find(login);
+    if (it == friends.end() || !it->second.count(friendLogin)) return false;
+    if (!db.removeFriend(login, friendLogin)) return false;
+
+    it->second.erase(friendLogin);
+    if (it->second.empty()) friends.erase(it);
+
+    auto back = followers.find(friendLogin);
+    if (back != followers.end()) {
+        back->second.erase(login);
+        if (back->second.empty()) followers.erase(back);
+    }
+    return true;
+}
+
+bool FriendGraph::hasFriend(const string& login, const string& friendLogin) const {
+    lock_guard<mutex> lock(graphMutex);
+    auto it = friends.find(login);
+    return it != friends.end() && it->second.count(friendLogin) > 0;
+}
+
+vector<string> FriendGraph::getFriends(const string& login) const {
+    lock_guard<mutex> lock(graphMutex);
+    auto it = friends.find(login);
+    if (it == friends.end()) return vector<string>();
+    return vector<string>(it->second.begin(), it->second.end());
+}
+
+vector<string> FriendGraph::getFollowers(const string& login) const {
+    lock_guard<mutex> lock(graphMutex);
+    auto it = followers.find(login);
+    if (it == followers.end()) return vector<string>();
+    return vector<string>(it->second.begin(), it->second.end());
+}
+
+size_t FriendGraph::getEdgeCount() const {
+    lock_guard<mutex> lock(graphMutex);
+    size_t count = 0;
+    for (const auto& item : friends) {
+        count += item.second.size();
+    }
+    return count;
+}
+
+size_t FriendGraph::memoryUsage() const {
+    lock_guard<mutex> lock(graphMutex);
+    return memory_usage::heapBytes(friends) + memory_usage::heapBytes(followers);
+}
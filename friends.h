@@ -0,0 +1,36 @@
+#ifndef FRIENDS_H
+#define FRIENDS_H
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <mutex>
+#include "database.h"
+
+using namespace std;
+
+// Граф друзей в памяти: прямые и обратные списки смежности на хэш-множествах
+class FriendGraph {
+private:
+    Database& db;
+    mutable mutex graphMutex;
+    unordered_map<string, unordered_set<string>> friends;
+    unordered_map<string, unordered_set<string>> followers;
+
+public:
+    explicit FriendGraph(Database& db);
+
+    void load();
+
+    bool addFriend(const string& login, const string& friendLogin);
+    bool removeFriend(const string& login, const string& friendLogin);
+
+    bool hasFriend(const string& login, const string& friendLogin) const;
+    vector<string> getFriends(const string& login) const;
+    vector<string> getFollowers(const string& login) const;
+    size_t getEdgeCount() const;
+    size_t memoryUsage() const;
+};
+
+#endif
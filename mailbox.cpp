@@ -0,0 +1,105 @@
+#include "mailbox.h"
+#include "memory_usage.h"
+#include <algorithm>
+
+using namespace std;
+
+MailboxManager::MailboxManager(size_t capacity) : capacity(capacity > 0 ? capacity : 1) {
+}
+
+void MailboxManager::addUser(const string& login) {
+    lock_guard<mutex> lock(mailboxMutex);
+    boxes[login];
+}
+
+bool MailboxManager::deliver(const string& login, uint64_t messageId) {
+    lock_guard<mutex> lock(mailboxMutex);
+    auto it = boxes.find(login);
+    if (it == boxes.end()) return false;
+    
+    // Как TimelineService::appendId: почти всегда в конец, редкие перестановки - вставкой
+    Mailbox& box = it->second;
+    if (messageId >= box.scannedFrom && messageId < box.scannedTo) return true;
+    deque<uint64_t>& unread = box.unread;
+    auto pos = unread.end();
+    while (pos != unread.begin() && *(pos - 1) > messageId) --pos;
+    if (pos != unread.begin() && *(pos - 1) == messageId) return true;
+    unread.insert(pos, messageId);
+    
+    if (unread.size() > capacity) {
+        auto victim = lower_bound(unread.begin(), unread.end(), box.lastReadId);
+        if (victim != unread.end()) {
+            box.evictedTo = max(box.evictedTo, *victim + 1);
+            ++box.evicted;
+            unread.erase(victim);
+        }
+    }
+    return true;
+}
+
+// O(непрочитанных)
+MailboxFetch MailboxManager::fetchUnread(const string& login) {
+    MailboxFetch result;
+    result.overflowed = false;
+    result.scanFrom = 0;
+    result.scanTo = 0;
+
+    lock_guard<mutex> lock(mailboxMutex);
+    auto it = boxes.find(login);
+    if (it == boxes.end()) return result;
+
+    Mailbox& box = it->second;
+    result.ids.assign(box.unread.begin(), box.unread.end());
+    if (box.evicted > 0) {
+        result.overflowed = true;
+        result.scanFrom = box.lastReadId;
+        result.scanTo = box.evictedTo;
+        box.scannedFrom = result.scanFrom;
+        box.scannedTo = result.scanTo;
+        box.lastReadId = max(box.lastReadId, box.evictedTo);
+    }
+    if (!result.ids.empty()) {
+        box.lastReadId = max(box.lastReadId, result.ids.back() + 1);
+    }
+    box.unread.clear();
+    box.evicted = 0;
+    box.evictedTo = 0;
+    return result;
+}
+
+void MailboxManager::markAllRead(const string& login, uint64_t nextId) {
+    lock_guard<mutex> lock(mailboxMutex);
+    auto it = boxes.find(login);
+    if (it == boxes.end()) return;
+
+    // Доставленное позже снимка nextId остаётся непрочитанным
+    Mailbox& box = it->second;
+    while (!box.unread.empty() && box.unread.front() < nextId) box.unread.pop_front();
+    box.evicted = 0;
+    box.evictedTo = 0;
+    box.lastReadId = nextId;
+    box.scannedFrom = 0;
+    box.scannedTo = nextId;
+}
+
+size_t MailboxManager::unreadCount(const string& login) const {
+    lock_guard<mutex> lock(mailboxMutex);
+    auto it = boxes.find(login);
+    if (it == boxes.end()) return 0;
+    return static_cast<size_t>(it->second.unread.size() + it->second.evicted);
+}
+
+size_t MailboxManager::getMailboxCount() const {
+    lock_guard<mutex> lock(mailboxMutex);
+    return boxes.size();
+}
+
+size_t MailboxManager::memoryUsage() const {
+    lock_guard<mutex> lock(mailboxMutex);
+    size_t bytes = boxes.bucket_count() * sizeof(void*) +
+                   boxes.size() * (sizeof(pair<const string, Mailbox>) + memory_usage::HASH_NODE_OVERHEAD);
+    for (const auto& box : boxes) {
+        bytes += memory_usage::heapBytes(box.first) + memory_usage::heapBytes(box.second.unread);
+    }
+    return bytes;
+}
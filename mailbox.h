@@ -0,0 +1,55 @@
+#ifndef MAILBOX_H
+#define MAILBOX_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <mutex>
+#include <cstdint>
+
+using namespace std;
+
+struct MailboxFetch {
+    vector<uint64_t> ids;      // непрочитанные id из ящика, по возрастанию
+    bool overflowed;           // часть непрочитанных вытеснена из кольца
+    uint64_t scanFrom;         // при переполнении: искать в индексе с этого id
+    uint64_t scanTo;           // ... до этого id (не включая)
+};
+
+// Почтовые ящики личных сообщений: не больше capacity последних непрочитанных id
+// на зарегистрированного получателя. Доставки из разных потоков приходят не по порядку
+// id, поэтому ящик держит их отсортированными и при переполнении вытесняет наименьший
+// из не меньших lastReadId: вытесненные тогда лежат в [lastReadId, evictedTo) ниже
+// оставшихся и добираются из журнала одним отрезком. Опоздавшие id меньше lastReadId
+// не вытесняются - их не больше, чем записей в полёте
+class MailboxManager {
+private:
+    struct Mailbox {
+        deque<uint64_t> unread;   // по возрастанию
+        uint64_t evicted = 0;     // вытеснено с последнего чтения
+        uint64_t evictedTo = 0;   // id, следующий за наибольшим вытесненным
+        uint64_t lastReadId = 0;  // id, следующий за последним прочитанным
+        uint64_t scannedFrom = 0; // последний отрезок, отданный из журнала: опоздавшая
+        uint64_t scannedTo = 0;   // доставка из него уже прочитана
+    };
+
+    mutable mutex mailboxMutex;
+    unordered_map<string, Mailbox> boxes;
+    size_t capacity;
+
+public:
+    explicit MailboxManager(size_t capacity = 256);
+
+    // Ящик заводится только на регистрации: письмо несуществующему логину не хранится
+    void addUser(const string& login);
+    bool deliver(const string& login, uint64_t messageId);
+    MailboxFetch fetchUnread(const string& login);
+    void markAllRead(const string& login, uint64_t nextId);
+    size_t unreadCount(const string& login) const;
+    size_t getCapacity() const { return capacity; }
+    size_t getMailboxCount() const;
+    size_t memoryUsage() const;
+};
+
+#endif
@@ -41,6 +41,8 @@ int main(int argc, char** argv) {
     uint16_t serverPort = 8080;
     string serverHost = "127.0.0.1";
     uint16_t serverPortArg = 8080;
+    ServerConfig serverConfig;
+    string restoreFrom;
     
     for (int i = 1; i < argc; ++i) {
         string arg = argv[i];
@@ -51,17 +53,97 @@ int main(int argc, char** argv) {
             mode = "client";
             string spec = argv[++i];
             size_t colon = spec.find(':');
-            if (colon != string::npos) {
+            if (spec.compare(0, 5, "unix:") == 0 || spec.compare(0, 4, "shm:") == 0) {
+                serverHost = spec;
+            } else if (colon != string::npos) {
                 serverHost = spec.substr(0, colon);
                 serverPortArg = static_cast<uint16_t>(stoi(spec.substr(colon + 1)));
             } else {
                 serverHost = spec;
             }
+        } else if (arg == "--mailbox-capacity" && i + 1 < argc) {
+            serverConfig.mailboxCapacity = static_cast<size_t>(stoul(argv[++i]));
+        } else if (arg == "--output-queue-bytes" && i + 1 < argc) {
+            serverConfig.outputQueueBytes = static_cast<size_t>(stoul(argv[++i]));
+        } else if (arg == "--max-connections" && i + 1 < argc) {
+            serverConfig.admission.maxConnections = static_cast<size_t>(stoul(argv[++i]));
+        } else if (arg == "--max-in-flight" && i + 1 < argc) {
+            serverConfig.admission.maxInFlight = static_cast<size_t>(stoul(argv[++i]));
+        } else if (arg == "--max-heavy-in-flight" && i + 1 < argc) {
+            serverConfig.admission.maxHeavyInFlight = static_cast<size_t>(stoul(argv[++i]));
+        } else if (arg == "--rate-limit" && i + 1 < argc) {
+            if (!RateLimiter::parseSpec(argv[++i], serverConfig.rateLimits)) {
+                cerr << "Invalid rate limit: " << argv[i] << endl;
+                return 1;
+            }
+        } else if (arg == "--retention" && i + 1 < argc) {
+            if (!Database::parseRetentionSpec(argv[++i], serverConfig.retention)) {
+                cerr << "Invalid retention: " << argv[i] << endl;
+                return 1;
+            }
+        } else if (arg == "--compress-threshold" && i + 1 < argc) {
+            serverConfig.compressThresholdBytes = static_cast<size_t>(stoul(argv[++i]));
+        } else if (arg == "--retention-interval-ms" && i + 1 < argc) {
+            serverConfig.retentionIntervalMs = stoll(argv[++i]);
+        } else if (arg == "--reactors" && i + 1 < argc) {
+            serverConfig.reactorCount = static_cast<size_t>(stoul(argv[++i]));
+        } else if (arg == "--ingest-queue" && i + 1 < argc) {
+            serverConfig.ingestQueueCapacity = static_cast<size_t>(stoul(argv[++i]));
+        } else if (arg == "--metrics-interval-ms" && i + 1 < argc) {
+            serverConfig.metricsDumpIntervalMs = stoll(argv[++i]);
+        } else if (arg == "--metrics-file" && i + 1 < argc) {
+            serverConfig.metricsDumpPath = argv[++i];
+        } else if (arg == "--trace-sample" && i + 1 < argc) {
+            serverConfig.traceSampleEvery = static_cast<size_t>(stoul(argv[++i]));
+        } else if (arg == "--trace-buffer" && i + 1 < argc) {
+            serverConfig.traceBufferEvents = static_cast<size_t>(stoul(argv[++i]));
+        } else if (arg == "--trace-file" && i + 1 < argc) {
+            serverConfig.tracePath = argv[++i];
+        } else if (arg == "--export-dir" && i + 1 < argc) {
+            serverConfig.exportDirectory = argv[++i];
+        } else if (arg == "--backup-dir" && i + 1 < argc) {
+            serverConfig.backupDirectory = argv[++i];
+        } else if (arg == "--restore-backup" && i + 1 < argc) {
+            restoreFrom = argv[++i];
+        } else if (arg == "--memory-limit" && i + 1 < argc) {
+            serverConfig.memorySoftLimitBytes = static_cast<size_t>(stoull(argv[++i]));
+        } else if (arg == "--unix-socket" && i + 1 < argc) {
+            serverConfig.unixSocketPath = argv[++i];
+        } else if (arg == "--idle-timeout-ms" && i + 1 < argc) {
+            serverConfig.idleTimeoutMs = stoll(argv[++i]);
+        } else if (arg == "--pong-timeout-ms" && i + 1 < argc) {
+            serverConfig.pongTimeoutMs = stoll(argv[++i]);
+        } else if (arg == "--tcp-keepalive" && i + 1 < argc) {
+            // IDLE:INTERVAL:COUNT в секундах, 0 - выключить
+            char sep;
+            stringstream spec(argv[++i]);
+            spec >> serverConfig.keepaliveIdleSec >> sep >> serverConfig.keepaliveIntervalSec
+                 >> sep >> serverConfig.keepaliveCount;
+        } else if (arg == "--slow-consumer" && i + 1 < argc) {
+            string policy = argv[++i];
+            if (policy == "coalesce") {
+                serverConfig.slowConsumerPolicy = SlowConsumerPolicy::COALESCE;
+            } else if (policy == "disconnect") {
+                serverConfig.slowConsumerPolicy = SlowConsumerPolicy::DISCONNECT;
+            } else {
+                serverConfig.slowConsumerPolicy = SlowConsumerPolicy::DROP_OLDEST;
+            }
         }
     }
     
+    if (!restoreFrom.empty()) {
+        // Восстановление - до запуска сервера: работающая база пишет в те же файлы
+        string error;
+        if (!BackupManager::restoreBackup(restoreFrom, "chat.db", error)) {
+            cerr << "Restore failed: " << error << endl;
+            return 1;
+        }
+        cout << "Restored chat.db from " << restoreFrom << endl;
+        return 0;
+    }
+    
     if (mode == "server") {
-        Server server(serverPort);
+        Server server(serverPort, "chat.db", serverConfig);
         if (!server.start()) {
             cerr << "Failed to start server!" << endl;
             return 1;
@@ -83,7 +165,7 @@ int main(int argc, char** argv) {
     uint16_t clientPort = (mode == "client" && serverPortArg != 8080) ? serverPortArg : 8080;
     if (!chat.connectToServer(serverHost, clientPort)) {
         cout << "Failed to connect to server " << serverHost << ":" << clientPort << endl;
-        cout << "Usage: --client <host:port> or --server <port>" << endl;
+        cout << "Usage: --client <host:port|unix:/path|shm:/path> or --server <port> [--unix-socket PATH] [--reactors N] [--ingest-queue N] [--metrics-interval-ms N] [--metrics-file PATH] [--trace-sample N] [--trace-buffer N] [--trace-file PATH] [--memory-limit BYTES] [--export-dir PATH] [--backup-dir PATH] [--restore-backup PATH] [--retention TYPE:AGE] [--retention-interval-ms N] [--compress-threshold BYTES] [--mailbox-capacity N] [--output-queue-bytes N] [--slow-consumer drop|coalesce|disconnect] [--max-connections N] [--max-in-flight N] [--max-heavy-in-flight N] [--rate-limit user|connection:auth|read|write:RATE:BURST] [--idle-timeout-ms N] [--pong-timeout-ms N] [--tcp-keepalive IDLE:INTERVAL:COUNT]" << endl;
         return 1;
     }
     int choice;
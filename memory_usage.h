@@ -0,0 +1,126 @@
+#ifndef MEMORY_USAGE_H
+#define MEMORY_USAGE_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <list>
+#include <map>
+#include <set>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <cstddef>
+
+using namespace std;
+
+// Оценка кучи, которую занимают контейнеры: ёмкость, узлы и строки внутри, без учёта
+// служебных байтов самого malloc. Учитывается только то, что лежит вне объекта:
+// sizeof(контейнера) входит в размер владельца. Узлы считаются по устройству libstdc++
+// (указатели на соседей и кэш хэша) - для других библиотек это приближение
+namespace memory_usage {
+
+const size_t TREE_NODE_OVERHEAD = 4 * sizeof(void*);    // цвет, родитель, два потомка
+const size_t HASH_NODE_OVERHEAD = 2 * sizeof(void*);    // next и кэш хэша
+const size_t LIST_NODE_OVERHEAD = 2 * sizeof(void*);
+
+// Объявления заранее: вложенные контейнеры должны видеть друг друга при любом порядке
+template <typename T> size_t heapBytes(const T& value);
+template <typename A, typename B> size_t heapBytes(const pair<A, B>& value);
+template <typename T> size_t heapBytes(const vector<T>& values);
+template <typename T> size_t heapBytes(const deque<T>& values);
+template <typename T> size_t heapBytes(const list<T>& values);
+template <typename T, typename C> size_t heapBytes(const set<T, C>& values);
+template <typename K, typename V, typename C> size_t heapBytes(const map<K, V, C>& values);
+template <typename T, typename H, typename E> size_t heapBytes(const unordered_set<T, H, E>& values);
+template <typename K, typename V, typename H, typename E> size_t heapBytes(const unordered_map<K, V, H, E>& values);
+
+inline size_t heapBytes(const string& s) {
+    // Короткая строка живёт внутри объекта (SSO) и кучу не трогает
+    const char* data = s.data();
+    const char* self = reinterpret_cast<const char*>(&s);
+    if (data >= self && data < self + sizeof(s)) return 0;
+    return s.capacity() + 1;
+}
+
+// Скаляры, указатели и структуры: кучу своих полей структура считает сама
+template <typename T>
+inline size_t heapBytes(const T&) {
+    return 0;
+}
+
+template <typename A, typename B>
+inline size_t heapBytes(const pair<A, B>& value) {
+    return heapBytes(value.first) + heapBytes(value.second);
+}
+
+template <typename T>
+inline size_t heapBytes(const vector<T>& values) {
+    size_t bytes = values.capacity() * sizeof(T);
+    for (const auto& value : values) bytes += heapBytes(value);
+    return bytes;
+}
+
+template <typename T>
+inline size_t heapBytes(const deque<T>& values) {
+    size_t bytes = values.size() * sizeof(T);
+    for (const auto& value : values) bytes += heapBytes(value);
+    return bytes;
+}
+
+template <typename T>
+inline size_t heapBytes(const list<T>& values) {
+    size_t bytes = values.size() * (sizeof(T) + LIST_NODE_OVERHEAD);
+    for (const auto& value : values) bytes += heapBytes(value);
+    return bytes;
+}
+
+template <typename T, typename C>
+inline size_t heapBytes(const set<T, C>& values) {
+    size_t bytes = values.size() * (sizeof(T) + TREE_NODE_OVERHEAD);
+    for (const auto& value : values) bytes += heapBytes(value);
+    return bytes;
+}
+
+template <typename K, typename V, typename C>
+inline size_t heapBytes(const map<K, V, C>& values) {
+    size_t bytes = values.size() * (sizeof(pair<const K, V>) + TREE_NODE_OVERHEAD);
+    for (const auto& value : values) bytes += heapBytes(value.first) + heapBytes(value.second);
+    return bytes;
+}
+
+template <typename T, typename H, typename E>
+inline size_t heapBytes(const unordered_set<T, H, E>& values) {
+    size_t bytes = values.bucket_count() * sizeof(void*) + values.size() * (sizeof(T) + HASH_NODE_OVERHEAD);
+    for (const auto& value : values) bytes += heapBytes(value);
+    return bytes;
+}
+
+template <typename K, typename V, typename H, typename E>
+inline size_t heapBytes(const unordered_map<K, V, H, E>& values) {
+    size_t bytes = values.bucket_count() * sizeof(void*) +
+                   values.size() * (sizeof(pair<const K, V>) + HASH_NODE_OVERHEAD);
+    for (const auto& value : values) bytes += heapBytes(value.first) + heapBytes(value.second);
+    return bytes;
+}
+
+}
+
+// Разбивка по подсистемам для MEMORY и статистики клиента
+class MemoryReport {
+private:
+    vector<pair<string, size_t>> entries;
+
+public:
+    void add(const string& subsystem, size_t bytes) { entries.push_back(make_pair(subsystem, bytes)); }
+
+    size_t total() const {
+        size_t sum = 0;
+        for (const auto& entry : entries) sum += entry.second;
+        return sum;
+    }
+
+    const vector<pair<string, size_t>>& getEntries() const { return entries; }
+};
+
+#endif
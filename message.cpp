@@ -1,4 +1,5 @@
 #include "message.h"
+#include "message_store.h"
 #include <sstream>
 #include <string>
 #include <algorithm>
@@ -7,60 +8,77 @@
 
 using namespace std;
 
-Message::Message(const User* sender, const User* recipient, const string& text, MessageType type)
-    : sender(sender), recipient(recipient), text(text), type(type) {
-    timestamp = chrono::system_clock::now();
-}
+Message::Message(MessageStore* store, size_t index)
+    : store(store), index(index) {}
 
 const User* Message::getSender() const {
-    return sender;
+    return store->getSender(index);
 }
 
 const User* Message::getRecipient() const {
-    return recipient;
+    return store->getRecipient(index);
+}
+
+const string& Message::getRoom() const {
+    return store->getRoom(index);
+}
+
+string Message::getText() const {
+    return string(store->getTextData(index), store->getTextLength(index));
 }
 
-const string& Message::getText() const {
-    return text;
+const char* Message::getTextData() const {
+    return store->getTextData(index);
 }
 
-const chrono::system_clock::time_point& Message::getTimestamp() const {
-    return timestamp;
+size_t Message::getTextLength() const {
+    return store->getTextLength(index);
+}
+
+chrono::system_clock::time_point Message::getTimestamp() const {
+    return chrono::system_clock::time_point(chrono::milliseconds(store->getTimestamp(index)));
+}
+
+long long Message::getTimestampMs() const {
+    return store->getTimestamp(index);
 }
 
 MessageType Message::getType() const {
-    return type;
+    return store->getType(index);
 }
 
-const vector<string>& Message::getTags() const {
-    return tags;
+vector<string> Message::getTags() const {
+    return store->getTags(index);
 }
 
 void Message::addTag(const string& tag) {
-    if (!hasTag(tag)) {
-        tags.push_back(tag);
-    }
+    store->addTag(index, tag);
 }
 
 void Message::removeTag(const string& tag) {
-    auto it = find(tags.begin(), tags.end(), tag);
-    if (it != tags.end()) {
-        tags.erase(it);
-    }
+    store->removeTag(index, tag);
 }
 
 string Message::toString() const {
     stringstream ss;
     ss << "[" << getFormattedTime() << "] ";
-    
-    if (type == MessageType::SYSTEM) {
-        ss << "[SYSTEM]: " << text;
+
+    const User* sender = getSender();
+    const User* recipient = getRecipient();
+    string senderName = sender ? sender->getName() : "?";
+
+    if (getType() == MessageType::SYSTEM) {
+        ss << "[SYSTEM]: ";
+    } else if (getType() == MessageType::ROOM) {
+        ss << "[" << getRoom() << "] " << senderName << ": ";
     } else if (recipient == nullptr) {
-        ss << sender->getName() << ": " << text;
+        ss << senderName << ": ";
     } else {
-        ss << sender->getName() << " -> " << recipient->getName() << ": " << text;
+        ss << senderName << " -> " << recipient->getName() << ": ";
     }
-    
+    ss.write(getTextData(), static_cast<streamsize>(getTextLength()));
+
+    vector<string> tags = getTags();
     if (!tags.empty()) {
         ss << " [Tags: ";
         for (size_t i = 0; i < tags.size(); ++i) {
@@ -69,14 +87,14 @@ string Message::toString() const {
         }
         ss << "]";
     }
-    
+
     return ss.str();
 }
 
 string Message::getFormattedTime() const {
-    auto time_t = chrono::system_clock::to_time_t(timestamp);
+    auto time_t = chrono::system_clock::to_time_t(getTimestamp());
     auto tm = *localtime(&time_t);
-    
+
     stringstream ss;
     ss << setfill('0') << setw(2) << tm.tm_hour << ":"
        << setfill('0') << setw(2) << tm.tm_min << ":"
@@ -85,19 +103,23 @@ string Message::getFormattedTime() const {
 }
 
 bool Message::hasTag(const string& tag) const {
-    return find(tags.begin(), tags.end(), tag) != tags.end();
+    return store->hasTag(index, tag);
 }
 
 bool Message::isPublic() const {
-    return type == MessageType::PUBLIC;
+    return getType() == MessageType::PUBLIC;
 }
 
 bool Message::isPrivate() const {
-    return type == MessageType::PRIVATE;
+    return getType() == MessageType::PRIVATE;
 }
 
 bool Message::isSystem() const {
-    return type == MessageType::SYSTEM;
+    return getType() == MessageType::SYSTEM;
+}
+
+bool Message::isRoom() const {
+    return getType() == MessageType::ROOM;
 }
 
 string Message::typeToString(MessageType type) {
@@ -105,6 +127,14 @@ string Message::typeToString(MessageType type) {
         case MessageType::PUBLIC: return "PUBLIC";
         case MessageType::PRIVATE: return "PRIVATE";
         case MessageType::SYSTEM: return "SYSTEM";
+        case MessageType::ROOM: return "ROOM";
         default: return "UNKNOWN";
     }
-} 
\ No newline at end of file
+}
+
+MessageType Message::typeFromString(const string& type) {
+    if (type == "PRIVATE") return MessageType::PRIVATE;
+    if (type == "SYSTEM") return MessageType::SYSTEM;
+    if (type == "ROOM") return MessageType::ROOM;
+    return MessageType::PUBLIC;
+}
\ No newline at end of file
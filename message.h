@@ -11,39 +11,48 @@ using namespace std;
 enum class MessageType {
     PUBLIC,
     PRIVATE,
-    SYSTEM
+    SYSTEM,
+    ROOM
 };
 
+const size_t MESSAGE_TYPE_COUNT = 4;
+
+class MessageStore;
+
+// Хэндл сообщения в MessageStore: копируется дёшево, данные лежат в колонках хранилища
 class Message {
 private:
-    const User* sender;
-    const User* recipient;
-    string text;
-    chrono::system_clock::time_point timestamp;
-    MessageType type;
-    vector<string> tags;
+    MessageStore* store;
+    size_t index;
 
 public:
-    Message(const User* sender, const User* recipient, const string& text, MessageType type = MessageType::PUBLIC);
-    
+    Message(MessageStore* store, size_t index);
+
     const User* getSender() const;
     const User* getRecipient() const;
-    const string& getText() const;
-    const chrono::system_clock::time_point& getTimestamp() const;
+    const string& getRoom() const;
+    string getText() const;
+    const char* getTextData() const;
+    size_t getTextLength() const;
+    chrono::system_clock::time_point getTimestamp() const;
+    long long getTimestampMs() const;
     MessageType getType() const;
-    const vector<string>& getTags() const;
-    
+    vector<string> getTags() const;
+    size_t getIndex() const { return index; }
+
     void addTag(const string& tag);
     void removeTag(const string& tag);
-    
+
     string toString() const;
     string getFormattedTime() const;
     bool hasTag(const string& tag) const;
     bool isPublic() const;
     bool isPrivate() const;
     bool isSystem() const;
-    
+    bool isRoom() const;
+
     static string typeToString(MessageType type);
+    static MessageType typeFromString(const string& type);
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,292 @@
+#include "message_store.h"
+#include "memory_usage.h"
+#include <algorithm>
+#include <cstring>
+
+using namespace std;
+
+TextArena::TextArena(size_t blockSize)
+    : currentBlock(0), used(0), totalUsed(0), defaultBlockSize(blockSize) {}
+
+void TextArena::nextBlock(size_t minSize) {
+    // Переиспользуем уже выделенные блоки после reset()
+    while (currentBlock + 1 < blocks.size()) {
+        ++currentBlock;
+        used = 0;
+        if (blockSizes[currentBlock] >= minSize) return;
+    }
+
+    size_t size = max(defaultBlockSize, minSize);
+    blocks.emplace_back(new char[size]);
+    blockSizes.push_back(size);
+    currentBlock = blocks.size() - 1;
+    used = 0;
+}
+
+const char* TextArena::store(const char* data, size_t length) {
+    if (blocks.empty() || used + length > blockSizes[currentBlock]) {
+        nextBlock(length);
+    }
+
+    char* dest = blocks[currentBlock].get() + used;
+    if (length > 0) {
+        memcpy(dest, data, length);
+    }
+    used += length;
+    totalUsed += length;
+    return dest;
+}
+
+void TextArena::reserve(size_t bytes) {
+    if (bytesReserved() - totalUsed >= bytes) return;
+    blocks.emplace_back(new char[bytes]);
+    blockSizes.push_back(bytes);
+    if (blocks.size() == 1) {
+        currentBlock = 0;
+        used = 0;
+    }
+}
+
+void TextArena::reset() {
+    currentBlock = 0;
+    used = 0;
+    totalUsed = 0;
+}
+
+size_t TextArena::bytesUsed() const {
+    return totalUsed;
+}
+
+size_t TextArena::bytesReserved() const {
+    size_t total = 0;
+    for (size_t size : blockSizes) {
+        total += size;
+    }
+    return total;
+}
+
+MessageStore::MessageStore() {}
+
+uint32_t MessageStore::internUser(const User* user) {
+    if (user == nullptr) return NO_USER;
+
+    auto it = userIds.find(user);
+    if (it != userIds.end()) return it->second;
+
+    uint32_t id = static_cast<uint32_t>(userTable.size());
+    userTable.push_back(user);
+    userIds.emplace(user, id);
+    return id;
+}
+
+uint32_t MessageStore::internRoom(const string& room) {
+    auto it = roomIds.find(room);
+    if (it != roomIds.end()) return it->second;
+
+    uint32_t id = static_cast<uint32_t>(roomNames.size());
+    roomNames.push_back(room);
+    roomIds.emplace(room, id);
+    return id;
+}
+
+int MessageStore::findTag(const string& tag) const {
+    auto it = tagIds.find(tag);
+    return it != tagIds.end() ? static_cast<int>(it->second) : -1;
+}
+
+// Число тегов не ограничено: в маску попадают первые MASK_TAGS, редкие поздние - в overflowTags
+uint32_t MessageStore::internTag(const string& tag) {
+    auto it = tagIds.find(tag);
+    if (it != tagIds.end()) return it->second;
+
+    uint32_t id = static_cast<uint32_t>(tagNames.size());
+    tagNames.push_back(tag);
+    tagIds.emplace(tag, id);
+    return id;
+}
+
+Message MessageStore::append(const User* sender, const User* recipient, const char* text, size_t length,
+                             MessageType type, long long timestamp) {
+    timestamps.push_back(timestamp);
+    types.push_back(static_cast<uint8_t>(type));
+    senderIds.push_back(internUser(sender));
+    recipientIds.push_back(internUser(recipient));
+    texts.push_back(arena.store(text, length));
+    textLengths.push_back(static_cast<uint32_t>(length));
+    tagMasks.push_back(0);
+    return Message(this, types.size() - 1);
+}
+
+Message MessageStore::append(const User* sender, const User* recipient, const string& text,
+                             MessageType type, long long timestamp) {
+    return append(sender, recipient, text.data(), text.size(), type, timestamp);
+}
+
+Message MessageStore::appendToRoom(const User* sender, const string& room, const char* text, size_t length,
+                                   long long timestamp) {
+    Message message = append(sender, nullptr, text, length, MessageType::ROOM, timestamp);
+    recipientIds.back() = internRoom(room);
+    return message;
+}
+
+void MessageStore::reserve(size_t messageCount, size_t textBytes) {
+    timestamps.reserve(messageCount);
+    types.reserve(messageCount);
+    senderIds.reserve(messageCount);
+    recipientIds.reserve(messageCount);
+    texts.reserve(messageCount);
+    textLengths.reserve(messageCount);
+    tagMasks.reserve(messageCount);
+    arena.reserve(textBytes);
+}
+
+void MessageStore::clear() {
+    timestamps.clear();
+    types.clear();
+    senderIds.clear();
+    recipientIds.clear();
+    texts.clear();
+    textLengths.clear();
+    tagMasks.clear();
+    overflowTags.clear();
+    arena.reset();
+    userTable.clear();
+    userIds.clear();
+    roomNames.clear();
+    roomIds.clear();
+}
+
+Message MessageStore::at(size_t index) const {
+    return Message(const_cast<MessageStore*>(this), index);
+}
+
+const User* MessageStore::getSender(size_t index) const {
+    uint32_t id = senderIds[index];
+    return id == NO_USER ? nullptr : userTable[id];
+}
+
+const User* MessageStore::getRecipient(size_t index) const {
+    uint32_t id = recipientIds[index];
+    if (id == NO_USER || types[index] == static_cast<uint8_t>(MessageType::ROOM)) return nullptr;
+    return userTable[id];
+}
+
+const string& MessageStore::getRoom(size_t index) const {
+    static const string noRoom;
+    if (types[index] != static_cast<uint8_t>(MessageType::ROOM)) return noRoom;
+    return roomNames[recipientIds[index]];
+}
+
+void MessageStore::addTag(size_t index, const string& tag) {
+    uint32_t id = internTag(tag);
+    if (id < MASK_TAGS) {
+        tagMasks[index] |= (1ULL << id);
+        return;
+    }
+    vector<uint32_t>& ids = overflowTags[index];
+    if (find(ids.begin(), ids.end(), id) == ids.end()) ids.push_back(id);
+}
+
+void MessageStore::removeTag(size_t index, const string& tag) {
+    int id = findTag(tag);
+    if (id < 0) return;
+    if (static_cast<uint32_t>(id) < MASK_TAGS) {
+        tagMasks[index] &= ~(1ULL << id);
+        return;
+    }
+    auto it = overflowTags.find(index);
+    if (it == overflowTags.end()) return;
+    vector<uint32_t>& ids = it->second;
+    ids.erase(remove(ids.begin(), ids.end(), static_cast<uint32_t>(id)), ids.end());
+    if (ids.empty()) overflowTags.erase(it);
+}
+
+bool MessageStore::hasTag(size_t index, const string& tag) const {
+    int id = findTag(tag);
+    if (id < 0) return false;
+    if (static_cast<uint32_t>(id) < MASK_TAGS) return (tagMasks[index] & (1ULL << id)) != 0;
+    auto it = overflowTags.find(index);
+    return it != overflowTags.end() &&
+           find(it->second.begin(), it->second.end(), static_cast<uint32_t>(id)) != it->second.end();
+}
+
+vector<string> MessageStore::getTags(size_t index) const {
+    vector<string> result;
+    uint64_t mask = tagMasks[index];
+    for (size_t bit = 0; mask != 0 && bit < MASK_TAGS; ++bit) {
+        if (mask & (1ULL << bit)) {
+            result.push_back(tagNames[bit]);
+            mask &= ~(1ULL << bit);
+        }
+    }
+    auto it = overflowTags.find(index);
+    if (it != overflowTags.end()) {
+        for (uint32_t id : it->second) result.push_back(tagNames[id]);
+    }
+    return result;
+}
+
+vector<size_t> MessageStore::findByText(const string& needle) const {
+    vector<size_t> result;
+    for (size_t i = 0; i < texts.size(); ++i) {
+        const char* begin = texts[i];
+        const char* end = begin + textLengths[i];
+        if (needle.empty() || search(begin, end, needle.begin(), needle.end()) != end) {
+            result.push_back(i);
+        }
+    }
+    return result;
+}
+
+vector<size_t> MessageStore::findByTag(const string& tag) const {
+    vector<size_t> result;
+    int id = findTag(tag);
+    if (id < 0) return result;
+
+    if (static_cast<uint32_t>(id) >= MASK_TAGS) {
+        for (const auto& entry : overflowTags) {
+            if (find(entry.second.begin(), entry.second.end(), static_cast<uint32_t>(id)) != entry.second.end()) {
+                result.push_back(entry.first);
+            }
+        }
+        sort(result.begin(), result.end());
+        return result;
+    }
+
+    uint64_t mask = 1ULL << id;
+    for (size_t i = 0; i < tagMasks.size(); ++i) {
+        if (tagMasks[i] & mask) {
+            result.push_back(i);
+        }
+    }
+    return result;
+}
+
+vector<size_t> MessageStore::findBySender(const User* sender) const {
+    vector<size_t> result;
+    auto it = userIds.find(sender);
+    if (it == userIds.end()) return result;
+
+    uint32_t id = it->second;
+    for (size_t i = 0; i < senderIds.size(); ++i) {
+        if (senderIds[i] == id) {
+            result.push_back(i);
+        }
+    }
+    return result;
+}
+
+size_t MessageStore::countByType(MessageType type) const {
+    uint8_t value = static_cast<uint8_t>(type);
+    return static_cast<size_t>(count(types.begin(), types.end(), value));
+}
+
+// Колонки по ёмкости, арена по выделенным блокам; сами User учитывает их владелец
+size_t MessageStore::memoryUsage() const {
+    return memory_usage::heapBytes(timestamps) + memory_usage::heapBytes(types) +
+           memory_usage::heapBytes(senderIds) + memory_usage::heapBytes(recipientIds) +
+           memory_usage::heapBytes(texts) + memory_usage::heapBytes(textLengths) +
+           memory_usage::heapBytes(tagMasks) + memory_usage::heapBytes(overflowTags) + arena.bytesReserved() +
+           memory_usage::heapBytes(userTable) + memory_usage::heapBytes(userIds) +
+           memory_usage::heapBytes(tagNames) + memory_usage::heapBytes(tagIds) + memory_usage::heapBytes(roomNames) + memory_usage::heapBytes(roomIds);
+}
@@ -0,0 +1,116 @@
+#ifndef MESSAGE_STORE_H
+#define MESSAGE_STORE_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <cstdint>
+#include "user.h"
+#include "message.h"
+
+using namespace std;
+
+// Отвязанная от хранилища копия сообщения (для очередей и сетевого приёма)
+struct MessageRecord {
+    string senderLogin;
+    string recipientLogin;
+    string text;
+    MessageType type;
+    long long timestamp;
+    vector<string> tags;
+};
+
+// Bump-аллокатор для байтов текста: блоки не освобождаются до reset()
+class TextArena {
+private:
+    vector<unique_ptr<char[]>> blocks;
+    vector<size_t> blockSizes;
+    size_t currentBlock;
+    size_t used;
+    size_t totalUsed;
+    size_t defaultBlockSize;
+
+    void nextBlock(size_t minSize);
+
+public:
+    explicit TextArena(size_t blockSize = 64 * 1024);
+
+    const char* store(const char* data, size_t length);
+    void reserve(size_t bytes);
+    void reset();
+    size_t bytesUsed() const;
+    size_t bytesReserved() const;
+};
+
+// Колоночное хранилище сообщений: каждый атрибут лежит в своём массиве,
+// Message - лёгкий хэндл (хранилище + индекс)
+class MessageStore {
+private:
+    vector<long long> timestamps;
+    vector<uint8_t> types;
+    vector<uint32_t> senderIds;
+    vector<uint32_t> recipientIds;     // для ROOM - индекс в roomNames
+    vector<const char*> texts;
+    vector<uint32_t> textLengths;
+    vector<uint64_t> tagMasks;         // первые MASK_TAGS тегов - биты
+    unordered_map<size_t, vector<uint32_t>> overflowTags;  // остальные: индекс сообщения -> id тегов
+    TextArena arena;
+
+    vector<const User*> userTable;
+    unordered_map<const User*, uint32_t> userIds;
+    vector<string> tagNames;
+    unordered_map<string, uint32_t> tagIds;
+    vector<string> roomNames;
+    unordered_map<string, uint32_t> roomIds;
+
+    uint32_t internUser(const User* user);
+    uint32_t internRoom(const string& room);
+    int findTag(const string& tag) const;
+    uint32_t internTag(const string& tag);
+
+public:
+    static const uint32_t NO_USER = 0xFFFFFFFFu;
+    static const uint32_t MASK_TAGS = 64;
+
+    MessageStore();
+    MessageStore(const MessageStore&) = delete;
+    MessageStore& operator=(const MessageStore&) = delete;
+
+    Message append(const User* sender, const User* recipient, const char* text, size_t length,
+                   MessageType type, long long timestamp);
+    Message append(const User* sender, const User* recipient, const string& text,
+                   MessageType type, long long timestamp);
+    Message appendToRoom(const User* sender, const string& room, const char* text, size_t length,
+                         long long timestamp);
+
+    void reserve(size_t messageCount, size_t textBytes);
+    void clear();
+    size_t size() const { return types.size(); }
+    bool empty() const { return types.empty(); }
+    Message at(size_t index) const;
+
+    const User* getSender(size_t index) const;
+    const User* getRecipient(size_t index) const;
+    const string& getRoom(size_t index) const;
+    const char* getTextData(size_t index) const { return texts[index]; }
+    size_t getTextLength(size_t index) const { return textLengths[index]; }
+    long long getTimestamp(size_t index) const { return timestamps[index]; }
+    MessageType getType(size_t index) const { return static_cast<MessageType>(types[index]); }
+
+    void addTag(size_t index, const string& tag);
+    void removeTag(size_t index, const string& tag);
+    bool hasTag(size_t index, const string& tag) const;
+    vector<string> getTags(size_t index) const;
+
+    // Последовательные сканы по колонкам
+    vector<size_t> findByText(const string& needle) const;
+    vector<size_t> findByTag(const string& tag) const;
+    vector<size_t> findBySender(const User* sender) const;
+    size_t countByType(MessageType type) const;
+
+    size_t textBytes() const { return arena.bytesUsed(); }
+    size_t memoryUsage() const;
+};
+
+#endif
@@ -0,0 +1,222 @@
+#include "metrics.h"
+#include "memory_usage.h"
+#include <sstream>
+#include <chrono>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+static const char* const COMMAND_NAMES[] = {
+    "REGISTER", "LOGIN", "LOGOUT", "HEARTBEAT", "PING",
+    "SEND_MESSAGE", "GET_MESSAGES", "GET_USERS", "GET_ONLINE", "STATS",
+    "ADD_FRIEND", "REMOVE_FRIEND", "GET_FRIENDS", "FETCH_MAIL", "GET_UNREAD",
+    "CREATE_ROOM", "JOIN_ROOM", "LEAVE_ROOM", "GET_ROOMS", "GET_ROOM_MEMBERS",
+    "SLOW_CONSUMERS", "LOAD", "RATE_LIMITS", "METRICS", "SHM_ATTACH",
+    "TRACE_FLUSH", "MEMORY", "EXPORT", "IMPORT", "BACKUP",
+    "HISTORY", "ARCHIVE", "COMPRESS", "OTHER"
+};
+
+static const size_t COMMAND_NAME_COUNT = sizeof(COMMAND_NAMES) / sizeof(COMMAND_NAMES[0]);
+
+static const char* const PHASE_NAMES[METRIC_PHASE_COUNT] = {"QUEUE", "EXECUTE", "IO"};
+
+static long long steadyTimeMs() {
+    return chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+size_t LatencyBuckets::indexOf(uint64_t micros) {
+    if (micros < SUB_BUCKETS) return static_cast<size_t>(micros);
+#if defined(__GNUC__)
+    size_t exponent = 63 - static_cast<size_t>(__builtin_clzll(micros));
+#else
+    size_t exponent = 0;
+    for (uint64_t rest = micros >> 1; rest != 0; rest >>= 1) ++exponent;
+#endif
+    if (exponent > MAX_EXPONENT) return BUCKET_COUNT - 1;
+    return (exponent - 3) * SUB_BUCKETS + static_cast<size_t>((micros >> (exponent - 4)) - SUB_BUCKETS);
+}
+
+uint64_t LatencyBuckets::upperBound(size_t index) {
+    if (index < SUB_BUCKETS) return index;
+    size_t exponent = index / SUB_BUCKETS + 3;
+    uint64_t sub = index % SUB_BUCKETS;
+    return ((SUB_BUCKETS + sub + 1) << (exponent - 4)) - 1;
+}
+
+ServerMetrics::ServerMetrics()
+    : shards(new Shard[SHARD_COUNT]), connectionsOpened(0), connectionsClosed(0), startedMs(steadyTimeMs()) {
+    static_assert(COMMAND_NAME_COUNT <= COMMAND_SLOTS, "too many metric commands");
+    for (size_t s = 0; s < SHARD_COUNT; ++s) {
+        Shard& shard = shards[s];
+        for (size_t c = 0; c < COMMAND_SLOTS; ++c) {
+            for (size_t p = 0; p < METRIC_PHASE_COUNT; ++p) {
+                for (size_t b = 0; b < LatencyBuckets::BUCKET_COUNT; ++b) {
+                    shard.latency[c][p][b].store(0, memory_order_relaxed);
+                }
+                shard.latencySum[c][p].store(0, memory_order_relaxed);
+            }
+            shard.errors[c].store(0, memory_order_relaxed);
+            shard.rejected[c].store(0, memory_order_relaxed);
+        }
+        shard.bytesIn.store(0, memory_order_relaxed);
+        shard.bytesOut.store(0, memory_order_relaxed);
+        shard.compressedResponses.store(0, memory_order_relaxed);
+        shard.compressedRawBytes.store(0, memory_order_relaxed);
+        shard.compressedWireBytes.store(0, memory_order_relaxed);
+    }
+}
+
+// Шард закрепляется за потоком при первом обращении, по кругу
+ServerMetrics::Shard& ServerMetrics::localShard() {
+    static atomic<size_t> nextShard(0);
+    static thread_local size_t shardIndex = nextShard.fetch_add(1, memory_order_relaxed) % SHARD_COUNT;
+    return shards[shardIndex];
+}
+
+size_t ServerMetrics::commandIndex(const string& command) {
+    static const unordered_map<string, size_t> indexes = [] {
+        unordered_map<string, size_t> table;
+        for (size_t i = 0; i + 1 < COMMAND_NAME_COUNT; ++i) {
+            table[COMMAND_NAMES[i]] = i;
+        }
+        return table;
+    }();
+    auto it = indexes.find(command);
+    return it != indexes.end() ? it->second : COMMAND_NAME_COUNT - 1;
+}
+
+size_t ServerMetrics::commandCount() {
+    return COMMAND_NAME_COUNT;
+}
+
+const char* ServerMetrics::commandName(size_t index) {
+    return index < COMMAND_NAME_COUNT ? COMMAND_NAMES[index] : "OTHER";
+}
+
+void ServerMetrics::record(size_t command, MetricPhase phase, long long micros) {
+    uint64_t value = micros > 0 ? static_cast<uint64_t>(micros) : 0;
+    size_t p = static_cast<size_t>(phase);
+    Shard& shard = localShard();
+    shard.latency[command][p][LatencyBuckets::indexOf(value)].fetch_add(1, memory_order_relaxed);
+    shard.latencySum[command][p].fetch_add(value, memory_order_relaxed);
+}
+
+void ServerMetrics::recordResult(size_t command, const string& response) {
+    if (response.compare(0, 12, "STATUS:ERROR") == 0) {
+        localShard().errors[command].fetch_add(1, memory_order_relaxed);
+    } else if (response.compare(0, 11, "STATUS:BUSY") == 0 || response.compare(0, 16, "STATUS:THROTTLED") == 0) {
+        localShard().rejected[command].fetch_add(1, memory_order_relaxed);
+    }
+}
+
+void ServerMetrics::addBytesIn(size_t bytes) {
+    localShard().bytesIn.fetch_add(bytes, memory_order_relaxed);
+}
+
+void ServerMetrics::addBytesOut(size_t bytes) {
+    localShard().bytesOut.fetch_add(bytes, memory_order_relaxed);
+}
+
+void ServerMetrics::addCompressed(size_t rawBytes, size_t wireBytes) {
+    Shard& shard = localShard();
+    shard.compressedResponses.fetch_add(1, memory_order_relaxed);
+    shard.compressedRawBytes.fetch_add(rawBytes, memory_order_relaxed);
+    shard.compressedWireBytes.fetch_add(wireBytes, memory_order_relaxed);
+}
+
+void ServerMetrics::connectionOpened() {
+    connectionsOpened.fetch_add(1, memory_order_relaxed);
+}
+
+void ServerMetrics::connectionClosed() {
+    connectionsClosed.fetch_add(1, memory_order_relaxed);
+}
+
+// Строка на команду и фазу: COMMAND:PHASE:COUNT:n:MEAN:x:P50:x:P90:x:P99:x:P999:x:MAX:x (мкс).
+// Перцентили - верхняя граница корзины, то есть оценка сверху
+string ServerMetrics::serialize() const {
+    uint64_t opened = connectionsOpened.load(memory_order_relaxed);
+    uint64_t closed = connectionsClosed.load(memory_order_relaxed);
+    uint64_t bytesIn = 0, bytesOut = 0;
+    uint64_t compressed = 0, compressedRaw = 0, compressedWire = 0;
+    uint64_t totalRequests = 0, totalErrors = 0, totalRejected = 0;
+    for (size_t s = 0; s < SHARD_COUNT; ++s) {
+        bytesIn += shards[s].bytesIn.load(memory_order_relaxed);
+        bytesOut += shards[s].bytesOut.load(memory_order_relaxed);
+        compressed += shards[s].compressedResponses.load(memory_order_relaxed);
+        compressedRaw += shards[s].compressedRawBytes.load(memory_order_relaxed);
+        compressedWire += shards[s].compressedWireBytes.load(memory_order_relaxed);
+    }
+
+    ostringstream commands;
+    vector<uint64_t> merged(LatencyBuckets::BUCKET_COUNT);
+    for (size_t c = 0; c < COMMAND_NAME_COUNT; ++c) {
+        uint64_t errors = 0, rejected = 0;
+        for (size_t s = 0; s < SHARD_COUNT; ++s) {
+            errors += shards[s].errors[c].load(memory_order_relaxed);
+            rejected += shards[s].rejected[c].load(memory_order_relaxed);
+        }
+
+        for (size_t p = 0; p < METRIC_PHASE_COUNT; ++p) {
+            uint64_t count = 0, sum = 0;
+            for (size_t b = 0; b < LatencyBuckets::BUCKET_COUNT; ++b) {
+                merged[b] = 0;
+                for (size_t s = 0; s < SHARD_COUNT; ++s) {
+                    merged[b] += shards[s].latency[c][p][b].load(memory_order_relaxed);
+                }
+                count += merged[b];
+            }
+            if (count == 0) continue;
+            for (size_t s = 0; s < SHARD_COUNT; ++s) {
+                sum += shards[s].latencySum[c][p].load(memory_order_relaxed);
+            }
+
+            const double quantiles[] = {0.50, 0.90, 0.99, 0.999};
+            uint64_t values[4] = {0, 0, 0, 0};
+            uint64_t maxValue = 0;
+            uint64_t seen = 0;
+            size_t q = 0;
+            for (size_t b = 0; b < LatencyBuckets::BUCKET_COUNT; ++b) {
+                if (merged[b] == 0) continue;
+                seen += merged[b];
+                maxValue = LatencyBuckets::upperBound(b);
+                while (q < 4 && seen >= static_cast<uint64_t>(quantiles[q] * count + 0.5)) {
+                    values[q++] = maxValue;
+                }
+            }
+            while (q < 4) values[q++] = maxValue;
+
+            if (p == static_cast<size_t>(MetricPhase::EXECUTE)) {
+                totalRequests += count;
+            }
+            commands << "\n" << COMMAND_NAMES[c] << ":" << PHASE_NAMES[p] << ":COUNT:" << count
+                     << ":MEAN:" << sum / count << ":P50:" << values[0] << ":P90:" << values[1]
+                     << ":P99:" << values[2] << ":P999:" << values[3] << ":MAX:" << maxValue;
+        }
+        if (errors > 0 || rejected > 0) {
+            commands << "\n" << COMMAND_NAMES[c] << ":ERRORS:" << errors << ":REJECTED:" << rejected;
+        }
+        totalErrors += errors;
+        totalRejected += rejected;
+    }
+
+    ostringstream oss;
+    oss << "UPTIME_S:" << (steadyTimeMs() - startedMs) / 1000;
+    oss << "\nCONNECTIONS_ACTIVE:" << (opened >= closed ? opened - closed : 0);
+    oss << "\nCONNECTIONS_TOTAL:" << opened;
+    oss << "\nBYTES_IN:" << bytesIn;
+    oss << "\nBYTES_OUT:" << bytesOut;
+    oss << "\nCOMPRESSED_RESPONSES:" << compressed;
+    oss << "\nCOMPRESSED_RAW_BYTES:" << compressedRaw;
+    oss << "\nCOMPRESSED_WIRE_BYTES:" << compressedWire;
+    oss << "\nREQUESTS:" << totalRequests;
+    oss << "\nERRORS:" << totalErrors;
+    oss << "\nREJECTED:" << totalRejected;
+    oss << commands.str();
+    return oss.str();
+}
+
+size_t ServerMetrics::memoryUsage() const {
+    return SHARD_COUNT * sizeof(Shard);
+}
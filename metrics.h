@@ -0,0 +1,80 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <string>
+#include <atomic>
+#include <memory>
+#include <cstdint>
+#include <cstddef>
+
+using namespace std;
+
+enum class MetricPhase {
+    QUEUE,      // от прихода байтов запроса до начала исполнения
+    EXECUTE,    // admitRequest целиком, включая ожидание записи на диск
+    IO          // постановка ответа в очередь соединения и попытка записи
+};
+
+static const size_t METRIC_PHASE_COUNT = 3;
+
+// Корзины в духе HDR: 16 линейных на каждую степень двойки, погрешность не больше 1/16.
+// Значения в микросекундах; всё дольше 2^27 мкс (~2 минуты) попадает в последнюю корзину
+class LatencyBuckets {
+public:
+    static const size_t SUB_BUCKETS = 16;
+    static const size_t MAX_EXPONENT = 26;
+    static const size_t BUCKET_COUNT = (MAX_EXPONENT - 3) * SUB_BUCKETS + SUB_BUCKETS;
+
+    static size_t indexOf(uint64_t micros);
+    static uint64_t upperBound(size_t index);
+};
+
+// Счётчики сервера. Запись - relaxed-инкременты в шард потока, без блокировок;
+// чтение складывает шарды, поэтому снимок может на пару запросов отставать
+class ServerMetrics {
+private:
+    static const size_t SHARD_COUNT = 8;
+    static const size_t COMMAND_SLOTS = 40;     // команд в протоколе меньше, лишние идут в OTHER
+
+    struct Shard {
+        atomic<uint64_t> latency[COMMAND_SLOTS][METRIC_PHASE_COUNT][LatencyBuckets::BUCKET_COUNT];
+        atomic<uint64_t> latencySum[COMMAND_SLOTS][METRIC_PHASE_COUNT];
+        atomic<uint64_t> errors[COMMAND_SLOTS];
+        atomic<uint64_t> rejected[COMMAND_SLOTS];
+        atomic<uint64_t> bytesIn;
+        atomic<uint64_t> bytesOut;
+        atomic<uint64_t> compressedResponses;
+        atomic<uint64_t> compressedRawBytes;
+        atomic<uint64_t> compressedWireBytes;
+    };
+
+    unique_ptr<Shard[]> shards;
+    atomic<uint64_t> connectionsOpened;
+    atomic<uint64_t> connectionsClosed;
+    long long startedMs;
+
+    Shard& localShard();
+
+public:
+    ServerMetrics();
+
+    // Неизвестные команды считаются вместе под именем OTHER
+    static size_t commandIndex(const string& command);
+    static size_t commandCount();
+    static const char* commandName(size_t index);
+
+    void record(size_t command, MetricPhase phase, long long micros);
+    // Ответ без строки ID: STATUS:ERROR - ошибка, BUSY и THROTTLED - отказ
+    void recordResult(size_t command, const string& response);
+    void addBytesIn(size_t bytes);
+    void addBytesOut(size_t bytes);
+    // Ответ ушёл сжатым: сколько было и сколько стало
+    void addCompressed(size_t rawBytes, size_t wireBytes);
+    void connectionOpened();
+    void connectionClosed();
+
+    string serialize() const;
+    size_t memoryUsage() const;
+};
+
+#endif
@@ -0,0 +1,152 @@
+#ifndef MPSC_QUEUE_H
+#define MPSC_QUEUE_H
+
+#include <atomic>
+#include <utility>
+#include <memory>
+#include <cstddef>
+#include <cstdint>
+
+using namespace std;
+
+// Неограниченная очередь многих производителей и одного потребителя (схема Вьюкова):
+// push - один exchange без блокировок, pop вызывает только поток-владелец.
+// Между exchange и записью next производителя pop может временно видеть очередь пустой
+template <typename T>
+class MpscQueue {
+private:
+    struct Node {
+        atomic<Node*> next;
+        T value;
+
+        Node() : next(nullptr) {}
+    };
+
+    atomic<Node*> head;     // последний добавленный узел
+    Node* tail;             // заглушка перед первым непрочитанным узлом
+
+public:
+    MpscQueue() {
+        Node* stub = new Node();
+        head.store(stub);
+        tail = stub;
+    }
+
+    ~MpscQueue() {
+        T value;
+        while (pop(value)) {
+        }
+        delete tail;
+    }
+
+    MpscQueue(const MpscQueue&) = delete;
+    MpscQueue& operator=(const MpscQueue&) = delete;
+
+    void push(T value) {
+        Node* node = new Node();
+        node->value = move(value);
+        Node* previous = head.exchange(node, memory_order_acq_rel);
+        previous->next.store(node, memory_order_release);
+    }
+
+    bool pop(T& value) {
+        Node* next = tail->next.load(memory_order_acquire);
+        if (!next) return false;
+
+        value = move(next->value);
+        delete tail;
+        tail = next;
+        return true;
+    }
+};
+
+// Ограниченная очередь многих производителей и одного потребителя на кольце ячеек
+// с номерами последовательности (схема Вьюкова). Элементы перемещаются, а не копируются;
+// при переполнении tryPush возвращает false - решение о потере или отказе за вызывающим
+template <typename T>
+class BoundedMpscQueue {
+private:
+    struct Cell {
+        atomic<size_t> sequence;
+        T value;
+    };
+
+    unique_ptr<Cell[]> cells;
+    size_t mask;
+    alignas(64) atomic<size_t> enqueuePosition;
+    alignas(64) size_t dequeuePosition;     // только потребитель
+
+    static size_t roundUp(size_t capacity) {
+        size_t size = 2;
+        while (size < capacity) size <<= 1;
+        return size;
+    }
+
+public:
+    explicit BoundedMpscQueue(size_t capacity)
+        : cells(new Cell[roundUp(capacity)]), mask(roundUp(capacity) - 1), enqueuePosition(0), dequeuePosition(0) {
+        for (size_t i = 0; i <= mask; ++i) {
+            cells[i].sequence.store(i, memory_order_relaxed);
+        }
+    }
+
+    BoundedMpscQueue(const BoundedMpscQueue&) = delete;
+    BoundedMpscQueue& operator=(const BoundedMpscQueue&) = delete;
+
+    bool tryPush(T&& value) {
+        size_t position = enqueuePosition.load(memory_order_relaxed);
+        Cell* cell;
+        while (true) {
+            cell = &cells[position & mask];
+            size_t sequence = cell->sequence.load(memory_order_acquire);
+            intptr_t difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+            if (difference == 0) {
+                if (enqueuePosition.compare_exchange_weak(position, position + 1, memory_order_relaxed)) break;
+            } else if (difference < 0) {
+                return false;
+            } else {
+                position = enqueuePosition.load(memory_order_relaxed);
+            }
+        }
+        cell->value = move(value);
+        cell->sequence.store(position + 1, memory_order_release);
+        return true;
+    }
+
+    bool tryPop(T& value) {
+        Cell& cell = cells[dequeuePosition & mask];
+        size_t sequence = cell.sequence.load(memory_order_acquire);
+        if (static_cast<intptr_t>(sequence) - static_cast<intptr_t>(dequeuePosition + 1) < 0) return false;
+
+        value = move(cell.value);
+        cell.value = T();
+        cell.sequence.store(dequeuePosition + mask + 1, memory_order_release);
+        ++dequeuePosition;
+        return true;
+    }
+
+    // Забирает до maxItems готовых элементов, передавая каждый в consumer(T&&)
+    template <typename Consumer>
+    size_t drain(Consumer consumer, size_t maxItems = SIZE_MAX) {
+        size_t drained = 0;
+        T value;
+        while (drained < maxItems && tryPop(value)) {
+            consumer(move(value));
+            ++drained;
+        }
+        return drained;
+    }
+
+    // Только для потребителя
+    bool empty() const {
+        const Cell& cell = cells[dequeuePosition & mask];
+        return static_cast<intptr_t>(cell.sequence.load(memory_order_acquire)) -
+               static_cast<intptr_t>(dequeuePosition + 1) < 0;
+    }
+
+    size_t capacity() const { return mask + 1; }
+    // Только кольцо ячеек: содержимое элементов в пути не учитывается
+    size_t memoryUsage() const { return capacity() * sizeof(Cell); }
+};
+
+#endif
@@ -0,0 +1,170 @@
+#include "output_queue.h"
+#include "memory_usage.h"
+#include <vector>
+#include <unordered_map>
+#include <cerrno>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#endif
+
+using namespace std;
+
+#if defined(MSG_DONTWAIT) && defined(MSG_NOSIGNAL)
+static const int SEND_FLAGS = MSG_DONTWAIT | MSG_NOSIGNAL;
+#elif defined(MSG_DONTWAIT)
+static const int SEND_FLAGS = MSG_DONTWAIT;
+#else
+static const int SEND_FLAGS = 0;
+#endif
+
+OutputQueue::OutputQueue(size_t maxBytes, SlowConsumerPolicy policy)
+    : frontOffset(0), maxBytes(maxBytes), policy(policy) {
+}
+
+void OutputQueue::configure(size_t maxBytes, SlowConsumerPolicy policy) {
+    this->maxBytes = maxBytes;
+    this->policy = policy;
+}
+
+// Кадр "EVENT:...\nDATA:+a,-b": токены с одинаковым логином заменяются более поздними
+string OutputQueue::mergeDiffPayload(const string& older, const string& newer) {
+    size_t olderData = older.find("DATA:");
+    size_t newerData = newer.find("DATA:");
+    if (olderData == string::npos || newerData == string::npos) return newer;
+
+    vector<string> order;
+    unordered_map<string, string> latest;
+    string tokens = older.substr(olderData + 5) + "," + newer.substr(newerData + 5);
+
+    size_t pos = 0;
+    while (pos <= tokens.size()) {
+        size_t comma = tokens.find(',', pos);
+        if (comma == string::npos) comma = tokens.size();
+        string token = tokens.substr(pos, comma - pos);
+        if (token.size() > 1) {
+            string key = token.substr(1);
+            if (latest.find(key) == latest.end()) order.push_back(key);
+            latest[key] = token;
+        }
+        pos = comma + 1;
+    }
+
+    string merged = older.substr(0, olderData + 5);
+    for (size_t i = 0; i < order.size(); ++i) {
+        if (i > 0) merged += ",";
+        merged += latest[order[i]];
+    }
+    return merged;
+}
+
+bool OutputQueue::coalesce(const string& data, const string& key) {
+    static const size_t TERMINATOR_LENGTH = 5;     // "\nEND\n"
+
+    // Первый кадр может быть частично отправлен - его не трогаем
+    size_t first = frontOffset > 0 ? 1 : 0;
+    for (size_t i = frames.size(); i > first; --i) {
+        Frame& frame = frames[i - 1];
+        if (!frame.isEvent || frame.coalesceKey != key) continue;
+
+        string merged = mergeDiffPayload(frame.data.substr(0, frame.data.size() - TERMINATOR_LENGTH),
+                                         data.substr(0, data.size() - TERMINATOR_LENGTH));
+        merged += "\nEND\n";
+        counters.queuedBytes = counters.queuedBytes - frame.data.size() + merged.size();
+        frame.data.swap(merged);
+        ++counters.coalescedEvents;
+        return true;
+    }
+    return false;
+}
+
+void OutputQueue::dropOldestEvents(size_t needed) {
+    size_t index = frontOffset > 0 ? 1 : 0;
+    while (index < frames.size() && counters.queuedBytes + needed > maxBytes) {
+        if (frames[index].isEvent) {
+            counters.queuedBytes -= frames[index].data.size();
+            frames.erase(frames.begin() + static_cast<long>(index));
+            ++counters.droppedEvents;
+        } else {
+            ++index;
+        }
+    }
+}
+
+OutputQueue::PushResult OutputQueue::push(const string& data, bool isEvent, const string& coalesceKey) {
+    // Ответы на запросы не выбрасываются: пока очередь выше предела, сервер не читает
+    // новых запросов этого соединения (backlogged), так что ответов больше не станет
+    if (isEvent && counters.queuedBytes + data.size() > maxBytes) {
+        if (policy == SlowConsumerPolicy::DISCONNECT) {
+            return OVERFLOW;
+        }
+        if (policy == SlowConsumerPolicy::COALESCE && !coalesceKey.empty() && coalesce(data, coalesceKey)) {
+            return QUEUED;
+        }
+        dropOldestEvents(data.size());
+        if (counters.queuedBytes + data.size() > maxBytes) {
+            ++counters.droppedEvents;
+            return DROPPED;
+        }
+    }
+
+    frames.push_back(Frame{data, isEvent, coalesceKey});
+    counters.queuedBytes += data.size();
+    if (counters.queuedBytes > counters.highWaterBytes) {
+        counters.highWaterBytes = counters.queuedBytes;
+    }
+    return QUEUED;
+}
+
+long OutputQueue::flush(int socket) {
+    long total = 0;
+    while (!frames.empty()) {
+        const string& data = frames.front().data;
+        int sent = send(socket, data.data() + frontOffset, static_cast<int>(data.size() - frontOffset), SEND_FLAGS);
+        if (sent < 0) {
+#ifdef _WIN32
+            return total > 0 ? total : -1;
+#else
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return total;
+            return -1;
+#endif
+        }
+
+        total += sent;
+        counters.bytesSent += static_cast<size_t>(sent);
+        frontOffset += static_cast<size_t>(sent);
+        if (frontOffset == data.size()) {
+            counters.queuedBytes -= data.size();
+            frames.pop_front();
+            frontOffset = 0;
+        }
+    }
+    return total;
+}
+
+size_t OutputQueue::memoryUsage() const {
+    size_t bytes = frames.size() * sizeof(Frame);
+    for (const Frame& frame : frames) {
+        bytes += memory_usage::heapBytes(frame.data) + memory_usage::heapBytes(frame.coalesceKey);
+    }
+    return bytes;
+}
+
+size_t OutputQueue::dropQueuedEvents() {
+    size_t dropped = 0;
+    size_t index = frontOffset > 0 ? 1 : 0;
+    while (index < frames.size()) {
+        if (frames[index].isEvent) {
+            counters.queuedBytes -= frames[index].data.size();
+            frames.erase(frames.begin() + static_cast<long>(index));
+            ++dropped;
+        } else {
+            ++index;
+        }
+    }
+    counters.droppedEvents += dropped;
+    return dropped;
+}
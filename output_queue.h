@@ -0,0 +1,72 @@
+#ifndef OUTPUT_QUEUE_H
+#define OUTPUT_QUEUE_H
+
+#include <string>
+#include <deque>
+#include <cstddef>
+
+using namespace std;
+
+// Что делать, когда клиент не успевает читать события
+enum class SlowConsumerPolicy {
+    DROP_OLDEST,    // выбрасывать самые старые ещё не начатые события
+    COALESCE,       // сливать события с одинаковым ключом (диффы присутствия), иначе как DROP_OLDEST
+    DISCONNECT      // отключать клиента
+};
+
+struct OutputQueueCounters {
+    size_t queuedBytes = 0;
+    size_t highWaterBytes = 0;
+    size_t droppedEvents = 0;
+    size_t coalescedEvents = 0;
+    size_t bytesSent = 0;
+};
+
+// Ограниченный буфер исходящих кадров одного соединения.
+// Не потокобезопасен: владелец держит мьютекс соединения.
+class OutputQueue {
+public:
+    enum PushResult {
+        QUEUED,
+        DROPPED,
+        OVERFLOW
+    };
+
+private:
+    struct Frame {
+        string data;
+        bool isEvent;
+        string coalesceKey;
+    };
+
+    deque<Frame> frames;
+    size_t frontOffset;        // сколько байт первого кадра уже отправлено
+    size_t maxBytes;
+    SlowConsumerPolicy policy;
+    OutputQueueCounters counters;
+
+    bool coalesce(const string& data, const string& key);
+    void dropOldestEvents(size_t needed);
+
+public:
+    OutputQueue(size_t maxBytes = 1024 * 1024, SlowConsumerPolicy policy = SlowConsumerPolicy::DROP_OLDEST);
+
+    void configure(size_t maxBytes, SlowConsumerPolicy policy);
+    PushResult push(const string& data, bool isEvent, const string& coalesceKey = "");
+
+    // Неблокирующая запись: >0 - отправлено байт, 0 - сокет занят, -1 - ошибка
+    long flush(int socket);
+
+    bool empty() const { return frames.empty(); }
+    // Ответы не выбрасываются, поэтому очередь может перерасти предел: тогда сервер
+    // перестаёт читать запросы соединения, пока она не разойдётся
+    bool backlogged() const { return counters.queuedBytes > maxBytes; }
+    const OutputQueueCounters& getCounters() const { return counters; }
+    size_t memoryUsage() const;
+    // Выбросить все ещё не начатые события (нехватка памяти); ответы остаются. Возвращает число
+    size_t dropQueuedEvents();
+
+    static string mergeDiffPayload(const string& older, const string& newer);
+};
+
+#endif
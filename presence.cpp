@@ -0,0 +1,155 @@
+#include "presence.h"
+#include "memory_usage.h"
+
+using namespace std;
+
+PresenceTracker::PresenceTracker(long long heartbeatTimeoutMs)
+    : anonymousConnections(0), onlineCount(0), heartbeatTimeoutMs(heartbeatTimeoutMs) {
+}
+
+void PresenceTracker::setOnline(const string& login, Entry& entry, bool online) {
+    if (entry.online == online) return;
+
+    // Запоминаем только первое состояние до сброса, последующие флапы схлопываются
+    if (pending.find(login) == pending.end()) {
+        pending[login] = entry.online;
+    }
+    entry.online = online;
+    if (online) {
+        ++onlineCount;
+        deadlines.emplace(entry.lastSeenMs + heartbeatTimeoutMs, login);
+    } else {
+        --onlineCount;
+        deadlines.erase(make_pair(entry.lastSeenMs + heartbeatTimeoutMs, login));
+    }
+}
+
+// Срок сдвигается вместе с lastSeenMs: старый ключ убираем до изменения
+void PresenceTracker::touch(const string& login, Entry& entry, long long nowMs) {
+    if (entry.online) {
+        deadlines.erase(make_pair(entry.lastSeenMs + heartbeatTimeoutMs, login));
+        deadlines.emplace(nowMs + heartbeatTimeoutMs, login);
+    }
+    entry.lastSeenMs = nowMs;
+}
+
+// Последнее соединение закрыто: пользователь уходит в офлайн и пропадает из таблицы.
+// Незабранное изменение останется в pending, takeChanges считает отсутствующего офлайн
+void PresenceTracker::release(unordered_map<string, Entry>::iterator it) {
+    Entry& entry = it->second;
+    if (entry.connections > 0) --entry.connections;
+    if (entry.connections == 0) {
+        setOnline(it->first, entry, false);
+        table.erase(it);
+    }
+}
+
+void PresenceTracker::connected() {
+    lock_guard<mutex> lock(presenceMutex);
+    ++anonymousConnections;
+}
+
+void PresenceTracker::disconnected(const string& login) {
+    lock_guard<mutex> lock(presenceMutex);
+    if (login.empty()) {
+        if (anonymousConnections > 0) --anonymousConnections;
+        return;
+    }
+
+    auto it = table.find(login);
+    if (it != table.end()) release(it);
+}
+
+void PresenceTracker::loggedIn(const string& login, long long nowMs) {
+    lock_guard<mutex> lock(presenceMutex);
+    if (anonymousConnections > 0) --anonymousConnections;
+
+    auto it = table.emplace(login, Entry()).first;
+    Entry& entry = it->second;
+    ++entry.connections;
+    touch(it->first, entry, nowMs);
+    setOnline(it->first, entry, true);
+}
+
+void PresenceTracker::loggedOut(const string& login) {
+    lock_guard<mutex> lock(presenceMutex);
+    ++anonymousConnections;
+
+    auto it = table.find(login);
+    if (it != table.end()) release(it);
+}
+
+void PresenceTracker::heartbeat(const string& login, long long nowMs) {
+    lock_guard<mutex> lock(presenceMutex);
+    auto it = table.find(login);
+    if (it == table.end() || it->second.connections == 0) return;
+
+    touch(it->first, it->second, nowMs);
+    setOnline(it->first, it->second, true);
+}
+
+// Только просроченное начало deadlines. Соединение без пульса остаётся в таблице офлайн:
+// его закроет пинг или таймаут простоя, и тогда запись уберёт release
+size_t PresenceTracker::expireStale(long long nowMs) {
+    lock_guard<mutex> lock(presenceMutex);
+    size_t expired = 0;
+    while (!deadlines.empty() && deadlines.begin()->first < nowMs) {
+        auto it = table.find(deadlines.begin()->second);
+        if (it == table.end()) {
+            deadlines.erase(deadlines.begin());
+            continue;
+        }
+        setOnline(it->first, it->second, false);
+        ++expired;
+    }
+    return expired;
+}
+
+vector<PresenceChange> PresenceTracker::takeChanges() {
+    lock_guard<mutex> lock(presenceMutex);
+    vector<PresenceChange> changes;
+    changes.reserve(pending.size());
+    for (const auto& item : pending) {
+        auto it = table.find(item.first);
+        bool online = it != table.end() && it->second.online;
+        if (online != item.second) {
+            changes.push_back(PresenceChange{item.first, online});
+        }
+    }
+    pending.clear();
+    return changes;
+}
+
+bool PresenceTracker::isOnline(const string& login) const {
+    lock_guard<mutex> lock(presenceMutex);
+    auto it = table.find(login);
+    return it != table.end() && it->second.online;
+}
+
+vector<string> PresenceTracker::getOnlineUsers() const {
+    lock_guard<mutex> lock(presenceMutex);
+    vector<string> result;
+    for (const auto& item : table) {
+        if (item.second.online) result.push_back(item.first);
+    }
+    return result;
+}
+
+size_t PresenceTracker::getOnlineCount() const {
+    lock_guard<mutex> lock(presenceMutex);
+    return onlineCount;
+}
+
+size_t PresenceTracker::getConnectionCount() const {
+    lock_guard<mutex> lock(presenceMutex);
+    size_t count = anonymousConnections;
+    for (const auto& item : table) {
+        count += item.second.connections;
+    }
+    return count;
+}
+
+size_t PresenceTracker::memoryUsage() const {
+    lock_guard<mutex> lock(presenceMutex);
+    return memory_usage::heapBytes(table) + memory_usage::heapBytes(deadlines) + memory_usage::heapBytes(pending);
+}
@@ -0,0 +1,59 @@
+#ifndef PRESENCE_H
+#define PRESENCE_H
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <set>
+#include <mutex>
+
+using namespace std;
+
+struct PresenceChange {
+    string login;
+    bool online;
+};
+
+// Таблица присутствия. Изменения копятся и отдаются пачкой в takeChanges():
+// если пользователь успел выйти и снова войти между сбросами, изменения нет вовсе.
+// В таблице только пользователи с открытыми соединениями; сроки онлайн-записей
+// упорядочены в deadlines, и expireStale смотрит лишь на истёкшие
+class PresenceTracker {
+private:
+    struct Entry {
+        int connections = 0;
+        long long lastSeenMs = 0;
+        bool online = false;
+    };
+
+    mutable mutex presenceMutex;
+    unordered_map<string, Entry> table;
+    set<pair<long long, string>> deadlines;  // lastSeenMs + heartbeatTimeoutMs -> логин, только online
+    unordered_map<string, bool> pending;     // логин -> состояние на момент прошлого сброса
+    size_t anonymousConnections;
+    size_t onlineCount;
+    long long heartbeatTimeoutMs;
+
+    void setOnline(const string& login, Entry& entry, bool online);
+    void touch(const string& login, Entry& entry, long long nowMs);
+    void release(unordered_map<string, Entry>::iterator it);
+
+public:
+    explicit PresenceTracker(long long heartbeatTimeoutMs = 30000);
+
+    void connected();
+    void disconnected(const string& login);
+    void loggedIn(const string& login, long long nowMs);
+    void loggedOut(const string& login);
+    void heartbeat(const string& login, long long nowMs);
+    size_t expireStale(long long nowMs);
+
+    vector<PresenceChange> takeChanges();
+    bool isOnline(const string& login) const;
+    vector<string> getOnlineUsers() const;
+    size_t getOnlineCount() const;
+    size_t getConnectionCount() const;
+    size_t memoryUsage() const;
+};
+
+#endif
@@ -0,0 +1,122 @@
+#include "rate_limiter.h"
+#include "memory_usage.h"
+#include <sstream>
+#include <functional>
+#include <cstdlib>
+
+using namespace std;
+
+bool TokenBucket::tryAcquire(const RateLimit& limit, long long nowUs) {
+    if (limit.ratePerSec <= 0) return true;
+
+    long long intervalUs = static_cast<long long>(1000000.0 / limit.ratePerSec);
+    long long toleranceUs = static_cast<long long>(limit.burst * intervalUs);
+
+    long long arrival = theoreticalArrivalUs.load(memory_order_relaxed);
+    while (true) {
+        long long next = (arrival > nowUs ? arrival : nowUs) + intervalUs;
+        if (next - nowUs > toleranceUs) {
+            return false;
+        }
+        if (theoreticalArrivalUs.compare_exchange_weak(arrival, next, memory_order_relaxed)) {
+            return true;
+        }
+    }
+}
+
+RateLimiter::RateLimiter(const RateLimitConfig& config) : config(config) {
+    for (size_t i = 0; i < COMMAND_CLASS_COUNT; ++i) {
+        throttledUser[i].store(0);
+        throttledConnection[i].store(0);
+    }
+}
+
+RateBuckets& RateLimiter::userBuckets(const string& login) {
+    Shard& shard = shards[hash<string>()(login) % SHARD_COUNT];
+    lock_guard<mutex> lock(shard.shardMutex);
+    return shard.users[login];
+}
+
+bool RateLimiter::allow(RateBuckets& connectionBuckets, const string& login, CommandClass commandClass,
+                        long long nowUs) {
+    size_t index = static_cast<size_t>(commandClass);
+    if (!connectionBuckets.buckets[index].tryAcquire(config.connection[index], nowUs)) {
+        ++throttledConnection[index];
+        return false;
+    }
+    if (!login.empty() && !userBuckets(login).buckets[index].tryAcquire(config.user[index], nowUs)) {
+        ++throttledUser[index];
+        return false;
+    }
+    return true;
+}
+
+string RateLimiter::serialize() const {
+    ostringstream oss;
+    for (size_t i = 0; i < COMMAND_CLASS_COUNT; ++i) {
+        string name = classToString(static_cast<CommandClass>(i));
+        if (i > 0) oss << "\n";
+        oss << name << ":USER:" << config.user[i].ratePerSec << "/" << config.user[i].burst
+            << ":THROTTLED:" << throttledUser[i].load();
+        oss << "\n" << name << ":CONNECTION:" << config.connection[i].ratePerSec << "/"
+            << config.connection[i].burst << ":THROTTLED:" << throttledConnection[i].load();
+    }
+    return oss.str();
+}
+
+bool RateLimiter::classify(const string& command, CommandClass& commandClass) {
+    if (command == "LOGOUT" || command == "HEARTBEAT" || command == "PING") {
+        return false;
+    }
+    if (command == "LOGIN" || command == "REGISTER") {
+        commandClass = CommandClass::AUTH;
+    } else if (command == "SEND_MESSAGE" || command == "CREATE_ROOM" || command == "JOIN_ROOM" ||
+               command == "LEAVE_ROOM" || command == "ADD_FRIEND" || command == "REMOVE_FRIEND" ||
+               command == "IMPORT") {
+        commandClass = CommandClass::WRITE;
+    } else {
+        commandClass = CommandClass::READ;
+    }
+    return true;
+}
+
+bool RateLimiter::parseSpec(const string& spec, RateLimitConfig& config) {
+    stringstream ss(spec);
+    string scope, name, rate, burst;
+    if (!getline(ss, scope, ':') || !getline(ss, name, ':') || !getline(ss, rate, ':') || !getline(ss, burst)) {
+        return false;
+    }
+
+    RateLimit* table = nullptr;
+    if (scope == "user") table = config.user;
+    else if (scope == "connection") table = config.connection;
+    else return false;
+
+    size_t index;
+    if (name == "auth") index = static_cast<size_t>(CommandClass::AUTH);
+    else if (name == "read") index = static_cast<size_t>(CommandClass::READ);
+    else if (name == "write") index = static_cast<size_t>(CommandClass::WRITE);
+    else return false;
+
+    table[index].ratePerSec = atof(rate.c_str());
+    table[index].burst = atof(burst.c_str());
+    return true;
+}
+
+string RateLimiter::classToString(CommandClass commandClass) {
+    switch (commandClass) {
+        case CommandClass::AUTH: return "AUTH";
+        case CommandClass::READ: return "READ";
+        case CommandClass::WRITE: return "WRITE";
+    }
+    return "UNKNOWN";
+}
+
+size_t RateLimiter::memoryUsage() const {
+    size_t bytes = 0;
+    for (size_t i = 0; i < SHARD_COUNT; ++i) {
+        lock_guard<mutex> lock(shards[i].shardMutex);
+        bytes += memory_usage::heapBytes(shards[i].users);
+    }
+    return bytes;
+}
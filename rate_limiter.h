@@ -0,0 +1,78 @@
+#ifndef RATE_LIMITER_H
+#define RATE_LIMITER_H
+
+#include <string>
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <cstddef>
+
+using namespace std;
+
+// Классы команд с отдельными вёдрами: перебор паролей, чтение и запись на диск
+enum class CommandClass {
+    AUTH,
+    READ,
+    WRITE
+};
+
+const size_t COMMAND_CLASS_COUNT = 3;
+
+struct RateLimit {
+    double ratePerSec;     // 0 - без ограничения
+    double burst;
+};
+
+struct RateLimitConfig {
+    RateLimit user[COMMAND_CLASS_COUNT] = {{1, 5}, {20, 50}, {5, 20}};
+    RateLimit connection[COMMAND_CLASS_COUNT] = {{1, 5}, {50, 100}, {10, 40}};
+};
+
+// Ведро токенов в форме GCRA: всё состояние - одно число (теоретическое время
+// следующего запроса), поэтому списание токена - один CAS без блокировок
+class TokenBucket {
+private:
+    atomic<long long> theoreticalArrivalUs;
+
+public:
+    TokenBucket() : theoreticalArrivalUs(0) {}
+    bool tryAcquire(const RateLimit& limit, long long nowUs);
+};
+
+struct RateBuckets {
+    TokenBucket buckets[COMMAND_CLASS_COUNT];
+};
+
+class RateLimiter {
+private:
+    static const size_t SHARD_COUNT = 16;
+
+    // Мьютекс шарда держится только на время поиска вёдер логина:
+    // узлы unordered_map не переезжают, ссылка остаётся действительной
+    struct Shard {
+        mutable mutex shardMutex;
+        unordered_map<string, RateBuckets> users;
+    };
+
+    RateLimitConfig config;
+    Shard shards[SHARD_COUNT];
+    atomic<size_t> throttledUser[COMMAND_CLASS_COUNT];
+    atomic<size_t> throttledConnection[COMMAND_CLASS_COUNT];
+
+    RateBuckets& userBuckets(const string& login);
+
+public:
+    explicit RateLimiter(const RateLimitConfig& config = RateLimitConfig());
+
+    bool allow(RateBuckets& connectionBuckets, const string& login, CommandClass commandClass, long long nowUs);
+    string serialize() const;
+    size_t memoryUsage() const;
+
+    // false - команда не ограничивается
+    static bool classify(const string& command, CommandClass& commandClass);
+    // Формат: user|connection:auth|read|write:RATE:BURST
+    static bool parseSpec(const string& spec, RateLimitConfig& config);
+    static string classToString(CommandClass commandClass);
+};
+
+#endif
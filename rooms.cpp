@@ -0,0 +1,113 @@
+#include "rooms.h"
+#include "memory_usage.h"
+
+using namespace std;
+
+RoomManager::RoomManager(Database& db) : db(db) {
+}
+
+void RoomManager::load() {
+    lock_guard<mutex> lock(roomsMutex);
+    rooms.clear();
+    userRooms.clear();
+
+    for (const auto& data : db.getAllRooms()) {
+        RoomInfo& info = rooms[data.name];
+        info.owner = data.owner;
+        for (const auto& member : data.members) {
+            info.members.insert(member);
+            userRooms[member].insert(data.name);
+        }
+    }
+}
+
+bool RoomManager::createRoom(const string& name, const string& owner) {
+    if (!isValidRoomName(name) || owner.empty()) return false;
+
+    lock_guard<mutex> lock(roomsMutex);
+    if (rooms.find(name) != rooms.end()) return false;
+    if (!db.addRoom(name, owner)) return false;
+
+    RoomInfo& info = rooms[name];
+    info.owner = owner;
+    info.members.insert(owner);
+    userRooms[owner].insert(name);
+    return true;
+}
+
+bool RoomManager::joinRoom(const string& name, const string& login) {
+    lock_guard<mutex> lock(roomsMutex);
+    auto it = rooms.find(name);
+    if (it == rooms.end() || login.empty()) return false;
+    if (it->second.members.count(login)) return true;
+    if (!db.addRoomMember(name, login)) return false;
+
+    it->second.members.insert(login);
+    userRooms[login].insert(name);
+    return true;
+}
+
+bool RoomManager::leaveRoom(const string& name, const string& login) {
+    lock_guard<mutex> lock(roomsMutex);
+    auto it = rooms.find(name);
+    if (it == rooms.end() || !it->second.members.count(login)) return false;
+    if (!db.removeRoomMember(name, login)) return false;
+
+    it->second.members.erase(login);
+    userRooms[login].erase(name);
+    return true;
+}
+
+bool RoomManager::roomExists(const string& name) const {
+    lock_guard<mutex> lock(roomsMutex);
+    return rooms.find(name) != rooms.end();
+}
+
+bool RoomManager::isMember(const string& name, const string& login) const {
+    lock_guard<mutex> lock(roomsMutex);
+    auto it = rooms.find(name);
+    return it != rooms.end() && it->second.members.count(login) > 0;
+}
+
+vector<string> RoomManager::getMembers(const string& name) const {
+    lock_guard<mutex> lock(roomsMutex);
+    auto it = rooms.find(name);
+    if (it == rooms.end()) return vector<string>();
+    return vector<string>(it->second.members.begin(), it->second.members.end());
+}
+
+set<string> RoomManager::getRoomsOf(const string& login) const {
+    lock_guard<mutex> lock(roomsMutex);
+    auto it = userRooms.find(login);
+    return it != userRooms.end() ? it->second : set<string>();
+}
+
+vector<pair<string, size_t>> RoomManager::listRooms() const {
+    lock_guard<mutex> lock(roomsMutex);
+    vector<pair<string, size_t>> result;
+    for (const auto& room : rooms) {
+        result.emplace_back(room.first, room.second.members.size());
+    }
+    return result;
+}
+
+size_t RoomManager::getRoomCount() const {
+    lock_guard<mutex> lock(roomsMutex);
+    return rooms.size();
+}
+
+bool RoomManager::isValidRoomName(const string& name) {
+    if (name.empty() || name.length() > 64) return false;
+    return name.find_first_of("|:,\n\r") == string::npos;
+}
+
+size_t RoomManager::memoryUsage() const {
+    lock_guard<mutex> lock(roomsMutex);
+    size_t bytes = rooms.bucket_count() * sizeof(void*) +
+                   rooms.size() * (sizeof(pair<const string, RoomInfo>) + memory_usage::HASH_NODE_OVERHEAD);
+    for (const auto& room : rooms) {
+        bytes += memory_usage::heapBytes(room.first) + memory_usage::heapBytes(room.second.owner) +
+                 memory_usage::heapBytes(room.second.members);
+    }
+    return bytes + memory_usage::heapBytes(userRooms);
+}
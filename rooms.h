@@ -0,0 +1,47 @@
+#ifndef ROOMS_H
+#define ROOMS_H
+
+#include <string>
+#include <vector>
+#include <set>
+#include <unordered_map>
+#include <unordered_set>
+#include <mutex>
+#include "database.h"
+
+using namespace std;
+
+struct RoomInfo {
+    string owner;
+    unordered_set<string> members;
+};
+
+// Серверный реестр комнат: членство в памяти, изменения пишутся в журнал rooms.txt
+class RoomManager {
+private:
+    Database& db;
+    mutable mutex roomsMutex;
+    unordered_map<string, RoomInfo> rooms;
+    unordered_map<string, set<string>> userRooms;
+
+public:
+    explicit RoomManager(Database& db);
+
+    void load();
+
+    bool createRoom(const string& name, const string& owner);
+    bool joinRoom(const string& name, const string& login);
+    bool leaveRoom(const string& name, const string& login);
+
+    bool roomExists(const string& name) const;
+    bool isMember(const string& name, const string& login) const;
+    vector<string> getMembers(const string& name) const;
+    set<string> getRoomsOf(const string& login) const;
+    vector<pair<string, size_t>> listRooms() const;
+    size_t getRoomCount() const;
+    size_t memoryUsage() const;
+
+    static bool isValidRoomName(const string& name);
+};
+
+#endif
@@ -1,8 +1,14 @@
 #include "server.h"
+#include "tracer.h"
+#include "block_codec.h"
 #include <iostream>
 #include <sstream>
 #include <algorithm>
 #include <chrono>
+#include <cerrno>
+#include <fstream>
+#include <cstdio>
+#include <limits>
 
 #ifdef _WIN32
 #include <winsock2.h>
@@ -14,6 +20,15 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <poll.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
+#endif
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
 #endif
 
 using namespace std;
@@ -26,7 +41,90 @@ static int close_socket_portable(int s) {
 #endif
 }
 
-Server::Server(uint16_t port, const string& dbPath) : serverSocket(-1), port(port), db(dbPath) {
+static long long currentTimeMs() {
+    return chrono::duration_cast<chrono::milliseconds>(
+        chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// Период сбора изменений присутствия в одну пачку
+static const int PRESENCE_FLUSH_INTERVAL_MS = 1000;
+
+// Как часто поток канала в разделяемой памяти проверяет, жив ли сокет клиента
+static const int SHM_POLL_INTERVAL_MS = 100;
+
+// Запрос без END длиннее этого считается мусором, соединение закрывается
+static const size_t MAX_REQUEST_BYTES = 1024 * 1024;
+
+// Опустевший буфер приёма больше этого отдаёт память: один большой запрос не держит её вечно
+static const size_t INPUT_BUFFER_KEEP_BYTES = 64 * 1024;
+
+// Выход из режима нехватки памяти - ниже этой доли мягкого предела, чтобы не дребезжать
+static const double MEMORY_RECOVERY_RATIO = 0.9;
+
+// "ID:" и число: длиннее не бывает у честного клиента
+static const size_t MAX_REQUEST_ID_LENGTH = 32;
+
+// Индекс реактора, которому принадлежит текущий поток
+static thread_local int currentReactor = -1;
+
+// Запрос, который реактор исполняет прямо сейчас: обработчик может отложить ответ на него.
+// Вне реактора пусто - там поток соединения сам ждёт результата
+static thread_local DeferredReply* currentDispatch = nullptr;
+static thread_local bool dispatchDeferred = false;
+
+// Колесо таймеров простоя крутится тем же потоком, что и присутствие
+static const size_t IDLE_WHEEL_SLOTS = 512;
+
+// Сколько сообщений поток записи на диск пишет одной пачкой
+static const size_t INGEST_BATCH_SIZE = 256;
+
+// Больше стольких сообщений HISTORY не отдаёт: клиент сужает период или уточняет запрос
+static const size_t HISTORY_MAX_MESSAGES = 500;
+
+// Сколько поток записи ждёт готовности сокетов, прежде чем пересобрать список
+static const int WRITER_POLL_INTERVAL_MS = 50;
+
+#ifdef MSG_NOSIGNAL
+static const int SEND_NOSIGNAL = MSG_NOSIGNAL;
+#else
+static const int SEND_NOSIGNAL = 0;
+#endif
+
+static long long steadyTimeUs() {
+    return chrono::duration_cast<chrono::microseconds>(
+        chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void shutdown_socket_portable(int s) {
+#ifdef _WIN32
+    shutdown(s, SD_BOTH);
+#else
+    shutdown(s, SHUT_RDWR);
+#endif
+}
+
+// Вызывает только поток, читающий сокет: он же владелец inputBuffer
+static void noteInputBuffer(ClientConnection& conn) {
+    if (conn.inputBuffer.empty() && conn.inputBuffer.capacity() > INPUT_BUFFER_KEEP_BYTES) {
+        string().swap(conn.inputBuffer);
+    }
+    conn.inputBufferBytes.store(memory_usage::heapBytes(conn.inputBuffer), memory_order_relaxed);
+}
+
+// Запросы, которые растят структуры в памяти или собирают большой ответ: при нехватке отклоняются
+static bool growsMemory(const string& command) {
+    return command == "REGISTER" || command == "SEND_MESSAGE" || command == "CREATE_ROOM" ||
+           command == "JOIN_ROOM" || command == "ADD_FRIEND" || command == "IMPORT" ||
+           AdmissionController::classify(command) == RequestClass::HEAVY;
+}
+
+Server::Server(uint16_t port, const string& dbPath, const ServerConfig& config)
+    : serverSocket(-1), unixSocket(-1), port(port), config(config), db(dbPath), rooms(db), friends(db),
+      mailboxes(config.mailboxCapacity), admission(config.admission),
+      rateLimiter(config.rateLimits), backups(db, config.backupDirectory), lastMetricsDumpMs(steadyTimeUs() / 1000),
+      ingestQueue(config.ingestQueueCapacity), idleTimers(IDLE_WHEEL_SLOTS, PRESENCE_FLUSH_INTERVAL_MS, steadyTimeUs() / 1000), idlePings(0), idleReaped(0) {
+    // Трассировщик общий на процесс: его отрезки ставит и Database
+    Tracer::configure(config.traceSampleEvery, config.traceBufferEvents);
 }
 
 Server::~Server() {
@@ -41,6 +139,31 @@ bool Server::start() {
         return false;
     }
     
+    rooms.load();
+    
+    // Единственный полный проход по журналу; дальше счётчики и ленты ведутся при записи.
+    // Счётчики включают архив: перенос их не уменьшает, и после перезапуска они те же
+    stats.reset();
+    timelines.clear();
+    db.forEachArchived(numeric_limits<long long>::min(), numeric_limits<long long>::max(), [this](uint64_t, MessageData& msg) {
+        if (msg.text.empty()) return;
+        stats.record(msg.senderLogin, msg.recipientLogin,
+                     Message::typeFromString(msg.type), msg.timestamp);
+    });
+    db.forEachMessage(0, db.getMessageCount(), [this](uint64_t id, MessageData& msg) {
+        if (msg.text.empty()) return;
+        stats.record(msg.senderLogin, msg.recipientLogin,
+                     Message::typeFromString(msg.type), msg.timestamp);
+        addToTimelines(id, msg);
+    });
+    friends.load();
+    for (const auto& user : db.getAllUsers()) {
+        mailboxes.addUser(user.login);
+    }
+    for (const auto& room : rooms.listRooms()) {
+        stats.roomOpened(room.first);
+    }
+    
 #ifdef _WIN32
     WSADATA wsaData;
     if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
@@ -49,6 +172,56 @@ bool Server::start() {
     }
 #endif
 
+#ifndef __linux__
+    if (config.reactorCount > 0) {
+        cerr << "Reactors require epoll, using one thread per connection" << endl;
+        config.reactorCount = 0;
+    }
+#endif
+    if (config.reactorCount > 0 ? !startReactors() : !startTcpListener()) {
+        return false;
+    }
+
+    if (!config.unixSocketPath.empty() && !startUnixListener()) {
+        if (serverSocket >= 0) {
+            close_socket_portable(serverSocket);
+            serverSocket = -1;
+        }
+        releaseReactors();
+        return false;
+    }
+
+    running.store(true);
+    if (serverSocket >= 0) {
+        serverThread = thread(&Server::serverLoop, this, serverSocket, true);
+    }
+    for (const auto& reactor : reactors) {
+        reactor->worker = thread(&Server::reactorLoop, this, reactor.get());
+    }
+    if (unixSocket >= 0) {
+        unixServerThread = thread(&Server::serverLoop, this, unixSocket, false);
+    }
+    deliveryThread = thread(&Server::deliveryLoop, this);
+    presenceThread = thread(&Server::presenceLoop, this);
+    if (!config.retention.empty()) {
+        retentionThread = thread(&Server::retentionLoop, this);
+    }
+    if (!reactors.empty()) {
+        // Больше тяжёлых запросов, чем пропускает допуск, в очереди не окажется
+        size_t workers = max<size_t>(1, min<size_t>(config.admission.maxHeavyInFlight, thread::hardware_concurrency()));
+        for (size_t i = 0; i < workers; ++i) {
+            historyThreads.emplace_back(&Server::historyLoop, this);
+        }
+    }
+    writerThread = thread(&Server::writerLoop, this);
+    storageStopped.store(false);
+    storageThread = thread(&Server::storageLoop, this);
+    
+    cout << "Server started on port " << port << endl;
+    return true;
+}
+
+bool Server::startTcpListener() {
     serverSocket = socket(AF_INET, SOCK_STREAM, 0);
     if (serverSocket < 0) {
         cerr << "Failed to create socket" << endl;
@@ -74,18 +247,47 @@ bool Server::start() {
         return false;
     }
 
-    if (listen(serverSocket, 10) < 0) {
+    if (listen(serverSocket, config.listenBacklog) < 0) {
         cerr << "Failed to listen on socket" << endl;
         close_socket_portable(serverSocket);
         serverSocket = -1;
         return false;
     }
+    return true;
+}
 
-    running.store(true);
-    serverThread = thread(&Server::serverLoop, this);
+bool Server::startUnixListener() {
+#ifdef _WIN32
+    cerr << "Unix domain sockets are not supported on this platform" << endl;
+    return false;
+#else
+    sockaddr_un unixAddr{};
+    if (config.unixSocketPath.size() >= sizeof(unixAddr.sun_path)) {
+        cerr << "Unix socket path is too long: " << config.unixSocketPath << endl;
+        return false;
+    }
+    unixAddr.sun_family = AF_UNIX;
+    config.unixSocketPath.copy(unixAddr.sun_path, config.unixSocketPath.size());
     
-    cout << "Server started on port " << port << endl;
+    unixSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (unixSocket < 0) {
+        cerr << "Failed to create unix socket" << endl;
+        return false;
+    }
+    
+    // Файл от прошлого запуска мешает bind
+    unlink(config.unixSocketPath.c_str());
+    if (::bind(unixSocket, (sockaddr*)&unixAddr, sizeof(unixAddr)) < 0 ||
+        listen(unixSocket, config.listenBacklog) < 0) {
+        cerr << "Failed to listen on unix socket " << config.unixSocketPath << endl;
+        close_socket_portable(unixSocket);
+        unixSocket = -1;
+        return false;
+    }
+    
+    cout << "Server listening on unix:" << config.unixSocketPath << endl;
     return true;
+#endif
 }
 
 void Server::stop() {
@@ -93,22 +295,83 @@ void Server::stop() {
     
     running.store(false);
     
+    // shutdown будит поток, заблокированный в accept
     if (serverSocket >= 0) {
+        shutdown_socket_portable(serverSocket);
         close_socket_portable(serverSocket);
         serverSocket = -1;
     }
+    if (unixSocket >= 0) {
+        shutdown_socket_portable(unixSocket);
+        close_socket_portable(unixSocket);
+        unixSocket = -1;
+#ifndef _WIN32
+        unlink(config.unixSocketPath.c_str());
+#endif
+    }
+    stopReactors();
     
     {
         lock_guard<mutex> lock(clientsMutex);
-        for (int sock : clientSockets) {
-            close_socket_portable(sock);
+        for (const auto& client : clients) {
+            close_socket_portable(client.first);
         }
-        clientSockets.clear();
+        clients.clear();
+        subscriptions.clear();
     }
     
+    {
+        lock_guard<mutex> lock(deliveryMutex);
+    }
+    deliveryCv.notify_all();
+    {
+        lock_guard<mutex> lock(presenceWaitMutex);
+    }
+    presenceCv.notify_all();
+    {
+        lock_guard<mutex> lock(writerMutex);
+        pendingWrites.clear();
+    }
+    writerCv.notify_all();
+    {
+        lock_guard<mutex> lock(storageMutex);
+    }
+    storageCv.notify_all();
+    {
+        lock_guard<mutex> lock(historyMutex);
+    }
+    historyCv.notify_all();
     if (serverThread.joinable()) {
         serverThread.join();
     }
+    if (unixServerThread.joinable()) {
+        unixServerThread.join();
+    }
+    if (deliveryThread.joinable()) {
+        deliveryThread.join();
+    }
+    if (presenceThread.joinable()) {
+        presenceThread.join();
+    }
+    if (retentionThread.joinable()) {
+        retentionThread.join();
+    }
+    // До releaseReactors: завершения пишут в wakeFd реакторов
+    for (auto& worker : historyThreads) {
+        worker.join();
+    }
+    historyThreads.clear();
+    if (writerThread.joinable()) {
+        writerThread.join();
+    }
+    if (storageThread.joinable()) {
+        storageThread.join();
+    }
+    releaseReactors();
+    dumpMetrics(true);
+    if (Tracer::enabled() && Tracer::writeChromeTrace(config.tracePath) < 0) {
+        cerr << "Failed to write trace to " << config.tracePath << endl;
+    }
     
 #ifdef _WIN32
     WSACleanup();
@@ -117,12 +380,9 @@ void Server::stop() {
     cout << "Server stopped" << endl;
 }
 
-void Server::serverLoop() {
+void Server::serverLoop(int listenSocket, bool tcp) {
     while (running.load()) {
-        sockaddr_in clientAddr{};
-        socklen_t clientLen = sizeof(clientAddr);
-        
-        int clientSocket = accept(serverSocket, (sockaddr*)&clientAddr, &clientLen);
+        int clientSocket = accept(listenSocket, nullptr, nullptr);
         if (clientSocket < 0) {
             if (running.load()) {
                 cerr << "Failed to accept client" << endl;
@@ -130,144 +390,1332 @@ void Server::serverLoop() {
             continue;
         }
         
-        {
-            lock_guard<mutex> lock(clientsMutex);
-            clientSockets.insert(clientSocket);
+        // Сверх лимита соединение не получает потока: короткий отказ и закрытие
+        if (!admission.openConnection()) {
+            string busy = serializeResponse("BUSY", "CONNECTION_LIMIT") + "\nEND\n";
+            send(clientSocket, busy.c_str(), static_cast<int>(busy.length()), SEND_NOSIGNAL);
+            close_socket_portable(clientSocket);
+            continue;
         }
         
+        registerConnection(clientSocket, tcp);
         thread clientThread(&Server::handleClient, this, clientSocket);
         clientThread.detach();
     }
 }
 
+// Соединение становится видно другим потокам только полностью настроенным
+shared_ptr<ClientConnection> Server::registerConnection(int clientSocket, bool tcp, int reactor) {
+    shared_ptr<ClientConnection> conn = make_shared<ClientConnection>(clientSocket, !tcp);
+    conn->reactor = reactor;
+    conn->output.configure(config.outputQueueBytes, config.slowConsumerPolicy);
+    {
+        lock_guard<mutex> lock(clientsMutex);
+        clients[clientSocket] = conn;
+    }
+    if (tcp) {
+        configureKeepalive(clientSocket);
+    }
+    if (config.idleTimeoutMs > 0) {
+        lock_guard<mutex> lock(idleMutex);
+        idleTimers.schedule(clientSocket, steadyTimeUs() / 1000 + config.idleTimeoutMs);
+    }
+    presence.connected();
+    metrics.connectionOpened();
+    return conn;
+}
+
+void Server::closeConnection(const shared_ptr<ClientConnection>& conn) {
+    int clientSocket = conn->socket;
+    metrics.connectionClosed();
+    presence.disconnected(conn->login);
+    unsubscribe(*conn);
+    {
+        // Поток записи может держать ссылку на соединение: дескриптор больше не трогаем
+        lock_guard<mutex> lock(conn->writeMutex);
+        conn->closed = true;
+    }
+    {
+        // После отмены таймера дескриптор можно закрывать: колесо его больше не вернёт
+        lock_guard<mutex> lock(idleMutex);
+        idleTimers.cancel(clientSocket);
+    }
+    {
+        lock_guard<mutex> lock(clientsMutex);
+        if (clients.erase(clientSocket)) {
+            close_socket_portable(clientSocket);
+        }
+    }
+    admission.closeConnection();
+}
+
 void Server::handleClient(int clientSocket) {
+    shared_ptr<ClientConnection> conn;
+    {
+        lock_guard<mutex> lock(clientsMutex);
+        auto it = clients.find(clientSocket);
+        if (it != clients.end()) conn = it->second;
+    }
+    if (!conn) return;
+    
     try {
-        while (running.load()) {
-            string request = receiveFromClient(clientSocket);
-            if (request.empty()) break;
+        string request;
+        while (running.load() && receiveFromClient(*conn, request)) {
+            touchConnection(*conn);
+            
+            // Дальше запросы идут через разделяемую память; сокет остаётся для событий
+            if (request.compare(0, 11, "SHM_ATTACH\n") == 0) {
+                if (serveSharedMemory(conn, request.substr(11))) break;
+                continue;
+            }
             
-            string response = processRequest(request);
-            sendToClient(clientSocket, response);
+            serveRequest(conn, request, conn->lastReadUs);
         }
     } catch (...) {
     }
     
-    close_socket_portable(clientSocket);
-    {
-        lock_guard<mutex> lock(clientsMutex);
-        clientSockets.erase(clientSocket);
-    }
+    closeConnection(conn);
 }
 
-string Server::receiveFromClient(int clientSocket) {
-    string request;
-    char buffer[4096];
+// Тот же путь admitRequest/processRequest, только кадры берутся из кольца запросов
+// и кладутся в кольцо ответов. Возвращает false, если канал не открыт
+bool Server::serveSharedMemory(const shared_ptr<ClientConnection>& conn, const string& name) {
+    ShmChannel channel;
+    if (!conn->local) {
+        sendToClient(conn, serializeResponse("ERROR", "Shared memory requires a unix socket connection"));
+        return false;
+    }
+    if (!channel.open(name)) {
+        sendToClient(conn, serializeResponse("ERROR", "Failed to open shared memory segment"));
+        return false;
+    }
+    sendToClient(conn, serializeResponse("SUCCESS", "ATTACHED"));
     
-    while (true) {
-        int bytesReceived = recv(clientSocket, buffer, sizeof(buffer) - 1, 0);
-        if (bytesReceived <= 0) break;
+    string request;
+    while (running.load()) {
+        if (!channel.requestRing().pop(request, SHM_POLL_INTERVAL_MS)) {
+            if (channel.isClosed()) break;
+            
+            // Клиент мог завершиться, не закрыв канал: проверяем сокет
+#ifndef _WIN32
+            char probe;
+            ssize_t peeked = recv(conn->socket, &probe, 1, MSG_PEEK | MSG_DONTWAIT);
+            if (peeked == 0 || (peeked < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) break;
+#endif
+            continue;
+        }
+        
+        touchConnection(*conn);
+        long long receivedUs = steadyTimeUs();
+        TraceRequest trace(receivedUs);
+        size_t command;
+        string response = dispatchRequest(*conn, request, receivedUs, command);
+        trace.setName(ServerMetrics::commandName(command));
+        if (response.size() > channel.responseRing().maxFrameSize()) {
+            response = serializeResponse("ERROR", "Response too large for shared memory ring");
+        }
+        long long writeStartedUs = steadyTimeUs();
+        {
+            TraceSpan span("shm.push", "io");
+            if (!channel.responseRing().push(response, PRESENCE_FLUSH_INTERVAL_MS * 5)) break;
+        }
+        metrics.record(command, MetricPhase::IO, steadyTimeUs() - writeStartedUs);
+        metrics.addBytesOut(response.size());
+    }
+    channel.close();
+    return true;
+}
+
+bool Server::startReactors() {
+#ifdef __linux__
+    for (size_t i = 0; i < config.reactorCount; ++i) {
+        unique_ptr<Reactor> reactor(new Reactor(i));
+        reactor->listenSocket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        reactor->epollFd = epoll_create1(0);
+        reactor->wakeFd = eventfd(0, EFD_NONBLOCK);
+        Reactor* raw = reactor.get();
+        reactors.push_back(move(reactor));
+        if (raw->listenSocket < 0 || raw->epollFd < 0 || raw->wakeFd < 0) {
+            cerr << "Failed to create reactor " << i << endl;
+            releaseReactors();
+            return false;
+        }
         
-        buffer[bytesReceived] = '\0';
-        request += buffer;
+        // Каждый реактор слушает тот же порт; соединения распределяет ядро
+        int opt = 1;
+        setsockopt(raw->listenSocket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+        setsockopt(raw->listenSocket, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
         
-        if (request.find("\nEND\n") != string::npos) {
-            break;
+        sockaddr_in serverAddr{};
+        serverAddr.sin_family = AF_INET;
+        serverAddr.sin_addr.s_addr = INADDR_ANY;
+        serverAddr.sin_port = htons(port);
+        if (::bind(raw->listenSocket, (sockaddr*)&serverAddr, sizeof(serverAddr)) < 0 ||
+            listen(raw->listenSocket, config.listenBacklog) < 0) {
+            cerr << "Failed to bind reactor " << i << " on port " << port << endl;
+            releaseReactors();
+            return false;
         }
+        
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.fd = raw->listenSocket;
+        epoll_ctl(raw->epollFd, EPOLL_CTL_ADD, raw->listenSocket, &event);
+        event.data.fd = raw->wakeFd;
+        epoll_ctl(raw->epollFd, EPOLL_CTL_ADD, raw->wakeFd, &event);
     }
-    
-    size_t endPos = request.find("\nEND\n");
-    if (endPos != string::npos) {
-        request = request.substr(0, endPos);
+    cout << "Started " << reactors.size() << " reactors on port " << port << endl;
+    return true;
+#else
+    return false;
+#endif
+}
+
+void Server::stopReactors() {
+#ifdef __linux__
+    for (const auto& reactor : reactors) {
+        if (reactor->wakeFd >= 0) {
+            uint64_t one = 1;
+            ssize_t written = write(reactor->wakeFd, &one, sizeof(one));
+            (void)written;
+        }
     }
-    
-    return request;
+    for (const auto& reactor : reactors) {
+        if (reactor->worker.joinable()) {
+            reactor->worker.join();
+        }
+    }
+#endif
+}
+
+// Только когда никто уже не может вызвать postToReactor
+void Server::releaseReactors() {
+#ifdef __linux__
+    for (const auto& reactor : reactors) {
+        if (reactor->listenSocket >= 0) close_socket_portable(reactor->listenSocket);
+        if (reactor->epollFd >= 0) close(reactor->epollFd);
+        if (reactor->wakeFd >= 0) close(reactor->wakeFd);
+    }
+#endif
+    reactors.clear();
 }
 
-void Server::sendToClient(int clientSocket, const string& message) {
-    string msg = message + "\nEND\n";
-    send(clientSocket, msg.c_str(), static_cast<int>(msg.length()), 0);
+// Кадры для соединений этого реактора из потоков доставки и присутствия
+void Server::postToReactor(const shared_ptr<ClientConnection>& conn, const string& frame, bool isEvent,
+                           const string& coalesceKey) {
+    pushToReactor(conn->reactor, ReactorEvent{conn, frame, isEvent, coalesceKey, nullptr, nullptr, false});
 }
 
-string Server::serializeResponse(const string& status, const string& data) {
-    return "STATUS:" + status + "\nDATA:" + data;
+void Server::pushToReactor(int index, ReactorEvent&& event) {
+#ifdef __linux__
+    Reactor* reactor = reactors[static_cast<size_t>(index)].get();
+    reactor->inbox.push(move(event));
+    // Одно пробуждение на пачку: пока реактор не разобрал inbox, писать в eventfd незачем
+    if (!reactor->wakePending.exchange(true)) {
+        uint64_t one = 1;
+        ssize_t written = write(reactor->wakeFd, &one, sizeof(one));
+        (void)written;
+    }
+#else
+    (void)index;
+    (void)event;
+#endif
 }
 
-string Server::processRequest(const string& request) {
-    stringstream ss(request);
-    string command;
-    getline(ss, command);
+void Server::reactorLoop(Reactor* reactor) {
+#ifdef __linux__
+    currentReactor = static_cast<int>(reactor->index);
+    const int maxEvents = 64;
+    epoll_event events[maxEvents];
     
-    if (command == "REGISTER") {
-        string login, password, name;
-        getline(ss, login);
-        getline(ss, password);
-        getline(ss, name);
-        return handleRegister(login, password, name);
-    }
-    else if (command == "LOGIN") {
-        string login, password;
-        getline(ss, login);
-        getline(ss, password);
-        return handleLogin(login, password);
+    while (running.load()) {
+        int ready = epoll_wait(reactor->epollFd, events, maxEvents, -1);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        
+        for (int i = 0; i < ready && running.load(); ++i) {
+            int fd = events[i].data.fd;
+            if (fd == reactor->listenSocket) {
+                acceptOnReactor(reactor);
+            } else if (fd == reactor->wakeFd) {
+                uint64_t counter;
+                ssize_t drained = read(reactor->wakeFd, &counter, sizeof(counter));
+                (void)drained;
+                reactor->wakePending.store(false);
+                
+                ReactorEvent event;
+                while (reactor->inbox.pop(event)) {
+                    if (event.reply) {
+                        finishDeferred(reactor, event);
+                        continue;
+                    }
+                    shared_ptr<ClientConnection> conn = event.conn.lock();
+                    if (!conn) continue;
+                    if (event.resume) {
+                        auto it = reactor->connections.find(conn->socket);
+                        if (it != reactor->connections.end() && it->second == conn) {
+                            readFromConnection(reactor, conn);
+                        }
+                        continue;
+                    }
+                    sendToClient(conn, event.frame, event.isEvent, event.coalesceKey);
+                }
+            } else {
+                auto it = reactor->connections.find(fd);
+                if (it != reactor->connections.end()) {
+                    shared_ptr<ClientConnection> conn = it->second;
+                    // На приостановленном сокете epoll сообщает только об ошибке или обрыве
+                    if (conn->readPaused) {
+                        dropFromReactor(reactor, conn);
+                    } else {
+                        readFromConnection(reactor, conn);
+                    }
+                }
+            }
+        }
     }
-    else if (command == "SEND_MESSAGE") {
-        string senderLogin, recipientLogin, text, type;
-        getline(ss, senderLogin);
-        getline(ss, recipientLogin);
-        getline(ss, text);
-        getline(ss, type);
-        return handleSendMessage(senderLogin, recipientLogin, text, type);
+    
+    // Сокеты закроет stop() вместе с остальными клиентами
+    reactor->connections.clear();
+    currentReactor = -1;
+#else
+    (void)reactor;
+#endif
+}
+
+void Server::acceptOnReactor(Reactor* reactor) {
+#ifdef __linux__
+    while (true) {
+        int clientSocket = accept4(reactor->listenSocket, nullptr, nullptr, SOCK_NONBLOCK);
+        if (clientSocket < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        
+        if (!admission.openConnection()) {
+            string busy = serializeResponse("BUSY", "CONNECTION_LIMIT") + "\nEND\n";
+            send(clientSocket, busy.c_str(), busy.length(), SEND_NOSIGNAL);
+            close_socket_portable(clientSocket);
+            continue;
+        }
+        
+        shared_ptr<ClientConnection> conn = registerConnection(clientSocket, true, static_cast<int>(reactor->index));
+        reactor->connections[clientSocket] = conn;
+        ++reactor->accepted;
+        
+        epoll_event event{};
+        event.events = EPOLLIN | EPOLLRDHUP;
+        event.data.fd = clientSocket;
+        epoll_ctl(reactor->epollFd, EPOLL_CTL_ADD, clientSocket, &event);
     }
-    else if (command == "GET_USERS") {
-        return handleGetUsers();
+#else
+    (void)reactor;
+#endif
+}
+
+// Читаем всё, что есть (не больше MAX_REQUEST_BYTES в буфере - остальное дождётся
+// следующего прохода), и обрабатываем каждый полный запрос в этом же потоке
+void Server::readFromConnection(Reactor* reactor, const shared_ptr<ClientConnection>& conn) {
+#ifdef __linux__
+    bool closing = false;
+    char buffer[4096];
+    while (conn->inputBuffer.size() <= MAX_REQUEST_BYTES) {
+        ssize_t bytesReceived = recv(conn->socket, buffer, sizeof(buffer), 0);
+        if (bytesReceived > 0) {
+            conn->inputBuffer.append(buffer, static_cast<size_t>(bytesReceived));
+            conn->lastReadUs = steadyTimeUs();
+            noteInputBuffer(*conn);
+            continue;
+        }
+        if (bytesReceived < 0 && errno == EINTR) continue;
+        if (bytesReceived == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) closing = true;
+        break;
     }
-    else if (command == "GET_MESSAGES") {
-        string login;
-        getline(ss, login);
-        return handleGetMessages(login);
+    
+    if (!closing && !serveBuffered(reactor, conn)) closing = true;
+    noteInputBuffer(*conn);
+    if (!closing) updateReading(reactor, conn);
+    // Разбор не остановлен - в буфере остался один неполный запрос
+    if (!conn->readPaused && conn->inputBuffer.size() > MAX_REQUEST_BYTES) closing = true;
+    
+    if (closing) {
+        dropFromReactor(reactor, conn);
     }
-    else {
-        return serializeResponse("ERROR", "Unknown command");
+#else
+    (void)reactor;
+    (void)conn;
+#endif
+}
+
+// Полные запросы из буфера по порядку. Отложенный ответ без ID останавливает разбор:
+// продолжит finishDeferred, когда ответ уйдёт; переполненная очередь ответов - тоже,
+// продолжит событие resume от того, кто её разгрузит. false - соединение надо закрыть
+bool Server::serveBuffered(Reactor* reactor, const shared_ptr<ClientConnection>& conn) {
+    try {
+        size_t endPos;
+        while (!conn->replyPending && !outputBacklogged(*conn) &&
+               (endPos = conn->inputBuffer.find("\nEND\n")) != string::npos) {
+            string request = conn->inputBuffer.substr(0, endPos);
+            conn->inputBuffer.erase(0, endPos + 5);
+            touchConnection(*conn);
+            ++reactor->requests;
+            
+            if (request.compare(0, 11, "SHM_ATTACH\n") == 0) {
+                sendToClient(conn, serializeResponse("ERROR", "Shared memory requires a unix socket connection"));
+                continue;
+            }
+            serveRequest(conn, request, conn->lastReadUs);
+        }
+    } catch (...) {
+        return false;
     }
+    return true;
 }
 
-string Server::handleRegister(const string& login, const string& password, const string& name) {
-    if (db.addUser(login, password, name)) {
-        return serializeResponse("SUCCESS", "User registered");
-    } else {
-        return serializeResponse("ERROR", "User already exists");
+void Server::dropFromReactor(Reactor* reactor, const shared_ptr<ClientConnection>& conn) {
+#ifdef __linux__
+    epoll_ctl(reactor->epollFd, EPOLL_CTL_DEL, conn->socket, nullptr);
+    reactor->connections.erase(conn->socket);
+    closeConnection(conn);
+#else
+    (void)reactor;
+    (void)conn;
+#endif
+}
+
+// Пока разбор стоит, сокет не читается вовсе: иначе клиент, не читающий ответов,
+// раздувал бы inputBuffer вместо очереди. Без EPOLLIN данные копятся в ядре,
+// и отправитель упирается в окно TCP
+void Server::updateReading(Reactor* reactor, const shared_ptr<ClientConnection>& conn) {
+#ifdef __linux__
+    bool pause = conn->replyPending || outputBacklogged(*conn);
+    if (pause == conn->readPaused) return;
+    conn->readPaused = pause;
+    epoll_event event{};
+    event.events = pause ? 0 : EPOLLIN | EPOLLRDHUP;
+    event.data.fd = conn->socket;
+    epoll_ctl(reactor->epollFd, EPOLL_CTL_MOD, conn->socket, &event);
+#else
+    (void)reactor;
+    (void)conn;
+#endif
+}
+
+// Отмечает, что читатель встал: разгрузивший очередь разбудит его через wakeReader
+bool Server::outputBacklogged(ClientConnection& conn) {
+    lock_guard<mutex> lock(conn.writeMutex);
+    bool backlogged = !conn.closed && conn.output.backlogged();
+    if (backlogged) conn.readBlocked = true;
+    return backlogged;
+}
+
+// Свой поток соединения: следующий запрос берётся, только когда очередь ниже предела
+bool Server::waitForOutput(ClientConnection& conn) {
+    unique_lock<mutex> lock(conn.writeMutex);
+    while (!conn.closed && conn.output.backlogged()) {
+        if (!running.load()) return false;
+        conn.readBlocked = true;
+        conn.drained.wait_for(lock, chrono::milliseconds(WRITER_POLL_INTERVAL_MS));
     }
+    conn.readBlocked = false;
+    return true;
 }
 
-string Server::handleLogin(const string& login, const string& password) {
-    if (db.checkUserPassword(login, password)) {
-        string usersData = handleGetUsers();
-        string messagesData = handleGetMessages(login);
-        return serializeResponse("SUCCESS", "USERS:" + usersData + "\nMESSAGES:" + messagesData);
+// Под writeMutex после отправки или ошибки записи
+void Server::wakeReader(const shared_ptr<ClientConnection>& conn) {
+    if (!conn->readBlocked || (!conn->closed && conn->output.backlogged())) return;
+    conn->readBlocked = false;
+    if (conn->reactor >= 0) {
+        pushToReactor(conn->reactor, ReactorEvent{conn, string(), false, string(), nullptr, nullptr, true});
     } else {
-        return serializeResponse("ERROR", "Invalid login or password");
+        conn->drained.notify_all();
     }
 }
 
-string Server::handleSendMessage(const string& senderLogin, const string& recipientLogin, 
+// Под writeMutex: писать в сокет больше нельзя, а ждущий разгрузки читатель увидит обрыв
+void Server::abortWrites(const shared_ptr<ClientConnection>& conn) {
+    shutdown_socket_portable(conn->socket);
+    conn->closed = true;
+    wakeReader(conn);
+}
+
+void Server::subscribe(ClientConnection& conn, const string& login) {
+    lock_guard<mutex> lock(clientsMutex);
+    auto it = clients.find(conn.socket);
+    if (it == clients.end()) return;
+    
+    if (!conn.login.empty()) {
+        subscriptions[conn.login].erase(it->second);
+    }
+    conn.login = login;
+    subscriptions[login].insert(it->second);
+}
+
+void Server::unsubscribe(ClientConnection& conn) {
+    lock_guard<mutex> lock(clientsMutex);
+    if (conn.login.empty()) return;
+    
+    // Логин сбрасываем под той же блокировкой, под которой его читает рассылка
+    string login;
+    login.swap(conn.login);
+    
+    auto sub = subscriptions.find(login);
+    if (sub != subscriptions.end()) {
+        for (auto it = sub->second.begin(); it != sub->second.end(); ++it) {
+            if (it->get() == &conn) {
+                sub->second.erase(it);
+                break;
+            }
+        }
+        if (sub->second.empty()) {
+            subscriptions.erase(sub);
+        }
+    }
+}
+
+void Server::presenceLoop() {
+    while (running.load()) {
+        {
+            unique_lock<mutex> lock(presenceWaitMutex);
+            presenceCv.wait_for(lock, chrono::milliseconds(PRESENCE_FLUSH_INTERVAL_MS),
+                                [this] { return !running.load(); });
+        }
+        if (!running.load()) break;
+        
+        presence.expireStale(currentTimeMs());
+        reapIdleConnections();
+        checkMemoryLimit();
+        dumpMetrics(false);
+        vector<PresenceChange> changes = presence.takeChanges();
+        if (!changes.empty()) {
+            publishPresence(changes);
+        }
+    }
+}
+
+// Ждёт на том же условии, что и присутствие: stop() будит оба потока разом
+void Server::retentionLoop() {
+    while (running.load()) {
+        applyRetention();
+        unique_lock<mutex> lock(presenceWaitMutex);
+        presenceCv.wait_for(lock, chrono::milliseconds(config.retentionIntervalMs),
+                            [this] { return !running.load(); });
+    }
+}
+
+long long Server::applyRetention() {
+    vector<uint64_t> archivedIds;
+    long long archived = db.archiveExpired(config.retention, currentTimeMs(), archivedIds);
+    if (archived < 0) {
+        cerr << "Failed to archive expired messages" << endl;
+        return archived;
+    }
+    timelines.removeIds(archivedIds);
+    archivedMessages += static_cast<size_t>(archived);
+    return archived;
+}
+
+// При остановке невзятые задания бросаются: их соединения уже закрыты
+void Server::historyLoop() {
+    while (true) {
+        function<void()> job;
+        {
+            unique_lock<mutex> lock(historyMutex);
+            historyCv.wait(lock, [this] { return !historyJobs.empty() || !running.load(); });
+            if (!running.load()) break;
+            job = move(historyJobs.front());
+            historyJobs.pop();
+        }
+        job();
+    }
+}
+
+void Server::configureKeepalive(int clientSocket) {
+    if (config.keepaliveIdleSec <= 0) return;
+    
+    int enable = 1;
+#ifdef _WIN32
+    setsockopt(clientSocket, SOL_SOCKET, SO_KEEPALIVE, (char*)&enable, sizeof(enable));
+#else
+    setsockopt(clientSocket, SOL_SOCKET, SO_KEEPALIVE, &enable, sizeof(enable));
+#ifdef TCP_KEEPIDLE
+    setsockopt(clientSocket, IPPROTO_TCP, TCP_KEEPIDLE, &config.keepaliveIdleSec, sizeof(int));
+#elif defined(TCP_KEEPALIVE)
+    setsockopt(clientSocket, IPPROTO_TCP, TCP_KEEPALIVE, &config.keepaliveIdleSec, sizeof(int));
+#endif
+#ifdef TCP_KEEPINTVL
+    setsockopt(clientSocket, IPPROTO_TCP, TCP_KEEPINTVL, &config.keepaliveIntervalSec, sizeof(int));
+#endif
+#ifdef TCP_KEEPCNT
+    setsockopt(clientSocket, IPPROTO_TCP, TCP_KEEPCNT, &config.keepaliveCount, sizeof(int));
+#endif
+#endif
+}
+
+void Server::touchConnection(ClientConnection& conn) {
+    if (config.idleTimeoutMs <= 0) return;
+    lock_guard<mutex> lock(idleMutex);
+    conn.pingSent = false;
+    idleTimers.schedule(conn.socket, steadyTimeUs() / 1000 + config.idleTimeoutMs);
+}
+
+// Первое срабатывание таймера - EVENT:PING и отсрочка на pongTimeoutMs,
+// второе подряд - соединение закрывается, его поток выходит из recv
+void Server::reapIdleConnections() {
+    if (config.idleTimeoutMs <= 0) return;
+    
+    vector<shared_ptr<ClientConnection>> toPing;
+    vector<shared_ptr<ClientConnection>> toReap;
+    {
+        lock_guard<mutex> lock(idleMutex);
+        long long nowMs = steadyTimeUs() / 1000;
+        vector<int> expired = idleTimers.advance(nowMs);
+        if (expired.empty()) return;
+        
+        lock_guard<mutex> clientsLock(clientsMutex);
+        for (int socket : expired) {
+            auto it = clients.find(socket);
+            if (it == clients.end()) continue;
+            shared_ptr<ClientConnection> conn = it->second;
+            if (conn->pingSent) {
+                toReap.push_back(conn);
+                ++idleReaped;
+            } else {
+                conn->pingSent = true;
+                idleTimers.schedule(socket, nowMs + config.pongTimeoutMs);
+                toPing.push_back(conn);
+                ++idlePings;
+            }
+        }
+    }
+    
+    for (const auto& conn : toPing) {
+        sendToClient(conn, "EVENT:PING\nDATA:", true);
+    }
+    for (const auto& conn : toReap) {
+        lock_guard<mutex> lock(conn->writeMutex);
+        if (!conn->closed) {
+            shutdown_socket_portable(conn->socket);
+        }
+    }
+}
+
+// Одна пачка на получателя: друзья получают свой дифф, комнаты - общий дифф на всех участников
+void Server::publishPresence(const vector<PresenceChange>& changes) {
+    unordered_map<string, string> recipientDiffs;
+    map<string, string> roomDiffs;
+    for (const auto& change : changes) {
+        string token = (change.online ? "+" : "-") + change.login;
+        
+        for (const auto& follower : friends.getFollowers(change.login)) {
+            string& diff = recipientDiffs[follower];
+            if (!diff.empty()) diff += ",";
+            diff += token;
+        }
+        for (const auto& room : rooms.getRoomsOf(change.login)) {
+            string& diff = roomDiffs[room];
+            if (!diff.empty()) diff += ",";
+            diff += token;
+        }
+    }
+    
+    vector<pair<string, string>> framesByLogin;
+    for (const auto& diff : recipientDiffs) {
+        framesByLogin.emplace_back(diff.first, "EVENT:PRESENCE\nDATA:" + diff.second);
+    }
+    for (const auto& diff : roomDiffs) {
+        string frame = "EVENT:PRESENCE\nDATA:" + diff.second;
+        for (const auto& member : rooms.getMembers(diff.first)) {
+            framesByLogin.emplace_back(member, frame);
+        }
+    }
+    sendToLogins(framesByLogin);
+}
+
+void Server::sendToLogins(const vector<pair<string, string>>& framesByLogin) {
+    vector<pair<shared_ptr<ClientConnection>, const string*>> targets;
+    {
+        lock_guard<mutex> lock(clientsMutex);
+        for (const auto& item : framesByLogin) {
+            auto sub = subscriptions.find(item.first);
+            if (sub == subscriptions.end()) continue;
+            for (const auto& conn : sub->second) {
+                targets.emplace_back(conn, &item.second);
+            }
+        }
+    }
+    
+    // Диффы присутствия одному получателю при политике COALESCE сливаются в очереди
+    for (const auto& target : targets) {
+        sendToClient(target.first, *target.second, true, "PRESENCE");
+    }
+}
+
+void Server::enqueueRoomDelivery(const string& room, const string& frame, int excludeSocket) {
+    {
+        lock_guard<mutex> lock(deliveryMutex);
+        deliveryQueue.push(RoomDelivery{room, frame, excludeSocket});
+    }
+    deliveryCv.notify_one();
+}
+
+// Рассылка по участникам комнаты: O(members) работы здесь, а не в потоке отправителя
+void Server::deliveryLoop() {
+    while (true) {
+        RoomDelivery job;
+        {
+            unique_lock<mutex> lock(deliveryMutex);
+            deliveryCv.wait(lock, [this] { return !deliveryQueue.empty() || !running.load(); });
+            if (!running.load()) break;
+            job = deliveryQueue.front();
+            deliveryQueue.pop();
+        }
+        
+        vector<shared_ptr<ClientConnection>> targets;
+        vector<string> members = rooms.getMembers(job.room);
+        {
+            lock_guard<mutex> lock(clientsMutex);
+            for (const auto& member : members) {
+                auto sub = subscriptions.find(member);
+                if (sub == subscriptions.end()) continue;
+                for (const auto& conn : sub->second) {
+                    if (conn->socket != job.excludeSocket) {
+                        targets.push_back(conn);
+                    }
+                }
+            }
+        }
+        
+        for (const auto& conn : targets) {
+            sendToClient(conn, job.frame, true);
+        }
+    }
+}
+
+// Байты после END - начало следующего запроса: клиент может слать их, не дожидаясь ответа
+bool Server::receiveFromClient(ClientConnection& conn, string& request) {
+    char buffer[4096];
+    
+    while (true) {
+        if (!waitForOutput(conn)) return false;
+        size_t endPos = conn.inputBuffer.find("\nEND\n");
+        if (endPos != string::npos) {
+            request = conn.inputBuffer.substr(0, endPos);
+            conn.inputBuffer.erase(0, endPos + 5);
+            noteInputBuffer(conn);
+            return true;
+        }
+        if (conn.inputBuffer.size() > MAX_REQUEST_BYTES) return false;
+        
+        int bytesReceived = recv(conn.socket, buffer, sizeof(buffer), 0);
+        if (bytesReceived <= 0) return false;
+        conn.inputBuffer.append(buffer, static_cast<size_t>(bytesReceived));
+        conn.lastReadUs = steadyTimeUs();
+        noteInputBuffer(conn);
+    }
+}
+
+// Кадр ставится в очередь соединения и сразу пишется без блокировки;
+// остаток досылает поток записи, когда сокет снова готов
+void Server::sendToClient(const shared_ptr<ClientConnection>& conn, const string& message, bool isEvent,
+                          const string& coalesceKey) {
+    if (conn->reactor >= 0 && conn->reactor != currentReactor) {
+        postToReactor(conn, message, isEvent, coalesceKey);
+        return;
+    }
+    
+    TraceSpan span("sendToClient", "io");
+    lock_guard<mutex> lock(conn->writeMutex);
+    if (conn->closed) return;
+    
+    OutputQueue::PushResult result = conn->output.push(message + "\nEND\n", isEvent, coalesceKey);
+    if (result == OutputQueue::OVERFLOW) {
+        // Поток клиента увидит закрытие на recv и уберёт соединение сам
+        ++slowConsumerDisconnects;
+        abortWrites(conn);
+        return;
+    }
+    if (result == OutputQueue::DROPPED) return;
+    metrics.addBytesOut(message.size() + 5);
+    
+    if (conn->output.flush(conn->socket) < 0) {
+        abortWrites(conn);
+        return;
+    }
+    wakeReader(conn);
+    if (!conn->output.empty()) {
+        lock_guard<mutex> writerLock(writerMutex);
+        if (pendingWrites.insert(conn).second) {
+            writerCv.notify_one();
+        }
+    }
+}
+
+// Единственный писатель журнала сообщений: всё, что накопилось, уходит одной записью
+void Server::storageLoop() {
+    vector<shared_ptr<IngestRequest>> batch;
+    vector<const MessageData*> messages;
+    vector<uint64_t> ids;
+    while (true) {
+        batch.clear();
+        ingestQueue.drain([&batch](shared_ptr<IngestRequest>&& request) {
+            batch.push_back(move(request));
+        }, INGEST_BATCH_SIZE);
+        
+        if (batch.empty()) {
+            if (!running.load()) break;
+            storageIdle.store(true);
+            {
+                unique_lock<mutex> lock(storageMutex);
+                storageCv.wait_for(lock, chrono::milliseconds(WRITER_POLL_INTERVAL_MS),
+                                   [this] { return !ingestQueue.empty() || !running.load(); });
+            }
+            storageIdle.store(false);
+            continue;
+        }
+        
+        messages.clear();
+        for (const auto& request : batch) {
+            messages.push_back(&request->message);
+        }
+        long long writeStartedUs = steadyTimeUs();
+        bool written = db.addMessages(messages, ids);
+        if (Tracer::enabled()) {
+            // Одна запись на всю пачку: отрезок достаётся каждому трассируемому запросу в ней
+            long long writeFinishedUs = steadyTimeUs();
+            for (const auto& request : batch) {
+                if (request->traceId == 0) continue;
+                uint64_t previous = Tracer::adoptRequest(request->traceId);
+                Tracer::record("storage.write", "db", writeStartedUs, writeFinishedUs);
+                Tracer::adoptRequest(previous);
+            }
+        }
+        for (size_t i = 0; i < batch.size(); ++i) {
+            long long id = written ? static_cast<long long>(ids[i]) : -1;
+            if (batch[i]->onWritten) {
+                batch[i]->onWritten(id);
+            } else {
+                batch[i]->result.set_value(id);
+            }
+        }
+    }
+    storageStopped.store(true);
+}
+
+// false - очередь полна или сервер останавливается
+bool Server::submitIngest(const shared_ptr<IngestRequest>& request) {
+    shared_ptr<IngestRequest> queued = request;
+    if (!running.load() || !ingestQueue.tryPush(move(queued))) {
+        return false;
+    }
+    // Будим писателя, только если он уснул: иначе он сам заберёт запрос следующим проходом
+    if (storageIdle.load()) {
+        lock_guard<mutex> lock(storageMutex);
+        storageCv.notify_one();
+    }
+    return true;
+}
+
+// Блокирующий путь для потоков своих соединений и разделяемой памяти
+Server::IngestStatus Server::ingestMessage(const MessageData& msg, uint64_t& id) {
+    TraceSpan span("ingest.wait", "storage");
+    shared_ptr<IngestRequest> request = make_shared<IngestRequest>();
+    request->message = msg;
+    request->traceId = Tracer::currentRequest();
+    future<long long> result = request->result.get_future();
+    if (!submitIngest(request)) {
+        return INGEST_FULL;
+    }
+    
+    while (result.wait_for(chrono::milliseconds(WRITER_POLL_INTERVAL_MS)) != future_status::ready) {
+        if (storageStopped.load()) return INGEST_FAILED;
+    }
+    long long value = result.get();
+    if (value < 0) return INGEST_FAILED;
+    id = static_cast<uint64_t>(value);
+    return INGESTED;
+}
+
+void Server::writerLoop() {
+    while (running.load()) {
+        vector<shared_ptr<ClientConnection>> pending;
+        {
+            unique_lock<mutex> lock(writerMutex);
+            writerCv.wait(lock, [this] { return !pendingWrites.empty() || !running.load(); });
+            if (!running.load()) break;
+            pending.assign(pendingWrites.begin(), pendingWrites.end());
+        }
+        
+        vector<pollfd> fds;
+        vector<shared_ptr<ClientConnection>> polled;
+        for (const auto& conn : pending) {
+            lock_guard<mutex> lock(conn->writeMutex);
+            if (conn->closed || conn->output.empty()) {
+                lock_guard<mutex> writerLock(writerMutex);
+                pendingWrites.erase(conn);
+                continue;
+            }
+            pollfd pfd{};
+            pfd.fd = conn->socket;
+            pfd.events = POLLOUT;
+            fds.push_back(pfd);
+            polled.push_back(conn);
+        }
+        if (fds.empty()) continue;
+        
+#ifdef _WIN32
+        int ready = WSAPoll(fds.data(), static_cast<ULONG>(fds.size()), WRITER_POLL_INTERVAL_MS);
+#else
+        int ready = poll(fds.data(), fds.size(), WRITER_POLL_INTERVAL_MS);
+#endif
+        if (ready <= 0) continue;
+        
+        for (size_t i = 0; i < fds.size(); ++i) {
+            if (fds[i].revents == 0) continue;
+            const shared_ptr<ClientConnection>& conn = polled[i];
+            lock_guard<mutex> lock(conn->writeMutex);
+            if (conn->closed) continue;
+            
+            bool failed = (fds[i].revents & (POLLERR | POLLHUP | POLLNVAL)) != 0 ||
+                          conn->output.flush(conn->socket) < 0;
+            if (failed) {
+                abortWrites(conn);
+            } else {
+                wakeReader(conn);
+            }
+            if (failed || conn->output.empty()) {
+                lock_guard<mutex> writerLock(writerMutex);
+                pendingWrites.erase(conn);
+            }
+        }
+    }
+}
+
+string Server::serializeResponse(const string& status, const string& data) {
+    return "STATUS:" + status + "\nDATA:" + data;
+}
+
+// Первая строка "ID:n" - запрос из конвейера: ответ помечается тем же id,
+// и клиент сопоставляет его со своим запросом, не полагаясь на порядок
+// receivedUs - когда пришли последние байты запроса: разница до начала исполнения идёт в QUEUE
+string Server::dispatchRequest(ClientConnection& conn, const string& frame, long long receivedUs, size_t& command) {
+    long long startedUs = steadyTimeUs();
+    metrics.addBytesIn(frame.size() + 5);
+    
+    string idLine;
+    string request;
+    if (frame.compare(0, 3, "ID:") == 0) {
+        size_t lineEnd = frame.find('\n');
+        idLine = frame.substr(0, lineEnd);
+        request = lineEnd != string::npos ? frame.substr(lineEnd + 1) : string();
+    } else {
+        request = frame;
+    }
+    command = ServerMetrics::commandIndex(request.substr(0, request.find('\n')));
+    if (currentDispatch) {
+        currentDispatch->idLine = idLine;
+        currentDispatch->command = command;
+        currentDispatch->startedUs = startedUs;
+    }
+    metrics.record(command, MetricPhase::QUEUE, startedUs - receivedUs);
+    Tracer::record("queue", "server", receivedUs, startedUs);
+    if (idLine.size() > MAX_REQUEST_ID_LENGTH) {
+        return serializeResponse("ERROR", "Request id too long");
+    }
+    
+    string response = admitRequest(conn, request);
+    if (dispatchDeferred) {
+        return string();
+    }
+    metrics.record(command, MetricPhase::EXECUTE, steadyTimeUs() - startedUs);
+    metrics.recordResult(command, response);
+    return frameResponse(conn, idLine, response);
+}
+
+// Сжимается кадр целиком, со строкой ID: клиент сначала распаковывает, потом разбирает
+string Server::frameResponse(ClientConnection& conn, const string& idLine, string response) {
+    if (!idLine.empty()) {
+        response = idLine + "\n" + response;
+    }
+    if (config.compressThresholdBytes > 0 && response.size() >= config.compressThresholdBytes &&
+        conn.compressResponses.load(memory_order_relaxed)) {
+        TraceSpan span("compress", "server");
+        string packed = block_codec::packFrame(response);
+        if (packed.size() < response.size()) {
+            metrics.addCompressed(response.size(), packed.size());
+            response.swap(packed);
+        }
+    }
+    return response;
+}
+
+void Server::serveRequest(const shared_ptr<ClientConnection>& conn, const string& frame, long long receivedUs) {
+    TraceRequest trace(receivedUs);
+    size_t command;
+    DeferredReply context;
+    if (conn->reactor >= 0 && conn->reactor == currentReactor) {
+        context.conn = conn;
+        context.reactor = conn->reactor;
+        currentDispatch = &context;
+    }
+    string response;
+    try {
+        response = dispatchRequest(*conn, frame, receivedUs, command);
+    } catch (...) {
+        currentDispatch = nullptr;
+        dispatchDeferred = false;
+        throw;
+    }
+    currentDispatch = nullptr;
+    trace.setName(ServerMetrics::commandName(command));
+    if (dispatchDeferred) {
+        dispatchDeferred = false;
+        // Без ID клиент сопоставляет ответы по порядку: следующие запросы ждут этот
+        if (context.idLine.empty()) conn->replyPending = true;
+        return;
+    }
+    long long writeStartedUs = steadyTimeUs();
+    sendToClient(conn, response);
+    metrics.record(command, MetricPhase::IO, steadyTimeUs() - writeStartedUs);
+}
+
+// Отказ происходит до разбора аргументов и обращения к базе
+string Server::admitRequest(ClientConnection& conn, const string& request) {
+    string command = request.substr(0, request.find('\n'));
+    
+    // Вёдра пользователя берутся по логину соединения, а не по аргументу команды
+    CommandClass commandClass;
+    if (RateLimiter::classify(command, commandClass)) {
+        string login;
+        {
+            lock_guard<mutex> lock(clientsMutex);
+            login = conn.login;
+        }
+        if (!rateLimiter.allow(conn.rateBuckets, login, commandClass, steadyTimeUs())) {
+            return serializeResponse("THROTTLED", "Too many requests, slow down");
+        }
+    }
+    
+    if (memoryPressure.load(memory_order_relaxed) && growsMemory(command)) {
+        ++shedRequests;
+        return serializeResponse("BUSY", "Server memory limit reached, retry later");
+    }
+    
+    RequestClass requestClass = AdmissionController::classify(command);
+    if (!admission.admit(requestClass)) {
+        return serializeResponse("BUSY", "Server overloaded, retry later");
+    }
+    if (currentDispatch) {
+        currentDispatch->requestClass = requestClass;
+    }
+    
+    string response;
+    try {
+        TraceSpan span("processRequest", "server");
+        response = processRequest(conn, request);
+    } catch (...) {
+        admission.finish(requestClass);
+        throw;
+    }
+    // Отложенный запрос занимает место до ответа: его освободит finishDeferred
+    if (!dispatchDeferred) {
+        admission.finish(requestClass);
+    }
+    return response;
+}
+
+// Заготовка для обработчика, который отдаёт работу другому потоку; nullptr - отложить нельзя,
+// и обработчик ждёт результата сам
+shared_ptr<DeferredReply> Server::prepareDeferred() {
+    return currentDispatch ? make_shared<DeferredReply>(*currentDispatch) : nullptr;
+}
+
+// Возвращается обработчиком вместо ответа, когда работа передана: ответа пока нет
+string Server::deferResponse() {
+    dispatchDeferred = true;
+    return string();
+}
+
+// Из любого потока. complete исполнит реактор-владелец, даже если клиент уже ушёл:
+// побочные эффекты запроса (ленты, почта) не должны теряться вместе с соединением
+void Server::completeDeferred(const shared_ptr<DeferredReply>& reply, function<string()> complete) {
+    pushToReactor(reply->reactor, ReactorEvent{reply->conn, string(), false, string(), reply, move(complete), false});
+}
+
+void Server::finishDeferred(Reactor* reactor, ReactorEvent& event) {
+    const DeferredReply& reply = *event.reply;
+    string response;
+    try {
+        response = event.complete ? event.complete() : event.frame;
+    } catch (...) {
+        response = serializeResponse("ERROR", "Internal server error");
+    }
+    admission.finish(reply.requestClass);
+    metrics.record(reply.command, MetricPhase::EXECUTE, steadyTimeUs() - reply.startedUs);
+    metrics.recordResult(reply.command, response);
+    
+    // Соединение могли закрыть, пока шла запись: тогда ответ отдавать некому
+    shared_ptr<ClientConnection> conn = event.conn.lock();
+    if (!conn) return;
+    auto it = reactor->connections.find(conn->socket);
+    if (it == reactor->connections.end() || it->second != conn) return;
+    
+    long long writeStartedUs = steadyTimeUs();
+    sendToClient(conn, frameResponse(*conn, reply.idLine, response));
+    metrics.record(reply.command, MetricPhase::IO, steadyTimeUs() - writeStartedUs);
+    if (conn->replyPending) {
+        conn->replyPending = false;
+        // Пока ответ ждали, сокет не читался: дочитываем и разбираем дальше
+        readFromConnection(reactor, conn);
+    }
+}
+
+string Server::processRequest(ClientConnection& conn, const string& request) {
+    stringstream ss(request);
+    string command;
+    getline(ss, command);
+    
+    if (command == "REGISTER") {
+        string login, password, name;
+        getline(ss, login);
+        getline(ss, password);
+        getline(ss, name);
+        return handleRegister(login, password, name);
+    }
+    else if (command == "LOGIN") {
+        string login, password;
+        getline(ss, login);
+        getline(ss, password);
+        return handleLogin(conn, login, password);
+    }
+    else if (command == "SEND_MESSAGE") {
+        string senderLogin, recipientLogin, text, type;
+        getline(ss, senderLogin);
+        getline(ss, recipientLogin);
+        getline(ss, text);
+        getline(ss, type);
+        return handleSendMessage(conn, senderLogin, recipientLogin, text, type);
+    }
+    else if (command == "GET_USERS") {
+        return handleGetUsers();
+    }
+    else if (command == "GET_MESSAGES") {
+        string login;
+        getline(ss, login);
+        return handleGetMessages(login);
+    }
+    else if (command == "STATS") {
+        string login;
+        getline(ss, login);
+        return handleStats(login);
+    }
+    else if (command == "LOGOUT") {
+        return handleLogout(conn);
+    }
+    else if (command == "HEARTBEAT") {
+        string login;
+        getline(ss, login);
+        return handleHeartbeat(conn, login);
+    }
+    else if (command == "GET_ONLINE") {
+        return handleGetOnline();
+    }
+    else if (command == "ADD_FRIEND" || command == "REMOVE_FRIEND") {
+        string login, friendLogin;
+        getline(ss, login);
+        getline(ss, friendLogin);
+        if (command == "ADD_FRIEND") return handleAddFriend(conn, login, friendLogin);
+        return handleRemoveFriend(conn, login, friendLogin);
+    }
+    else if (command == "FETCH_MAIL" || command == "GET_UNREAD") {
+        string login;
+        getline(ss, login);
+        if (command == "FETCH_MAIL") return handleFetchMail(conn, login);
+        return handleGetUnread(conn, login);
+    }
+    else if (command == "SLOW_CONSUMERS") {
+        return handleSlowConsumers();
+    }
+    else if (command == "LOAD") {
+        return handleLoad();
+    }
+    else if (command == "PING") {
+        return serializeResponse("SUCCESS", "PONG");
+    }
+    else if (command == "METRICS") {
+        return serializeResponse("SUCCESS", metrics.serialize());
+    }
+    else if (command == "MEMORY") {
+        return handleMemory();
+    }
+    else if (command == "EXPORT" || command == "IMPORT") {
+        string name;
+        getline(ss, name);
+        return command == "EXPORT" ? handleExport(conn, name) : handleImport(conn, name);
+    }
+    else if (command == "COMPRESS") {
+        // Согласование на соединение: старые клиенты COMPRESS не шлют и получают ответы как есть
+        string codec;
+        getline(ss, codec);
+        if (codec != "BLOCK" || config.compressThresholdBytes == 0) {
+            return serializeResponse("ERROR", "Compression is not available");
+        }
+        conn.compressResponses.store(true);
+        return serializeResponse("SUCCESS", "CODEC:BLOCK\nTHRESHOLD:" + to_string(config.compressThresholdBytes));
+    }
+    else if (command == "HISTORY") {
+        string login, from, to, query;
+        getline(ss, login);
+        getline(ss, from);
+        getline(ss, to);
+        getline(ss, query);
+        return handleHistory(conn, login, from, to, query);
+    }
+    else if (command == "ARCHIVE") {
+        return handleArchive(conn);
+    }
+    else if (command == "BACKUP") {
+        string name, mode;
+        getline(ss, name);
+        getline(ss, mode);
+        return handleBackup(conn, name, mode);
+    }
+    else if (command == "TRACE_FLUSH") {
+        // Путь только из конфигурации: клиент не выбирает, куда сервер пишет файлы
+        if (!Tracer::enabled()) {
+            return serializeResponse("ERROR", "Tracing is disabled");
+        }
+        long long written = Tracer::writeChromeTrace(config.tracePath);
+        if (written < 0) {
+            return serializeResponse("ERROR", "Failed to write trace file");
+        }
+        return serializeResponse("SUCCESS", to_string(written) + " events written to " + config.tracePath);
+    }
+    else if (command == "RATE_LIMITS") {
+        return handleRateLimits();
+    }
+    else if (command == "GET_FRIENDS") {
+        string login;
+        getline(ss, login);
+        return handleGetFriends(conn, login);
+    }
+    else if (command == "CREATE_ROOM" || command == "JOIN_ROOM" || command == "LEAVE_ROOM") {
+        string name, login;
+        getline(ss, name);
+        getline(ss, login);
+        if (command == "CREATE_ROOM") return handleCreateRoom(conn, name, login);
+        if (command == "JOIN_ROOM") return handleJoinRoom(conn, name, login);
+        return handleLeaveRoom(conn, name, login);
+    }
+    else if (command == "GET_ROOMS") {
+        string login;
+        getline(ss, login);
+        return handleGetRooms(conn, login);
+    }
+    else if (command == "GET_ROOM_MEMBERS") {
+        string name;
+        getline(ss, name);
+        return handleGetRoomMembers(name);
+    }
+    else {
+        return serializeResponse("ERROR", "Unknown command");
+    }
+}
+
+string Server::handleRegister(const string& login, const string& password, const string& name) {
+    if (db.addUser(login, password, name)) {
+        mailboxes.addUser(login);
+        return serializeResponse("SUCCESS", "User registered");
+    } else {
+        return serializeResponse("ERROR", "User already exists");
+    }
+}
+
+string Server::handleLogin(ClientConnection& conn, const string& login, const string& password) {
+    if (db.checkUserPassword(login, password)) {
+        if (!conn.login.empty()) {
+            presence.loggedOut(conn.login);
+        }
+        subscribe(conn, login);
+        presence.loggedIn(login, currentTimeMs());
+        // История ниже уже содержит всю личную почту
+        mailboxes.markAllRead(login, db.getMessageCount());
+        string usersData = handleGetUsers();
+        string messagesData = handleGetMessages(login);
+        return serializeResponse("SUCCESS", "USERS:" + usersData + "\nMESSAGES:" + messagesData);
+    } else {
+        return serializeResponse("ERROR", "Invalid login or password");
+    }
+}
+
+string Server::handleSendMessage(ClientConnection& conn, const string& senderLogin, const string& recipientLogin, 
                                  const string& text, const string& type) {
+    // Членство проверяется у того, кто вошёл в это соединение, а не у логина из запроса
+    bool roomMessage = (type == "ROOM");
+    if (roomMessage && (conn.login.empty() || conn.login != senderLogin)) {
+        return serializeResponse("ERROR", "Not logged in");
+    }
+    if (roomMessage && !rooms.isMember(recipientLogin, senderLogin)) {
+        return serializeResponse("ERROR", "Not a member of this room");
+    }
+    
     MessageData msg;
     msg.senderLogin = senderLogin;
     msg.recipientLogin = recipientLogin;
     msg.text = text;
     msg.type = type;
-    msg.timestamp = chrono::duration_cast<chrono::milliseconds>(
-        chrono::system_clock::now().time_since_epoch()).count();
+    msg.timestamp = currentTimeMs();
     
-    if (db.addMessage(msg)) {
-        return serializeResponse("SUCCESS", "Message sent");
-    } else {
+    // Реактор не ждёт диска: поток записи передаст id обратно, и ответ соберёт реактор
+    shared_ptr<DeferredReply> reply = prepareDeferred();
+    if (reply) {
+        shared_ptr<IngestRequest> request = make_shared<IngestRequest>();
+        request->message = msg;
+        request->traceId = Tracer::currentRequest();
+        int socket = conn.socket;
+        request->onWritten = [this, reply, msg, socket](long long id) {
+            completeDeferred(reply, [this, msg, id, socket] { return completeSend(msg, id, socket); });
+        };
+        if (!submitIngest(request)) {
+            return serializeResponse("BUSY", "Storage queue full, retry later");
+        }
+        return deferResponse();
+    }
+    
+    uint64_t messageId = 0;
+    IngestStatus status = ingestMessage(msg, messageId);
+    if (status == INGEST_FULL) {
+        return serializeResponse("BUSY", "Storage queue full, retry later");
+    }
+    return completeSend(msg, status == INGESTED ? static_cast<long long>(messageId) : -1, conn.socket);
+}
+
+// Сообщение уже в журнале (id < 0 - запись не удалась): раскладываем по лентам и рассылаем
+string Server::completeSend(const MessageData& msg, long long id, int excludeSocket) {
+    if (id < 0) {
         return serializeResponse("ERROR", "Failed to send message");
     }
+    uint64_t messageId = static_cast<uint64_t>(id);
+    if (msg.type == "PRIVATE" && !msg.recipientLogin.empty()) {
+        mailboxes.deliver(msg.recipientLogin, messageId);
+    }
+    addToTimelines(messageId, msg);
+    stats.record(msg.senderLogin, msg.recipientLogin,
+                 Message::typeFromString(msg.type), msg.timestamp);
+    if (msg.type == "ROOM") {
+        ostringstream frame;
+        frame << "EVENT:ROOM_MESSAGE\nDATA:" << msg.senderLogin << "|" << msg.recipientLogin << "|"
+              << msg.text << "|" << msg.type << "|" << msg.timestamp;
+        enqueueRoomDelivery(msg.recipientLogin, frame.str(), excludeSocket);
+    }
+    return serializeResponse("SUCCESS", "Message sent");
 }
 
 string Server::handleGetUsers() {
     vector<UserData> users = db.getAllUsers();
+    TraceSpan span("formatUsers", "server");
     stringstream ss;
     for (size_t i = 0; i < users.size(); ++i) {
         if (i > 0) ss << "|";
@@ -277,7 +1725,22 @@ string Server::handleGetUsers() {
 }
 
 string Server::handleGetMessages(const string& login) {
-    vector<MessageData> messages = db.getMessagesForUser(login);
+    vector<uint64_t> ids = timelines.assemble(login, rooms.getRoomsOf(login));
+    return formatMessages(db.getMessagesByIds(ids));
+}
+
+void Server::addToTimelines(uint64_t id, const MessageData& msg) {
+    if (msg.type == "ROOM") {
+        timelines.addRoom(msg.recipientLogin, id);
+    } else if (msg.type == "SYSTEM" || msg.recipientLogin.empty()) {
+        timelines.addPublic(id);
+    } else {
+        timelines.addPrivate(msg.senderLogin, msg.recipientLogin, id);
+    }
+}
+
+string Server::formatMessages(const vector<MessageData>& messages) {
+    TraceSpan span("formatMessages", "server");
     stringstream ss;
     for (size_t i = 0; i < messages.size(); ++i) {
         if (i > 0) ss << "\n";
@@ -290,3 +1753,494 @@ string Server::handleGetMessages(const string& login) {
     return ss.str();
 }
 
+string Server::handleStats(const string& login) {
+    return serializeResponse("SUCCESS", stats.serialize(login));
+}
+
+// Членство в комнатах меняет и показывает только сам пользователь: логин в теле запроса
+// обязан совпасть с тем, под которым вошло соединение
+string Server::handleCreateRoom(const ClientConnection& conn, const string& name, const string& login) {
+    if (conn.login.empty() || conn.login != login) {
+        return serializeResponse("ERROR", "Not logged in");
+    }
+    if (!RoomManager::isValidRoomName(name)) {
+        return serializeResponse("ERROR", "Invalid room name");
+    }
+    if (!db.userExists(login)) {
+        return serializeResponse("ERROR", "Unknown user");
+    }
+    if (!rooms.createRoom(name, login)) {
+        return serializeResponse("ERROR", "Room already exists");
+    }
+    stats.roomOpened(name);
+    return serializeResponse("SUCCESS", "Room created");
+}
+
+string Server::handleJoinRoom(const ClientConnection& conn, const string& name, const string& login) {
+    if (conn.login.empty() || conn.login != login) {
+        return serializeResponse("ERROR", "Not logged in");
+    }
+    if (!rooms.roomExists(name)) {
+        return serializeResponse("ERROR", "Room not found");
+    }
+    if (rooms.isMember(name, login)) {
+        return serializeResponse("ERROR", "Already a member");
+    }
+    if (!db.userExists(login) || !rooms.joinRoom(name, login)) {
+        return serializeResponse("ERROR", "Failed to join room");
+    }
+    return serializeResponse("SUCCESS", "Joined room");
+}
+
+string Server::handleLeaveRoom(const ClientConnection& conn, const string& name, const string& login) {
+    if (conn.login.empty() || conn.login != login) {
+        return serializeResponse("ERROR", "Not logged in");
+    }
+    if (!rooms.leaveRoom(name, login)) {
+        return serializeResponse("ERROR", "Not a member of this room");
+    }
+    return serializeResponse("SUCCESS", "Left room");
+}
+
+string Server::handleGetRooms(const ClientConnection& conn, const string& login) {
+    if (conn.login.empty() || conn.login != login) {
+        return serializeResponse("ERROR", "Not logged in");
+    }
+    vector<pair<string, size_t>> list = rooms.listRooms();
+    set<string> joined = rooms.getRoomsOf(login);
+    stringstream ss;
+    for (size_t i = 0; i < list.size(); ++i) {
+        if (i > 0) ss << "|";
+        ss << list[i].first << ":" << list[i].second << ":" << (joined.count(list[i].first) ? 1 : 0);
+    }
+    return serializeResponse("SUCCESS", ss.str());
+}
+
+string Server::handleGetRoomMembers(const string& name) {
+    if (!rooms.roomExists(name)) {
+        return serializeResponse("ERROR", "Room not found");
+    }
+    vector<string> members = rooms.getMembers(name);
+    stringstream ss;
+    for (size_t i = 0; i < members.size(); ++i) {
+        if (i > 0) ss << ",";
+        ss << members[i];
+    }
+    return serializeResponse("SUCCESS", ss.str());
+}
+
+string Server::handleLogout(ClientConnection& conn) {
+    if (conn.login.empty()) {
+        return serializeResponse("ERROR", "Not logged in");
+    }
+    presence.loggedOut(conn.login);
+    unsubscribe(conn);
+    return serializeResponse("SUCCESS", "Logged out");
+}
+
+string Server::handleHeartbeat(ClientConnection& conn, const string& login) {
+    if (conn.login.empty() || conn.login != login) {
+        return serializeResponse("ERROR", "Not logged in");
+    }
+    presence.heartbeat(login, currentTimeMs());
+    return serializeResponse("SUCCESS", "OK");
+}
+
+string Server::handleGetOnline() {
+    vector<string> online = presence.getOnlineUsers();
+    stringstream ss;
+    for (size_t i = 0; i < online.size(); ++i) {
+        if (i > 0) ss << ",";
+        ss << online[i];
+    }
+    return serializeResponse("SUCCESS", ss.str());
+}
+
+// Список друзей правит и читает только его владелец, вошедший на этом соединении
+string Server::handleAddFriend(const ClientConnection& conn, const string& login, const string& friendLogin) {
+    if (conn.login.empty() || conn.login != login) {
+        return serializeResponse("ERROR", "Not logged in");
+    }
+    if (login == friendLogin) {
+        return serializeResponse("ERROR", "Cannot add yourself");
+    }
+    if (friends.hasFriend(login, friendLogin)) {
+        return serializeResponse("ERROR", "Already a friend");
+    }
+    if (!db.userExists(login) || !db.userExists(friendLogin)) {
+        return serializeResponse("ERROR", "User not found");
+    }
+    if (!friends.addFriend(login, friendLogin)) {
+        return serializeResponse("ERROR", "Failed to add friend");
+    }
+    return serializeResponse("SUCCESS", "Friend added");
+}
+
+string Server::handleRemoveFriend(const ClientConnection& conn, const string& login, const string& friendLogin) {
+    if (conn.login.empty() || conn.login != login) {
+        return serializeResponse("ERROR", "Not logged in");
+    }
+    if (!friends.removeFriend(login, friendLogin)) {
+        return serializeResponse("ERROR", "Not a friend");
+    }
+    return serializeResponse("SUCCESS", "Friend removed");
+}
+
+string Server::handleGetFriends(const ClientConnection& conn, const string& login) {
+    if (conn.login.empty() || conn.login != login) {
+        return serializeResponse("ERROR", "Not logged in");
+    }
+    vector<string> list = friends.getFriends(login);
+    stringstream ss;
+    for (size_t i = 0; i < list.size(); ++i) {
+        if (i > 0) ss << ",";
+        ss << list[i];
+    }
+    return serializeResponse("SUCCESS", ss.str());
+}
+
+string Server::handleFetchMail(ClientConnection& conn, const string& login) {
+    if (conn.login.empty() || conn.login != login) {
+        return serializeResponse("ERROR", "Not logged in");
+    }
+    
+    MailboxFetch fetch = mailboxes.fetchUnread(login);
+    vector<MessageData> mail;
+    if (fetch.overflowed) {
+        // Кольцо переполнено: вытесненные id добираем из индекса журнала
+        for (auto& item : db.scanMessages(fetch.scanFrom, fetch.scanTo)) {
+            if (item.second.type == "PRIVATE" && item.second.recipientLogin == login) {
+                mail.push_back(item.second);
+            }
+        }
+    }
+    vector<MessageData> recent = db.getMessagesByIds(fetch.ids);
+    mail.insert(mail.end(), recent.begin(), recent.end());
+    return serializeResponse("SUCCESS", formatMessages(mail));
+}
+
+string Server::handleGetUnread(ClientConnection& conn, const string& login) {
+    if (conn.login.empty() || conn.login != login) {
+        return serializeResponse("ERROR", "Not logged in");
+    }
+    return serializeResponse("SUCCESS", to_string(mailboxes.unreadCount(login)));
+}
+
+string Server::handleLoad() {
+    ostringstream oss;
+    oss << admission.serialize();
+    oss << "\nREACTORS:" << reactors.size();
+    for (const auto& reactor : reactors) {
+        oss << "\nREACTOR_" << reactor->index << ":ACCEPTED:" << reactor->accepted.load()
+            << ":REQUESTS:" << reactor->requests.load();
+    }
+    {
+        lock_guard<mutex> lock(idleMutex);
+        oss << "\nIDLE_TIMERS:" << idleTimers.size();
+        oss << "\nIDLE_PINGS:" << idlePings;
+        oss << "\nIDLE_REAPED:" << idleReaped;
+    }
+    return serializeResponse("SUCCESS", oss.str());
+}
+
+// Раз в metricsDumpIntervalMs (с шагом цикла присутствия) - снимок METRICS в файл или в cerr.
+// Файл заменяется целиком через rename, читатель не увидит половину снимка
+void Server::dumpMetrics(bool force) {
+    if (config.metricsDumpIntervalMs <= 0) return;
+    long long nowMs = steadyTimeUs() / 1000;
+    if (!force && nowMs - lastMetricsDumpMs < config.metricsDumpIntervalMs) return;
+    lastMetricsDumpMs = nowMs;
+    
+    string snapshot = metrics.serialize();
+    if (config.metricsDumpPath.empty()) {
+        cerr << "--- METRICS ---\n" << snapshot << endl;
+        return;
+    }
+    string tempPath = config.metricsDumpPath + ".tmp";
+    {
+        ofstream file(tempPath, ios::trunc);
+        if (!file.is_open()) return;
+        file << snapshot << "\n";
+        if (!file.good()) return;
+    }
+    rename(tempPath.c_str(), config.metricsDumpPath.c_str());
+}
+
+string Server::handleRateLimits() {
+    return serializeResponse("SUCCESS", rateLimiter.serialize());
+}
+
+// Оценка по подсистемам. Каждая считается под своим замком, так что сумма - не атомарный
+// снимок, но для порядка величин этого хватает. Содержимое сообщений в очередях записи
+// и рассылки и буферы ядра не учитываются
+MemoryReport Server::collectMemory() {
+    vector<shared_ptr<ClientConnection>> connections;
+    size_t subscriptionBytes;
+    {
+        lock_guard<mutex> lock(clientsMutex);
+        for (const auto& client : clients) {
+            connections.push_back(client.second);
+        }
+        subscriptionBytes = memory_usage::heapBytes(subscriptions);
+    }
+    
+    size_t connectionBytes = connections.size() * (sizeof(ClientConnection) + memory_usage::TREE_NODE_OVERHEAD +
+                                                   sizeof(pair<const int, shared_ptr<ClientConnection>>));
+    size_t outputBytes = 0;
+    for (const auto& conn : connections) {
+        {
+            lock_guard<mutex> lock(clientsMutex);
+            connectionBytes += memory_usage::heapBytes(conn->login);
+        }
+        connectionBytes += conn->inputBufferBytes.load(memory_order_relaxed);
+        lock_guard<mutex> lock(conn->writeMutex);
+        outputBytes += conn->output.memoryUsage();
+    }
+    
+    size_t deliveryBytes;
+    {
+        lock_guard<mutex> lock(deliveryMutex);
+        deliveryBytes = deliveryQueue.size() * sizeof(RoomDelivery);
+    }
+    size_t timerBytes;
+    {
+        lock_guard<mutex> lock(idleMutex);
+        timerBytes = idleTimers.memoryUsage();
+    }
+    
+    MemoryReport report;
+    report.add("CONNECTIONS", connectionBytes);
+    report.add("OUTPUT_QUEUES", outputBytes);
+    report.add("SUBSCRIPTIONS", subscriptionBytes);
+    report.add("DELIVERY_QUEUE", deliveryBytes);
+    report.add("INGEST_QUEUE", ingestQueue.memoryUsage());
+    report.add("MESSAGE_INDEX", db.memoryUsage());
+    report.add("TIMELINES", timelines.memoryUsage());
+    report.add("MAILBOXES", mailboxes.memoryUsage());
+    report.add("ROOMS", rooms.memoryUsage());
+    report.add("FRIENDS", friends.memoryUsage());
+    report.add("PRESENCE", presence.memoryUsage());
+    report.add("STATS", stats.memoryUsage());
+    report.add("RATE_LIMITS", rateLimiter.memoryUsage());
+    report.add("IDLE_TIMERS", timerBytes);
+    report.add("METRICS", metrics.memoryUsage());
+    report.add("TRACE_BUFFER", Tracer::memoryUsage());
+    return report;
+}
+
+// При превышении мягкого предела сбрасываются события из очередей соединений (их можно
+// дополучить запросом), а запросы, растящие память, получают BUSY до возврата под предел
+void Server::checkMemoryLimit() {
+    if (config.memorySoftLimitBytes == 0) return;
+    size_t total = collectMemory().total();
+    
+    bool pressure = memoryPressure.load(memory_order_relaxed);
+    if (!pressure && total > config.memorySoftLimitBytes) {
+        memoryPressure.store(true);
+        cerr << "Memory soft limit exceeded: " << total << " > " << config.memorySoftLimitBytes << " bytes" << endl;
+    } else if (pressure && total < static_cast<size_t>(config.memorySoftLimitBytes * MEMORY_RECOVERY_RATIO)) {
+        memoryPressure.store(false);
+        cerr << "Memory back under soft limit: " << total << " bytes" << endl;
+    }
+    if (!memoryPressure.load(memory_order_relaxed)) return;
+    
+    vector<shared_ptr<ClientConnection>> connections;
+    {
+        lock_guard<mutex> lock(clientsMutex);
+        for (const auto& client : clients) {
+            connections.push_back(client.second);
+        }
+    }
+    for (const auto& conn : connections) {
+        lock_guard<mutex> lock(conn->writeMutex);
+        shedEvents += conn->output.dropQueuedEvents();
+    }
+}
+
+// Команды администратора: только через unix-сокет, то есть с той же машины, и только
+// по имени внутри каталога из конфигурации - путь клиент не выбирает
+bool Server::resolveAdminPath(const ClientConnection& conn, const string& directory, const string& name,
+                              string& path, string& error) {
+    if (!conn.local) {
+        error = "Administrative commands require a unix socket connection";
+        return false;
+    }
+    if (directory.empty()) {
+        error = "Directory for this command is not configured";
+        return false;
+    }
+    if (name.empty() || name == "." || name == ".." || name.find_first_of("/\\") != string::npos) {
+        error = "Invalid file name";
+        return false;
+    }
+    path = directory + "/" + name;
+    return true;
+}
+
+string Server::handleExport(const ClientConnection& conn, const string& name) {
+    string path, error;
+    if (!resolveAdminPath(conn, config.exportDirectory, name, path, error)) {
+        return serializeResponse("ERROR", error);
+    }
+    long long exported = db.exportMessages(path);
+    if (exported < 0) {
+        return serializeResponse("ERROR", "Failed to write export file");
+    }
+    return serializeResponse("SUCCESS", "EXPORTED:" + to_string(exported));
+}
+
+// Импортированные сообщения получают новые id после уже записанных и раскладываются
+// по лентам как обычные; почтовые ящики не трогаются - это история, а не новая почта.
+// Административные команды приходят только через unix-сокет, а такие соединения всегда
+// в своём потоке: импорт занимает его, реакторы и прочие соединения не ждут
+string Server::handleImport(const ClientConnection& conn, const string& name) {
+    string path, error;
+    if (!resolveAdminPath(conn, config.exportDirectory, name, path, error)) {
+        return serializeResponse("ERROR", error);
+    }
+    
+    size_t threads = max<size_t>(1, thread::hardware_concurrency());
+    size_t rejected = 0;
+    long long imported = db.importMessages(path, threads, rejected, [this](uint64_t id, const MessageData& msg) {
+        addToTimelines(id, msg);
+        stats.record(msg.senderLogin, msg.recipientLogin, Message::typeFromString(msg.type), msg.timestamp);
+    });
+    if (imported < 0) {
+        return serializeResponse("ERROR", "Failed to import " + name);
+    }
+    return serializeResponse("SUCCESS", "IMPORTED:" + to_string(imported) + "\nREJECTED:" + to_string(rejected));
+}
+
+// Копия снимается без остановки записи: Database держит писателей только на время,
+// пока фиксирует длины файлов, остальное читается из уже открытых потоков
+string Server::handleBackup(const ClientConnection& conn, const string& name, const string& mode) {
+    string path, error;
+    if (!resolveAdminPath(conn, config.backupDirectory, name, path, error)) {
+        return serializeResponse("ERROR", error);
+    }
+    if (!mode.empty() && mode != "FULL" && mode != "INCREMENTAL") {
+        return serializeResponse("ERROR", "Mode must be FULL or INCREMENTAL");
+    }
+    BackupResult result;
+    if (!backups.createBackup(name, mode == "INCREMENTAL", result, error)) {
+        return serializeResponse("ERROR", error);
+    }
+    ostringstream oss;
+    oss << "BACKUP:" << result.name;
+    oss << "\nBASE:" << result.base;
+    oss << "\nMESSAGES:" << result.messageCount;
+    oss << "\nCOPIED_BYTES:" << result.copiedBytes;
+    oss << "\nSTORED_BYTES:" << result.storedBytes;
+    oss << "\nLINKED_BYTES:" << result.linkedBytes;
+    return serializeResponse("SUCCESS", oss.str());
+}
+
+// Внеочередной проход хранения; обычно его делает retentionLoop по расписанию
+string Server::handleArchive(const ClientConnection& conn) {
+    if (!conn.local) {
+        return serializeResponse("ERROR", "Administrative commands require a unix socket connection");
+    }
+    if (config.retention.empty()) {
+        return serializeResponse("ERROR", "Retention is not configured");
+    }
+    long long archived = applyRetention();
+    if (archived < 0) {
+        return serializeResponse("ERROR", "Failed to archive expired messages");
+    }
+    return serializeResponse("SUCCESS", "ARCHIVED:" + to_string(archived) +
+                                        "\nTOTAL_ARCHIVED:" + to_string(archivedMessages.load()));
+}
+
+// HISTORY: login, начало и конец периода в мс (пусто - без границы), подстрока текста.
+// Единственный запрос, который читает архив; видимость та же, что у GET_MESSAGES.
+// С реактора проход уходит в historyThreads, ответ вернётся через inbox
+string Server::handleHistory(ClientConnection& conn, const string& login, const string& from, const string& to,
+                             const string& query) {
+    if (conn.login.empty() || conn.login != login) {
+        return serializeResponse("ERROR", "Not logged in");
+    }
+    long long fromMs = from.empty() ? 0 : strtoll(from.c_str(), nullptr, 10);
+    long long toMs = to.empty() ? numeric_limits<long long>::max() : strtoll(to.c_str(), nullptr, 10);
+    
+    shared_ptr<DeferredReply> reply = prepareDeferred();
+    if (!reply) {
+        return runHistory(login, fromMs, toMs, query);
+    }
+    {
+        lock_guard<mutex> lock(historyMutex);
+        if (!running.load()) {
+            return serializeResponse("BUSY", "Server is stopping");
+        }
+        historyJobs.push([this, reply, login, fromMs, toMs, query] {
+            string response;
+            try {
+                response = runHistory(login, fromMs, toMs, query);
+            } catch (...) {
+                response = serializeResponse("ERROR", "Internal server error");
+            }
+            completeDeferred(reply, [response] { return response; });
+        });
+    }
+    historyCv.notify_one();
+    return deferResponse();
+}
+
+string Server::runHistory(const string& login, long long fromMs, long long toMs, const string& query) {
+    set<string> memberOf = rooms.getRoomsOf(login);
+    
+    auto visible = [&](const MessageData& msg) {
+        if (!query.empty() && msg.text.find(query) == string::npos) return false;
+        if (msg.type == "ROOM") return memberOf.count(msg.recipientLogin) > 0;
+        return msg.type == "SYSTEM" || msg.senderLogin == login || msg.recipientLogin == login ||
+               (msg.type == "PUBLIC" && msg.recipientLogin.empty());
+    };
+    vector<MessageData> messages;
+    for (auto& item : db.readHistory(fromMs, toMs, visible, HISTORY_MAX_MESSAGES)) {
+        messages.push_back(move(item.second));
+    }
+    return serializeResponse("SUCCESS", formatMessages(messages));
+}
+
+// Первые строки - итог и режим нехватки, далее подсистемы: NAME:bytes
+string Server::handleMemory() {
+    MemoryReport report = collectMemory();
+    ostringstream oss;
+    oss << "TOTAL:" << report.total();
+    oss << "\nSOFT_LIMIT:" << config.memorySoftLimitBytes;
+    oss << "\nPRESSURE:" << (memoryPressure.load() ? 1 : 0);
+    oss << "\nSHED_REQUESTS:" << shedRequests.load();
+    oss << "\nSHED_EVENTS:" << shedEvents.load();
+    for (const auto& entry : report.getEntries()) {
+        oss << "\n" << entry.first << ":" << entry.second;
+    }
+    return serializeResponse("SUCCESS", oss.str());
+}
+
+// Первая строка - число отключённых по переполнению, далее отстающие соединения:
+// login|queuedBytes|highWaterBytes|droppedEvents|coalescedEvents
+string Server::handleSlowConsumers() {
+    vector<shared_ptr<ClientConnection>> connections;
+    {
+        lock_guard<mutex> lock(clientsMutex);
+        for (const auto& client : clients) {
+            connections.push_back(client.second);
+        }
+    }
+    
+    ostringstream oss;
+    oss << "DISCONNECTED:" << slowConsumerDisconnects.load();
+    for (const auto& conn : connections) {
+        string login;
+        {
+            lock_guard<mutex> lock(clientsMutex);
+            login = conn->login;
+        }
+        lock_guard<mutex> lock(conn->writeMutex);
+        const OutputQueueCounters& counters = conn->output.getCounters();
+        if (counters.queuedBytes == 0 && counters.droppedEvents == 0 && counters.coalescedEvents == 0) continue;
+        oss << "\n" << (login.empty() ? "-" : login) << "|" << counters.queuedBytes << "|"
+            << counters.highWaterBytes << "|" << counters.droppedEvents << "|" << counters.coalescedEvents;
+    }
+    return serializeResponse("SUCCESS", oss.str());
+}
+
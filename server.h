@@ -6,39 +6,317 @@
 #include <atomic>
 #include <vector>
 #include <mutex>
+#include <condition_variable>
+#include <queue>
+#include <map>
 #include <set>
+#include <memory>
+#include <unordered_map>
+#include <future>
+#include <functional>
 #include "database.h"
+#include "stats.h"
+#include "rooms.h"
+#include "presence.h"
+#include "friends.h"
+#include "mailbox.h"
+#include "timeline.h"
+#include "output_queue.h"
+#include "admission.h"
+#include "rate_limiter.h"
+#include "timer_wheel.h"
+#include "shm_channel.h"
+#include "mpsc_queue.h"
+#include "metrics.h"
+#include "memory_usage.h"
+#include "backup.h"
 
 using namespace std;
 
+// Параметры сервера, задаются при запуске
+struct ServerConfig {
+    size_t mailboxCapacity = 256;     // id личных сообщений в кольце на получателя
+    size_t outputQueueBytes = 1024 * 1024;   // предел неотправленных байт на соединение
+    SlowConsumerPolicy slowConsumerPolicy = SlowConsumerPolicy::DROP_OLDEST;
+    AdmissionLimits admission;
+    RateLimitConfig rateLimits;
+    int listenBacklog = 128;
+    long long idleTimeoutMs = 60000;    // тишина до EVENT:PING, 0 - не следить
+    long long pongTimeoutMs = 30000;    // ожидание любого запроса после PING
+    int keepaliveIdleSec = 60;          // TCP keepalive, 0 - не включать
+    int keepaliveIntervalSec = 10;
+    int keepaliveCount = 3;
+    string unixSocketPath;              // второй слушатель для клиентов на той же машине
+    size_t reactorCount = 0;            // 0 - поток на соединение, иначе реакторы epoll с SO_REUSEPORT
+    size_t ingestQueueCapacity = 4096;  // сообщений, ждущих записи на диск
+    long long metricsDumpIntervalMs = 0;    // 0 - не сбрасывать METRICS периодически
+    string metricsDumpPath;             // пусто - в cerr
+    size_t traceSampleEvery = 0;        // трассировать каждый N-й запрос, 0 - выключено
+    size_t traceBufferEvents = 65536;   // кольцо отрезков; старые затираются новыми
+    string tracePath = "trace.json";    // куда пишут TRACE_FLUSH и остановка сервера
+    size_t memorySoftLimitBytes = 0;    // оценка кучи выше - сброс событий и отказ растущим запросам
+    string exportDirectory;             // каталог файлов EXPORT/IMPORT; пусто - команды выключены
+    string backupDirectory;             // каталог копий BACKUP; пусто - команда выключена
+    size_t compressThresholdBytes = 4096;   // ответ длиннее сжимается, если клиент согласен; 0 - не сжимать
+    RetentionPolicy retention;          // сроки по типам сообщений; пусто - всё хранится в журнале
+    long long retentionIntervalMs = 3600000;    // как часто искать устаревшие сообщения
+};
+
+struct ClientConnection {
+    int socket;
+    string login;
+    mutex writeMutex;
+    OutputQueue output;     // под writeMutex
+    bool closed;            // под writeMutex: сокет закрыт, писать нельзя
+    RateBuckets rateBuckets;
+    bool pingSent;          // под idleMutex
+    bool local;             // пришло через unix-сокет: разрешён SHM_ATTACH
+    int reactor;            // индекс реактора-владельца, -1 - свой поток
+    string inputBuffer;     // только поток, читающий сокет: реактор или свой поток соединения
+    long long lastReadUs;   // там же: когда в inputBuffer легли последние байты
+    atomic<size_t> inputBufferBytes;    // ёмкость inputBuffer для MEMORY: сам буфер читать из чужого потока нельзя
+    atomic<bool> compressResponses;     // клиент прислал COMPRESS и умеет разбирать кадры "Z:"
+    bool replyPending;      // только поток реактора: отложен ответ без ID, следующие запросы ждут его
+    bool readPaused;        // только поток реактора: EPOLLIN снят до ответа или разгрузки очереди
+    bool readBlocked;       // под writeMutex: чтение стоит, пока очередь выше предела
+    condition_variable drained;     // будит свой поток соединения, когда очередь ушла ниже предела
+
+    ClientConnection(int socket, bool local)
+        : socket(socket), closed(false), pingSent(false), local(local), reactor(-1), lastReadUs(0),
+          inputBufferBytes(0), compressResponses(false), replyPending(false), readPaused(false),
+          readBlocked(false) {}
+};
+
+// Запрос, ответ на который допишет не поток реактора: заготовка снимается при разборе,
+// а ответ собирается и уходит, когда реактор достанет завершение из своего inbox
+struct DeferredReply {
+    weak_ptr<ClientConnection> conn;
+    string idLine;
+    size_t command = 0;
+    long long startedUs = 0;
+    RequestClass requestClass = RequestClass::EXEMPT;
+    int reactor = -1;
+};
+
+// Кадр для соединения чужого реактора: пишет только поток-владелец
+struct ReactorEvent {
+    weak_ptr<ClientConnection> conn;
+    string frame;
+    bool isEvent;
+    string coalesceKey;
+    shared_ptr<DeferredReply> reply;    // не пусто - завершение отложенного запроса
+    function<string()> complete;        // доделывает запрос в потоке реактора и возвращает ответ
+    bool resume;                        // очередь соединения разошлась: снова читать запросы
+};
+
+// Реактор владеет своим слушателем SO_REUSEPORT, epoll и соединениями;
+// другие потоки общаются с ним только через inbox и wakeFd
+struct Reactor {
+    size_t index;
+    int listenSocket;
+    int epollFd;
+    int wakeFd;
+    thread worker;
+    MpscQueue<ReactorEvent> inbox;
+    atomic<bool> wakePending;
+    unordered_map<int, shared_ptr<ClientConnection>> connections;
+    atomic<size_t> accepted;
+    atomic<size_t> requests;
+
+    explicit Reactor(size_t index)
+        : index(index), listenSocket(-1), epollFd(-1), wakeFd(-1), wakePending(false), accepted(0), requests(0) {}
+};
+
+// Задание рассылки: исполняется потоком доставки, а не потоком отправителя
+struct RoomDelivery {
+    string room;
+    string frame;
+    int excludeSocket;
+};
+
+// Сообщение на пути к потоку записи; обработчик ждёт id в result (-1 - ошибка записи).
+// Из реактора не ждут: поток записи вызывает onWritten, и тот передаёт завершение реактору
+struct IngestRequest {
+    MessageData message;
+    promise<long long> result;
+    function<void(long long)> onWritten;
+    uint64_t traceId = 0;       // запрос под трассировкой, от имени которого записано сообщение
+};
+
 class Server {
 private:
+    enum IngestStatus {
+        INGESTED,
+        INGEST_FULL,
+        INGEST_FAILED
+    };
+
     int serverSocket;
+    int unixSocket;
     uint16_t port;
+    ServerConfig config;
     Database db;
+    MessageStats stats;
+    RoomManager rooms;
+    PresenceTracker presence;
+    FriendGraph friends;
+    MailboxManager mailboxes;
+    TimelineService timelines;
+    AdmissionController admission;
+    RateLimiter rateLimiter;
+    BackupManager backups;
+    ServerMetrics metrics;
+    long long lastMetricsDumpMs;    // только поток присутствия
     atomic<bool> running{false};
     thread serverThread;
-    set<int> clientSockets;
+    thread unixServerThread;
+    vector<unique_ptr<Reactor>> reactors;
+    map<int, shared_ptr<ClientConnection>> clients;
+    unordered_map<string, set<shared_ptr<ClientConnection>>> subscriptions;
     mutex clientsMutex;
-    
-    void serverLoop();
+
+    thread deliveryThread;
+    queue<RoomDelivery> deliveryQueue;
+    mutex deliveryMutex;
+    condition_variable deliveryCv;
+
+    thread presenceThread;
+    mutex presenceWaitMutex;
+    condition_variable presenceCv;
+
+    thread writerThread;
+    set<shared_ptr<ClientConnection>> pendingWrites;
+    mutex writerMutex;
+    condition_variable writerCv;
+    atomic<size_t> slowConsumerDisconnects{0};
+
+    thread storageThread;
+    BoundedMpscQueue<shared_ptr<IngestRequest>> ingestQueue;
+    mutex storageMutex;
+    condition_variable storageCv;
+    atomic<bool> storageIdle{false};
+    atomic<bool> storageStopped{false};
+
+    TimerWheel idleTimers;      // по сокету; под idleMutex
+    mutex idleMutex;
+    size_t idlePings;
+    size_t idleReaped;
+
+    // Мягкий предел памяти проверяет поток присутствия раз в тик
+    atomic<bool> memoryPressure{false};
+    atomic<size_t> shedRequests{0};
+    atomic<size_t> shedEvents{0};
+
+    // Перенос устаревших сообщений в архив: свой поток, чтобы долгий проход журнала
+    // не задерживал тики присутствия
+    thread retentionThread;
+    atomic<size_t> archivedMessages{0};
+
+    // HISTORY с соединений реакторов идёт в этих потоках: проход журнала и архива
+    // не должен останавливать остальные соединения реактора. Только при реакторах
+    vector<thread> historyThreads;
+    queue<function<void()>> historyJobs;
+    mutex historyMutex;
+    condition_variable historyCv;
+
+    bool startTcpListener();
+    bool startUnixListener();
+    void serverLoop(int listenSocket, bool tcp);
+    void deliveryLoop();
+    void presenceLoop();
+    void writerLoop();
+    void storageLoop();
+    void retentionLoop();
+    void historyLoop();
+    long long applyRetention();
+    IngestStatus ingestMessage(const MessageData& msg, uint64_t& id);
+    bool submitIngest(const shared_ptr<IngestRequest>& request);
+    string completeSend(const MessageData& msg, long long id, int excludeSocket);
+    void reapIdleConnections();
+    void touchConnection(ClientConnection& conn);
+    void configureKeepalive(int clientSocket);
+    void publishPresence(const vector<PresenceChange>& changes);
+    void sendToLogins(const vector<pair<string, string>>& framesByLogin);
+    shared_ptr<ClientConnection> registerConnection(int clientSocket, bool tcp, int reactor = -1);
+    void closeConnection(const shared_ptr<ClientConnection>& conn);
     void handleClient(int clientSocket);
-    string processRequest(const string& request);
+    bool startReactors();
+    void stopReactors();
+    void releaseReactors();
+    void reactorLoop(Reactor* reactor);
+    void acceptOnReactor(Reactor* reactor);
+    void readFromConnection(Reactor* reactor, const shared_ptr<ClientConnection>& conn);
+    void postToReactor(const shared_ptr<ClientConnection>& conn, const string& frame, bool isEvent,
+                       const string& coalesceKey);
+    void pushToReactor(int index, ReactorEvent&& event);
+    bool serveBuffered(Reactor* reactor, const shared_ptr<ClientConnection>& conn);
+    void dropFromReactor(Reactor* reactor, const shared_ptr<ClientConnection>& conn);
+    void updateReading(Reactor* reactor, const shared_ptr<ClientConnection>& conn);
+    bool outputBacklogged(ClientConnection& conn);
+    bool waitForOutput(ClientConnection& conn);
+    void wakeReader(const shared_ptr<ClientConnection>& conn);
+    void abortWrites(const shared_ptr<ClientConnection>& conn);
+    shared_ptr<DeferredReply> prepareDeferred();
+    string deferResponse();
+    void completeDeferred(const shared_ptr<DeferredReply>& reply, function<string()> complete);
+    void finishDeferred(Reactor* reactor, ReactorEvent& event);
+    string frameResponse(ClientConnection& conn, const string& idLine, string response);
+    bool serveSharedMemory(const shared_ptr<ClientConnection>& conn, const string& name);
+    string dispatchRequest(ClientConnection& conn, const string& frame, long long receivedUs, size_t& command);
+    void serveRequest(const shared_ptr<ClientConnection>& conn, const string& frame, long long receivedUs);
+    void dumpMetrics(bool force);
+    MemoryReport collectMemory();
+    void checkMemoryLimit();
+    string admitRequest(ClientConnection& conn, const string& request);
+    string processRequest(ClientConnection& conn, const string& request);
     string serializeResponse(const string& status, const string& data = "");
-    void sendToClient(int clientSocket, const string& message);
-    string receiveFromClient(int clientSocket);
-    
+    void sendToClient(const shared_ptr<ClientConnection>& conn, const string& message, bool isEvent = false,
+                      const string& coalesceKey = "");
+    bool receiveFromClient(ClientConnection& conn, string& request);
+    void subscribe(ClientConnection& conn, const string& login);
+    void unsubscribe(ClientConnection& conn);
+    void enqueueRoomDelivery(const string& room, const string& frame, int excludeSocket);
+
     string handleRegister(const string& login, const string& password, const string& name);
-    string handleLogin(const string& login, const string& password);
-    string handleSendMessage(const string& senderLogin, const string& recipientLogin, 
+    string handleLogin(ClientConnection& conn, const string& login, const string& password);
+    string handleSendMessage(ClientConnection& conn, const string& senderLogin, const string& recipientLogin,
                             const string& text, const string& type);
     string handleGetUsers();
     string handleGetMessages(const string& login);
+    string handleStats(const string& login);
+    string handleLogout(ClientConnection& conn);
+    string handleHeartbeat(ClientConnection& conn, const string& login);
+    string handleGetOnline();
+    string handleAddFriend(const ClientConnection& conn, const string& login, const string& friendLogin);
+    string handleRemoveFriend(const ClientConnection& conn, const string& login, const string& friendLogin);
+    string handleGetFriends(const ClientConnection& conn, const string& login);
+    string handleFetchMail(ClientConnection& conn, const string& login);
+    string handleGetUnread(ClientConnection& conn, const string& login);
+    string handleSlowConsumers();
+    string handleLoad();
+    string handleRateLimits();
+    string handleMemory();
+    bool resolveAdminPath(const ClientConnection& conn, const string& directory, const string& name,
+                          string& path, string& error);
+    string handleExport(const ClientConnection& conn, const string& name);
+    string handleImport(const ClientConnection& conn, const string& name);
+    string handleBackup(const ClientConnection& conn, const string& name, const string& mode);
+    string handleArchive(const ClientConnection& conn);
+    string runHistory(const string& login, long long fromMs, long long toMs, const string& query);
+    string handleHistory(ClientConnection& conn, const string& login, const string& from, const string& to,
+                         const string& query);
+    string formatMessages(const vector<MessageData>& messages);
+    void addToTimelines(uint64_t id, const MessageData& msg);
+    string handleCreateRoom(const ClientConnection& conn, const string& name, const string& login);
+    string handleJoinRoom(const ClientConnection& conn, const string& name, const string& login);
+    string handleLeaveRoom(const ClientConnection& conn, const string& name, const string& login);
+    string handleGetRooms(const ClientConnection& conn, const string& login);
+    string handleGetRoomMembers(const string& name);
 
 public:
-    Server(uint16_t port, const string& dbPath = "chat.db");
+    Server(uint16_t port, const string& dbPath = "chat.db", const ServerConfig& config = ServerConfig());
     ~Server();
-    
+
     bool start();
     void stop();
     bool isRunning() const { return running.load(); }
@@ -0,0 +1,304 @@
+#include "shm_channel.h"
+#include <chrono>
+#include <thread>
+#include <cstring>
+#include <climits>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <ctime>
+#endif
+
+using namespace std;
+
+static const uint32_t SEGMENT_MAGIC = 0x43534d31;     // "CSM1"
+
+static size_t alignUp(size_t value, size_t alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+// Ждём, пока слово изменится с expected; ложные пробуждения допустимы
+static void waitOnWord(atomic<uint32_t>* word, uint32_t expected, int timeoutMs) {
+#ifdef __linux__
+    timespec timeout;
+    timeout.tv_sec = timeoutMs / 1000;
+    timeout.tv_nsec = (timeoutMs % 1000) * 1000000L;
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAIT, expected, &timeout, nullptr, 0);
+#else
+    (void)word;
+    (void)expected;
+    this_thread::sleep_for(chrono::microseconds(timeoutMs > 0 ? 200 : 0));
+#endif
+}
+
+static void wakeWord(atomic<uint32_t>* word) {
+#ifdef __linux__
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+#else
+    (void)word;
+#endif
+}
+
+void SpscRing::attach(ShmRingHeader* header, char* data, uint32_t capacity, atomic<uint32_t>* closed) {
+    this->header = header;
+    this->data = data;
+    this->capacity = capacity;
+    this->closed = closed;
+}
+
+void SpscRing::copyIn(uint32_t position, const char* bytes, uint32_t length) {
+    uint32_t offset = position % capacity;
+    uint32_t first = length < capacity - offset ? length : capacity - offset;
+    memcpy(data + offset, bytes, first);
+    memcpy(data, bytes + first, length - first);
+}
+
+void SpscRing::copyOut(uint32_t position, char* bytes, uint32_t length) const {
+    uint32_t offset = position % capacity;
+    uint32_t first = length < capacity - offset ? length : capacity - offset;
+    memcpy(bytes, data + offset, first);
+    memcpy(bytes + first, data, length - first);
+}
+
+bool SpscRing::tryPush(const string& frame) {
+    uint32_t length = static_cast<uint32_t>(frame.size());
+    uint32_t head = header->head.load(memory_order_relaxed);
+    uint32_t tail = header->tail.load(memory_order_acquire);
+    if (capacity - (head - tail) < length + 4) return false;
+
+    copyIn(head, reinterpret_cast<const char*>(&length), 4);
+    copyIn(head + 4, frame.data(), length);
+    header->head.store(head + 4 + length, memory_order_seq_cst);
+
+    header->dataSignal.fetch_add(1, memory_order_seq_cst);
+    if (header->consumerWaiting.load(memory_order_seq_cst)) {
+        wakeWord(&header->dataSignal);
+    }
+    return true;
+}
+
+bool SpscRing::push(const string& frame, int timeoutMs) {
+    if (frame.size() > maxFrameSize()) return false;
+
+    auto deadline = chrono::steady_clock::now() + chrono::milliseconds(timeoutMs);
+    while (!closed->load(memory_order_acquire)) {
+        if (tryPush(frame)) return true;
+
+        header->producerWaiting.store(1, memory_order_seq_cst);
+        uint32_t signal = header->spaceSignal.load(memory_order_seq_cst);
+        if (tryPush(frame)) {
+            header->producerWaiting.store(0, memory_order_relaxed);
+            return true;
+        }
+        auto left = chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now()).count();
+        if (left <= 0) {
+            header->producerWaiting.store(0, memory_order_relaxed);
+            return false;
+        }
+        waitOnWord(&header->spaceSignal, signal, static_cast<int>(left));
+        header->producerWaiting.store(0, memory_order_relaxed);
+    }
+    return false;
+}
+
+bool SpscRing::tryPop(string& frame) {
+    uint32_t tail = header->tail.load(memory_order_relaxed);
+    uint32_t head = header->head.load(memory_order_acquire);
+    if (head == tail) return false;
+
+    // Другая сторона могла испортить кольцо - тогда дальше ему верить нельзя
+    uint32_t length = 0;
+    bool corrupted = head - tail < 4 || head - tail > capacity;
+    if (!corrupted) {
+        copyOut(tail, reinterpret_cast<char*>(&length), 4);
+        corrupted = length > head - tail - 4;
+    }
+    if (corrupted) {
+        closed->store(1, memory_order_release);
+        return false;
+    }
+    frame.resize(length);
+    if (length > 0) {
+        copyOut(tail + 4, &frame[0], length);
+    }
+    header->tail.store(tail + 4 + length, memory_order_seq_cst);
+
+    header->spaceSignal.fetch_add(1, memory_order_seq_cst);
+    if (header->producerWaiting.load(memory_order_seq_cst)) {
+        wakeWord(&header->spaceSignal);
+    }
+    return true;
+}
+
+bool SpscRing::pop(string& frame, int timeoutMs) {
+    auto deadline = chrono::steady_clock::now() + chrono::milliseconds(timeoutMs);
+    while (true) {
+        if (tryPop(frame)) return true;
+        if (closed->load(memory_order_acquire)) return false;
+
+        header->consumerWaiting.store(1, memory_order_seq_cst);
+        uint32_t signal = header->dataSignal.load(memory_order_seq_cst);
+        if (tryPop(frame)) {
+            header->consumerWaiting.store(0, memory_order_relaxed);
+            return true;
+        }
+        auto left = chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now()).count();
+        if (left <= 0) {
+            header->consumerWaiting.store(0, memory_order_relaxed);
+            return false;
+        }
+        waitOnWord(&header->dataSignal, signal, static_cast<int>(left));
+        header->consumerWaiting.store(0, memory_order_relaxed);
+    }
+}
+
+void SpscRing::wakeAll() {
+    if (!header) return;
+    header->dataSignal.fetch_add(1);
+    header->spaceSignal.fetch_add(1);
+    wakeWord(&header->dataSignal);
+    wakeWord(&header->spaceSignal);
+}
+
+ShmChannel::ShmChannel() : base(nullptr), size(0), segment(nullptr) {
+}
+
+ShmChannel::~ShmChannel() {
+    close();
+}
+
+bool ShmChannel::validCapacity(uint32_t ringCapacity) {
+    return ringCapacity >= MIN_RING_CAPACITY && ringCapacity <= MAX_RING_CAPACITY &&
+           (ringCapacity & (ringCapacity - 1)) == 0;
+}
+
+// Раскладка: заголовок сегмента | кольцо запросов | данные | кольцо ответов | данные.
+// Ёмкость при открытии пришла из заголовка, записанного клиентом, и проверяется до всего
+bool ShmChannel::map(int fd, bool initialize, uint32_t ringCapacity) {
+#ifdef _WIN32
+    (void)fd;
+    (void)initialize;
+    (void)ringCapacity;
+    return false;
+#else
+    if (!validCapacity(ringCapacity)) return false;
+    size_t ringHeaderSize = alignUp(sizeof(ShmRingHeader), 64);
+    size_t segmentHeaderSize = alignUp(sizeof(SegmentHeader), 64);
+    size_t ringSize = ringHeaderSize + alignUp(ringCapacity, 64);
+    size = segmentHeaderSize + 2 * ringSize;
+
+    if (initialize && ftruncate(fd, static_cast<off_t>(size)) < 0) return false;
+    if (!initialize) {
+        struct stat info;
+        if (fstat(fd, &info) < 0 || static_cast<size_t>(info.st_size) != size) return false;
+    }
+
+    void* mapped = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapped == MAP_FAILED) return false;
+    base = mapped;
+
+    char* bytes = static_cast<char*>(base);
+    segment = reinterpret_cast<SegmentHeader*>(bytes);
+    ShmRingHeader* requestHeader = reinterpret_cast<ShmRingHeader*>(bytes + segmentHeaderSize);
+    ShmRingHeader* responseHeader = reinterpret_cast<ShmRingHeader*>(bytes + segmentHeaderSize + ringSize);
+    if (initialize) {
+        // ftruncate обнулил сегмент: нулевые атомики уже корректны
+        segment->magic = SEGMENT_MAGIC;
+        segment->ringCapacity = ringCapacity;
+    } else if (segment->magic != SEGMENT_MAGIC || segment->ringCapacity != ringCapacity) {
+        munmap(base, size);
+        base = nullptr;
+        segment = nullptr;
+        return false;
+    }
+
+    requests.attach(requestHeader, bytes + segmentHeaderSize + ringHeaderSize, ringCapacity, &segment->closed);
+    responses.attach(responseHeader, bytes + segmentHeaderSize + ringSize + ringHeaderSize, ringCapacity,
+                     &segment->closed);
+    return true;
+#endif
+}
+
+bool ShmChannel::create(const string& name, uint32_t ringCapacity) {
+#ifdef _WIN32
+    (void)name;
+    (void)ringCapacity;
+    return false;
+#else
+    close();
+    int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0) return false;
+
+    this->name = name;
+    bool mapped = map(fd, true, ringCapacity);
+    ::close(fd);
+    if (!mapped) {
+        shm_unlink(name.c_str());
+        return false;
+    }
+    return true;
+#endif
+}
+
+bool ShmChannel::open(const string& name) {
+#ifdef _WIN32
+    (void)name;
+    return false;
+#else
+    close();
+    int fd = shm_open(name.c_str(), O_RDWR, 0600);
+    if (fd < 0) return false;
+
+    // Ёмкость колец неизвестна до чтения заголовка
+    uint32_t header[2] = {0, 0};
+    bool mapped = pread(fd, header, sizeof(header), 0) == static_cast<ssize_t>(sizeof(header)) &&
+                  header[0] == SEGMENT_MAGIC && map(fd, false, header[1]);
+    ::close(fd);
+    if (mapped) this->name = name;
+    return mapped;
+#endif
+}
+
+// Имя больше не нужно после того, как обе стороны отобразили сегмент
+void ShmChannel::unlinkName() {
+#ifndef _WIN32
+    if (!name.empty()) {
+        shm_unlink(name.c_str());
+        name.clear();
+    }
+#endif
+}
+
+void ShmChannel::close() {
+    if (!base) return;
+#ifndef _WIN32
+    segment->closed.store(1, memory_order_release);
+    requests.wakeAll();
+    responses.wakeAll();
+    munmap(base, size);
+#endif
+    base = nullptr;
+    segment = nullptr;
+    size = 0;
+}
+
+bool ShmChannel::isClosed() const {
+    return !segment || segment->closed.load(memory_order_acquire) != 0;
+}
+
+string ShmChannel::uniqueName() {
+    static atomic<unsigned> counter(0);
+#ifdef _WIN32
+    return "";
+#else
+    return "/chat-" + to_string(getpid()) + "-" + to_string(counter++);
+#endif
+}
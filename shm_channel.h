@@ -0,0 +1,91 @@
+#ifndef SHM_CHANNEL_H
+#define SHM_CHANNEL_H
+
+#include <string>
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+using namespace std;
+
+// Кольцо одного производителя и одного потребителя в разделяемой памяти.
+// Позиции растут без ограничения и сравниваются по модулю 2^32,
+// ожидание - futex на счётчике сигналов (на других системах - короткий сон)
+struct ShmRingHeader {
+    alignas(64) atomic<uint32_t> head;            // пишет производитель
+    alignas(64) atomic<uint32_t> tail;            // пишет потребитель
+    alignas(64) atomic<uint32_t> dataSignal;
+    atomic<uint32_t> consumerWaiting;
+    alignas(64) atomic<uint32_t> spaceSignal;
+    atomic<uint32_t> producerWaiting;
+};
+
+class SpscRing {
+private:
+    ShmRingHeader* header;
+    char* data;
+    uint32_t capacity;
+    atomic<uint32_t>* closed;
+
+    void copyIn(uint32_t position, const char* bytes, uint32_t length);
+    void copyOut(uint32_t position, char* bytes, uint32_t length) const;
+
+public:
+    SpscRing() : header(nullptr), data(nullptr), capacity(0), closed(nullptr) {}
+    void attach(ShmRingHeader* header, char* data, uint32_t capacity, atomic<uint32_t>* closed);
+
+    bool tryPush(const string& frame);
+    bool push(const string& frame, int timeoutMs);
+    bool tryPop(string& frame);
+    bool pop(string& frame, int timeoutMs);
+    void wakeAll();
+
+    uint32_t maxFrameSize() const { return capacity - 4; }
+};
+
+// Сегмент с двумя кольцами: запросы клиента и ответы сервера.
+// Клиент создаёт сегмент и сообщает имя серверу командой SHM_ATTACH
+class ShmChannel {
+private:
+    struct SegmentHeader {
+        uint32_t magic;
+        uint32_t ringCapacity;
+        atomic<uint32_t> closed;
+    };
+
+    void* base;
+    size_t size;
+    string name;
+    SegmentHeader* segment;
+    SpscRing requests;
+    SpscRing responses;
+
+    bool map(int fd, bool initialize, uint32_t ringCapacity);
+
+public:
+    // Ёмкость - степень двойки: позиции идут по модулю 2^32, и остаток от деления
+    // на ёмкость должен оставаться непрерывным при их переполнении
+    static const uint32_t DEFAULT_RING_CAPACITY = 1 << 20;
+    static const uint32_t MIN_RING_CAPACITY = 1 << 12;
+    static const uint32_t MAX_RING_CAPACITY = 1 << 26;
+
+    static bool validCapacity(uint32_t ringCapacity);
+
+    ShmChannel();
+    ~ShmChannel();
+
+    bool create(const string& name, uint32_t ringCapacity = DEFAULT_RING_CAPACITY);
+    bool open(const string& name);
+    void unlinkName();
+    void close();
+
+    bool isOpen() const { return base != nullptr; }
+    bool isClosed() const;
+    SpscRing& requestRing() { return requests; }
+    SpscRing& responseRing() { return responses; }
+    const string& getName() const { return name; }
+
+    static string uniqueName();
+};
+
+#endif
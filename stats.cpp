@@ -0,0 +1,115 @@
+#include "stats.h"
+#include "memory_usage.h"
+#include <sstream>
+
+using namespace std;
+
+MessageStats::MessageStats() {
+    reset();
+}
+
+void MessageStats::record(const string& senderLogin, const string& recipientLogin,
+                          MessageType type, long long timestampMs) {
+    const long long msPerHour = 3600LL * 1000;
+    int hour = static_cast<int>((timestampMs / msPerHour) % HOURS_PER_DAY);
+    if (hour < 0) hour += HOURS_PER_DAY;
+
+    lock_guard<mutex> lock(statsMutex);
+    ++total;
+    ++typeTotals[static_cast<size_t>(type)];
+    ++hourBuckets[hour];
+    if (!senderLogin.empty()) {
+        ++perUser[senderLogin].sent;
+    }
+    if (!recipientLogin.empty() && type != MessageType::ROOM) {
+        ++perUser[recipientLogin].received;
+    }
+}
+
+void MessageStats::roomOpened(const string& room) {
+    lock_guard<mutex> lock(statsMutex);
+    activeRooms.insert(room);
+}
+
+void MessageStats::roomClosed(const string& room) {
+    lock_guard<mutex> lock(statsMutex);
+    activeRooms.erase(room);
+}
+
+void MessageStats::reset() {
+    lock_guard<mutex> lock(statsMutex);
+    total = 0;
+    for (size_t i = 0; i < MESSAGE_TYPE_COUNT; ++i) typeTotals[i] = 0;
+    for (int i = 0; i < HOURS_PER_DAY; ++i) hourBuckets[i] = 0;
+    perUser.clear();
+    activeRooms.clear();
+}
+
+size_t MessageStats::getTotal() const {
+    lock_guard<mutex> lock(statsMutex);
+    return total;
+}
+
+size_t MessageStats::getTypeTotal(MessageType type) const {
+    lock_guard<mutex> lock(statsMutex);
+    return typeTotals[static_cast<size_t>(type)];
+}
+
+size_t MessageStats::getHourBucket(int hour) const {
+    if (hour < 0 || hour >= HOURS_PER_DAY) return 0;
+    lock_guard<mutex> lock(statsMutex);
+    return hourBuckets[hour];
+}
+
+int MessageStats::getBusiestHour() const {
+    lock_guard<mutex> lock(statsMutex);
+    int busiest = 0;
+    for (int i = 1; i < HOURS_PER_DAY; ++i) {
+        if (hourBuckets[i] > hourBuckets[busiest]) busiest = i;
+    }
+    return busiest;
+}
+
+UserMessageCounters MessageStats::getUserCounters(const string& login) const {
+    lock_guard<mutex> lock(statsMutex);
+    auto it = perUser.find(login);
+    return it != perUser.end() ? it->second : UserMessageCounters();
+}
+
+size_t MessageStats::getActiveUserCount() const {
+    lock_guard<mutex> lock(statsMutex);
+    return perUser.size();
+}
+
+size_t MessageStats::getActiveRoomCount() const {
+    lock_guard<mutex> lock(statsMutex);
+    return activeRooms.size();
+}
+
+string MessageStats::serialize(const string& login) const {
+    lock_guard<mutex> lock(statsMutex);
+    ostringstream oss;
+    oss << "TOTAL:" << total;
+    for (size_t i = 0; i < MESSAGE_TYPE_COUNT; ++i) {
+        oss << "\n" << Message::typeToString(static_cast<MessageType>(i)) << ":" << typeTotals[i];
+    }
+    oss << "\nACTIVE_USERS:" << perUser.size();
+    oss << "\nACTIVE_ROOMS:" << activeRooms.size();
+    oss << "\nHOURS:";
+    for (int i = 0; i < HOURS_PER_DAY; ++i) {
+        if (i > 0) oss << ",";
+        oss << hourBuckets[i];
+    }
+    if (!login.empty()) {
+        auto it = perUser.find(login);
+        UserMessageCounters counters = it != perUser.end() ? it->second : UserMessageCounters();
+        oss << "\nSENT:" << counters.sent;
+        oss << "\nRECEIVED:" << counters.received;
+    }
+    return oss.str();
+}
+
+size_t MessageStats::memoryUsage() const {
+    lock_guard<mutex> lock(statsMutex);
+    return memory_usage::heapBytes(perUser) + memory_usage::heapBytes(activeRooms);
+}
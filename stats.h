@@ -0,0 +1,51 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <string>
+#include <set>
+#include <unordered_map>
+#include <mutex>
+#include "message.h"
+
+using namespace std;
+
+struct UserMessageCounters {
+    size_t sent = 0;
+    size_t received = 0;
+};
+
+// Счётчики, обновляемые при каждой вставке сообщения: чтение за O(1)
+class MessageStats {
+private:
+    static const int HOURS_PER_DAY = 24;
+
+    mutable mutex statsMutex;
+    size_t total;
+    size_t typeTotals[MESSAGE_TYPE_COUNT];
+    size_t hourBuckets[HOURS_PER_DAY];
+    unordered_map<string, UserMessageCounters> perUser;
+    set<string> activeRooms;
+
+public:
+    MessageStats();
+
+    void record(const string& senderLogin, const string& recipientLogin,
+                MessageType type, long long timestampMs);
+    void roomOpened(const string& room);
+    void roomClosed(const string& room);
+    void reset();
+
+    size_t getTotal() const;
+    size_t getTypeTotal(MessageType type) const;
+    size_t getHourBucket(int hour) const;
+    int getBusiestHour() const;
+    UserMessageCounters getUserCounters(const string& login) const;
+    size_t getActiveUserCount() const;
+    size_t getActiveRoomCount() const;
+    size_t memoryUsage() const;
+
+    // Строки "KEY:value" для ответа на STATS
+    string serialize(const string& login = "") const;
+};
+
+#endif
@@ -0,0 +1,488 @@
+#include "database.h"
+#include "block_codec.h"
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <algorithm>
+#include <random>
+#include <functional>
+#include <cstdlib>
+#include <cmath>
+
+using namespace std;
+
+// Замеры горячих функций хранилища на наборах 10k/1M/10M записей.
+// Кодек (escapeString, unescapeString, serializeMessage, deserializeMessage) гоняется в памяти
+// по пулу сгенерированных сообщений; getUser, getMessagesForUser и updateUser - по файлам,
+// записанным напрямую в формате базы. Наборы: обычный текст и текст, где каждый восьмой
+// символ требует экранирования; длины - 70% коротких, 25% средних, 5% длинных; отправители,
+// получатели и ключи поиска - по Ципфу, как активность живых пользователей.
+// block_codec сжимает и распаковывает блоки журнала по 256 КБ (как в архиве) и ответы
+// GET_MESSAGES по 64 КБ через packFrame/unpackFrame; колонка ratio - исходный размер к сжатому.
+// Запуск: ./storage_bench [--sizes 10000,1000000,10000000] [--min-time-ms 1000] [--seed 42] [--json results.json]
+// По умолчанию 10k и 1M: на 10M getMessagesForUser держит весь журнал в памяти.
+
+struct BenchResult {
+    string benchmark;
+    string dataset;
+    size_t records;
+    size_t ops;
+    double seconds;
+    size_t bytes;               // обработано байт, 0 - не считается
+    vector<long long> callNs;   // задержки отдельных вызовов, пусто - замер пачкой
+    double ratio;               // степень сжатия, 0 - не сжатие
+};
+
+// Доступ к закрытому кодеку Database; объявлен другом в database.h
+class StorageBench {
+public:
+    static string escape(const Database& db, const string& s) { return db.escapeString(s); }
+    static string unescape(const Database& db, const string& s) { return db.unescapeString(s); }
+    static string serializeMessage(const Database& db, const MessageData& m) { return db.serializeMessage(m); }
+    static MessageData deserializeMessage(const Database& db, const string& line) { return db.deserializeMessage(line); }
+    static string serializeUser(const Database& db, const UserData& u) { return db.serializeUser(u); }
+    static string usersPath(const Database& db) { return db.getUsersFilePath(); }
+    static string messagesPath(const Database& db) { return db.getMessagesFilePath(); }
+};
+
+// Не даёт компилятору выбросить результат замеряемого вызова
+static volatile size_t benchSink = 0;
+
+// Пул для кодека: больше не нужен, записи сверх него берутся по кругу
+static const size_t CODEC_POOL_SIZE = 65536;
+
+// Вызовы по файлам: не больше стольких, даже если бюджет времени не исчерпан
+static const size_t MAX_FILE_CALLS = 1000;
+
+// Выборка по закону Ципфа с показателем 1.1: ранг 0 - самый активный
+class ZipfSampler {
+private:
+    vector<double> cdf;
+    vector<size_t> rankToIndex;     // популярные не обязаны лежать в начале файла
+
+public:
+    ZipfSampler(size_t count, mt19937_64& rng) : cdf(count), rankToIndex(count) {
+        double sum = 0;
+        for (size_t i = 0; i < count; ++i) {
+            sum += 1.0 / pow(static_cast<double>(i + 1), 1.1);
+            cdf[i] = sum;
+        }
+        for (size_t i = 0; i < count; ++i) {
+            cdf[i] /= sum;
+            rankToIndex[i] = i;
+        }
+        shuffle(rankToIndex.begin(), rankToIndex.end(), rng);
+    }
+
+    size_t operator()(mt19937_64& rng) const {
+        double u = uniform_real_distribution<double>(0.0, 1.0)(rng);
+        size_t rank = static_cast<size_t>(lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin());
+        return rankToIndex[min(rank, rankToIndex.size() - 1)];
+    }
+};
+
+static size_t messageLength(mt19937_64& rng) {
+    uint64_t bucket = rng() % 100;
+    if (bucket < 70) return 8 + rng() % 57;         // 8-64
+    if (bucket < 95) return 100 + rng() % 301;      // 100-400
+    return 1000 + rng() % 3001;                     // 1000-4000
+}
+
+static string messageText(mt19937_64& rng, bool escapeHeavy) {
+    static const char plain[] = "abcdefghijklmnopqrstuvwxyz ABCDEFGHIJKLMNOPQRSTUVWXYZ 0123456789 .,!?";
+    static const char special[] = "|\\\n\r";
+    size_t length = messageLength(rng);
+    string text;
+    text.reserve(length);
+    for (size_t i = 0; i < length; ++i) {
+        if (escapeHeavy && rng() % 8 == 0) {
+            text += special[rng() % (sizeof(special) - 1)];
+        } else {
+            text += plain[rng() % (sizeof(plain) - 1)];
+        }
+    }
+    return text;
+}
+
+static string userLogin(size_t index) {
+    return "user" + to_string(index);
+}
+
+static MessageData makeMessage(mt19937_64& rng, const ZipfSampler& users, bool escapeHeavy, long long timestamp) {
+    MessageData msg;
+    msg.senderLogin = userLogin(users(rng));
+    msg.text = messageText(rng, escapeHeavy);
+    msg.timestamp = timestamp;
+    uint64_t kind = rng() % 100;
+    if (kind < 60) {
+        msg.type = "PUBLIC";
+    } else if (kind < 95) {
+        msg.type = "PRIVATE";
+        msg.recipientLogin = userLogin(users(rng));
+    } else {
+        msg.type = "ROOM";
+        msg.recipientLogin = "room" + to_string(rng() % 100);
+    }
+    if (rng() % 10 == 0) {
+        msg.tags.push_back("tag" + to_string(rng() % 50));
+    }
+    return msg;
+}
+
+// Пачка: повторяем проход по records записям, пока не выйдет бюджет времени
+static BenchResult measureBatch(const string& benchmark, const string& dataset, size_t records,
+                                double minSeconds, const function<size_t(size_t)>& pass) {
+    BenchResult result{benchmark, dataset, records, 0, 0, 0, vector<long long>(), 0};
+    auto started = chrono::steady_clock::now();
+    do {
+        result.bytes += pass(records);
+        result.ops += records;
+        result.seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+    } while (result.seconds < minSeconds);
+    return result;
+}
+
+// По одному вызову: у каждого своя задержка, чтобы видеть хвост
+static BenchResult measureCalls(const string& benchmark, const string& dataset, size_t records,
+                                double minSeconds, const function<void()>& call) {
+    BenchResult result{benchmark, dataset, records, 0, 0, 0, vector<long long>(), 0};
+    auto started = chrono::steady_clock::now();
+    do {
+        auto before = chrono::steady_clock::now();
+        call();
+        auto after = chrono::steady_clock::now();
+        result.callNs.push_back(chrono::duration_cast<chrono::nanoseconds>(after - before).count());
+        ++result.ops;
+        result.seconds = chrono::duration<double>(after - started).count();
+    } while (result.seconds < minSeconds && result.ops < MAX_FILE_CALLS);
+    return result;
+}
+
+static void runCodec(vector<BenchResult>& results, size_t records, bool escapeHeavy, double minSeconds, uint64_t seed) {
+    const string dataset = escapeHeavy ? "escape_heavy" : "plain";
+    Database db("storage_bench.db/codec");
+    mt19937_64 rng(seed);
+    ZipfSampler users(max<size_t>(records, 1), rng);
+
+    size_t poolSize = min(records, CODEC_POOL_SIZE);
+    vector<MessageData> messages;
+    vector<string> escaped, lines;
+    messages.reserve(poolSize);
+    for (size_t i = 0; i < poolSize; ++i) {
+        messages.push_back(makeMessage(rng, users, escapeHeavy, 1700000000000LL + static_cast<long long>(i)));
+        escaped.push_back(StorageBench::escape(db, messages.back().text));
+        lines.push_back(StorageBench::serializeMessage(db, messages.back()));
+    }
+
+    results.push_back(measureBatch("escapeString", dataset, records, minSeconds, [&](size_t count) {
+        size_t bytes = 0;
+        for (size_t i = 0; i < count; ++i) {
+            const string& text = messages[i % poolSize].text;
+            benchSink += StorageBench::escape(db, text).size();
+            bytes += text.size();
+        }
+        return bytes;
+    }));
+    results.push_back(measureBatch("unescapeString", dataset, records, minSeconds, [&](size_t count) {
+        size_t bytes = 0;
+        for (size_t i = 0; i < count; ++i) {
+            const string& text = escaped[i % poolSize];
+            benchSink += StorageBench::unescape(db, text).size();
+            bytes += text.size();
+        }
+        return bytes;
+    }));
+    results.push_back(measureBatch("serializeMessage", dataset, records, minSeconds, [&](size_t count) {
+        size_t bytes = 0;
+        for (size_t i = 0; i < count; ++i) {
+            string line = StorageBench::serializeMessage(db, messages[i % poolSize]);
+            bytes += line.size();
+            benchSink += line.size();
+        }
+        return bytes;
+    }));
+    results.push_back(measureBatch("deserializeMessage", dataset, records, minSeconds, [&](size_t count) {
+        size_t bytes = 0;
+        for (size_t i = 0; i < count; ++i) {
+            const string& line = lines[i % poolSize];
+            benchSink += StorageBench::deserializeMessage(db, line).text.size();
+            bytes += line.size();
+        }
+        return bytes;
+    }));
+}
+
+// Блоки журнала - как сегменты архива; ответы - как крупный GET_MESSAGES на проводе
+static const size_t JOURNAL_BLOCK_BYTES = 256 * 1024;
+static const size_t RESPONSE_FRAME_BYTES = 64 * 1024;
+
+// Нарезка подряд идущих строк на куски не больше limit байт
+static vector<string> splitLines(const vector<string>& lines, size_t limit, const string& prefix) {
+    vector<string> blocks;
+    string block = prefix;
+    for (const string& line : lines) {
+        if (block.size() + line.size() + 1 > limit && block.size() > prefix.size()) {
+            blocks.push_back(block);
+            block = prefix;
+        }
+        block += line;
+        block += '\n';
+    }
+    if (block.size() > prefix.size()) blocks.push_back(block);
+    return blocks;
+}
+
+static void runCompression(vector<BenchResult>& results, size_t records, double minSeconds, uint64_t seed) {
+    Database db("storage_bench.db/codec");
+    mt19937_64 rng(seed);
+    ZipfSampler users(max<size_t>(records, 1), rng);
+
+    size_t poolSize = min(records, CODEC_POOL_SIZE);
+    vector<string> lines;
+    lines.reserve(poolSize);
+    for (size_t i = 0; i < poolSize; ++i) {
+        lines.push_back(StorageBench::serializeMessage(
+            db, makeMessage(rng, users, false, 1700000000000LL + static_cast<long long>(i))));
+    }
+
+    vector<string> blocks = splitLines(lines, JOURNAL_BLOCK_BYTES, "");
+    vector<string> packedBlocks;
+    size_t rawTotal = 0, packedTotal = 0;
+    for (const string& block : blocks) {
+        packedBlocks.push_back(block_codec::compress(block.data(), block.size()));
+        rawTotal += block.size();
+        packedTotal += packedBlocks.back().size();
+    }
+    double journalRatio = packedTotal > 0 ? static_cast<double>(rawTotal) / packedTotal : 0;
+
+    BenchResult result = measureBatch("compress", "journal", blocks.size(), minSeconds, [&](size_t count) {
+        size_t bytes = 0;
+        for (size_t i = 0; i < count; ++i) {
+            benchSink += block_codec::compress(blocks[i].data(), blocks[i].size()).size();
+            bytes += blocks[i].size();
+        }
+        return bytes;
+    });
+    result.ratio = journalRatio;
+    results.push_back(result);
+    result = measureBatch("decompress", "journal", blocks.size(), minSeconds, [&](size_t count) {
+        size_t bytes = 0;
+        string raw;
+        for (size_t i = 0; i < count; ++i) {
+            block_codec::decompress(packedBlocks[i].data(), packedBlocks[i].size(), blocks[i].size(), raw);
+            benchSink += raw.size();
+            bytes += raw.size();
+        }
+        return bytes;
+    });
+    result.ratio = journalRatio;
+    results.push_back(result);
+
+    // Кадр ответа вместе с экранированием перевода строки - ровно то, что уходит клиенту
+    vector<string> frames = splitLines(lines, RESPONSE_FRAME_BYTES, "STATUS:SUCCESS\nDATA:");
+    vector<string> packedFrames;
+    rawTotal = packedTotal = 0;
+    for (const string& frame : frames) {
+        packedFrames.push_back(block_codec::packFrame(frame));
+        rawTotal += frame.size();
+        packedTotal += packedFrames.back().size();
+    }
+    double responseRatio = packedTotal > 0 ? static_cast<double>(rawTotal) / packedTotal : 0;
+
+    result = measureBatch("packFrame", "response", frames.size(), minSeconds, [&](size_t count) {
+        size_t bytes = 0;
+        for (size_t i = 0; i < count; ++i) {
+            benchSink += block_codec::packFrame(frames[i]).size();
+            bytes += frames[i].size();
+        }
+        return bytes;
+    });
+    result.ratio = responseRatio;
+    results.push_back(result);
+    result = measureBatch("unpackFrame", "response", frames.size(), minSeconds, [&](size_t count) {
+        size_t bytes = 0;
+        string frame;
+        for (size_t i = 0; i < count; ++i) {
+            block_codec::unpackFrame(packedFrames[i], frame);
+            benchSink += frame.size();
+            bytes += frame.size();
+        }
+        return bytes;
+    });
+    result.ratio = responseRatio;
+    results.push_back(result);
+}
+
+// Файлы пишутся напрямую: addUser проверяет уникальность полным проходом и на миллионах займёт часы
+static bool writeDataset(Database& db, size_t records, const ZipfSampler& users, mt19937_64& rng) {
+    if (!db.initialize()) return false;
+
+    ofstream usersFile(StorageBench::usersPath(db), ios::trunc);
+    for (size_t i = 0; i < records; ++i) {
+        UserData user;
+        user.login = userLogin(i);
+        user.password = "pw" + to_string(i);
+        user.name = "User " + to_string(i);
+        size_t friendCount = rng() % 6;
+        for (size_t f = 0; f < friendCount; ++f) {
+            user.friends.push_back(userLogin(users(rng)));
+        }
+        usersFile << StorageBench::serializeUser(db, user) << "\n";
+    }
+
+    ofstream messagesFile(StorageBench::messagesPath(db), ios::trunc);
+    for (size_t i = 0; i < records; ++i) {
+        MessageData msg = makeMessage(rng, users, false, 1700000000000LL + static_cast<long long>(i));
+        messagesFile << StorageBench::serializeMessage(db, msg) << "\n";
+    }
+    usersFile.close();
+    messagesFile.close();
+    if (usersFile.fail() || messagesFile.fail()) return false;
+    return db.initialize();
+}
+
+static bool runStorage(vector<BenchResult>& results, size_t records, double minSeconds, uint64_t seed) {
+    const string dataset = "zipf_users";
+    Database db("storage_bench.db/" + to_string(records));
+    mt19937_64 rng(seed);
+    ZipfSampler users(max<size_t>(records, 1), rng);
+    if (!writeDataset(db, records, users, rng)) {
+        cerr << "Failed to write dataset of " << records << " records" << endl;
+        return false;
+    }
+
+    results.push_back(measureCalls("getUser", dataset, records, minSeconds, [&] {
+        benchSink += db.getUser(userLogin(users(rng))).name.size();
+    }));
+    results.push_back(measureCalls("getMessagesForUser", dataset, records, minSeconds, [&] {
+        benchSink += db.getMessagesForUser(userLogin(users(rng))).size();
+    }));
+    size_t renamed = 0;
+    results.push_back(measureCalls("updateUser", dataset, records, minSeconds, [&] {
+        UserData user = db.getUser(userLogin(users(rng)));
+        user.name = "Renamed " + to_string(renamed++);
+        benchSink += db.updateUser(user) ? 1 : 0;
+    }));
+    return true;
+}
+
+static long long percentileNs(vector<long long> samples, double p) {
+    if (samples.empty()) return 0;
+    sort(samples.begin(), samples.end());
+    return samples[min(samples.size() - 1, static_cast<size_t>(p * samples.size()))];
+}
+
+static void printResult(const BenchResult& result) {
+    double nsPerOp = result.seconds * 1e9 / result.ops;
+    cout << left << setw(20) << result.benchmark << setw(14) << result.dataset << right
+         << setw(10) << result.records << setw(12) << result.ops
+         << fixed << setprecision(1) << setw(14) << nsPerOp;
+    if (result.bytes > 0) {
+        cout << setw(10) << result.bytes / result.seconds / 1e6;
+    } else {
+        cout << setw(10) << "-";
+    }
+    if (!result.callNs.empty()) {
+        cout << setw(14) << percentileNs(result.callNs, 0.50) / 1000.0
+             << setw(14) << percentileNs(result.callNs, 0.99) / 1000.0;
+    } else if (result.ratio > 0) {
+        cout << setw(28) << "-";
+    }
+    if (result.ratio > 0) {
+        cout << setprecision(2) << setw(8) << result.ratio;
+    }
+    cout << endl;
+}
+
+// Один объект на запуск; имена и наборы - латиница без кавычек, экранировать нечего
+static bool writeJson(const string& path, const vector<BenchResult>& results, uint64_t seed, double minSeconds) {
+    ofstream out(path, ios::trunc);
+    if (!out.is_open()) return false;
+    out << "{\n  \"suite\": \"storage_bench\",\n  \"seed\": " << seed
+        << ",\n  \"min_time_ms\": " << static_cast<long long>(minSeconds * 1000)
+        << ",\n  \"timestamp\": " << chrono::duration_cast<chrono::seconds>(
+               chrono::system_clock::now().time_since_epoch()).count()
+        << ",\n  \"results\": [";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const BenchResult& result = results[i];
+        out << (i > 0 ? ",\n" : "\n") << fixed << setprecision(3)
+            << "    {\"benchmark\": \"" << result.benchmark << "\", \"dataset\": \"" << result.dataset
+            << "\", \"records\": " << result.records << ", \"ops\": " << result.ops
+            << ", \"seconds\": " << result.seconds
+            << ", \"ns_per_op\": " << result.seconds * 1e9 / result.ops
+            << ", \"ops_per_sec\": " << result.ops / result.seconds;
+        if (result.bytes > 0) {
+            out << ", \"mb_per_sec\": " << result.bytes / result.seconds / 1e6;
+        }
+        if (!result.callNs.empty()) {
+            out << ", \"p50_ns\": " << percentileNs(result.callNs, 0.50)
+                << ", \"p99_ns\": " << percentileNs(result.callNs, 0.99);
+        }
+        if (result.ratio > 0) {
+            out << ", \"compression_ratio\": " << result.ratio;
+        }
+        out << "}";
+    }
+    out << "\n  ]\n}\n";
+    return out.good();
+}
+
+int main(int argc, char** argv) {
+    vector<size_t> sizes = {10000, 1000000};
+    double minSeconds = 1.0;
+    uint64_t seed = 42;
+    string jsonPath;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--sizes" && i + 1 < argc) {
+            sizes.clear();
+            stringstream ss(argv[++i]);
+            string size;
+            while (getline(ss, size, ',')) {
+                size_t records = static_cast<size_t>(strtoull(size.c_str(), nullptr, 10));
+                if (records > 0) sizes.push_back(records);
+            }
+        } else if (arg == "--min-time-ms" && i + 1 < argc) {
+            minSeconds = atof(argv[++i]) / 1000.0;
+        } else if (arg == "--seed" && i + 1 < argc) {
+            seed = strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--json" && i + 1 < argc) {
+            jsonPath = argv[++i];
+        } else {
+            cerr << "Unknown option: " << arg << endl;
+            return 1;
+        }
+    }
+    if (sizes.empty()) {
+        cerr << "--sizes needs at least one positive record count" << endl;
+        return 1;
+    }
+
+    cout << left << setw(20) << "benchmark" << setw(14) << "dataset" << right << setw(10) << "records"
+         << setw(12) << "ops" << setw(14) << "ns/op" << setw(10) << "MB/s"
+         << setw(14) << "p50 us" << setw(14) << "p99 us" << setw(8) << "ratio" << endl;
+
+    vector<BenchResult> results;
+    for (size_t records : sizes) {
+        size_t first = results.size();
+        runCodec(results, records, false, minSeconds, seed);
+        runCodec(results, records, true, minSeconds, seed);
+        runCompression(results, records, minSeconds, seed);
+        if (!runStorage(results, records, minSeconds, seed)) {
+            return 1;
+        }
+        for (size_t i = first; i < results.size(); ++i) {
+            printResult(results[i]);
+        }
+    }
+
+    if (!jsonPath.empty() && !writeJson(jsonPath, results, seed, minSeconds)) {
+        cerr << "Failed to write " << jsonPath << endl;
+        return 1;
+    }
+    return 0;
+}
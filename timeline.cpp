@@ -0,0 +1,123 @@
+#include "timeline.h"
+#include "memory_usage.h"
+#include <queue>
+#include <algorithm>
+#include <iterator>
+#include <functional>
+
+using namespace std;
+
+void TimelineService::appendId(vector<uint64_t>& timeline, uint64_t id) {
+    // Записи приходят почти по порядку; редкие перестановки между потоками чиним вставкой
+    if (timeline.empty() || timeline.back() < id) {
+        timeline.push_back(id);
+        return;
+    }
+    auto pos = timeline.end();
+    while (pos != timeline.begin() && *(pos - 1) > id) --pos;
+    if (pos == timeline.begin() || *(pos - 1) != id) {
+        timeline.insert(pos, id);
+    }
+}
+
+void TimelineService::clear() {
+    lock_guard<mutex> lock(timelineMutex);
+    publicTimeline.clear();
+    userTimelines.clear();
+    roomTimelines.clear();
+}
+
+void TimelineService::addPublic(uint64_t id) {
+    lock_guard<mutex> lock(timelineMutex);
+    appendId(publicTimeline, id);
+}
+
+void TimelineService::addPrivate(const string& sender, const string& recipient, uint64_t id) {
+    lock_guard<mutex> lock(timelineMutex);
+    if (!sender.empty()) {
+        appendId(userTimelines[sender], id);
+    }
+    if (!recipient.empty() && recipient != sender) {
+        appendId(userTimelines[recipient], id);
+    }
+}
+
+void TimelineService::addRoom(const string& room, uint64_t id) {
+    lock_guard<mutex> lock(timelineMutex);
+    appendId(roomTimelines[room], id);
+}
+
+void TimelineService::eraseIds(vector<uint64_t>& timeline, const vector<uint64_t>& sortedIds) {
+    timeline.erase(remove_if(timeline.begin(), timeline.end(), [&sortedIds](uint64_t id) {
+        return binary_search(sortedIds.begin(), sortedIds.end(), id);
+    }), timeline.end());
+}
+
+void TimelineService::removeIds(const vector<uint64_t>& sortedIds) {
+    if (sortedIds.empty()) return;
+    lock_guard<mutex> lock(timelineMutex);
+    eraseIds(publicTimeline, sortedIds);
+    for (auto it = userTimelines.begin(); it != userTimelines.end();) {
+        eraseIds(it->second, sortedIds);
+        it = it->second.empty() ? userTimelines.erase(it) : next(it);
+    }
+    for (auto it = roomTimelines.begin(); it != roomTimelines.end();) {
+        eraseIds(it->second, sortedIds);
+        it = it->second.empty() ? roomTimelines.erase(it) : next(it);
+    }
+}
+
+// История при входе: k-way merge публичной ленты, ленты пользователя и лент его комнат
+vector<uint64_t> TimelineService::assemble(const string& login, const set<string>& rooms) const {
+    lock_guard<mutex> lock(timelineMutex);
+    vector<const vector<uint64_t>*> lists;
+    lists.push_back(&publicTimeline);
+
+    auto own = userTimelines.find(login);
+    if (own != userTimelines.end()) {
+        lists.push_back(&own->second);
+    }
+    for (const auto& room : rooms) {
+        auto it = roomTimelines.find(room);
+        if (it != roomTimelines.end()) {
+            lists.push_back(&it->second);
+        }
+    }
+    return mergeSorted(lists);
+}
+
+vector<uint64_t> TimelineService::mergeSorted(const vector<const vector<uint64_t>*>& lists) {
+    typedef pair<uint64_t, size_t> Head;    // id, номер списка
+    priority_queue<Head, vector<Head>, greater<Head>> heap;
+    vector<size_t> positions(lists.size(), 0);
+
+    size_t total = 0;
+    for (size_t i = 0; i < lists.size(); ++i) {
+        total += lists[i]->size();
+        if (!lists[i]->empty()) {
+            heap.push(Head((*lists[i])[0], i));
+        }
+    }
+
+    vector<uint64_t> result;
+    result.reserve(total);
+    while (!heap.empty()) {
+        Head head = heap.top();
+        heap.pop();
+        if (result.empty() || result.back() != head.first) {
+            result.push_back(head.first);
+        }
+
+        size_t next = ++positions[head.second];
+        if (next < lists[head.second]->size()) {
+            heap.push(Head((*lists[head.second])[next], head.second));
+        }
+    }
+    return result;
+}
+
+size_t TimelineService::memoryUsage() const {
+    lock_guard<mutex> lock(timelineMutex);
+    return memory_usage::heapBytes(publicTimeline) + memory_usage::heapBytes(userTimelines) +
+           memory_usage::heapBytes(roomTimelines);
+}
@@ -0,0 +1,42 @@
+#ifndef TIMELINE_H
+#define TIMELINE_H
+
+#include <string>
+#include <vector>
+#include <set>
+#include <unordered_map>
+#include <mutex>
+#include <cstdint>
+
+using namespace std;
+
+// Ленты сообщений (id по возрастанию).
+// Публичная лента одна на всех и читается при запросе. Личные сообщения раскладываются
+// по лентам отправителя и получателя при записи. Сообщения комнат остаются в ленте комнаты
+// и подмешиваются при чтении по текущему членству: вступивший видит прежние сообщения,
+// вышедший их больше не видит - как в HISTORY.
+class TimelineService {
+private:
+    mutable mutex timelineMutex;
+    vector<uint64_t> publicTimeline;
+    unordered_map<string, vector<uint64_t>> userTimelines;
+    unordered_map<string, vector<uint64_t>> roomTimelines;
+
+    static void appendId(vector<uint64_t>& timeline, uint64_t id);
+    static void eraseIds(vector<uint64_t>& timeline, const vector<uint64_t>& sortedIds);
+
+public:
+    void clear();
+    void addPublic(uint64_t id);
+    void addPrivate(const string& sender, const string& recipient, uint64_t id);
+    void addRoom(const string& room, uint64_t id);
+    // Сообщения ушли в архив: горячие ленты их больше не держат
+    void removeIds(const vector<uint64_t>& sortedIds);
+
+    vector<uint64_t> assemble(const string& login, const set<string>& rooms) const;
+    size_t memoryUsage() const;
+
+    static vector<uint64_t> mergeSorted(const vector<const vector<uint64_t>*>& lists);
+};
+
+#endif
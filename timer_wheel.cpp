@@ -0,0 +1,50 @@
+#include "timer_wheel.h"
+#include "memory_usage.h"
+
+using namespace std;
+
+TimerWheel::TimerWheel(size_t slotCount, long long tickMs, long long nowMs)
+    : slots(slotCount > 0 ? slotCount : 1), tickMs(tickMs > 0 ? tickMs : 1), currentTick(nowMs / this->tickMs) {
+}
+
+void TimerWheel::schedule(int id, long long deadlineMs) {
+    cancel(id);
+
+    long long tick = (deadlineMs + tickMs - 1) / tickMs;
+    if (tick <= currentTick) tick = currentTick + 1;
+
+    size_t slot = static_cast<size_t>(tick % static_cast<long long>(slots.size()));
+    slots[slot].push_back(id);
+    entries[id] = Entry{tick, slot, --slots[slot].end()};
+}
+
+void TimerWheel::cancel(int id) {
+    auto it = entries.find(id);
+    if (it == entries.end()) return;
+    slots[it->second.slot].erase(it->second.position);
+    entries.erase(it);
+}
+
+vector<int> TimerWheel::advance(long long nowMs) {
+    vector<int> expired;
+    long long targetTick = nowMs / tickMs;
+    while (currentTick < targetTick) {
+        ++currentTick;
+        list<int>& slot = slots[static_cast<size_t>(currentTick % static_cast<long long>(slots.size()))];
+        for (auto it = slot.begin(); it != slot.end();) {
+            auto entry = entries.find(*it);
+            if (entry->second.deadlineTick <= currentTick) {
+                expired.push_back(*it);
+                entries.erase(entry);
+                it = slot.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+    return expired;
+}
+
+size_t TimerWheel::memoryUsage() const {
+    return memory_usage::heapBytes(slots) + memory_usage::heapBytes(entries);
+}
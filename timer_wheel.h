@@ -0,0 +1,38 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <cstddef>
+
+using namespace std;
+
+// Хешированное колесо таймеров: перестановка и отмена - O(1) через итератор,
+// тик просматривает только один слот. Таймеры дальше оборота колеса ждут
+// в своём слоте нужного круга. Не потокобезопасно.
+class TimerWheel {
+private:
+    struct Entry {
+        long long deadlineTick;
+        size_t slot;
+        list<int>::iterator position;
+    };
+
+    vector<list<int>> slots;
+    unordered_map<int, Entry> entries;
+    long long tickMs;
+    long long currentTick;
+
+public:
+    TimerWheel(size_t slotCount, long long tickMs, long long nowMs);
+
+    void schedule(int id, long long deadlineMs);
+    void cancel(int id);
+    vector<int> advance(long long nowMs);
+
+    size_t size() const { return entries.size(); }
+    size_t memoryUsage() const;
+};
+
+#endif
@@ -0,0 +1,185 @@
+#include "tracer.h"
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+
+using namespace std;
+
+namespace {
+
+struct TraceEvent {
+    const char* name;
+    const char* category;
+    long long startUs;
+    long long durationUs;
+    uint32_t threadId;
+    uint64_t requestId;
+};
+
+// Слот кольца. Писатель и выгрузка берут его коротким спин-замком: кольцо обгоняет само себя
+// только при переполнении, так что замок почти никогда не ждёт
+struct TraceSlot {
+    atomic<bool> busy;
+    bool filled;
+    TraceEvent event;
+
+    TraceSlot() : busy(false), filled(false), event() {}
+};
+
+// Настраивается один раз до запуска потоков сервера
+size_t sampleEvery = 0;
+size_t slotCount = 0;
+unique_ptr<TraceSlot[]> slots;
+atomic<uint64_t> nextSlot(0);
+atomic<uint64_t> requestCounter(0);
+atomic<uint32_t> nextThreadId(1);
+
+thread_local uint64_t currentRequestId = 0;
+
+uint32_t localThreadId() {
+    static thread_local uint32_t threadId = nextThreadId.fetch_add(1, memory_order_relaxed);
+    return threadId;
+}
+
+void lockSlot(TraceSlot& slot) {
+    while (slot.busy.exchange(true, memory_order_acquire)) {
+    }
+}
+
+void unlockSlot(TraceSlot& slot) {
+    slot.busy.store(false, memory_order_release);
+}
+
+void writeJsonString(ofstream& out, const char* text) {
+    out << '"';
+    for (const char* p = text; *p; ++p) {
+        if (*p == '"' || *p == '\\') out << '\\';
+        out << *p;
+    }
+    out << '"';
+}
+
+}
+
+void Tracer::configure(size_t every, size_t capacity) {
+    sampleEvery = every;
+    if (every == 0 || capacity == 0) {
+        sampleEvery = 0;
+        slotCount = 0;
+        slots.reset();
+        return;
+    }
+    slotCount = capacity;
+    slots.reset(new TraceSlot[capacity]);
+    nextSlot.store(0, memory_order_relaxed);
+}
+
+bool Tracer::enabled() {
+    return sampleEvery != 0;
+}
+
+uint64_t Tracer::beginRequest() {
+    currentRequestId = 0;
+    if (sampleEvery == 0) return 0;
+    uint64_t sequence = requestCounter.fetch_add(1, memory_order_relaxed);
+    if (sequence % sampleEvery != 0) return 0;
+    currentRequestId = sequence / sampleEvery + 1;
+    return currentRequestId;
+}
+
+void Tracer::endRequest() {
+    currentRequestId = 0;
+}
+
+uint64_t Tracer::currentRequest() {
+    return currentRequestId;
+}
+
+uint64_t Tracer::adoptRequest(uint64_t requestId) {
+    uint64_t previous = currentRequestId;
+    currentRequestId = requestId;
+    return previous;
+}
+
+long long Tracer::nowUs() {
+    return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void Tracer::record(const char* name, const char* category, long long startUs, long long endUs) {
+    if (currentRequestId == 0 || slotCount == 0) return;
+    TraceSlot& slot = slots[nextSlot.fetch_add(1, memory_order_relaxed) % slotCount];
+    lockSlot(slot);
+    slot.event.name = name;
+    slot.event.category = category;
+    slot.event.startUs = startUs;
+    slot.event.durationUs = endUs > startUs ? endUs - startUs : 0;
+    slot.event.threadId = localThreadId();
+    slot.event.requestId = currentRequestId;
+    slot.filled = true;
+    unlockSlot(slot);
+}
+
+// Снимок кольца без остановки записи: события, пришедшие во время выгрузки, либо попадут
+// в файл, либо останутся до следующей выгрузки. Кольцо не очищается
+long long Tracer::writeChromeTrace(const string& path) {
+    vector<TraceEvent> events;
+    events.reserve(slotCount);
+    for (size_t i = 0; i < slotCount; ++i) {
+        TraceSlot& slot = slots[i];
+        lockSlot(slot);
+        if (slot.filled) events.push_back(slot.event);
+        unlockSlot(slot);
+    }
+    sort(events.begin(), events.end(), [](const TraceEvent& a, const TraceEvent& b) {
+        // При равном начале внешний отрезок идёт первым, иначе просмотрщик ломает вложенность
+        return a.startUs != b.startUs ? a.startUs < b.startUs : a.durationUs > b.durationUs;
+    });
+
+    string tmpPath = path + ".tmp";
+    ofstream out(tmpPath.c_str(), ios::trunc);
+    if (!out.is_open()) return -1;
+
+    out << "{\"traceEvents\":[";
+    for (size_t i = 0; i < events.size(); ++i) {
+        const TraceEvent& event = events[i];
+        out << (i == 0 ? "\n" : ",\n") << "{\"name\":";
+        writeJsonString(out, event.name);
+        out << ",\"cat\":";
+        writeJsonString(out, event.category);
+        out << ",\"ph\":\"X\",\"ts\":" << event.startUs << ",\"dur\":" << event.durationUs
+            << ",\"pid\":1,\"tid\":" << event.threadId
+            << ",\"args\":{\"request\":" << event.requestId << "}}";
+    }
+    out << "\n],\"displayTimeUnit\":\"ms\"}\n";
+    out.close();
+    if (!out) return -1;
+    if (rename(tmpPath.c_str(), path.c_str()) != 0) return -1;
+    return static_cast<long long>(events.size());
+}
+
+size_t Tracer::memoryUsage() {
+    return slotCount * sizeof(TraceSlot);
+}
+
+TraceSpan::TraceSpan(const char* spanName, const char* spanCategory)
+    : name(spanName), category(spanCategory), startUs(currentRequestId != 0 ? Tracer::nowUs() : 0) {}
+
+TraceSpan::~TraceSpan() {
+    if (currentRequestId != 0 && startUs != 0) {
+        Tracer::record(name, category, startUs, Tracer::nowUs());
+    }
+}
+
+TraceRequest::TraceRequest(long long requestStartUs)
+    : name("request"), startUs(requestStartUs), sampled(Tracer::beginRequest() != 0) {}
+
+TraceRequest::~TraceRequest() {
+    if (sampled) {
+        Tracer::record(name, "request", startUs, Tracer::nowUs());
+    }
+    Tracer::endRequest();
+}
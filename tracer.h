@@ -0,0 +1,68 @@
+#ifndef TRACER_H
+#define TRACER_H
+
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+using namespace std;
+
+// Трассировка запросов: каждый N-й запрос помечается, и все отрезки (TraceSpan) в его потоке
+// пишутся в общее кольцо. Кольцо выгружается в формате Chrome trace-event, который открывает
+// Perfetto и chrome://tracing. Трассировщик один на процесс: отрезки ставит и Database,
+// которая о сервере не знает. Без пометки отрезок стоит одно чтение thread_local
+class Tracer {
+public:
+    // sampleEvery 0 - выключено, 1 - каждый запрос; capacity - событий в кольце
+    static void configure(size_t sampleEvery, size_t capacity);
+    static bool enabled();
+
+    // Решение о выборке для запроса в этом потоке; 0 - запрос не трассируется
+    static uint64_t beginRequest();
+    static void endRequest();
+    static uint64_t currentRequest();
+    // Для чужого потока, который работает на запрос (поток записи на диск); возвращает прежний
+    static uint64_t adoptRequest(uint64_t requestId);
+
+    // Имена и категории - строковые литералы: кольцо хранит только указатели
+    static void record(const char* name, const char* category, long long startUs, long long endUs);
+    static long long nowUs();
+
+    // Возвращает число записанных событий, -1 - файл не открылся
+    static long long writeChromeTrace(const string& path);
+    static size_t memoryUsage();
+};
+
+class TraceSpan {
+private:
+    const char* name;
+    const char* category;
+    long long startUs;
+
+public:
+    TraceSpan(const char* name, const char* category);
+    ~TraceSpan();
+
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+};
+
+// Корневой отрезок запроса: имя (команда) становится известно после разбора
+class TraceRequest {
+private:
+    const char* name;
+    long long startUs;
+    bool sampled;
+
+public:
+    explicit TraceRequest(long long startUs);
+    ~TraceRequest();
+
+    bool isSampled() const { return sampled; }
+    void setName(const char* requestName) { name = requestName; }
+
+    TraceRequest(const TraceRequest&) = delete;
+    TraceRequest& operator=(const TraceRequest&) = delete;
+};
+
+#endif
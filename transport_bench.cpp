@@ -0,0 +1,155 @@
+#include "server.h"
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <algorithm>
+#include <cstdlib>
+
+#ifndef _WIN32
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+// Замер задержки запрос-ответ PING через TCP loopback, unix-сокет
+// и кольца в разделяемой памяти на одном и том же сервере. Запуск: ./transport_bench [итераций] [порт]
+
+#ifdef _WIN32
+int main() {
+    cerr << "transport_bench requires unix domain sockets" << endl;
+    return 1;
+}
+#else
+
+static int connectTcp(uint16_t port) {
+    int s = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    if (connect(s, (sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(s);
+        return -1;
+    }
+    int noDelay = 1;
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+    return s;
+}
+
+static int connectUnix(const string& path) {
+    int s = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    path.copy(addr.sun_path, sizeof(addr.sun_path) - 1);
+    if (connect(s, (sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(s);
+        return -1;
+    }
+    return s;
+}
+
+static bool roundTrip(int s, const string& request, string& buffer) {
+    if (send(s, request.data(), request.size(), 0) != static_cast<ssize_t>(request.size())) return false;
+    char chunk[4096];
+    while (true) {
+        size_t endPos = buffer.find("\nEND\n");
+        if (endPos != string::npos) {
+            buffer.erase(0, endPos + 5);
+            return true;
+        }
+        ssize_t received = recv(s, chunk, sizeof(chunk), 0);
+        if (received <= 0) return false;
+        buffer.append(chunk, static_cast<size_t>(received));
+    }
+}
+
+static bool sharedRoundTrip(ShmChannel& channel) {
+    string response;
+    return channel.requestRing().push("PING", 1000) && channel.responseRing().pop(response, 1000);
+}
+
+template <typename RoundTrip>
+static void measure(const string& name, size_t iterations, RoundTrip roundTrip) {
+    for (size_t i = 0; i < iterations / 10; ++i) {
+        roundTrip();
+    }
+
+    vector<long long> samples;
+    samples.reserve(iterations);
+    auto started = chrono::steady_clock::now();
+    for (size_t i = 0; i < iterations; ++i) {
+        auto before = chrono::steady_clock::now();
+        if (!roundTrip()) {
+            cerr << name << ": connection lost" << endl;
+            return;
+        }
+        samples.push_back(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - before).count());
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+
+    sort(samples.begin(), samples.end());
+    auto percentile = [&samples](double p) {
+        return samples[min(samples.size() - 1, static_cast<size_t>(p * samples.size()))] / 1000.0;
+    };
+    cout << left << setw(8) << name << right << fixed << setprecision(1)
+         << setw(10) << percentile(0.50) << setw(10) << percentile(0.99) << setw(10) << percentile(0.999)
+         << setw(12) << setprecision(0) << iterations / seconds << endl;
+}
+
+int main(int argc, char** argv) {
+    size_t iterations = argc > 1 ? static_cast<size_t>(strtoul(argv[1], nullptr, 10)) : 20000;
+    uint16_t port = argc > 2 ? static_cast<uint16_t>(atoi(argv[2])) : 9650;
+    if (iterations == 0) iterations = 1;
+
+    ServerConfig config;
+    config.unixSocketPath = "/tmp/chat_transport_bench.sock";
+    config.idleTimeoutMs = 0;
+    Server server(port, "transport_bench.db", config);
+    if (!server.start()) {
+        return 1;
+    }
+
+    int tcpSocket = connectTcp(port);
+    int unixSocket = connectUnix(config.unixSocketPath);
+    int shmSocket = connectUnix(config.unixSocketPath);
+    if (tcpSocket < 0 || unixSocket < 0 || shmSocket < 0) {
+        cerr << "Failed to connect to the benchmark server" << endl;
+        server.stop();
+        return 1;
+    }
+
+    ShmChannel channel;
+    string shmBuffer;
+    bool shmReady = channel.create(ShmChannel::uniqueName()) &&
+                    roundTrip(shmSocket, "SHM_ATTACH\n" + channel.getName() + "\nEND\n", shmBuffer);
+    channel.unlinkName();
+
+    cout << "\n" << iterations << " PING round trips per transport, latency in microseconds\n";
+    cout << left << setw(8) << "" << right << setw(10) << "p50" << setw(10) << "p99" << setw(10) << "p99.9"
+         << setw(12) << "req/s" << endl;
+    const string request = "PING\nEND\n";
+    string tcpBuffer, unixBuffer;
+    measure("tcp", iterations, [&] { return roundTrip(tcpSocket, request, tcpBuffer); });
+    measure("unix", iterations, [&] { return roundTrip(unixSocket, request, unixBuffer); });
+    if (shmReady) {
+        measure("shm", iterations, [&] { return sharedRoundTrip(channel); });
+    } else {
+        cerr << "shm: failed to attach shared memory channel" << endl;
+    }
+
+    channel.close();
+    close(tcpSocket);
+    close(unixSocket);
+    close(shmSocket);
+    server.stop();
+    return 0;
+}
+#endif
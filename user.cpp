@@ -1,4 +1,5 @@
 #include "user.h"
+#include "memory_usage.h"
 #include <string>
 #include <algorithm>
 #include <stdexcept>
@@ -29,12 +30,13 @@ void User::setOnlineStatus(bool status) {
 }
 
 void User::addFriend(const string& friendLogin) {
-    if (friendLogin != login && !hasFriend(friendLogin)) {
+    if (friendLogin != login && friendSet.insert(friendLogin).second) {
         friends.push_back(friendLogin);
     }
 }
 
 void User::removeFriend(const string& friendLogin) {
+    if (friendSet.erase(friendLogin) == 0) return;
     auto it = find(friends.begin(), friends.end(), friendLogin);
     if (it != friends.end()) {
         friends.erase(it);
@@ -54,9 +56,14 @@ void User::changePassword(const string& oldPassword, const string& newPassword)
 }
 
 bool User::hasFriend(const string& friendLogin) const {
-    return find(friends.begin(), friends.end(), friendLogin) != friends.end();
+    return friendSet.count(friendLogin) > 0;
 }
 
 size_t User::getFriendCount() const {
     return friends.size();
-} 
\ No newline at end of file
+}
+
+size_t User::memoryUsage() const {
+    return memory_usage::heapBytes(login) + memory_usage::heapBytes(password) + memory_usage::heapBytes(name) +
+           memory_usage::heapBytes(friends) + memory_usage::heapBytes(friendSet);
+}
@@ -4,6 +4,7 @@
 #include <string>
 #include <vector>
 #include <memory>
+#include <unordered_set>
 
 using namespace std;
 
@@ -13,6 +14,7 @@ private:
     string password;
     string name;
     vector<string> friends;
+    unordered_set<string> friendSet;
     bool isOnline;
 
 public:
@@ -32,6 +34,7 @@ public:
     
     bool hasFriend(const string& friendLogin) const;
     size_t getFriendCount() const;
+    size_t memoryUsage() const;
 };
 
 #endif 
\ No newline at end of file